@@ -0,0 +1,430 @@
+// Microbenchmarks for the packet codec and Controller dispatch. Every
+// benchmark also reports heap allocations per operation.
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "controller.hpp"
+#include "image_store.hpp"
+#include "memory_files.hpp"
+#include "netascii.hpp"
+#include "packets.hpp"
+#include "session_table.hpp"
+
+// Allocation counting
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *pointer = std::malloc(size ? size : 1)) return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+void operator delete(void *pointer, size_t) noexcept { std::free(pointer); }
+
+namespace {
+class AllocationCounter {
+   public:
+    AllocationCounter(benchmark::State &state)
+        : state(state), start(allocations.load()) {}
+    ~AllocationCounter() {
+        state.counters["allocs_per_op"] =
+            benchmark::Counter(allocations.load() - start,
+                               benchmark::Counter::kAvgIterations);
+    }
+
+   private:
+    benchmark::State &state;
+    const uint64_t start;
+};
+
+// Text with lines of 40 characters on average
+std::vector<char> makeText(size_t size) {
+    std::mt19937 random(1);
+    std::vector<char> text(size);
+    for (char &c : text) c = random() % 40 == 0 ? '\n' : 'a' + random() % 26;
+    return text;
+}
+
+std::map<std::string, std::string> makeOptions(int count) {
+    static const char *names[] = {"blksize", "timeout", "tsize",
+                                  "windowsize", "multicast", "rollover",
+                                  "utimeout", "checksum"};
+
+    std::map<std::string, std::string> options;
+    for (int i = 0; i < count; ++i) options[names[i % 8]] = "1468";
+    return options;
+}
+}  // namespace
+
+// DATA
+static void BM_DataPacketSerialize(benchmark::State &state) {
+    std::vector<char> payload(state.range(0), 'x');
+    auto packet = std::make_unique<tftp::DataPacket>(1, payload.data(),
+                                                     payload.size());
+    std::vector<char> buffer(UINT16_MAX + 1);
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet->serialize(buffer.data()));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DataPacketSerialize)->Arg(0)->Arg(512)->Arg(1428)->Arg(8192)->Arg(65464);
+
+static void BM_DataPacketDeserialize(benchmark::State &state) {
+    std::vector<char> payload(state.range(0), 'x');
+    std::vector<char> buffer(UINT16_MAX + 1);
+    ssize_t size = tftp::DataPacket(1, payload.data(), payload.size())
+                       .serialize(buffer.data());
+    auto packet = std::make_unique<tftp::DataPacket>();
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        packet->data_size = size - 4;
+        benchmark::DoNotOptimize(packet->deserialize(buffer.data()));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DataPacketDeserialize)->Arg(0)->Arg(512)->Arg(1428)->Arg(8192)->Arg(65464);
+
+// ACK
+static void BM_AckPacketSerialize(benchmark::State &state) {
+    tftp::AckPacket packet(42);
+    char buffer[4];
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.serialize(buffer));
+    }
+}
+BENCHMARK(BM_AckPacketSerialize);
+
+static void BM_AckPacketDeserialize(benchmark::State &state) {
+    char buffer[4];
+    tftp::AckPacket(42).serialize(buffer);
+    tftp::AckPacket packet;
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.deserialize(buffer));
+    }
+}
+BENCHMARK(BM_AckPacketDeserialize);
+
+// OACK
+static void BM_OptionAckPacketSerialize(benchmark::State &state) {
+    tftp::OptionAckPacket packet(makeOptions(state.range(0)));
+    std::vector<char> buffer(1024);
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.serialize(buffer.data()));
+    }
+}
+BENCHMARK(BM_OptionAckPacketSerialize)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+static void BM_OptionAckPacketDeserialize(benchmark::State &state) {
+    std::vector<char> buffer(1024, 0);
+    tftp::OptionAckPacket(makeOptions(state.range(0))).serialize(buffer.data());
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        tftp::OptionAckPacket packet;
+        benchmark::DoNotOptimize(packet.deserialize(buffer.data()));
+    }
+}
+BENCHMARK(BM_OptionAckPacketDeserialize)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+// RRQ/WRQ
+static void BM_ReadWriteRequestPacketSerialize(benchmark::State &state) {
+    tftp::ReadRequestPacket packet("pxelinux.cfg/default", "octet");
+    packet.options = makeOptions(state.range(0));
+    std::vector<char> buffer(1024);
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.serialize(buffer.data()));
+    }
+}
+BENCHMARK(BM_ReadWriteRequestPacketSerialize)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+static void BM_ReadWriteRequestPacketDeserialize(benchmark::State &state) {
+    tftp::ReadRequestPacket request("pxelinux.cfg/default", "octet");
+    request.options = makeOptions(state.range(0));
+    std::vector<char> buffer(1024, 0);
+    ssize_t size = request.serialize(buffer.data());
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        tftp::ReadRequestPacket packet;
+        ssize_t bytes_read = packet.deserialize(buffer.data());
+        if (bytes_read < size) {
+            packet.deserializeOptions(buffer.data() + bytes_read,
+                                      size - bytes_read);
+        }
+        benchmark::DoNotOptimize(packet.options.size());
+    }
+}
+BENCHMARK(BM_ReadWriteRequestPacketDeserialize)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+// Netascii
+static void BM_NetasciiEncode(benchmark::State &state) {
+    std::vector<char> text = makeText(state.range(0));
+    std::vector<char> block(state.range(0));
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        tftp::NetasciiEncoder encoder;
+        size_t consumed;
+        benchmark::DoNotOptimize(encoder.encode(text.data(), text.size(),
+                                                block.data(), block.size(),
+                                                consumed));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_NetasciiEncode)->Arg(512)->Arg(1428)->Arg(8192)->Arg(65464);
+
+static void BM_NetasciiDecode(benchmark::State &state) {
+    std::vector<char> text = makeText(state.range(0));
+    std::vector<char> encoded(2 * text.size());
+    size_t consumed;
+    encoded.resize(tftp::NetasciiEncoder().encode(
+        text.data(), text.size(), encoded.data(), encoded.size(), consumed));
+    std::vector<char> decoded(encoded.size() + 1);
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        tftp::NetasciiDecoder decoder;
+        benchmark::DoNotOptimize(
+            decoder.decode(encoded.data(), encoded.size(), decoded.data()));
+    }
+    state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_NetasciiDecode)->Arg(512)->Arg(1428)->Arg(8192)->Arg(65464);
+
+// What octet blocks cost, to compare against
+static void BM_BlockCopy(benchmark::State &state) {
+    std::vector<char> text = makeText(state.range(0));
+    std::vector<char> block(state.range(0));
+
+    for (auto _ : state) {
+        memcpy(block.data(), text.data(), text.size());
+        benchmark::DoNotOptimize(block.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_BlockCopy)->Arg(512)->Arg(1428)->Arg(8192)->Arg(65464);
+
+// Controller dispatch
+static void BM_ControllerReadTransfer(benchmark::State &state) {
+    const uint16_t block_size = state.range(0);
+
+    tftp::MemoryFileWorkerFactory factory;
+    factory.files["image"] = std::vector<char>(64 * 1024 * 1024, 'x');
+    tftp::Controller controller(factory);
+    tftp::Peer peer;
+
+    std::vector<char> request(1024, 0);
+    std::vector<char> response(UINT16_MAX + 1);
+
+    // Start a transfer and acknowledge the OACK
+    auto start = [&]() {
+        tftp::ReadRequestPacket packet("image", "octet");
+        packet.options["blksize"] = std::to_string(block_size);
+        ssize_t size = packet.serialize(request.data());
+        controller.handlePacket(peer, request.data(), response.data(), size);
+    };
+    start();
+
+    uint16_t block_number = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        // Every ACK produces the next DATA block
+        tftp::AckPacket(block_number).serialize(request.data());
+        ssize_t size =
+            controller.handlePacket(peer, request.data(), response.data(), 4);
+        benchmark::DoNotOptimize(size);
+
+        if (size - 4 < block_size) {
+            state.PauseTiming();
+            tftp::AckPacket(block_number + 1).serialize(request.data());
+            controller.handlePacket(peer, request.data(), response.data(), 4);
+            block_number = 0;
+            start();
+            state.ResumeTiming();
+            continue;
+        }
+        ++block_number;
+    }
+    state.SetBytesProcessed(state.iterations() * block_size);
+}
+BENCHMARK(BM_ControllerReadTransfer)->Arg(512)->Arg(1428)->Arg(8192);
+
+static void BM_ControllerWriteTransfer(benchmark::State &state) {
+    const uint16_t block_size = state.range(0);
+
+    tftp::MemoryFileWorkerFactory factory;
+    tftp::Controller controller(factory);
+    tftp::Peer peer;
+
+    std::vector<char> request(UINT16_MAX + 1, 0);
+    std::vector<char> response(UINT16_MAX + 1);
+    std::vector<char> payload(block_size, 'x');
+    auto data = std::make_unique<tftp::DataPacket>(0, payload.data(),
+                                                   payload.size());
+
+    auto start = [&]() {
+        factory.files.clear();
+        tftp::WriteRequestPacket packet("upload", "octet");
+        packet.options["blksize"] = std::to_string(block_size);
+        ssize_t size = packet.serialize(request.data());
+        controller.handlePacket(peer, request.data(), response.data(), size);
+    };
+    start();
+
+    uint16_t block_number = 1;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        // Restart before the block number wraps
+        if (block_number == 4096) {
+            state.PauseTiming();
+            data->block_number = block_number;
+            data->data_size = 0;
+            ssize_t size = data->serialize(request.data());
+            controller.handlePacket(peer, request.data(), response.data(), size);
+            data->data_size = block_size;
+            block_number = 1;
+            start();
+            state.ResumeTiming();
+        }
+
+        data->block_number = block_number++;
+        ssize_t size = data->serialize(request.data());
+        benchmark::DoNotOptimize(
+            controller.handlePacket(peer, request.data(), response.data(), size));
+    }
+    state.SetBytesProcessed(state.iterations() * block_size);
+}
+BENCHMARK(BM_ControllerWriteTransfer)->Arg(512)->Arg(1428)->Arg(8192);
+
+// Flood rejection
+static void BM_ControllerDropJunk(benchmark::State &state) {
+    tftp::MemoryFileWorkerFactory factory;
+    tftp::Controller controller(factory);
+    tftp::Peer peer;
+
+    // An unknown opcode, then an RRQ whose filename never ends
+    std::vector<char> junk(516, 'x');
+    junk[0] = 0;
+    junk[1] = state.range(0) == 0 ? 9 : 1;
+    std::vector<char> response(UINT16_MAX + 1);
+
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(controller.handlePacket(
+            peer, junk.data(), response.data(), junk.size()));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ControllerDropJunk)->Arg(0)->Arg(1);
+
+static void BM_ControllerRateLimitedRequest(benchmark::State &state) {
+    tftp::MemoryFileWorkerFactory factory;
+    tftp::Controller controller(factory);
+    controller.setRateLimit(1, 1);
+    tftp::Peer peer;
+
+    std::vector<char> request(1024, 0);
+    std::vector<char> response(UINT16_MAX + 1);
+    ssize_t size = tftp::ReadRequestPacket("pxelinux.0", "octet")
+                       .serialize(request.data());
+
+    // The first request takes the only token, the rest are dropped
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(controller.handlePacket(
+            peer, request.data(), response.data(), size));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ControllerRateLimitedRequest);
+
+// Storage: 1428 byte blocks of an 8 MB image, from disk, memory or a pack
+static void BM_StorageRead(benchmark::State &state) {
+    std::filesystem::path directory =
+        std::filesystem::temp_directory_path() / "self-tftp-bench";
+    std::filesystem::create_directories(directory);
+    std::string image = (directory / "image").string();
+    std::string pack = (directory / "image.pack").string();
+
+    std::vector<char> content = makeText(8 * 1024 * 1024);
+    std::ofstream(image, std::ios::binary)
+        .write(content.data(), content.size());
+    std::vector<tftp::ManifestEntry> manifest = {{"image", image}};
+
+    std::unique_ptr<tftp::FileSystem> filesystem;
+    std::string name = "image";
+    if (state.range(0) == 0) {
+        filesystem.reset(new tftp::DiskFileSystem());
+        name = image;
+    } else if (state.range(0) == 1) {
+        filesystem.reset(new tftp::MemoryFileSystem(manifest));
+    } else {
+        tftp::PackFileSystem::build(manifest, pack);
+        filesystem.reset(new tftp::PackFileSystem(pack));
+    }
+
+    char block[1428];
+    ssize_t offset = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            filesystem->read(name, block, sizeof(block), offset));
+        offset = (offset + sizeof(block)) % content.size();
+    }
+    state.SetBytesProcessed(state.iterations() * sizeof(block));
+}
+BENCHMARK(BM_StorageRead)->Arg(0)->Arg(1)->Arg(2);
+
+// Session lookup
+static void BM_SessionTableFind(benchmark::State &state) {
+    const size_t sessions = state.range(0);
+
+    // Clients spread over a /16, each with a random port
+    std::mt19937_64 random(1);
+    std::vector<tftp::Peer> peers(sessions);
+    tftp::SessionTable table;
+    for (tftp::Peer &peer : peers) {
+        struct sockaddr_in addr = {};
+        addr.sin_addr.s_addr = htonl(0x0A000000 | (random() & 0xFFFF));
+        addr.sin_port = htons(1024 + random() % 64511);
+        peer = tftp::Peer::fromSockaddr(addr);
+        if (table.find(peer) == tftp::NO_SESSION) table.insert(peer);
+    }
+
+    // Look peers up in random order, so the cache does not help
+    std::vector<uint32_t> order(1 << 16);
+    for (uint32_t &index : order) index = random() % sessions;
+
+    size_t i = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            table.find(peers[order[i++ & (order.size() - 1)]]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SessionTableFind)->Arg(1000)->Arg(100000);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,367 @@
+// Loopback load generator. Runs concurrent RRQ/WRQ sessions against a
+// tftp::Server, sweeping the transfer parameters, and prints one JSON result
+// per combination.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "controller.hpp"
+#include "disk_io.hpp"
+#include "filesystem.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "server.hpp"
+#include "transfer_client.hpp"
+#include "udp_transfer.hpp"
+
+namespace {
+struct Config {
+    std::string server_ip = "127.0.0.1";
+    unsigned int port = 16969;
+    bool in_process = true;
+    std::filesystem::path directory;
+    std::string output;
+    bool verify = false;
+    unsigned int io_threads = 4;
+    std::string multicast_address = "239.255.69.1";
+    unsigned int multicast_port = 16970;
+
+    std::vector<std::string> modes = {"read"};
+    std::vector<unsigned int> block_sizes = {512, 1428};
+    std::vector<unsigned int> window_sizes = {1};
+    std::vector<unsigned int> file_sizes = {64 * 1024, 1024 * 1024};
+    std::vector<unsigned int> concurrencies = {1, 4};
+    unsigned int transfers = 32;
+};
+
+struct Point {
+    std::string mode;
+    unsigned int block_size;
+    unsigned int window_size;
+    unsigned int file_size;
+    unsigned int concurrency;
+};
+
+struct Result {
+    unsigned int completed = 0;
+    unsigned int failed = 0;
+    uint64_t bytes = 0;
+    uint64_t retransmits = 0;
+    uint64_t server_bytes = 0;
+    // Smallest windowsize the server granted, 0 with no completed transfers
+    unsigned int window_size = 0;
+    double seconds = 0;
+    std::vector<uint64_t> latencies_us;
+};
+
+void usage(const char *name) {
+    std::cerr
+        << "Usage: " << name << " [options]" << std::endl
+        << std::endl
+        << "Options:" << std::endl
+        << "  --server IP:PORT       Use a running server instead of an "
+           "in-process one"
+        << std::endl
+        << "  --port PORT            Port of the in-process server" << std::endl
+        << "  --io-threads N         Disk I/O threads of the in-process server"
+        << std::endl
+        << "  --directory DIR        Where test files are created" << std::endl
+        << "  --mode LIST            read, write and/or multicast (reads "
+           "of one file by every session)"
+        << std::endl
+        << "  --multicast ADDR:PORT  First group of the in-process server"
+        << std::endl
+        << "  --blksize LIST         Block sizes to sweep" << std::endl
+        << "  --windowsize LIST      Window sizes to ask for" << std::endl
+        << "  --file-size LIST       File sizes to sweep, in bytes"
+        << std::endl
+        << "  --concurrency LIST     Concurrent sessions to sweep" << std::endl
+        << "  --transfers N          Transfers per combination" << std::endl
+        << "  --verify               Check every downloaded file" << std::endl
+        << "  --output FILE          Write JSON to FILE instead of stdout"
+        << std::endl;
+    exit(1);
+}
+
+template <typename T>
+std::vector<T> parseList(const std::string &value) {
+    std::vector<T> list;
+    std::stringstream stream(value);
+    std::string item;
+
+    while (std::getline(stream, item, ',')) {
+        if constexpr (std::is_same_v<T, std::string>) {
+            list.push_back(item);
+        } else {
+            list.push_back(std::stoul(item));
+        }
+    }
+
+    return list;
+}
+
+Config parseArguments(int argc, char **argv) {
+    Config config;
+    config.directory =
+        std::filesystem::temp_directory_path() / "self-tftp-loadgen";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+
+        if (argument == "-h" || argument == "--help") usage(argv[0]);
+        if (argument == "--verify") {
+            config.verify = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) usage(argv[0]);
+        std::string value = argv[++i];
+
+        if (argument == "--server") {
+            size_t colon = value.find(':');
+            if (colon == std::string::npos) usage(argv[0]);
+            config.server_ip = value.substr(0, colon);
+            config.port = std::stoul(value.substr(colon + 1));
+            config.in_process = false;
+        } else if (argument == "--multicast") {
+            size_t colon = value.find(':');
+            if (colon == std::string::npos) usage(argv[0]);
+            config.multicast_address = value.substr(0, colon);
+            config.multicast_port = std::stoul(value.substr(colon + 1));
+        } else if (argument == "--port") {
+            config.port = std::stoul(value);
+        } else if (argument == "--io-threads") {
+            config.io_threads = std::stoul(value);
+        } else if (argument == "--directory") {
+            config.directory = value;
+        } else if (argument == "--mode") {
+            config.modes = parseList<std::string>(value);
+        } else if (argument == "--blksize") {
+            config.block_sizes = parseList<unsigned int>(value);
+        } else if (argument == "--windowsize") {
+            config.window_sizes = parseList<unsigned int>(value);
+        } else if (argument == "--file-size") {
+            config.file_sizes = parseList<unsigned int>(value);
+        } else if (argument == "--concurrency") {
+            config.concurrencies = parseList<unsigned int>(value);
+        } else if (argument == "--transfers") {
+            config.transfers = std::stoul(value);
+        } else if (argument == "--output") {
+            config.output = value;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    return config;
+}
+
+std::vector<char> randomData(size_t size, unsigned int seed) {
+    std::mt19937 random(seed);
+    std::vector<char> data(size);
+    for (char &c : data) c = static_cast<char>(random());
+    return data;
+}
+
+uint64_t serverBytesSent() {
+    // Only the in-process server counts into the metrics of this process
+    return tftp::Metrics::instance()
+        .snapshot()
+        .counters[static_cast<unsigned int>(tftp::Counter::BytesSent)];
+}
+
+Result runPoint(const Config &config, const Point &point) {
+    bool reading = point.mode == "read" || point.mode == "multicast";
+    tftp::TransferOptions options;
+    options.block_size = point.block_size;
+    options.window_size = point.window_size;
+    options.timeout_ms = 200;
+    options.multicast = point.mode == "multicast";
+
+    // Downloads share one file, uploads each write their own
+    std::filesystem::path read_path =
+        config.directory / ("read-" + std::to_string(point.file_size) + ".bin");
+    std::vector<char> content = randomData(point.file_size, point.file_size);
+
+    if (reading && !std::filesystem::exists(read_path)) {
+        std::ofstream file(read_path, std::ios::binary);
+        file.write(content.data(), content.size());
+    }
+
+    Result result;
+    std::mutex result_mutex;
+    std::atomic<unsigned int> next_transfer{0};
+
+    auto worker = [&]() {
+        unsigned int transfer;
+        while ((transfer = next_transfer.fetch_add(1)) < config.transfers) {
+            std::string filename =
+                reading ? read_path.string()
+                        : (config.directory /
+                           ("write-" + std::to_string(transfer) + ".bin"))
+                              .string();
+
+            tftp::TransferClient client(
+                reading ? tftp::TransferClient::Mode::Read
+                        : tftp::TransferClient::Mode::Write,
+                filename, options, nullptr);
+            if (!reading) client.setData(content);
+
+            tftp::UdpTransferResult transfer_result = tftp::runUdpTransfer(
+                config.server_ip, config.port, client);
+            bool success = transfer_result.success;
+
+            if (success && reading && config.verify) {
+                success = client.getData() == content;
+            }
+
+            std::lock_guard<std::mutex> lock(result_mutex);
+            result.retransmits += client.getRetransmits();
+            if (!success) {
+                ++result.failed;
+                continue;
+            }
+
+            unsigned int window_size = client.getWindowSize();
+            if (result.completed == 0 || window_size < result.window_size) {
+                result.window_size = window_size;
+            }
+
+            ++result.completed;
+            result.bytes += point.file_size;
+            result.latencies_us.push_back(transfer_result.elapsed_us);
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t bytes_sent = serverBytesSent();
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < point.concurrency; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto &thread : threads) thread.join();
+
+    result.server_bytes = serverBytesSent() - bytes_sent;
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    std::sort(result.latencies_us.begin(), result.latencies_us.end());
+    return result;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double percentile) {
+    if (sorted.empty()) return 0;
+
+    size_t index = static_cast<size_t>(percentile * sorted.size());
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+std::string toJson(const Point &point, const Result &result) {
+    std::ostringstream out;
+    out << "{\"mode\": \"" << point.mode << "\""
+        << ", \"blksize\": " << point.block_size
+        << ", \"requested_windowsize\": " << point.window_size
+        << ", \"windowsize\": " << result.window_size
+        << ", \"file_size\": " << point.file_size
+        << ", \"concurrency\": " << point.concurrency
+        << ", \"completed\": " << result.completed
+        << ", \"failed\": " << result.failed
+        << ", \"retransmits\": " << result.retransmits
+        << ", \"server_bytes_sent\": " << result.server_bytes
+        << ", \"seconds\": " << result.seconds
+        << ", \"mb_per_s\": " << result.bytes / result.seconds / 1e6
+        << ", \"transfers_per_s\": " << result.completed / result.seconds
+        << ", \"latency_us\": {\"p50\": " << percentile(result.latencies_us, 0.5)
+        << ", \"p99\": " << percentile(result.latencies_us, 0.99)
+        << ", \"p999\": " << percentile(result.latencies_us, 0.999) << "}}";
+    return out.str();
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    Config config = parseArguments(argc, argv);
+
+    // Keep stdout for the results
+    tftp::Logger::instance().setSink(stderr);
+    std::filesystem::create_directories(config.directory);
+
+    // Start an in-process server unless one was given
+    tftp::DiskFileSystem filesystem;
+    tftp::BufferedFileWorkerFactory worker_factory(5 * 1024 * 1024, filesystem);
+    tftp::Controller controller(worker_factory);
+    std::unique_ptr<tftp::DiskIoPool> io_pool;
+    std::unique_ptr<tftp::GroupCommitter> committer;
+    std::unique_ptr<tftp::Server> server;
+    std::thread server_thread;
+
+    if (config.in_process) {
+        if (config.io_threads > 0) {
+            io_pool.reset(new tftp::DiskIoPool(config.io_threads));
+            controller.setDiskIoPool(io_pool.get());
+            committer.reset(new tftp::GroupCommitter(filesystem));
+            controller.setGroupCommitter(committer.get());
+        }
+
+        server.reset(new tftp::Server(config.server_ip, config.port, controller));
+
+        // Groups go out of the interface of the server address
+        if (std::find(config.modes.begin(), config.modes.end(),
+                      "multicast") != config.modes.end()) {
+            controller.setMulticast(config.multicast_address,
+                                    config.multicast_port);
+            server->setMulticastOptions(config.server_ip, 1);
+        }
+
+        server_thread = std::thread([&server]() { server->listen(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    // Sweep every combination
+    std::vector<std::string> results;
+    for (auto &mode : config.modes) {
+        for (auto block_size : config.block_sizes) {
+            for (auto window_size : config.window_sizes) {
+                for (auto file_size : config.file_sizes) {
+                    for (auto concurrency : config.concurrencies) {
+                        Point point = {mode, block_size, window_size,
+                                       file_size, concurrency};
+                        results.push_back(toJson(point, runPoint(config, point)));
+                        std::cerr << results.back() << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    if (server) {
+        server->stop();
+        server_thread.join();
+    }
+
+    // Write the results
+    std::ostringstream json;
+    json << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        json << "  " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "]\n";
+
+    if (config.output.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(config.output) << json.str();
+    }
+
+    return 0;
+}
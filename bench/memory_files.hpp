@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "files.hpp"
+
+namespace tftp {
+// In-memory files, so benchmarks and simulations never touch the disk
+class MemoryFileWorker : public FileWorker {
+   public:
+    MemoryFileWorker(std::string filename, FileWorkerMode mode,
+                     std::map<std::string, std::vector<char>> &files)
+        : FileWorker(filename, mode), files(files) {}
+
+    bool open() override { return true; }
+    bool close() override { return true; }
+    bool exists() override { return files.count(this->filename) > 0; }
+    bool remove() override { return files.erase(this->filename) > 0; }
+
+    ssize_t read(char *dst, ssize_t size, ssize_t offset) override {
+        auto &file = files[this->filename];
+        if (offset > static_cast<ssize_t>(file.size())) return 0;
+
+        size = std::min<ssize_t>(size, file.size() - offset);
+        memcpy(dst, file.data() + offset, size);
+        return size;
+    }
+
+    ssize_t write(char *src, ssize_t size, ssize_t offset) override {
+        auto &file = files[this->filename];
+        if (file.size() < static_cast<size_t>(offset + size)) {
+            file.resize(offset + size);
+        }
+        memcpy(file.data() + offset, src, size);
+        return size;
+    }
+
+    ssize_t size() override {
+        auto file = files.find(this->filename);
+        return file == files.end() ? -1 : file->second.size();
+    }
+
+    ssize_t append(char *src, ssize_t size) override {
+        auto &file = files[this->filename];
+        file.insert(file.end(), src, src + size);
+        return size;
+    }
+
+   private:
+    std::map<std::string, std::vector<char>> &files;
+};
+
+class MemoryFileWorkerFactory : public FileWorkerFactory {
+   public:
+    std::map<std::string, std::vector<char>> files;
+
+    FileWorker *create(std::string filename, FileWorkerMode mode) override {
+        return new MemoryFileWorker(filename, mode, this->files);
+    }
+};
+}  // namespace tftp
@@ -0,0 +1,375 @@
+// Deterministic network impairment simulator. Runs a Controller and a
+// TransferClient over an in-process link with configurable loss, reordering,
+// duplication, delay and jitter, on a virtual clock. Runs are reproducible
+// from their seed and report goodput, retransmission ratio and completion
+// time per scenario as JSON.
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "controller.hpp"
+#include "logger.hpp"
+#include "memory_files.hpp"
+#include "transfer_client.hpp"
+
+namespace {
+struct Impairment {
+    double loss = 0;       // Probability a packet is dropped
+    double duplicate = 0;  // Probability a packet is delivered twice
+    double reorder = 0;    // Probability a packet is held back
+    uint64_t delay_us = 100;
+    uint64_t jitter_us = 0;
+    uint64_t reorder_delay_us = 2000;
+};
+
+struct Scenario {
+    std::string name;
+    Impairment impairment;
+};
+
+struct Config {
+    uint64_t seed = 1;
+    unsigned int runs = 5;
+    unsigned int file_size = 1024 * 1024;
+    uint16_t block_size = 1428;
+    uint16_t window_size = 1;
+    std::string mode = "read";
+    std::string scenario;
+    unsigned int timeout_ms = 100;
+};
+
+struct Packet {
+    uint64_t time_us;
+    uint64_t sequence;  // Keeps delivery order stable for equal times
+    bool to_server;
+    std::vector<char> data;
+
+    bool operator>(const Packet &other) const {
+        if (this->time_us != other.time_us) {
+            return this->time_us > other.time_us;
+        }
+        return this->sequence > other.sequence;
+    }
+};
+
+struct RunResult {
+    bool completed = false;
+    uint64_t time_us = 0;
+    uint64_t data_packets = 0;
+    uint64_t unique_blocks = 0;
+    uint64_t client_retransmits = 0;
+};
+
+std::vector<Scenario> scenarios() {
+    std::vector<Scenario> list;
+
+    list.push_back({"clean", {}});
+
+    Impairment loss;
+    loss.loss = 0.01;
+    list.push_back({"loss-1", loss});
+    loss.loss = 0.05;
+    list.push_back({"loss-5", loss});
+
+    Impairment reorder;
+    reorder.reorder = 0.05;
+    list.push_back({"reorder-5", reorder});
+
+    Impairment duplicate;
+    duplicate.duplicate = 0.05;
+    list.push_back({"duplicate-5", duplicate});
+
+    Impairment jitter;
+    jitter.jitter_us = 5000;
+    list.push_back({"jitter-5ms", jitter});
+
+    Impairment wan;
+    wan.delay_us = 25000;
+    wan.jitter_us = 5000;
+    wan.loss = 0.01;
+    list.push_back({"wan", wan});
+
+    return list;
+}
+
+// Both directions of a lossy link, driven by one virtual clock
+class Simulation {
+   public:
+    Simulation(const Impairment &impairment, uint64_t seed)
+        : impairment(impairment), random(seed) {}
+
+    uint64_t now() const { return this->now_us; }
+
+    void send(const char *data, ssize_t size, bool to_server) {
+        if (this->chance(this->impairment.loss)) return;
+
+        int copies = this->chance(this->impairment.duplicate) ? 2 : 1;
+        for (int i = 0; i < copies; ++i) {
+            uint64_t delay = this->impairment.delay_us;
+            if (this->impairment.jitter_us > 0) {
+                delay += this->random() % this->impairment.jitter_us;
+            }
+            if (this->chance(this->impairment.reorder)) {
+                delay += this->impairment.reorder_delay_us;
+            }
+
+            this->queue.push({this->now_us + delay, this->sequence++,
+                              to_server, std::vector<char>(data, data + size)});
+        }
+    }
+
+    // Advances the clock to the next packet, or to the deadline if sooner
+    bool next(uint64_t deadline_us, Packet &packet) {
+        if (this->queue.empty() || this->queue.top().time_us > deadline_us) {
+            this->now_us = deadline_us;
+            return false;
+        }
+
+        packet = this->queue.top();
+        this->queue.pop();
+        this->now_us = packet.time_us;
+        return true;
+    }
+
+   private:
+    const Impairment impairment;
+    std::mt19937_64 random;
+    std::priority_queue<Packet, std::vector<Packet>, std::greater<Packet>>
+        queue;
+    uint64_t now_us = 0;
+    uint64_t sequence = 0;
+
+    bool chance(double probability) {
+        if (probability <= 0) return false;
+        return std::uniform_real_distribution<double>(0, 1)(this->random) <
+               probability;
+    }
+};
+
+RunResult runTransfer(const Config &config, const Scenario &scenario,
+                      uint64_t seed) {
+    bool reading = config.mode == "read";
+
+    // Server side
+    tftp::MemoryFileWorkerFactory factory;
+    std::vector<char> content(config.file_size);
+    std::mt19937 content_random(seed);
+    for (char &c : content) c = static_cast<char>(content_random());
+    if (reading) factory.files["file"] = content;
+
+    tftp::Controller controller(factory);
+    tftp::Peer peer;
+    std::vector<char> response(UINT16_MAX + 1);
+
+    // Client side
+    Simulation simulation(scenario.impairment, seed);
+    RunResult result;
+
+    tftp::TransferOptions options;
+    options.block_size = config.block_size;
+    options.window_size = config.window_size;
+    options.timeout_ms = config.timeout_ms;
+    options.retries = 20;
+
+    tftp::TransferClient client(
+        reading ? tftp::TransferClient::Mode::Read
+                : tftp::TransferClient::Mode::Write,
+        "file", options, [&](const char *data, ssize_t size) {
+            simulation.send(data, size, true);
+        });
+    if (!reading) client.setData(content);
+
+    const uint64_t timeout_us = config.timeout_ms * 1000;
+    const uint64_t limit_us = 600ull * 1000 * 1000;
+    uint64_t deadline_us = timeout_us;
+
+    // The server checks for lost blocks on its own clock
+    const uint64_t check_interval_us = TIMEOUT_CHECK_INTERVAL_MS * 1000;
+    uint64_t check_us = check_interval_us;
+
+    // Give up on runs that melt down, such as a Sorcerer's Apprentice storm
+    const uint64_t packet_limit =
+        (config.file_size / config.block_size + 1) * 20 + 1000;
+    uint64_t packets = 0;
+
+    client.start();
+    while (!client.isFinished() && !client.isFailed() &&
+           simulation.now() < limit_us && packets < packet_limit) {
+        Packet packet;
+        if (!simulation.next(std::min(deadline_us, check_us), packet)) {
+            if (simulation.now() == check_us) {
+                check_us += check_interval_us;
+                controller.handleTimeouts();
+
+                ssize_t reply_size;
+                while (controller.nextReply(peer, response.data(),
+                                            reply_size)) {
+                    if (reply_size <= 0) continue;
+                    ++result.data_packets;
+                    simulation.send(response.data(), reply_size, false);
+                }
+                continue;
+            }
+
+            client.handleTimeout();
+            deadline_us = simulation.now() + timeout_us;
+            continue;
+        }
+
+        ++packets;
+
+        // Strings in packets must be terminated, as the server does
+        packet.data.resize(packet.data.size() + 2, '\0');
+        ssize_t size = packet.data.size() - 2;
+
+        if (!packet.to_server) {
+            client.handlePacket(packet.data.data(), size);
+            deadline_us = simulation.now() + timeout_us;
+            continue;
+        }
+
+        ssize_t response_size = controller.handlePacket(
+            peer, packet.data.data(), response.data(), size);
+        if (response_size <= 0) continue;
+
+        if (ntohs(*reinterpret_cast<uint16_t *>(response.data())) ==
+            static_cast<uint16_t>(tftp::PacketType::DATA)) {
+            ++result.data_packets;
+        }
+        simulation.send(response.data(), response_size, false);
+    }
+
+    result.completed = client.isFinished();
+    result.time_us = simulation.now();
+    result.unique_blocks = config.file_size / client.getBlockSize() + 1;
+    result.client_retransmits = client.getRetransmits();
+
+    if (result.completed && reading && client.getData() != content) {
+        result.completed = false;
+    }
+    if (result.completed && !reading && factory.files["file"] != content) {
+        result.completed = false;
+    }
+
+    return result;
+}
+
+// Sets failed if any run did not complete
+std::string runScenario(const Config &config, const Scenario &scenario,
+                        bool &failed) {
+    unsigned int completed = 0;
+    uint64_t total_time_us = 0;
+    uint64_t max_time_us = 0;
+    uint64_t data_packets = 0;
+    uint64_t unique_blocks = 0;
+    uint64_t client_retransmits = 0;
+
+    for (unsigned int run = 0; run < config.runs; ++run) {
+        RunResult result = runTransfer(config, scenario, config.seed + run);
+        if (!result.completed) continue;
+
+        ++completed;
+        total_time_us += result.time_us;
+        max_time_us = std::max(max_time_us, result.time_us);
+        data_packets += result.data_packets;
+        unique_blocks += result.unique_blocks;
+        client_retransmits += result.client_retransmits;
+    }
+
+    if (completed < config.runs) failed = true;
+
+    double seconds = total_time_us / 1e6;
+    std::ostringstream out;
+    out << "{\"scenario\": \"" << scenario.name << "\""
+        << ", \"mode\": \"" << config.mode << "\""
+        << ", \"seed\": " << config.seed << ", \"runs\": " << config.runs
+        << ", \"completed\": " << completed
+        << ", \"failed\": " << config.runs - completed
+        << ", \"goodput_mb_per_s\": "
+        << (seconds > 0 ? completed * config.file_size / seconds / 1e6 : 0)
+        << ", \"retransmission_ratio\": "
+        << (unique_blocks > 0 && data_packets > 0
+                ? static_cast<double>(data_packets) / unique_blocks - 1
+                : 0)
+        << ", \"client_retransmits\": " << client_retransmits
+        << ", \"mean_completion_ms\": "
+        << (completed > 0 ? total_time_us / 1e3 / completed : 0)
+        << ", \"max_completion_ms\": " << max_time_us / 1e3 << "}";
+    return out.str();
+}
+
+void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [options]" << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << "  --scenario NAME        Only run this scenario" << std::endl
+              << "  --seed N               Seed of the first run" << std::endl
+              << "  --runs N               Transfers per scenario" << std::endl
+              << "  --mode read|write      Transfer direction" << std::endl
+              << "  --file-size BYTES      Size of each transfer" << std::endl
+              << "  --blksize N            Requested block size" << std::endl
+              << "  --windowsize N         Requested window size" << std::endl
+              << "  --timeout MS           Client retransmission timeout"
+              << std::endl;
+    exit(1);
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    Config config;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "-h" || argument == "--help" || i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        std::string value = argv[++i];
+
+        if (argument == "--scenario") {
+            config.scenario = value;
+        } else if (argument == "--seed") {
+            config.seed = std::stoull(value);
+        } else if (argument == "--runs") {
+            config.runs = std::stoul(value);
+        } else if (argument == "--mode") {
+            config.mode = value;
+        } else if (argument == "--file-size") {
+            config.file_size = std::stoul(value);
+        } else if (argument == "--blksize") {
+            config.block_size = std::stoul(value);
+        } else if (argument == "--windowsize") {
+            config.window_size = std::stoul(value);
+        } else if (argument == "--timeout") {
+            config.timeout_ms = std::stoul(value);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // Keep stdout for the results
+    tftp::Logger::instance().setSink(stderr);
+
+    std::vector<std::string> results;
+    bool failed = false;
+    for (const Scenario &scenario : scenarios()) {
+        if (!config.scenario.empty() && scenario.name != config.scenario) {
+            continue;
+        }
+        results.push_back(runScenario(config, scenario, failed));
+    }
+
+    std::cout << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        std::cout << "  " << results[i]
+                  << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    std::cout << "]" << std::endl;
+
+    // Every run has to complete, so the harness can gate changes
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,353 @@
+#include "pcap_trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+#include "packets.hpp"
+
+namespace tftp {
+namespace {
+constexpr inline uint32_t PCAP_MAGIC_MICROSECONDS = 0xa1b2c3d4;
+constexpr inline uint32_t PCAP_MAGIC_NANOSECONDS = 0xa1b23c4d;
+constexpr inline uint32_t PCAPNG_MAGIC = 0x0a0d0d0a;
+
+// Link types
+constexpr inline uint32_t LINKTYPE_NULL = 0;
+constexpr inline uint32_t LINKTYPE_ETHERNET = 1;
+constexpr inline uint32_t LINKTYPE_RAW = 101;
+constexpr inline uint32_t LINKTYPE_LOOP = 108;
+constexpr inline uint32_t LINKTYPE_LINUX_SLL = 113;
+constexpr inline uint32_t LINKTYPE_IPV4 = 228;
+constexpr inline uint32_t LINKTYPE_IPV6 = 229;
+constexpr inline uint32_t LINKTYPE_LINUX_SLL2 = 276;
+
+constexpr inline uint8_t IP_PROTOCOL_UDP = 17;
+
+uint16_t readBigEndian16(const uint8_t *src) {
+    return static_cast<uint16_t>(src[0] << 8 | src[1]);
+}
+
+uint32_t byteSwap32(uint32_t value) {
+    return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) |
+           (value << 24);
+}
+
+// A UDP datagram, possibly truncated by the snapshot length
+struct Datagram {
+    std::string source;  // Address and port, packed
+    std::string destination;
+    uint16_t destination_port;
+    const uint8_t *payload;
+    size_t captured;  // Payload bytes present in the capture
+    size_t length;    // Payload bytes on the wire
+};
+
+std::string endpoint(const uint8_t *address, size_t size, uint16_t port) {
+    std::string key(reinterpret_cast<const char *>(address), size);
+    key.push_back(static_cast<char>(port >> 8));
+    key.push_back(static_cast<char>(port & 0xFF));
+    return key;
+}
+
+bool parseUdp(const uint8_t *src, size_t size, const uint8_t *source_address,
+              const uint8_t *destination_address, size_t address_size,
+              Datagram &datagram) {
+    if (size < 8) return false;
+
+    uint16_t source_port = readBigEndian16(src);
+    datagram.destination_port = readBigEndian16(src + 2);
+    uint16_t length = readBigEndian16(src + 4);
+    if (length < 8) return false;
+
+    datagram.source = endpoint(source_address, address_size, source_port);
+    datagram.destination = endpoint(destination_address, address_size,
+                                    datagram.destination_port);
+    datagram.payload = src + 8;
+    datagram.length = length - 8;
+    datagram.captured = std::min(size - 8, datagram.length);
+    return true;
+}
+
+bool parseIp(const uint8_t *src, size_t size, Datagram &datagram) {
+    if (size < 1) return false;
+
+    if (src[0] >> 4 == 4) {
+        size_t header_size = (src[0] & 0x0F) * 4;
+        if (size < 20 || header_size < 20 || size < header_size) return false;
+        if (src[9] != IP_PROTOCOL_UDP) return false;
+
+        // Only the first fragment carries the UDP header
+        if ((readBigEndian16(src + 6) & 0x1FFF) != 0) return false;
+
+        return parseUdp(src + header_size, size - header_size, src + 12,
+                        src + 16, 4, datagram);
+    }
+
+    if (src[0] >> 4 == 6) {
+        // Extension headers are rare for TFTP and are not followed
+        if (size < 40 || src[6] != IP_PROTOCOL_UDP) return false;
+        return parseUdp(src + 40, size - 40, src + 8, src + 24, 16, datagram);
+    }
+
+    return false;
+}
+
+bool parseLinkLayer(uint32_t link_type, const uint8_t *src, size_t size,
+                    Datagram &datagram) {
+    switch (link_type) {
+        case LINKTYPE_ETHERNET: {
+            size_t offset = 12;
+            if (size < offset + 2) return false;
+            uint16_t ether_type = readBigEndian16(src + offset);
+
+            // Skip VLAN tags
+            while (ether_type == 0x8100 || ether_type == 0x88a8) {
+                offset += 4;
+                if (size < offset + 2) return false;
+                ether_type = readBigEndian16(src + offset);
+            }
+
+            if (ether_type != 0x0800 && ether_type != 0x86DD) return false;
+            return parseIp(src + offset + 2, size - offset - 2, datagram);
+        }
+        case LINKTYPE_LINUX_SLL:
+            if (size < 16) return false;
+            return parseIp(src + 16, size - 16, datagram);
+        case LINKTYPE_LINUX_SLL2:
+            if (size < 20) return false;
+            return parseIp(src + 20, size - 20, datagram);
+        case LINKTYPE_NULL:
+        case LINKTYPE_LOOP: {
+            // The address family is skipped, the IP version says the same
+            if (size < 4) return false;
+            return parseIp(src + 4, size - 4, datagram);
+        }
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            return parseIp(src, size, datagram);
+        default:
+            return false;
+    }
+}
+
+// Tracks the sessions of one capture as packets are read
+class SessionTracker {
+   public:
+    SessionTracker(uint16_t server_port) : server_port(server_port) {}
+
+    void handle(uint64_t time_us, const Datagram &datagram) {
+        if (datagram.captured < 4) return;
+
+        PacketType type =
+            static_cast<PacketType>(readBigEndian16(datagram.payload));
+
+        if ((type == PacketType::RRQ || type == PacketType::WRQ) &&
+            datagram.destination_port == this->server_port) {
+            this->handleRequest(time_us, datagram, type == PacketType::WRQ);
+            return;
+        }
+
+        // Transfers are keyed by the client, which sends from a fixed port
+        auto source = this->active.find(datagram.source);
+        auto destination = this->active.find(datagram.destination);
+
+        if (type == PacketType::OACK && destination != this->active.end()) {
+            this->handleOptionAck(datagram, this->sessions[destination->second]);
+        } else if (type == PacketType::DATA) {
+            // Downloads flow to the client, uploads from it
+            if (destination != this->active.end() &&
+                !this->sessions[destination->second].session.write) {
+                this->handleData(datagram, destination);
+            } else if (source != this->active.end() &&
+                       this->sessions[source->second].session.write) {
+                this->handleData(datagram, source);
+            }
+        } else if (type == PacketType::ERROR) {
+            if (source != this->active.end()) this->active.erase(source);
+            if (destination != this->active.end()) {
+                this->active.erase(destination);
+            }
+        }
+    }
+
+    std::vector<TraceSession> finish() {
+        std::vector<TraceSession> result;
+        for (auto &tracked : this->sessions) {
+            tracked.session.start_us -= this->first_time_us;
+            result.push_back(tracked.session);
+        }
+        return result;
+    }
+
+   private:
+    struct Tracked {
+        TraceSession session;
+        uint16_t next_block = 1;
+        bool acknowledged = false;  // Options were answered by an OACK
+    };
+
+    const uint16_t server_port;
+    std::vector<Tracked> sessions;
+    std::map<std::string, size_t> active;
+    uint64_t first_time_us = UINT64_MAX;
+
+    void handleRequest(uint64_t time_us, const Datagram &datagram, bool write) {
+        // Strings need the two terminating NULs the codec relies on
+        std::vector<char> buffer(datagram.payload,
+                                 datagram.payload + datagram.captured);
+        buffer.resize(buffer.size() + 2, '\0');
+
+        Tracked tracked;
+        tracked.session.write = write;
+        tracked.session.start_us = time_us;
+
+        try {
+            ReadRequestPacket packet;
+            ssize_t bytes_read = packet.deserialize(buffer.data());
+            if (bytes_read < static_cast<ssize_t>(datagram.captured)) {
+                packet.deserializeOptions(buffer.data() + bytes_read,
+                                          datagram.captured - bytes_read);
+            }
+
+            tracked.session.filename = packet.filename;
+            auto window_size = packet.options.find("windowsize");
+            if (window_size != packet.options.end()) {
+                tracked.session.window_size = std::stoi(window_size->second);
+            }
+            auto block_size = packet.options.find("blksize");
+            if (block_size != packet.options.end()) {
+                tracked.session.block_size = std::stoi(block_size->second);
+            }
+        } catch (const std::exception &) {
+            return;
+        }
+
+        // A retransmitted request does not start another session
+        auto existing = this->active.find(datagram.source);
+        if (existing != this->active.end()) {
+            Tracked &previous = this->sessions[existing->second];
+            if (previous.session.filename == tracked.session.filename &&
+                previous.next_block == 1) {
+                return;
+            }
+        }
+
+        this->first_time_us = std::min(this->first_time_us, time_us);
+        this->active[datagram.source] = this->sessions.size();
+        this->sessions.push_back(tracked);
+    }
+
+    void handleOptionAck(const Datagram &datagram, Tracked &tracked) {
+        std::vector<char> buffer(datagram.payload,
+                                 datagram.payload + datagram.captured);
+        buffer.resize(buffer.size() + 2, '\0');
+
+        OptionAckPacket packet;
+        try {
+            packet.deserialize(buffer.data());
+        } catch (const std::exception &) {
+            return;
+        }
+
+        // Options left out of the OACK fall back to their defaults
+        tracked.acknowledged = true;
+        auto block_size = packet.options.find("blksize");
+        tracked.session.block_size =
+            block_size != packet.options.end() ? std::stoi(block_size->second)
+                                               : 512;
+        auto window_size = packet.options.find("windowsize");
+        tracked.session.window_size =
+            window_size != packet.options.end()
+                ? std::stoi(window_size->second)
+                : 1;
+    }
+
+    void handleData(const Datagram &datagram,
+                    std::map<std::string, size_t>::iterator entry) {
+        Tracked &tracked = this->sessions[entry->second];
+        uint16_t block_number = readBigEndian16(datagram.payload + 2);
+        if (block_number != tracked.next_block) return;
+
+        // Without an OACK the server ignored the options
+        if (!tracked.acknowledged && block_number == 1) {
+            tracked.session.block_size = 512;
+            tracked.session.window_size = 1;
+        }
+
+        size_t data_size = datagram.length - 4;
+        tracked.session.size += data_size;
+        ++tracked.next_block;
+
+        if (data_size < tracked.session.block_size) {
+            tracked.session.complete = true;
+            this->active.erase(entry);
+        }
+    }
+};
+}  // namespace
+
+std::vector<TraceSession> readPcapTrace(const std::string &path,
+                                        uint16_t server_port) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("Can not open " + path);
+
+    uint8_t header[24];
+    if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+        throw std::runtime_error(path + " is not a pcap file");
+    }
+
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    bool swapped = false;
+    if (magic == byteSwap32(PCAP_MAGIC_MICROSECONDS) ||
+        magic == byteSwap32(PCAP_MAGIC_NANOSECONDS)) {
+        swapped = true;
+        magic = byteSwap32(magic);
+    }
+
+    if (magic == PCAPNG_MAGIC) {
+        throw std::runtime_error(path +
+                                 " is pcapng, convert it with editcap -F pcap");
+    }
+    if (magic != PCAP_MAGIC_MICROSECONDS && magic != PCAP_MAGIC_NANOSECONDS) {
+        throw std::runtime_error(path + " is not a pcap file");
+    }
+    bool nanoseconds = magic == PCAP_MAGIC_NANOSECONDS;
+
+    auto field = [swapped](const uint8_t *src) {
+        uint32_t value;
+        memcpy(&value, src, 4);
+        return swapped ? byteSwap32(value) : value;
+    };
+    uint32_t link_type = field(header + 20) & 0xFFFF;
+
+    SessionTracker tracker(server_port);
+    std::vector<uint8_t> packet;
+    uint8_t record[16];
+
+    while (file.read(reinterpret_cast<char *>(record), sizeof(record))) {
+        uint64_t seconds = field(record);
+        uint64_t fraction = field(record + 4);
+        uint32_t captured = field(record + 8);
+
+        packet.resize(captured);
+        if (!file.read(reinterpret_cast<char *>(packet.data()), captured)) {
+            break;  // Truncated capture
+        }
+
+        uint64_t time_us =
+            seconds * 1000000 + (nanoseconds ? fraction / 1000 : fraction);
+
+        Datagram datagram;
+        if (parseLinkLayer(link_type, packet.data(), packet.size(), datagram)) {
+            tracker.handle(time_us, datagram);
+        }
+    }
+
+    return tracker.finish();
+}
+}  // namespace tftp
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tftp {
+// One transfer seen in a capture
+struct TraceSession {
+    uint64_t start_us = 0;  // Since the first request in the capture
+    bool write = false;
+    std::string filename;
+    uint16_t block_size = 512;
+    uint16_t window_size = 1;
+    uint64_t size = 0;  // Bytes transferred in order
+    bool complete = false;
+};
+
+// Extracts the TFTP sessions from a classic pcap file, without libpcap.
+// Requests are recognised by their destination port and later packets are
+// matched to them by the client address and port. Throws std::runtime_error
+// if the file can not be read.
+std::vector<TraceSession> readPcapTrace(const std::string &path,
+                                        uint16_t server_port);
+}  // namespace tftp
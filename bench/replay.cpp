@@ -0,0 +1,433 @@
+// Pcap trace replay. Extracts the TFTP sessions from a capture of real
+// traffic and replays their client side against a tftp::Server, keeping or
+// compressing the original timing. Reports latency percentiles per file size
+// class and the CPU time of the server, and compares them to an earlier run.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "controller.hpp"
+#include "filesystem.hpp"
+#include "logger.hpp"
+#include "pcap_trace.hpp"
+#include "server.hpp"
+#include "transfer_client.hpp"
+#include "udp_transfer.hpp"
+
+namespace {
+// Files up to this size count as small, such as configs and boot loaders
+constexpr inline uint64_t SMALL_FILE_SIZE = 64 * 1024;
+
+// Starting this much after the capture did counts as late
+constexpr inline uint64_t LATE_START_US = 10000;
+
+struct Config {
+    std::string trace;
+    uint16_t trace_port = 69;
+    std::string server_ip = "127.0.0.1";
+    unsigned int port = 16969;
+    bool in_process = true;
+    pid_t server_pid = 0;
+    std::filesystem::path root;
+    double speed = 1;
+    unsigned int threads = 64;
+    unsigned int timeout_ms = 1000;
+    size_t limit = 0;
+    std::string output;
+    std::string compare;
+};
+
+struct SessionResult {
+    bool success = false;
+    bool late = false;
+    uint64_t first_reply_us = 0;
+    uint64_t elapsed_us = 0;
+};
+
+void usage(const char *name) {
+    std::cerr
+        << "Usage: " << name << " [options] TRACE.pcap" << std::endl
+        << std::endl
+        << "Options:" << std::endl
+        << "  --trace-port PORT      Server port in the capture (69)"
+        << std::endl
+        << "  --server IP:PORT       Use a running server instead of an "
+           "in-process one"
+        << std::endl
+        << "  --server-pid PID       Measure the CPU time of that server"
+        << std::endl
+        << "  --port PORT            Port of the in-process server" << std::endl
+        << "  --root DIR             Where the replayed files are created"
+        << std::endl
+        << "  --speed X              Timing compression, 0 for back to back"
+        << std::endl
+        << "  --threads N            Sessions that can run at once" << std::endl
+        << "  --timeout MS           Client retransmission timeout"
+        << std::endl
+        << "  --limit N              Only replay the first N sessions"
+        << std::endl
+        << "  --output FILE          Write JSON to FILE instead of stdout"
+        << std::endl
+        << "  --compare FILE         Print the change from an earlier run"
+        << std::endl;
+    exit(1);
+}
+
+Config parseArguments(int argc, char **argv) {
+    Config config;
+    config.root = std::filesystem::temp_directory_path() / "self-tftp-replay";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+
+        if (argument == "-h" || argument == "--help") usage(argv[0]);
+        if (argument.rfind("--", 0) != 0) {
+            config.trace = argument;
+            continue;
+        }
+
+        if (i + 1 >= argc) usage(argv[0]);
+        std::string value = argv[++i];
+
+        if (argument == "--trace-port") {
+            config.trace_port = std::stoul(value);
+        } else if (argument == "--server") {
+            size_t colon = value.find(':');
+            if (colon == std::string::npos) usage(argv[0]);
+            config.server_ip = value.substr(0, colon);
+            config.port = std::stoul(value.substr(colon + 1));
+            config.in_process = false;
+        } else if (argument == "--server-pid") {
+            config.server_pid = std::stoi(value);
+        } else if (argument == "--port") {
+            config.port = std::stoul(value);
+        } else if (argument == "--root") {
+            config.root = value;
+        } else if (argument == "--speed") {
+            config.speed = std::stod(value);
+        } else if (argument == "--threads") {
+            config.threads = std::max(1ul, std::stoul(value));
+        } else if (argument == "--timeout") {
+            config.timeout_ms = std::stoul(value);
+        } else if (argument == "--limit") {
+            config.limit = std::stoul(value);
+        } else if (argument == "--output") {
+            config.output = value;
+        } else if (argument == "--compare") {
+            config.compare = value;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (config.trace.empty()) usage(argv[0]);
+    return config;
+}
+
+// Keeps the files of a capture below the root
+std::filesystem::path localPath(const Config &config,
+                                const std::string &filename) {
+    std::filesystem::path path = config.root / "files";
+    std::stringstream stream(filename);
+    std::string part;
+
+    while (std::getline(stream, part, '/')) {
+        if (part.empty() || part == "." || part == "..") continue;
+        std::replace(part.begin(), part.end(), '\\', '_');
+        path /= part;
+    }
+
+    return path;
+}
+
+// Creates every downloaded file with the largest size seen for it
+void createFiles(const Config &config,
+                 const std::vector<tftp::TraceSession> &sessions) {
+    std::map<std::filesystem::path, uint64_t> sizes;
+    for (auto &session : sessions) {
+        if (session.write) continue;
+
+        uint64_t &size = sizes[localPath(config, session.filename)];
+        size = std::max(size, session.size);
+    }
+
+    std::mt19937 random(1);
+    for (auto &[path, size] : sizes) {
+        if (std::filesystem::exists(path) &&
+            std::filesystem::file_size(path) == size) {
+            continue;
+        }
+
+        std::filesystem::create_directories(path.parent_path());
+        std::ofstream file(path, std::ios::binary);
+        std::vector<char> chunk(64 * 1024);
+        for (uint64_t left = size; left > 0;) {
+            for (char &c : chunk) c = static_cast<char>(random());
+            size_t count = std::min<uint64_t>(left, chunk.size());
+            file.write(chunk.data(), count);
+            left -= count;
+        }
+    }
+
+    std::filesystem::create_directories(config.root / "uploads");
+}
+
+// CPU seconds used so far by the server, or a negative value if unknown
+double serverCpuSeconds(const Config &config, std::thread &server_thread) {
+    if (config.in_process) {
+        clockid_t clock;
+        struct timespec time;
+        if (pthread_getcpuclockid(server_thread.native_handle(), &clock) != 0 ||
+            clock_gettime(clock, &time) != 0) {
+            return -1;
+        }
+        return time.tv_sec + time.tv_nsec / 1e9;
+    }
+
+    if (config.server_pid == 0) return -1;
+
+    // utime and stime are the 14th and 15th fields, after the command name
+    std::ifstream stat("/proc/" + std::to_string(config.server_pid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line)) return -1;
+
+    size_t end = line.rfind(')');
+    if (end == std::string::npos) return -1;
+
+    std::istringstream fields(line.substr(end + 2));
+    std::string field;
+    uint64_t user = 0, system = 0;
+    for (int index = 3; fields >> field; ++index) {
+        if (index == 14) user = std::stoull(field);
+        if (index == 15) {
+            system = std::stoull(field);
+            break;
+        }
+    }
+
+    return static_cast<double>(user + system) / sysconf(_SC_CLK_TCK);
+}
+
+std::vector<SessionResult> replay(const Config &config,
+                                  const std::vector<tftp::TraceSession> &sessions) {
+    std::vector<SessionResult> results(sessions.size());
+    std::atomic<size_t> next_session{0};
+    auto start = std::chrono::steady_clock::now();
+
+    // Workers take sessions in capture order and wait for their start time
+    auto worker = [&]() {
+        size_t index;
+        while ((index = next_session.fetch_add(1)) < sessions.size()) {
+            const tftp::TraceSession &session = sessions[index];
+            SessionResult &result = results[index];
+
+            if (config.speed > 0) {
+                auto due = start + std::chrono::microseconds(static_cast<uint64_t>(
+                                       session.start_us / config.speed));
+                std::this_thread::sleep_until(due);
+                result.late = std::chrono::steady_clock::now() - due >
+                              std::chrono::microseconds(LATE_START_US);
+            }
+
+            tftp::TransferOptions options;
+            options.block_size = session.block_size;
+            options.window_size = session.window_size;
+            options.timeout_ms = config.timeout_ms;
+
+            std::filesystem::path path =
+                session.write
+                    ? config.root / "uploads" / std::to_string(index)
+                    : localPath(config, session.filename);
+
+            tftp::TransferClient client(
+                session.write ? tftp::TransferClient::Mode::Write
+                              : tftp::TransferClient::Mode::Read,
+                std::filesystem::absolute(path).string(), options, nullptr);
+            if (session.write) client.setData(std::vector<char>(session.size));
+
+            tftp::UdpTransferResult transfer =
+                tftp::runUdpTransfer(config.server_ip, config.port, client);
+            result.success = transfer.success;
+            result.first_reply_us = transfer.first_reply_us;
+            result.elapsed_us = transfer.elapsed_us;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < config.threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto &thread : threads) thread.join();
+
+    return results;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double percentile) {
+    if (sorted.empty()) return 0;
+
+    size_t index = static_cast<size_t>(percentile * sorted.size());
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void writePercentiles(std::ostream &out, const std::string &name,
+                      std::vector<uint64_t> values) {
+    std::sort(values.begin(), values.end());
+    out << ",\n  \"" << name << ".p50\": " << percentile(values, 0.5)
+        << ",\n  \"" << name << ".p99\": " << percentile(values, 0.99)
+        << ",\n  \"" << name << ".p999\": " << percentile(values, 0.999);
+}
+
+std::string toJson(const Config &config,
+                   const std::vector<tftp::TraceSession> &sessions,
+                   const std::vector<SessionResult> &results, double seconds,
+                   double cpu_seconds) {
+    unsigned int completed = 0, late = 0, writes = 0;
+    std::vector<uint64_t> first_reply, elapsed, small_elapsed, large_elapsed;
+
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        if (sessions[i].write) ++writes;
+        if (results[i].late) ++late;
+        if (!results[i].success) continue;
+
+        ++completed;
+        first_reply.push_back(results[i].first_reply_us);
+        elapsed.push_back(results[i].elapsed_us);
+        (sessions[i].size <= SMALL_FILE_SIZE ? small_elapsed : large_elapsed)
+            .push_back(results[i].elapsed_us);
+    }
+
+    std::ostringstream out;
+    out << "{\n  \"sessions\": " << sessions.size()
+        << ",\n  \"writes\": " << writes << ",\n  \"completed\": " << completed
+        << ",\n  \"failed\": " << sessions.size() - completed
+        << ",\n  \"late_starts\": " << late
+        << ",\n  \"speed\": " << config.speed
+        << ",\n  \"seconds\": " << seconds;
+    if (cpu_seconds >= 0) out << ",\n  \"server_cpu_s\": " << cpu_seconds;
+    writePercentiles(out, "first_reply_us", first_reply);
+    writePercentiles(out, "completion_us", elapsed);
+    writePercentiles(out, "small.completion_us", small_elapsed);
+    writePercentiles(out, "large.completion_us", large_elapsed);
+    out << "\n}\n";
+    return out.str();
+}
+
+// Reads the numbers of a flat JSON object written by toJson()
+std::map<std::string, double> readNumbers(const std::string &json) {
+    static const std::regex pair("\"([^\"]+)\": (-?[0-9.eE+-]+)");
+
+    std::map<std::string, double> numbers;
+    for (auto match = std::sregex_iterator(json.begin(), json.end(), pair);
+         match != std::sregex_iterator(); ++match) {
+        numbers[(*match)[1]] = std::stod((*match)[2]);
+    }
+    return numbers;
+}
+
+void compare(const std::string &base_path, const std::string &json) {
+    std::ifstream file(base_path);
+    if (!file) {
+        std::cerr << "Can not open " << base_path << std::endl;
+        return;
+    }
+
+    std::stringstream base_json;
+    base_json << file.rdbuf();
+    std::map<std::string, double> base = readNumbers(base_json.str());
+
+    std::cerr << "metric base current change" << std::endl;
+    for (auto &[name, value] : readNumbers(json)) {
+        auto before = base.find(name);
+        if (before == base.end()) continue;
+
+        std::cerr << name << " " << before->second << " " << value;
+        if (before->second != 0) {
+            std::cerr << " " << std::showpos
+                      << (value - before->second) / before->second * 100
+                      << std::noshowpos << "%";
+        }
+        std::cerr << std::endl;
+    }
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    Config config = parseArguments(argc, argv);
+
+    // Keep stdout for the results
+    tftp::Logger::instance().setSink(stderr);
+
+    std::vector<tftp::TraceSession> sessions;
+    try {
+        sessions = tftp::readPcapTrace(config.trace, config.trace_port);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    if (config.limit > 0 && sessions.size() > config.limit) {
+        sessions.resize(config.limit);
+    }
+    std::cerr << "Replaying " << sessions.size() << " sessions from "
+              << config.trace << std::endl;
+
+    createFiles(config, sessions);
+
+    // Start an in-process server unless one was given
+    tftp::DiskFileSystem filesystem;
+    tftp::BufferedFileWorkerFactory worker_factory(5 * 1024 * 1024, filesystem);
+    tftp::Controller controller(worker_factory);
+    std::unique_ptr<tftp::Server> server;
+    std::thread server_thread;
+
+    if (config.in_process) {
+        server.reset(new tftp::Server(config.server_ip, config.port, controller));
+        server_thread = std::thread([&server]() { server->listen(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    double cpu_start = serverCpuSeconds(config, server_thread);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<SessionResult> results = replay(config, sessions);
+
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    double cpu_end = serverCpuSeconds(config, server_thread);
+
+    if (server) {
+        server->stop();
+        server_thread.join();
+    }
+
+    std::string json = toJson(config, sessions, results, seconds,
+                              cpu_start >= 0 && cpu_end >= 0
+                                  ? cpu_end - cpu_start
+                                  : -1);
+
+    if (config.output.empty()) {
+        std::cout << json;
+    } else {
+        std::ofstream(config.output) << json;
+    }
+
+    if (!config.compare.empty()) compare(config.compare, json);
+
+    return 0;
+}
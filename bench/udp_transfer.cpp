@@ -0,0 +1,128 @@
+#include "udp_transfer.hpp"
+
+#include <chrono>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace tftp {
+namespace {
+// Socket that receives the blocks of a multicast group, on the interface
+// the server is reached through when that is loopback
+int joinGroup(const std::string &address, uint16_t port, in_addr_t server) {
+    int group_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (group_fd < 0) return -1;
+
+    // Every client on this host binds the same group and port
+    int reuse = 1;
+    setsockopt(group_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in group_addr = {};
+    group_addr.sin_family = AF_INET;
+    group_addr.sin_addr.s_addr = inet_addr(address.c_str());
+    group_addr.sin_port = htons(port);
+
+    struct ip_mreq request = {};
+    request.imr_multiaddr = group_addr.sin_addr;
+    request.imr_interface.s_addr =
+        (ntohl(server) >> 24) == 127 ? server : htonl(INADDR_ANY);
+
+    if (bind(group_fd, (struct sockaddr *)&group_addr, sizeof(group_addr)) <
+            0 ||
+        setsockopt(group_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request,
+                   sizeof(request)) < 0) {
+        close(group_fd);
+        return -1;
+    }
+
+    return group_fd;
+}
+}  // namespace
+
+UdpTransferResult runUdpTransfer(const std::string &ip, unsigned int port,
+                                 TransferClient &client) {
+    UdpTransferResult result;
+
+    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socket_fd < 0) return result;
+
+    struct sockaddr_in peer_addr = {};
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = inet_addr(ip.c_str());
+    peer_addr.sin_port = htons(port);
+
+    const int timeout_ms = client.getOptions().timeout_ms;
+
+    client.setSender([socket_fd, &peer_addr](const char *data, ssize_t size) {
+        sendto(socket_fd, data, size, 0, (struct sockaddr *)&peer_addr,
+               sizeof(peer_addr));
+    });
+
+    // Multicast blocks come in on a second socket
+    int group_fd = -1;
+    client.setJoiner([&group_fd, &peer_addr](const std::string &address,
+                                             uint16_t port) {
+        group_fd = joinGroup(address, port, peer_addr.sin_addr.s_addr);
+        return group_fd >= 0;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&start]() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+    };
+
+    std::vector<char> buffer(UINT16_MAX + 1);
+    bool answered = false;
+
+    client.start();
+    while (!client.isFinished() && !client.isFailed()) {
+        struct pollfd fds[2] = {{socket_fd, POLLIN, 0}, {group_fd, POLLIN, 0}};
+        if (poll(fds, 2, timeout_ms) <= 0) {
+            client.handleTimeout();
+            continue;
+        }
+
+        struct sockaddr_in from_addr;
+        socklen_t from_len = sizeof(from_addr);
+        bool from_group = (fds[1].revents & POLLIN) != 0;
+        ssize_t size = recvfrom(from_group ? group_fd : socket_fd,
+                                buffer.data(), buffer.size(), 0,
+                                (struct sockaddr *)&from_addr, &from_len);
+
+        if (size < 0) continue;
+        if (from_addr.sin_addr.s_addr != peer_addr.sin_addr.s_addr) continue;
+
+        // Blocks of the group come from the port the server answered from
+        if (from_group) {
+            if (answered && from_addr.sin_port == peer_addr.sin_port) {
+                client.handlePacket(buffer.data(), size);
+            }
+            continue;
+        }
+
+        // Lock on to the port of the first answer
+        if (!answered) {
+            answered = true;
+            result.first_reply_us = elapsed();
+            peer_addr.sin_port = from_addr.sin_port;
+        } else if (from_addr.sin_port != peer_addr.sin_port) {
+            continue;
+        }
+
+        client.handlePacket(buffer.data(), size);
+    }
+
+    close(socket_fd);
+    if (group_fd >= 0) close(group_fd);
+
+    result.success = client.isFinished();
+    result.elapsed_us = elapsed();
+    return result;
+}
+}  // namespace tftp
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "transfer_client.hpp"
+
+namespace tftp {
+struct UdpTransferResult {
+    bool success = false;
+    uint64_t first_reply_us = 0;  // Time until the server first answered
+    uint64_t elapsed_us = 0;
+};
+
+// Runs a transfer over its own UDP socket. The server may answer from a new
+// port (its transfer ID), which then becomes the peer for the rest of it.
+UdpTransferResult runUdpTransfer(const std::string &ip, unsigned int port,
+                                 TransferClient &client);
+}  // namespace tftp
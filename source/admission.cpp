@@ -0,0 +1,113 @@
+#include "admission.hpp"
+
+#include <cstring>
+
+namespace tftp {
+ClientCounter::ClientCounter(size_t capacity) {
+    // Keep the load factor at most 3/4
+    size_t size = 16;
+    while (size * 3 < capacity * 4) size *= 2;
+
+    this->slots.resize(size);
+    this->mask = size - 1;
+}
+
+uint32_t ClientCounter::get(const Peer &peer) const {
+    const Slot &slot = this->slots[this->find(clientOf(peer))];
+    return slot.sessions;
+}
+
+void ClientCounter::increment(const Peer &peer) {
+    if ((this->count + 1) * 4 > this->slots.size() * 3) this->grow();
+
+    Peer client = clientOf(peer);
+    Slot &slot = this->slots[this->find(client)];
+    if (slot.sessions == 0) {
+        slot.client = client;
+        ++this->count;
+    }
+    ++slot.sessions;
+}
+
+void ClientCounter::decrement(const Peer &peer) {
+    size_t hole = this->find(clientOf(peer));
+    if (this->slots[hole].sessions == 0) return;
+    if (--this->slots[hole].sessions > 0) return;
+
+    // Shift later entries of the run back, so no tombstones are needed
+    for (size_t index = (hole + 1) & this->mask;
+         this->slots[index].sessions != 0; index = (index + 1) & this->mask) {
+        size_t home = this->slots[index].client.hash() & this->mask;
+
+        // Entries whose home is between the hole and them have to stay
+        if (((index - home) & this->mask) >= ((index - hole) & this->mask)) {
+            this->slots[hole] = this->slots[index];
+            hole = index;
+        }
+    }
+    this->slots[hole] = Slot();
+    --this->count;
+}
+
+size_t ClientCounter::find(const Peer &client) const {
+    // The slot of the client, or the empty slot that ends its run
+    size_t index = client.hash() & this->mask;
+    while (this->slots[index].sessions != 0 &&
+           this->slots[index].client != client) {
+        index = (index + 1) & this->mask;
+    }
+    return index;
+}
+
+void ClientCounter::grow() {
+    std::vector<Slot> old_slots(this->slots.size() * 2);
+    old_slots.swap(this->slots);
+    this->mask = this->slots.size() - 1;
+
+    for (const Slot &slot : old_slots) {
+        if (slot.sessions != 0) this->slots[this->find(slot.client)] = slot;
+    }
+}
+
+void AdmissionQueue::setCapacity(size_t capacity) {
+    this->requests.resize(capacity);
+    this->order.clear();
+    this->order.reserve(capacity);
+
+    this->free_requests.clear();
+    for (size_t i = capacity; i > 0; --i) this->free_requests.push_back(i - 1);
+}
+
+bool AdmissionQueue::push(const Peer &peer, const char *src, ssize_t size,
+                          uint64_t now_us) {
+    if (this->free_requests.empty() || size > ADMISSION_REQUEST_SIZE) {
+        return false;
+    }
+
+    uint32_t index = this->free_requests.back();
+    this->free_requests.pop_back();
+
+    Request &request = this->requests[index];
+    request.peer = peer;
+    request.arrival_us = now_us;
+    request.size = size;
+    memcpy(request.data, src, size);
+    request.data[size] = '\0';
+    request.data[size + 1] = '\0';
+
+    this->order.push_back(index);
+    return true;
+}
+
+bool AdmissionQueue::contains(const Peer &peer) const {
+    for (uint32_t index : this->order) {
+        if (this->requests[index].peer == peer) return true;
+    }
+    return false;
+}
+
+void AdmissionQueue::erase(size_t i) {
+    this->free_requests.push_back(this->order[i]);
+    this->order.erase(this->order.begin() + i);
+}
+}  // namespace tftp
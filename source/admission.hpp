@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common.hpp"
+#include "peer.hpp"
+
+namespace tftp {
+// Largest request that can wait in the admission queue
+constexpr inline unsigned int ADMISSION_REQUEST_SIZE = 1024;
+constexpr inline unsigned int DEFAULT_ADMISSION_TIMEOUT_MS = 1000;
+
+// What the server takes on at once. Zero means no limit.
+struct AdmissionLimits {
+    size_t max_sessions = 0;
+    size_t max_client_sessions = 0;  // Per client address
+    size_t max_pending_io = 0;       // Sessions waiting for the disk
+
+    // Requests over a limit wait this long for a slot, as long as there is
+    // room in the queue, and are turned away otherwise
+    size_t queue_length = 0;
+    unsigned int queue_timeout_ms = DEFAULT_ADMISSION_TIMEOUT_MS;
+};
+
+// Sessions per client address, whatever their port. Open addressing with
+// backward shift deletion, like the session table. Not thread safe.
+class ClientCounter {
+   public:
+    ClientCounter(size_t capacity = 1024);
+
+    uint32_t get(const Peer &peer) const;
+    void increment(const Peer &peer);
+    void decrement(const Peer &peer);
+
+    size_t size() const { return this->count; }
+
+   private:
+    struct Slot {
+        Peer client;
+        uint32_t sessions = 0;  // 0 marks an empty slot
+    };
+
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t count = 0;
+
+    static Peer clientOf(const Peer &peer) {
+        Peer client = peer;
+        client.port = 0;
+        return client;
+    }
+
+    size_t find(const Peer &client) const;
+    void grow();
+};
+
+// Requests waiting for a session slot, oldest first. Room for all of them is
+// taken up front, so queueing never allocates.
+class AdmissionQueue {
+   public:
+    struct Request {
+        Peer peer;
+        uint64_t arrival_us;
+        ssize_t size;
+        char data[ADMISSION_REQUEST_SIZE + 2];  // Terminated like the server does
+    };
+
+    void setCapacity(size_t capacity);
+
+    // False if the queue is full or the request too large
+    bool push(const Peer &peer, const char *src, ssize_t size,
+              uint64_t now_us);
+    bool contains(const Peer &peer) const;
+
+    // The i-th oldest request
+    Request &at(size_t i) { return this->requests[this->order[i]]; }
+    void erase(size_t i);
+
+    bool empty() const { return this->order.empty(); }
+    size_t size() const { return this->order.size(); }
+
+   private:
+    std::vector<Request> requests;
+    std::vector<uint32_t> free_requests;
+    std::vector<uint32_t> order;
+};
+}  // namespace tftp
@@ -0,0 +1,137 @@
+#include "affinity.hpp"
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace tftp {
+namespace {
+constexpr unsigned long MAX_CPUS = 4096;
+
+// First line of a sysfs attribute, empty if it cannot be read
+std::string readAttribute(const std::string &path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+}  // namespace
+
+CpuPlacement CpuPlacement::resolve(const std::string &interface, int numa_node,
+                                   const std::vector<unsigned int> &cpus) {
+    CpuPlacement placement;
+    placement.numa_node = numa_node;
+    if (placement.numa_node < 0 && !interface.empty()) {
+        placement.numa_node = getInterfaceNumaNode(interface);
+    }
+
+    if (!cpus.empty()) {
+        placement.network_cpus = {cpus.front()};
+        placement.io_cpus = cpus.size() > 1
+                                ? std::vector<unsigned int>(cpus.begin() + 1,
+                                                            cpus.end())
+                                : cpus;
+    } else if (placement.numa_node >= 0) {
+        placement.network_cpus = getNumaNodeCpus(placement.numa_node);
+        placement.io_cpus = placement.network_cpus;
+    }
+
+    return placement;
+}
+
+std::vector<unsigned int> parseCpuList(const std::string &list) {
+    std::vector<unsigned int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+
+    while (std::getline(stream, range, ',')) {
+        if (range.empty()) continue;
+
+        // Either "N" or "N-M"
+        size_t dash = range.find('-');
+        std::string first_text = range.substr(0, dash);
+        std::string last_text =
+            dash == std::string::npos ? first_text : range.substr(dash + 1);
+
+        size_t first_end, last_end;
+        unsigned long first = std::stoul(first_text, &first_end);
+        unsigned long last = std::stoul(last_text, &last_end);
+
+        if (first_end != first_text.size() || last_end != last_text.size() ||
+            last < first || last >= MAX_CPUS) {
+            throw std::invalid_argument("Invalid CPU list!");
+        }
+
+        for (unsigned long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+int getInterfaceNumaNode(const std::string &interface) {
+    // Virtual interfaces and single node machines report -1 or nothing
+    std::string node =
+        readAttribute("/sys/class/net/" + interface + "/device/numa_node");
+
+    try {
+        return node.empty() ? -1 : std::stoi(node);
+    } catch (const std::exception &) {
+        return -1;
+    }
+}
+
+std::vector<unsigned int> getNumaNodeCpus(int node) {
+    if (node < 0) return {};
+
+    std::string list = readAttribute("/sys/devices/system/node/node" +
+                                     std::to_string(node) + "/cpulist");
+
+    try {
+        return parseCpuList(list);
+    } catch (const std::exception &) {
+        return {};
+    }
+}
+
+bool pinCurrentThread(const std::vector<unsigned int> &cpus) {
+    if (cpus.empty()) return true;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned int cpu : cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+bool preferNumaNode(int node) {
+    if (node < 0) return true;
+
+#ifdef __linux__
+    // Preferred rather than bound, so a full node spills over instead of
+    // failing allocations
+    constexpr unsigned long BITS = 8 * sizeof(unsigned long);
+    unsigned long mask[64] = {};
+    if (static_cast<unsigned long>(node) >= BITS * 64) return false;
+    mask[node / BITS] = 1ul << (node % BITS);
+
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, BITS * 64) == 0;
+#else
+    return false;
+#endif
+}
+}  // namespace tftp
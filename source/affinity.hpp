@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace tftp {
+// Where the server's threads run. Threads allocate from the node of the CPU
+// they run on, so pinning the network thread before the controller is
+// built keeps its tables and buffers on that node too.
+struct CpuPlacement {
+    int numa_node = -1;                  // -1 for no preference
+    std::vector<unsigned int> network_cpus;  // Empty to run anywhere
+    std::vector<unsigned int> io_cpus;
+
+    // The node of an interface, or an explicit node, and optionally the CPUs
+    // to use. The network thread gets the first of them and the disk I/O
+    // threads the rest; without a list both get every CPU of the node.
+    static CpuPlacement resolve(const std::string &interface, int numa_node,
+                                const std::vector<unsigned int> &cpus);
+
+    bool isEmpty() const {
+        return this->numa_node < 0 && this->network_cpus.empty();
+    }
+};
+
+// Parses a CPU list the way the kernel prints them, such as "0-3,8"
+std::vector<unsigned int> parseCpuList(const std::string &list);
+
+// The NUMA node a network interface hangs off, -1 if unknown
+int getInterfaceNumaNode(const std::string &interface);
+
+// The CPUs of a NUMA node, empty if unknown
+std::vector<unsigned int> getNumaNodeCpus(int node);
+
+// Restricts the calling thread to the CPUs. Threads it starts afterwards
+// inherit the mask. False where that is not supported.
+bool pinCurrentThread(const std::vector<unsigned int> &cpus);
+
+// Makes the calling thread, and threads it starts afterwards, allocate from
+// the node while it has free memory
+bool preferNumaNode(int node);
+}  // namespace tftp
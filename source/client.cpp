@@ -0,0 +1,295 @@
+#include "client.hpp"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "metrics.hpp"
+
+namespace tftp {
+namespace {
+bool readFile(const std::string &path, std::vector<char> &data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    data.assign(std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+}  // namespace
+
+Client::Client(const std::string &address, uint16_t port,
+               TransferOptions options)
+    : options(options), buffer(UINT16_MAX + 1) {
+    this->server_addr = {};
+    this->server_addr.sin_family = AF_INET;
+    this->server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &this->server_addr.sin_addr) !=
+        1) {
+        throw std::invalid_argument("Invalid server address!");
+    }
+
+    // Every block of a download would go to every client of the group
+    this->options.multicast = false;
+}
+
+#ifndef _WIN32
+std::vector<ClientResult> Client::run(
+    const std::vector<ClientTransfer> &transfers) {
+    std::vector<ClientResult> results(transfers.size());
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::vector<struct pollfd> fds;
+    size_t next = 0;
+
+    auto finish = [&](Slot &slot) {
+        if (slot.socket_fd >= 0) close(slot.socket_fd);
+        if (this->callback) {
+            this->callback(transfers[slot.index], results[slot.index]);
+        }
+    };
+
+    while (next < transfers.size() || !slots.empty()) {
+        // Start transfers as others end
+        while (slots.size() < this->parallel && next < transfers.size()) {
+            auto slot = std::make_unique<Slot>();
+            slot->index = next++;
+            if (this->start(*slot, transfers[slot->index],
+                            results[slot->index])) {
+                slots.push_back(std::move(slot));
+            } else {
+                finish(*slot);
+            }
+        }
+        if (slots.empty()) continue;
+
+        // Wait for a packet or the first timeout
+        uint64_t now_us = Metrics::nowMicros();
+        uint64_t deadline_us = UINT64_MAX;
+        fds.clear();
+        for (auto &slot : slots) {
+            fds.push_back({slot->socket_fd, POLLIN, 0});
+            deadline_us = std::min(deadline_us, slot->deadline_us);
+        }
+
+        int timeout_ms =
+            deadline_us > now_us ? (deadline_us - now_us + 999) / 1000 : 0;
+        if (poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR) {
+            throw std::runtime_error("Failed to poll client sockets");
+        }
+
+        now_us = Metrics::nowMicros();
+        for (size_t i = 0; i < fds.size(); ++i) {
+            Slot &slot = *slots[i];
+            if (fds[i].revents & POLLIN) {
+                this->receive(slot);
+            } else if (now_us >= slot.deadline_us) {
+                slot.client->handleTimeout();
+                slot.deadline_us = now_us + this->options.timeout_ms * 1000ull;
+            }
+        }
+
+        // Retire the transfers that ended, unless they go on to verify
+        for (auto slot = slots.begin(); slot != slots.end();) {
+            TransferClient &client = *(*slot)->client;
+            if ((!client.isFinished() && !client.isFailed()) ||
+                !this->complete(**slot, transfers[(*slot)->index],
+                                results[(*slot)->index])) {
+                ++slot;
+                continue;
+            }
+
+            finish(**slot);
+            slot = slots.erase(slot);
+        }
+    }
+
+    return results;
+}
+
+bool Client::start(Slot &slot, const ClientTransfer &transfer,
+                   ClientResult &result) {
+    slot.start_us = Metrics::nowMicros();
+    slot.socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (slot.socket_fd < 0) {
+        throw std::runtime_error("Failed to create client socket");
+    }
+
+    if (transfer.mode == TransferClient::Mode::Write) {
+        if (transfer.data != nullptr) {
+            slot.uploaded = *transfer.data;
+        } else if (!readFile(transfer.local, slot.uploaded)) {
+            result.error = "Failed to read " + transfer.local;
+            return false;
+        }
+    }
+
+    this->startTransfer(slot, transfer.mode, transfer.remote);
+    return true;
+}
+
+void Client::startTransfer(Slot &slot, TransferClient::Mode mode,
+                           const std::string &remote) {
+    TransferOptions options = this->options;
+    if (this->verify && mode == TransferClient::Mode::Read) {
+        options.transfer_size = true;
+    }
+
+    Slot *sender = &slot;
+    slot.client.reset(new TransferClient(
+        mode, remote, options, [sender](const char *data, ssize_t size) {
+            sendto(sender->socket_fd, data, size, 0,
+                   (const struct sockaddr *)&sender->peer,
+                   sizeof(sender->peer));
+        }));
+    if (mode == TransferClient::Mode::Write) {
+        slot.client->setData(slot.uploaded);
+    }
+
+    // A new transfer may get a new transfer ID
+    slot.peer = this->server_addr;
+    slot.answered = false;
+    slot.deadline_us = Metrics::nowMicros() + options.timeout_ms * 1000ull;
+    slot.client->start();
+}
+
+void Client::receive(Slot &slot) {
+    TransferClient &client = *slot.client;
+
+    // Take every packet that is there, a window may have come in
+    while (!client.isFinished() && !client.isFailed()) {
+        struct sockaddr_in from_addr;
+        socklen_t from_len = sizeof(from_addr);
+        ssize_t size = recvfrom(slot.socket_fd, this->buffer.data(),
+                                this->buffer.size(), MSG_DONTWAIT,
+                                (struct sockaddr *)&from_addr, &from_len);
+        if (size < 0) break;
+
+        if (from_addr.sin_addr.s_addr != slot.peer.sin_addr.s_addr) continue;
+
+        // Lock on to the port of the first answer
+        if (!slot.answered) {
+            slot.answered = true;
+            slot.peer.sin_port = from_addr.sin_port;
+        } else if (from_addr.sin_port != slot.peer.sin_port) {
+            continue;
+        }
+
+        slot.deadline_us =
+            Metrics::nowMicros() + this->options.timeout_ms * 1000ull;
+        client.handlePacket(this->buffer.data(), size);
+    }
+}
+
+bool Client::complete(Slot &slot, const ClientTransfer &transfer,
+                      ClientResult &result) {
+    TransferClient &client = *slot.client;
+    result.retransmits += client.getRetransmits();
+    result.elapsed_us = Metrics::nowMicros() - slot.start_us;
+
+    if (client.isFailed()) {
+        result.error = client.getError();
+        return true;
+    }
+
+    if (slot.verifying) {
+        result.success = client.getData() == slot.uploaded;
+        if (!result.success) result.error = "File on the server differs";
+        return true;
+    }
+
+    if (transfer.mode == TransferClient::Mode::Write) {
+        result.bytes = slot.uploaded.size();
+        if (!this->verify) {
+            result.success = true;
+            return true;
+        }
+
+        // Read it back from a new port, so late packets of the upload are
+        // not taken for the download
+        close(slot.socket_fd);
+        slot.socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (slot.socket_fd < 0) {
+            throw std::runtime_error("Failed to create client socket");
+        }
+
+        slot.verifying = true;
+        this->startTransfer(slot, TransferClient::Mode::Read, transfer.remote);
+        return false;
+    }
+
+    std::vector<char> data = client.takeData();
+    result.bytes = data.size();
+
+    // Servers need not send tsize
+    ssize_t size = client.getTransferSize();
+    if (this->verify && size >= 0 &&
+        size != static_cast<ssize_t>(data.size())) {
+        result.error = "Got " + std::to_string(data.size()) +
+                       " bytes, the server announced " + std::to_string(size);
+        return true;
+    }
+
+    result.success = this->store(transfer, data, result);
+    return true;
+}
+
+#else
+std::vector<ClientResult> Client::run(const std::vector<ClientTransfer> &) {
+    throw std::runtime_error("The client is not supported on Windows");
+}
+#endif
+
+bool Client::store(const ClientTransfer &transfer, std::vector<char> &data,
+                   ClientResult &result) {
+    if (transfer.data != nullptr) {
+        *transfer.data = std::move(data);
+        return true;
+    }
+
+    // Written under a hidden name, so a file that is there is whole
+    std::filesystem::path path(transfer.local);
+    std::filesystem::path temp_path =
+        path.parent_path() / ("." + path.filename().string() + ".part");
+
+    std::error_code error;
+    if (path.has_parent_path()) {
+        std::filesystem::create_directories(path.parent_path(), error);
+    }
+
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), data.size());
+        file.close();
+        if (!file) {
+            std::filesystem::remove(temp_path, error);
+            result.error = "Failed to write " + transfer.local;
+            return false;
+        }
+    }
+
+    std::vector<char> written;
+    if (this->verify && (!readFile(temp_path.string(), written) ||
+                         written != data)) {
+        std::filesystem::remove(temp_path, error);
+        result.error = "Written file differs from the download";
+        return false;
+    }
+
+    std::filesystem::rename(temp_path, path, error);
+    if (error) {
+        std::filesystem::remove(temp_path, error);
+        result.error = "Failed to write " + transfer.local;
+        return false;
+    }
+
+    return true;
+}
+}  // namespace tftp
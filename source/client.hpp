@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "transfer_client.hpp"
+
+namespace tftp {
+constexpr inline unsigned int DEFAULT_CLIENT_PARALLEL = 8;
+
+// A file to download or upload
+struct ClientTransfer {
+    TransferClient::Mode mode = TransferClient::Mode::Read;
+    std::string remote;  // Name on the server
+    std::string local;   // Path a download is written to or an upload read
+
+    // Keeps the file in memory instead of a local file when set
+    std::vector<char> *data = nullptr;
+};
+
+struct ClientResult {
+    bool success = false;
+    std::string error;
+    uint64_t bytes = 0;
+    uint64_t elapsed_us = 0;  // Verification included
+    uint64_t retransmits = 0;
+};
+
+// Runs transfers against one server, many at a time, each on a UDP socket
+// of its own and all from the calling thread. A download is held in memory
+// until it is complete, then written next to where it goes and renamed into
+// place, so a file that is there is whole. Multicast is not used.
+//
+// With verification, downloads ask for tsize and must be as large, and are
+// read back once they are written. Uploads are downloaded again and
+// compared.
+class Client {
+   public:
+    using Callback = std::function<void(const ClientTransfer &transfer,
+                                        const ClientResult &result)>;
+
+    // Throws std::invalid_argument for an address that is not IPv4
+    Client(const std::string &address, uint16_t port,
+           TransferOptions options = {});
+
+    void setParallel(unsigned int parallel) {
+        this->parallel = parallel > 0 ? parallel : 1;
+    }
+    void setVerify(bool verify) { this->verify = verify; }
+
+    // Called as each transfer ends, in the order they end
+    void setCallback(Callback callback) { this->callback = callback; }
+
+    // Results are in the order of the transfers. Throws std::runtime_error
+    // if a socket cannot be created.
+    std::vector<ClientResult> run(const std::vector<ClientTransfer> &transfers);
+
+   private:
+    // A transfer in progress
+    struct Slot {
+        size_t index;  // Of the transfer
+        std::unique_ptr<TransferClient> client;
+        int socket_fd = -1;
+        struct sockaddr_in peer;
+        bool answered = false;  // The peer port is the server's transfer ID
+        bool verifying = false;  // Reading an upload back
+        std::vector<char> uploaded;
+        uint64_t start_us = 0;
+        uint64_t deadline_us = 0;
+    };
+
+    struct sockaddr_in server_addr;
+    TransferOptions options;
+    unsigned int parallel = DEFAULT_CLIENT_PARALLEL;
+    bool verify = false;
+    Callback callback;
+
+    std::vector<char> buffer;
+
+    bool start(Slot &slot, const ClientTransfer &transfer,
+               ClientResult &result);
+    void startTransfer(Slot &slot, TransferClient::Mode mode,
+                       const std::string &remote);
+    void receive(Slot &slot);
+    bool complete(Slot &slot, const ClientTransfer &transfer,
+                  ClientResult &result);
+    bool store(const ClientTransfer &transfer, std::vector<char> &data,
+               ClientResult &result);
+};
+}  // namespace tftp
@@ -0,0 +1,493 @@
+#include "compressed_files.hpp"
+
+#include <memory.h>
+
+#include <algorithm>
+
+#ifdef TFTP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef TFTP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "logger.hpp"
+#include "metrics.hpp"
+
+namespace tftp {
+namespace {
+// Compressed bytes read from the file at a time
+constexpr size_t INPUT_SIZE = 128 * 1024;
+
+// Longest deflate back reference, which a resumed stream needs
+constexpr unsigned int WINDOW_SIZE = 32 * 1024;
+
+std::atomic<uint32_t> next_image_id{1};
+
+const char *getSuffix(CompressionFormat format) {
+    return format == CompressionFormat::Gzip ? ".gz" : ".zst";
+}
+}  // namespace
+
+// Chunk cache
+ChunkCache::Chunk ChunkCache::find(uint32_t image, uint32_t index) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    auto found = this->keys.find(key(image, index));
+    if (found == this->keys.end()) {
+        Metrics::instance().increment(Counter::CacheMisses);
+        return nullptr;
+    }
+
+    // Move it to the front
+    this->entries.splice(this->entries.begin(), this->entries, found->second);
+    Metrics::instance().increment(Counter::CacheHits);
+    return found->second->chunk;
+}
+
+void ChunkCache::insert(uint32_t image, uint32_t index, Chunk chunk) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    const uint64_t chunk_key = key(image, index);
+    if (this->keys.count(chunk_key) > 0) return;
+
+    this->size += chunk->size();
+    this->entries.push_front(Entry{chunk_key, std::move(chunk)});
+    this->keys[chunk_key] = this->entries.begin();
+
+    // Drop the least recently used, but never the chunk just added
+    while (this->size > this->capacity && this->entries.size() > 1) {
+        Entry &last = this->entries.back();
+        this->size -= last.chunk->size();
+        this->keys.erase(last.key);
+        this->entries.pop_back();
+    }
+}
+
+size_t ChunkCache::getSize() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->size;
+}
+
+// Decompresses an image forwards, from its start or from an access point
+class CompressedImage::Decompressor {
+   public:
+    Decompressor(CompressedImage &image) : image(image), input(INPUT_SIZE) {}
+    virtual ~Decompressor() = default;
+
+    // Starts over at the access point, or at the start without one
+    virtual bool start(const AccessPoint *point) = 0;
+
+    // Fills dst, and only falls short at the end of the image. -1 if the
+    // file cannot be read or is corrupt.
+    virtual ssize_t decompress(char *dst, size_t size) = 0;
+
+    // Uncompressed offset of the next byte out
+    uint64_t getPosition() const { return this->position; }
+
+   protected:
+    CompressedImage &image;
+    std::vector<unsigned char> input;
+    uint64_t offset = 0;  // Compressed offset of the next read
+    uint64_t position = 0;
+    bool finished = false;
+
+    // Reads the next compressed bytes into the input. 0 at the end.
+    ssize_t readInput() {
+        ssize_t count = this->image.filesystem.read(
+            this->image.path, reinterpret_cast<char *>(this->input.data()),
+            this->input.size(), this->offset);
+        if (count > 0) this->offset += count;
+        return count;
+    }
+};
+
+#ifdef TFTP_HAVE_ZLIB
+class CompressedImage::GzipDecompressor : public Decompressor {
+   public:
+    GzipDecompressor(CompressedImage &image) : Decompressor(image) {}
+    ~GzipDecompressor() { this->end(); }
+
+    bool start(const AccessPoint *point) override {
+        this->end();
+        this->stream = z_stream();
+        this->finished = false;
+
+        if (point == nullptr) {
+            this->offset = 0;
+            this->position = 0;
+            this->raw = false;
+            this->running = inflateInit2(&this->stream, 15 + 16) == Z_OK;
+            return this->running;
+        }
+
+        this->offset = point->in;
+        this->position = point->out;
+        this->raw = true;
+        this->running = inflateInit2(&this->stream, -15) == Z_OK;
+        if (!this->running) return false;
+
+        // The block boundary can be inside a byte, whose remaining bits
+        // are fed first
+        if (point->bits > 0) {
+            unsigned char byte;
+            if (this->image.filesystem.read(this->image.path,
+                                            reinterpret_cast<char *>(&byte),
+                                            1, point->in - 1) != 1) {
+                return false;
+            }
+            inflatePrime(&this->stream, point->bits, byte >> (8 - point->bits));
+        }
+
+        return inflateSetDictionary(&this->stream, point->window.data(),
+                                    point->window.size()) == Z_OK;
+    }
+
+    ssize_t decompress(char *dst, size_t size) override {
+        if (!this->running) return -1;
+
+        this->stream.next_out = reinterpret_cast<Bytef *>(dst);
+        this->stream.avail_out = size;
+
+        while (this->stream.avail_out > 0 && !this->finished) {
+            if (this->stream.avail_in == 0 && !this->fill()) return -1;
+
+            int result = inflate(&this->stream, Z_BLOCK);
+            if (result == Z_STREAM_END) {
+                if (!this->nextMember()) return -1;
+                continue;
+            }
+            if (result != Z_OK && result != Z_BUF_ERROR) return -1;
+
+            // Stopped at the end of a block that is not the last one
+            if ((this->stream.data_type & 128) &&
+                !(this->stream.data_type & 64)) {
+                this->addPoint(size - this->stream.avail_out);
+            }
+        }
+
+        ssize_t count = size - this->stream.avail_out;
+        this->position += count;
+        return count;
+    }
+
+   private:
+    z_stream stream = z_stream();
+    bool running = false;
+    bool raw = false;
+
+    void end() {
+        if (this->running) inflateEnd(&this->stream);
+        this->running = false;
+    }
+
+    bool fill() {
+        ssize_t count = this->readInput();
+        if (count <= 0) return false;  // Unreadable or cut short
+
+        this->stream.next_in = this->input.data();
+        this->stream.avail_in = count;
+        return true;
+    }
+
+    // A gzip file can hold several members one after the other
+    bool nextMember() {
+        // A raw stream leaves the CRC and size of the member behind
+        for (unsigned int skip = this->raw ? 8 : 0; skip > 0;) {
+            if (this->stream.avail_in == 0 && !this->fill()) return false;
+
+            unsigned int count = std::min(skip, this->stream.avail_in);
+            this->stream.next_in += count;
+            this->stream.avail_in -= count;
+            skip -= count;
+        }
+
+        if (this->stream.avail_in == 0) {
+            ssize_t count = this->readInput();
+            if (count < 0) return false;
+            if (count == 0) {
+                this->finished = true;
+                return true;
+            }
+
+            this->stream.next_in = this->input.data();
+            this->stream.avail_in = count;
+        }
+
+        this->raw = false;
+        return inflateReset2(&this->stream, 15 + 16) == Z_OK;
+    }
+
+    void addPoint(size_t produced) {
+        std::vector<AccessPoint> &points = this->image.points;
+        const uint64_t out = this->position + produced;
+
+        // One about every chunk is enough
+        uint64_t last = points.empty() ? 0 : points.back().out;
+        if (out < last + COMPRESSED_CHUNK_SIZE) return;
+
+        AccessPoint point;
+        point.in = this->offset - this->stream.avail_in;
+        point.out = out;
+        point.bits = this->stream.data_type & 7;
+        point.window.resize(WINDOW_SIZE);
+
+        unsigned int length = WINDOW_SIZE;
+        if (inflateGetDictionary(&this->stream, point.window.data(),
+                                 &length) != Z_OK) {
+            return;
+        }
+        point.window.resize(length);
+
+        points.push_back(std::move(point));
+    }
+};
+#endif
+
+#ifdef TFTP_HAVE_ZSTD
+class CompressedImage::ZstdDecompressor : public Decompressor {
+   public:
+    ZstdDecompressor(CompressedImage &image)
+        : Decompressor(image), stream(ZSTD_createDStream()) {}
+    ~ZstdDecompressor() { ZSTD_freeDStream(this->stream); }
+
+    // Frames cannot be entered part way, so this always starts over
+    bool start(const AccessPoint *) override {
+        this->offset = 0;
+        this->position = 0;
+        this->finished = false;
+        this->end_of_file = false;
+        this->remaining = 0;
+        this->buffer = ZSTD_inBuffer{this->input.data(), 0, 0};
+
+        return this->stream != nullptr &&
+               !ZSTD_isError(ZSTD_initDStream(this->stream));
+    }
+
+    ssize_t decompress(char *dst, size_t size) override {
+        ZSTD_outBuffer out{dst, size, 0};
+
+        while (out.pos < out.size && !this->finished) {
+            if (this->buffer.pos == this->buffer.size && !this->end_of_file) {
+                ssize_t count = this->readInput();
+                if (count < 0) return -1;
+
+                this->end_of_file = count == 0;
+                this->buffer = ZSTD_inBuffer{this->input.data(),
+                                             static_cast<size_t>(count), 0};
+            }
+
+            size_t before = out.pos;
+            size_t result =
+                ZSTD_decompressStream(this->stream, &out, &this->buffer);
+            if (ZSTD_isError(result)) return -1;
+
+            // Once everything is flushed, the file may only end between
+            // frames. Called with no input, the stream asks for the header
+            // of a next frame, so what the last call left is what counts.
+            if (this->end_of_file && out.pos == before) {
+                if (this->remaining != 0) return -1;
+                this->finished = true;
+            } else {
+                this->remaining = result;
+            }
+        }
+
+        this->position += out.pos;
+        return out.pos;
+    }
+
+   private:
+    ZSTD_DStream *stream;
+    ZSTD_inBuffer buffer{nullptr, 0, 0};
+    size_t remaining = 0;
+    bool end_of_file = false;
+};
+#endif
+
+// Compressed image
+CompressedImage::CompressedImage(const FileSystem &filesystem,
+                                 std::string path, CompressionFormat format,
+                                 ChunkCache &cache)
+    : filesystem(filesystem),
+      path(std::move(path)),
+      format(format),
+      cache(cache),
+      id(next_image_id.fetch_add(1)) {
+    this->compressed_size = filesystem.size(this->path);
+}
+
+CompressedImage::~CompressedImage() = default;
+
+const CompressedImage::AccessPoint *CompressedImage::findPoint(
+    uint64_t position) const {
+    // The last point at or before the position
+    auto point = std::upper_bound(
+        this->points.begin(), this->points.end(), position,
+        [](uint64_t value, const AccessPoint &p) { return value < p.out; });
+
+    return point == this->points.begin() ? nullptr : &*std::prev(point);
+}
+
+ChunkCache::Chunk CompressedImage::getChunk(uint32_t index) {
+    static const ChunkCache::Chunk empty =
+        std::make_shared<const std::vector<char>>();
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    ChunkCache::Chunk cached = this->cache.find(this->id, index);
+    if (cached != nullptr) return cached;
+
+    const uint64_t start = static_cast<uint64_t>(index) * COMPRESSED_CHUNK_SIZE;
+    if (this->complete && start >= static_cast<uint64_t>(this->size.load())) {
+        return empty;
+    }
+
+    bool restart = this->decompressor == nullptr;
+    if (restart) {
+#ifdef TFTP_HAVE_ZLIB
+        if (this->format == CompressionFormat::Gzip) {
+            this->decompressor.reset(new GzipDecompressor(*this));
+        }
+#endif
+#ifdef TFTP_HAVE_ZSTD
+        if (this->format == CompressionFormat::Zstd) {
+            this->decompressor.reset(new ZstdDecompressor(*this));
+        }
+#endif
+        if (this->decompressor == nullptr) return nullptr;
+    }
+
+    // Carry on with the running stream unless the chunk is behind it, or an
+    // access point is closer
+    const AccessPoint *point = this->findPoint(start);
+    const uint64_t position = this->decompressor->getPosition();
+    if (restart || position > start ||
+        (point != nullptr && point->out > position)) {
+        if (!this->decompressor->start(point)) {
+            TFTP_LOG_WARNING("Cannot decompress {}", this->path);
+            this->decompressor.reset();
+            return nullptr;
+        }
+    }
+
+    // Whole chunks passed on the way are cached too, and the part of one
+    // before the first chunk boundary is thrown away
+    while (true) {
+        const uint64_t offset = this->decompressor->getPosition();
+        const size_t skip = offset % COMPRESSED_CHUNK_SIZE;
+        const size_t wanted = COMPRESSED_CHUNK_SIZE - skip;
+
+        auto chunk = std::make_shared<std::vector<char>>(wanted);
+        ssize_t count = this->decompressor->decompress(chunk->data(), wanted);
+        if (count < 0) {
+            TFTP_LOG_WARNING("Cannot decompress {}", this->path);
+            this->decompressor.reset();
+            return nullptr;
+        }
+
+        // Now the size is known for certain
+        bool finished = static_cast<size_t>(count) < wanted;
+        if (finished) {
+            this->size = this->decompressor->getPosition();
+            this->complete = true;
+        }
+
+        if (skip == 0) {
+            const uint32_t chunk_index = offset / COMPRESSED_CHUNK_SIZE;
+            chunk->resize(count);
+            this->cache.insert(this->id, chunk_index, chunk);
+            if (chunk_index == index) return chunk;
+        }
+
+        if (finished) return empty;
+    }
+}
+
+// Compressed file worker
+bool CompressedFileWorker::close() {
+    this->chunk.reset();
+    return true;
+}
+
+ssize_t CompressedFileWorker::read(char *dst, ssize_t size, ssize_t offset) {
+    ssize_t total = 0;
+
+    while (total < size) {
+        const uint64_t position = offset + total;
+        const uint32_t index = position / COMPRESSED_CHUNK_SIZE;
+
+        if (this->chunk == nullptr || this->chunk_index != index) {
+            this->chunk = this->image->getChunk(index);
+            this->chunk_index = index;
+            if (this->chunk == nullptr) return -1;
+        }
+
+        // Past the end of the image
+        const size_t start = position % COMPRESSED_CHUNK_SIZE;
+        if (start >= this->chunk->size()) break;
+
+        size_t count =
+            std::min<size_t>(size - total, this->chunk->size() - start);
+        memcpy(dst + total, this->chunk->data() + start, count);
+        total += count;
+    }
+
+    return total;
+}
+
+// Compressed file worker factory
+FileWorker *CompressedFileWorkerFactory::create(std::string filename,
+                                                FileWorkerMode mode) {
+    // The plain file wins over a compressed one
+    if (!this->filesystem.exists(filename)) {
+        std::shared_ptr<CompressedImage> image = this->findImage(filename);
+        if (image != nullptr) {
+            return this->workers.create(filename, mode, std::move(image));
+        }
+    }
+
+    return this->files.create(filename, mode);
+}
+
+void CompressedFileWorkerFactory::destroy(FileWorker *file_worker) {
+    auto compressed = dynamic_cast<CompressedFileWorker *>(file_worker);
+    if (compressed != nullptr) {
+        this->workers.destroy(compressed);
+    } else {
+        this->files.destroy(file_worker);
+    }
+}
+
+std::vector<CompressionFormat> CompressedFileWorkerFactory::getFormats() {
+    std::vector<CompressionFormat> formats;
+#ifdef TFTP_HAVE_ZSTD
+    formats.push_back(CompressionFormat::Zstd);
+#endif
+#ifdef TFTP_HAVE_ZLIB
+    formats.push_back(CompressionFormat::Gzip);
+#endif
+    return formats;
+}
+
+std::shared_ptr<CompressedImage> CompressedFileWorkerFactory::findImage(
+    const std::string &filename) {
+    for (CompressionFormat format : getFormats()) {
+        std::string path = filename + getSuffix(format);
+        ssize_t compressed_size = this->filesystem.size(path);
+        if (compressed_size < 0) continue;
+
+        // The index is kept unless the file was replaced
+        std::shared_ptr<CompressedImage> &image = this->images[path];
+        if (image == nullptr ||
+            image->getCompressedSize() != compressed_size) {
+            image = std::make_shared<CompressedImage>(this->filesystem, path,
+                                                      format, this->cache);
+        }
+        return image;
+    }
+
+    return nullptr;
+}
+}  // namespace tftp
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "files.hpp"
+#include "filesystem.hpp"
+#include "pool.hpp"
+
+namespace tftp {
+// Images are decompressed and cached in chunks of this many bytes
+constexpr inline size_t COMPRESSED_CHUNK_SIZE = 1024 * 1024;
+constexpr inline size_t DEFAULT_CHUNK_CACHE_SIZE = 256 * 1024 * 1024;
+
+// Decompressed chunks of every compressed image, shared by all sessions. The
+// least recently used chunks are dropped once the cache is over its
+// capacity. Thread safe.
+class ChunkCache {
+   public:
+    using Chunk = std::shared_ptr<const std::vector<char>>;
+
+    ChunkCache(size_t capacity = DEFAULT_CHUNK_CACHE_SIZE)
+        : capacity(capacity) {}
+
+    Chunk find(uint32_t image, uint32_t index);
+    void insert(uint32_t image, uint32_t index, Chunk chunk);
+
+    size_t getSize();
+    size_t getCapacity() const { return this->capacity; }
+
+   private:
+    struct Entry {
+        uint64_t key;
+        Chunk chunk;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries;  // Most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> keys;
+    const size_t capacity;
+    size_t size = 0;
+
+    static uint64_t key(uint32_t image, uint32_t index) {
+        return static_cast<uint64_t>(image) << 32 | index;
+    }
+};
+
+enum class CompressionFormat {
+    Gzip,
+    Zstd,
+};
+
+// One compressed file, decompressed a chunk at a time. A gzip stream is
+// indexed as it is decompressed, with the state needed to resume at a
+// deflate block boundary about every chunk, so a chunk dropped from the
+// cache is decompressed again from nearby rather than from the start. zstd
+// cannot be resumed mid frame, and starts over. Sequential reads continue
+// the running stream either way. Thread safe.
+class CompressedImage {
+   public:
+    CompressedImage(const FileSystem &filesystem, std::string path,
+                    CompressionFormat format, ChunkCache &cache);
+    ~CompressedImage();
+    CompressedImage(const CompressedImage &) = delete;
+    CompressedImage &operator=(const CompressedImage &) = delete;
+
+    // Uncompressed size, -1 until the whole stream has been decompressed
+    // once. The gzip trailer only has the size of the last member, modulo
+    // 4 GiB, and a zstd frame header only that of its frame, so neither is
+    // trusted.
+    ssize_t getSize() const { return this->size.load(); }
+
+    // Size of the compressed file, to notice it being replaced
+    ssize_t getCompressedSize() const { return this->compressed_size; }
+
+    // Returns the chunk, decompressing it if it is not cached. Chunks past
+    // the end are empty, and null means the file could not be decompressed.
+    ChunkCache::Chunk getChunk(uint32_t index);
+
+   private:
+    // Where a gzip stream can be resumed: the compressed offset of the
+    // first whole byte after a block boundary, the bits of the byte before
+    // it still to be decoded, and the last 32 KiB of output
+    struct AccessPoint {
+        uint64_t in;
+        uint64_t out;
+        int bits;
+        std::vector<unsigned char> window;
+    };
+
+    class Decompressor;
+    class GzipDecompressor;
+    class ZstdDecompressor;
+
+    const FileSystem &filesystem;
+    const std::string path;
+    const CompressionFormat format;
+    ChunkCache &cache;
+    const uint32_t id;
+
+    ssize_t compressed_size;
+    std::atomic<ssize_t> size{-1};
+
+    std::mutex mutex;
+    bool complete = false;  // Whether the size was counted to the end
+    std::vector<AccessPoint> points;
+    std::unique_ptr<Decompressor> decompressor;
+
+    const AccessPoint *findPoint(uint64_t position) const;
+};
+
+// Reads a compressed image as if it were the plain file. Read only.
+class CompressedFileWorker : public FileWorker {
+   public:
+    CompressedFileWorker(const std::string filename, const FileWorkerMode mode,
+                         std::shared_ptr<CompressedImage> image)
+        : FileWorker(filename, mode), image(std::move(image)) {}
+
+    virtual bool open() { return false; }
+    virtual bool close();
+    virtual bool exists() { return true; }
+    virtual bool remove() { return false; }
+
+    virtual ssize_t read(char *dst, ssize_t size, ssize_t offset = 0);
+    virtual ssize_t write(char *, ssize_t, ssize_t = 0) { return -1; }
+    virtual ssize_t append(char *, ssize_t) { return -1; }
+    virtual ssize_t size() { return this->image->getSize(); }
+
+   private:
+    std::shared_ptr<CompressedImage> image;
+
+    // The chunk reads are served from, until they move past it
+    ChunkCache::Chunk chunk;
+    uint32_t chunk_index = 0;
+};
+
+// Serves FOO from FOO.gz or FOO.zst when FOO itself does not exist, and
+// leaves every other file to the factory it wraps. Images are kept across
+// sessions along with their index, and dropped when the compressed file
+// changes size. Like the controller it belongs to, not thread safe.
+class CompressedFileWorkerFactory : public FileWorkerFactory {
+   public:
+    CompressedFileWorkerFactory(FileWorkerFactory &files,
+                                const FileSystem &filesystem,
+                                size_t cache_size = DEFAULT_CHUNK_CACHE_SIZE)
+        : files(files), filesystem(filesystem), cache(cache_size) {}
+
+    virtual FileWorker *create(std::string filename, FileWorkerMode mode);
+    virtual void destroy(FileWorker *file_worker);
+
+    // Formats this build can decompress
+    static std::vector<CompressionFormat> getFormats();
+
+   private:
+    FileWorkerFactory &files;
+    const FileSystem &filesystem;
+    ChunkCache cache;
+
+    std::unordered_map<std::string, std::shared_ptr<CompressedImage>> images;
+    ObjectPool<CompressedFileWorker> workers;
+
+    std::shared_ptr<CompressedImage> findImage(const std::string &filename);
+};
+}  // namespace tftp
@@ -2,49 +2,97 @@
 
 #include <memory.h>
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <iostream>
 
+#include "logger.hpp"
+
 namespace tftp {
-ssize_t Controller::handlePacket(char *src, char *dst, ssize_t src_size) {
-    if (src_size < 4) {
-        return this->sendError(dst, ErrorCode::ILLEGAL_OPERATION,
-                               "Packet too small!");
+Controller::Controller(FileWorkerFactory &worker_factory)
+    : worker_factory(worker_factory) {
+    this->worker_factory.setReadyWake([this] {
+        this->files_ready = true;
+        this->completions.wake();
+    });
+}
+
+Controller::~Controller() {
+    this->worker_factory.setReadyWake(nullptr);
+    for (ControllerContext *context : this->contexts_by_session) {
+        if (context != nullptr) this->contexts.destroy(context);
+    }
+}
+
+ssize_t Controller::handlePacket(const Peer &peer, char *src, char *dst,
+                                 ssize_t src_size) {
+    const PacketType type = this->validatePacket(src, src_size);
+
+    // Junk is dropped before it is parsed, and counts against its source.
+    // So do requests, while the packets of running transfers do not.
+    bool request = type == PacketType::RRQ || type == PacketType::WRQ;
+    if (type == PacketType::UNKNOWN || request) {
+        bool allowed =
+            !this->rate_limiter.isEnabled() ||
+            this->rate_limiter.allow(peer, Metrics::coarseNowMicros());
+
+        if (type == PacketType::UNKNOWN || !allowed) {
+            Metrics::instance().increment(Counter::PacketsDropped);
+            return -1;
+        }
     }
 
     try {
-        const PacketType type = this->getPacketType(src);
-
-        // Check if we are already reading or writing
-        if (this->state.getLastPacketTime() != 0) {
-            time_t current_time = time(nullptr);
-            time_t time_diference =
-                current_time - this->state.getLastPacketTime();
-
-            if (time_diference > this->state.getTimeoutMs()) {
-                this->state.reset();
-
-                if (type == PacketType::ACK || type == PacketType::DATA ||
-                    type == PacketType::OACK) {
-                    return this->sendError(
-                        dst, ErrorCode::NOT_DEFINED,
-                        "A timeout has occured in the request!");
-                }
+        const uint64_t now_us = Metrics::nowMicros();
+
+        // Check if the peer is already reading or writing
+        ControllerContext *context = this->findSession(peer);
+
+        // The session waits for the disk, and the peer will retry
+        if (context != nullptr && context->io_pending) return -1;
+
+        // Or for its file, which the timeout check reads again
+        if (context != nullptr && context->waiting_file) return -1;
+
+        if (context != nullptr && context->isExpired(now_us)) {
+            this->expireSession(*context);
+            context = nullptr;
+
+            if (type == PacketType::ACK || type == PacketType::DATA) {
+                return this->sendError(dst, ErrorCode::NOT_DEFINED,
+                                       "A timeout has occured in the request!");
             }
         }
 
-        // Set last packet time
-        this->state.setLastPacketTime(time(nullptr));
+        // Push the deadline back
+        if (context != nullptr) context->refreshDeadline(now_us);
+
+        uint32_t session_id = context != nullptr ? context->session_id : 0;
+        uint16_t block_number =
+            context != nullptr ? context->getBlockNumber() : 0;
+
+        TFTP_PHASE_SCOPE(Phase::Dispatch);
+        TraceContext::set(session_id, block_number);
+        TFTP_PROBE3(dispatch, session_id, block_number,
+                    static_cast<uint16_t>(type));
 
         // Handle packet
         switch (type) {
             case PacketType::RRQ:
-                return this->handleReadRequestPacket(src, dst, src_size);
+                return this->handleReadRequestPacket(peer, src, dst, src_size,
+                                                     false);
             case PacketType::WRQ:
-                return this->handleWriteRequestPacket(src, dst, src_size);
+                return this->handleWriteRequestPacket(peer, src, dst, src_size,
+                                                      false);
             case PacketType::DATA:
-                return this->handleDataPacket(src, dst, src_size);
             case PacketType::ACK:
-                return this->handleAckPacket(src, dst, src_size);
+                return this->handleTransferPacket(context, type, src, dst,
+                                                  src_size);
+            case PacketType::ERROR:
+                // The peer gave up, and errors are never answered
+                if (context != nullptr) this->endSession(context);
+                return -1;
             default:
                 throw std::runtime_error("Invalid packet type!");
         }
@@ -53,186 +101,860 @@ ssize_t Controller::handlePacket(char *src, char *dst, ssize_t src_size) {
     }
 }
 
-ssize_t Controller::handleReadRequestPacket(char *src, char *dst,
-                                            ssize_t src_size) {
+void Controller::handleTimeouts() {
+    const uint64_t now_us = Metrics::nowMicros();
+
+    // Queued requests may have waited too long
+    if (!this->admission_queue.empty()) this->admission_changed = true;
+
+    // Only the hot records are walked to find expired sessions
+    this->expired_sessions.clear();
+    for (uint32_t session = 0; session < this->sessions.getIndexLimit();
+         ++session) {
+        const SessionHot &hot = this->sessions.get(session);
+        if (hot.used && hot.deadline_us != 0 && now_us > hot.deadline_us) {
+            this->expired_sessions.push_back(session);
+        }
+    }
+
+    for (uint32_t session : this->expired_sessions) {
+        ControllerContext *context = this->contexts_by_session[session];
+
+        // Its job still uses the context, or its file is on its way
+        if (context->io_pending || context->waiting_file) continue;
+
+        TFTP_LOG_DEBUG("Session {} timed out", context->session_id);
+        this->expireSession(*context);
+    }
+
+    // Blocks that were not acknowledged in time go out again. Retransmits
+    // may end sessions, so the table is looked up every time.
+    for (uint32_t session = 0; session < this->contexts_by_session.size();
+         ++session) {
+        ControllerContext *context = this->contexts_by_session[session];
+        if (context == nullptr ||
+            context->getState() != ControllerContext::State::READING ||
+            context->block_sent_time_us == 0 || context->multicast != nullptr ||
+            context->io_pending || context->waiting_file ||
+            !context->transfer.isRunning()) {
+            continue;
+        }
+
+        int interval_checks = context->timeout_ms / (BLOCK_RETRANSMITS + 1) /
+                              TIMEOUT_CHECK_INTERVAL_MS;
+        if (++context->unacked_checks >= std::max(interval_checks, 1)) {
+            this->retransmitBlock(*context);
+        }
+    }
+
+    // Sessions waiting for their file try their block again now and then,
+    // in case the factory never says it came in
+    if (!this->waiting_files.empty()) {
+        this->retryWaitingFiles();
+        this->completions.wake();
+    }
+}
+
+int Controller::getWakeFd() const {
+    // Any file may be on its way, so the loop always needs waking
+    return this->completions.getWakeFd();
+}
+
+bool Controller::nextReply(Peer &peer, char *dst, ssize_t &size) {
+    // Replies that could not go out with the packet they answer
+    if (!this->queued_replies.empty()) {
+        QueuedReply reply = this->queued_replies.front();
+        this->queued_replies.pop_front();
+
+        memcpy(dst, reply.buffer, reply.size);
+        this->block_buffers.release(reply.buffer);
+        peer = reply.peer;
+        size = reply.size;
+        return true;
+    }
+
+    // Requests that waited for a slot go first
+    if (this->admission_changed && this->nextAdmittedReply(peer, dst, size)) {
+        return true;
+    }
+
+    // Finished jobs wait for their turn to send
+    while (DiskJob *job = this->completions.pop()) {
+        const ControllerContext &context =
+            *static_cast<const ControllerContext *>(job->user_data);
+        this->scheduler.enqueue(context.session, context.priority,
+                                this->getReplyCost(*job));
+    }
+
+    // Once every reply is out, the sessions waiting for a file that came in
+    // try their block again
+    uint32_t session = this->scheduler.dequeue();
+    if (session == NO_SESSION && this->files_ready.exchange(false)) {
+        this->retryWaitingFiles();
+        session = this->scheduler.dequeue();
+    }
+    if (session == NO_SESSION) return false;
+
+    // Completing may end the session, so the peer is copied first
+    ControllerContext &context = *this->contexts_by_session[session];
+    peer = context.getPeer();
+
+    // Blocks of a multicast download go to the group
+    const MulticastGroup *group = context.multicast;
+    Peer group_address = group != nullptr ? group->address : Peer();
+
+    try {
+        // The peer was waiting on us, not the other way around
+        context.refreshDeadline(Metrics::nowMicros());
+        size = this->resumeTransfer(context, dst);
+    } catch (const std::exception &e) {
+        size = this->sendError(dst, ErrorCode::NOT_DEFINED, e.what());
+    }
+
+    if (group != nullptr && size > 0 &&
+        this->getPacketType(dst) == PacketType::DATA) {
+        peer = group_address;
+    }
+
+    return true;
+}
+
+ssize_t Controller::handleReadRequestPacket(const Peer &peer, char *src,
+                                            char *dst, ssize_t src_size,
+                                            bool admitted) {
     // Check if we are already reading or writing
-    if (this->state.getState() != ControllerContext::State::IDLE) {
+    ControllerContext *existing = this->findSession(peer);
+
+    if (existing != nullptr &&
+        existing->getState() != ControllerContext::State::IDLE) {
         return this->sendError(dst, ErrorCode::NOT_DEFINED,
                                "Server is currently busy!");
     }
 
+    // Turn the request away before it costs anything. While requests are
+    // queued, new ones queue up behind them rather than take their slot.
+    if (existing == nullptr && !admitted &&
+        (!this->admission_queue.empty() || !this->canAdmit(peer))) {
+        return this->deferRequest(peer, src, dst, src_size);
+    }
+
     // Deserialize packet
     ReadRequestPacket packet;
-    ssize_t bytes_read = packet.deserialize(src);
+    {
+        TFTP_PHASE_SCOPE(Phase::Decode);
+        ssize_t bytes_read = packet.deserialize(src);
 
-    // Deserialize options
-    if (bytes_read < src_size) {
-        packet.deserializeOptions(src + bytes_read, src_size - bytes_read);
+        // Deserialize options
+        if (bytes_read < src_size) {
+            packet.deserializeOptions(src + bytes_read, src_size - bytes_read);
+        }
     }
+    TFTP_PROBE2(decode, 0, 0);
 
     // Reset state
-    this->state.reset();
+    ControllerContext &context =
+        existing != nullptr ? *existing : *this->startSession(peer);
+    context.reset();
 
     // Check if file exists
-    if (!this->openFileWorker(packet.filename, packet.mode)) {
+    if (!this->openFileWorker(context, packet.filename, packet.mode)) {
+        this->endSession(&context);
         return this->sendError(dst, ErrorCode::FILE_NOT_FOUND,
                                "File does not exist!");
     }
 
     // Set state
-    this->state.setState(ControllerContext::State::READING);
-    this->state.incrementBlockNumber();
+    this->startTransfer(context, ControllerContext::State::READING);
+    context.priority = this->priority_rules.classify(peer, packet.filename);
 
     // Check and apply options
-    if (packet.options.size() > 0) {
-        // Create OACK packet
-        OptionAckPacket oack_packet;
-
-        // Check if we have a window size option
-        auto window_size_option = packet.options.find("blksize");
-        if (window_size_option != packet.options.end()) {
-            auto value = std::stoi(window_size_option->second);
+    bool send_options = packet.options.size() > 0;
+    ssize_t size = send_options ? this->applyOptions(context, packet, dst) : -1;
 
-            if (value >= 8 && value <= 65464) {
-                this->state.setWindowSize(value);
-                oack_packet.options["blksize"] = window_size_option->second;
-            }
-        }
-
-        // Check if we have a timeout option
-        auto timeout_option = packet.options.find("timeout");
-        if (timeout_option != packet.options.end()) {
-            this->state.setTimeoutMs(std::stoi(timeout_option->second));
-            oack_packet.options["timeout"] = timeout_option->second;
-        }
-
-        // Send OACK packet
-        return oack_packet.serialize(dst);
+    // A multicast client waits to be the master before it is sent anything
+    if (context.multicast != nullptr) {
+        context.transfer = this->multicastTransfer(context);
+        this->resumeTransfer(context, dst);
+        return size;
     }
 
-    // Send first block
-    return this->sendNextBlock(dst);
+    // The transfer sends the first block, unless the OACK has to be
+    // acknowledged first
+    context.transfer = this->readTransfer(context, !send_options);
+    ssize_t block_size = this->resumeTransfer(context, dst);
+
+    return send_options ? size : block_size;
 }
 
-ssize_t Controller::handleWriteRequestPacket(char *src, char *dst,
-                                             ssize_t src_size) {
+ssize_t Controller::handleWriteRequestPacket(const Peer &peer, char *src,
+                                             char *dst, ssize_t src_size,
+                                             bool admitted) {
     // Check if we are already reading or writing
-    if (this->state.getState() != ControllerContext::State::IDLE) {
+    ControllerContext *existing = this->findSession(peer);
+    if (existing != nullptr &&
+        existing->getState() != ControllerContext::State::IDLE) {
         return this->sendError(dst, ErrorCode::NOT_DEFINED,
                                "Server is currently busy!");
     }
 
+    // Turn the request away before it costs anything. While requests are
+    // queued, new ones queue up behind them rather than take their slot.
+    if (existing == nullptr && !admitted &&
+        (!this->admission_queue.empty() || !this->canAdmit(peer))) {
+        return this->deferRequest(peer, src, dst, src_size);
+    }
+
     // Deserialize packet
     WriteRequestPacket packet;
-    ssize_t bytes_read = packet.deserialize(src);
+    {
+        TFTP_PHASE_SCOPE(Phase::Decode);
+        ssize_t bytes_read = packet.deserialize(src);
 
-    // Deserialize options
-    if (bytes_read < src_size) {
-        packet.deserializeOptions(src + bytes_read, src_size - bytes_read);
+        // Deserialize options
+        if (bytes_read < src_size) {
+            packet.deserializeOptions(src + bytes_read, src_size - bytes_read);
+        }
     }
+    TFTP_PROBE2(decode, 0, 0);
 
     // Reset state
-    this->state.reset();
+    ControllerContext &context =
+        existing != nullptr ? *existing : *this->startSession(peer);
+    context.reset();
+
+    // The upload replaces the file once it is committed, so readers never
+    // see it missing or cut short
+    this->openFileWorker(context, packet.filename, packet.mode);
 
-    // Overwrite file if it exists
-    if (this->openFileWorker(packet.filename, packet.mode)) {
-        this->state.file_worker->remove();
+    // Read-only storage takes no uploads
+    if (!context.file_worker->open()) {
+        this->endSession(&context);
+        return this->sendError(dst, ErrorCode::ACCESS_VIOLATION,
+                               "Cannot write file!");
     }
 
     // Set state
-    this->state.setState(ControllerContext::State::WRITING);
-    this->state.incrementBlockNumber();
+    this->startTransfer(context, ControllerContext::State::WRITING);
+    context.priority = this->priority_rules.classify(peer, packet.filename);
+
+    // The transfer waits for the first block
+    context.transfer = this->writeTransfer(context);
+    this->resumeTransfer(context, dst);
 
     // Check and apply options
     if (packet.options.size() > 0) {
-        // Create OACK packet
-        OptionAckPacket oack_packet;
+        return this->applyOptions(context, packet, dst);
+    }
+
+    // Send ack packet
+    AckPacket ack_packet(0);
+    return this->encode(&context, ack_packet, dst);
+}
+
+ssize_t Controller::handleTransferPacket(ControllerContext *context,
+                                         PacketType type, char *src, char *dst,
+                                         ssize_t src_size) {
+    if (context == nullptr || !context->transfer.isRunning()) {
+        if (type == PacketType::ACK) return -1;
+        return this->sendError(dst, ErrorCode::NOT_DEFINED, "Invalid state!");
+    }
+
+    // The transfer takes it from here
+    context->src = src;
+    context->src_size = src_size;
+    context->timed_out = false;
+
+    // Blocks of a multicast download go to the group, whose address is
+    // taken first as the group goes away with its last member
+    if (context->multicast != nullptr) {
+        Peer group_address = context->multicast->address;
+        ssize_t size = this->resumeTransfer(*context, dst);
+        return this->routeGroupReply(group_address, dst, size);
+    }
+
+    return this->resumeTransfer(*context, dst);
+}
+
+// Admission control
+bool Controller::canAdmit(const Peer &peer) const {
+    const AdmissionLimits &limits = this->limits;
+
+    if (limits.max_sessions > 0 &&
+        this->sessions.size() >= limits.max_sessions) {
+        return false;
+    }
+
+    if (limits.max_client_sessions > 0 &&
+        this->client_sessions.get(peer) >= limits.max_client_sessions) {
+        return false;
+    }
+
+    return limits.max_pending_io == 0 ||
+           this->pending_io < limits.max_pending_io;
+}
+
+ssize_t Controller::deferRequest(const Peer &peer, const char *src, char *dst,
+                                 ssize_t size) {
+    // A retransmitted request keeps its place
+    if (this->admission_queue.contains(peer)) return -1;
+
+    if (this->admission_queue.push(peer, src, size, Metrics::nowMicros())) {
+        Metrics::instance().increment(Counter::SessionsQueued);
+
+        // It only queued behind others, and there may be a slot for one
+        if (this->canAdmit(peer)) {
+            this->admission_changed = true;
+            this->completions.wake();
+        }
+        return -1;
+    }
 
-        // Check if we have a window size option
-        auto window_size_option = packet.options.find("blksize");
-        if (window_size_option != packet.options.end()) {
-            auto value = std::stoi(window_size_option->second);
+    Metrics::instance().increment(Counter::SessionsRejected);
+    return this->sendError(dst, ErrorCode::NOT_DEFINED,
+                           "Too many transfers, try again later!");
+}
+
+bool Controller::nextAdmittedReply(Peer &peer, char *dst, ssize_t &size) {
+    const uint64_t now_us = Metrics::nowMicros();
+    const uint64_t timeout_us =
+        static_cast<uint64_t>(this->limits.queue_timeout_ms) * 1000;
+
+    // The oldest request that fits now, or that waited too long
+    for (size_t i = 0; i < this->admission_queue.size(); ++i) {
+        AdmissionQueue::Request &request = this->admission_queue.at(i);
+        bool expired = now_us - request.arrival_us > timeout_us;
+        if (!expired && !this->canAdmit(request.peer)) continue;
 
-            if (value >= 8 && value <= 65464) {
-                this->state.setWindowSize(value);
-                oack_packet.options["blksize"] = window_size_option->second;
+        peer = request.peer;
+        if (expired) {
+            Metrics::instance().increment(Counter::SessionsRejected);
+            size = this->sendError(dst, ErrorCode::NOT_DEFINED,
+                                   "Too many transfers, try again later!");
+        } else {
+            // The request was checked and rate limited when it came in
+            try {
+                size = this->getPacketType(request.data) == PacketType::RRQ
+                           ? this->handleReadRequestPacket(
+                                 request.peer, request.data, dst,
+                                 request.size, true)
+                           : this->handleWriteRequestPacket(
+                                 request.peer, request.data, dst,
+                                 request.size, true);
+            } catch (const std::exception &e) {
+                size = this->sendError(dst, ErrorCode::NOT_DEFINED, e.what());
             }
         }
 
-        // Check if we have a timeout option
-        auto timeout_option = packet.options.find("timeout");
-        if (timeout_option != packet.options.end()) {
-            this->state.setTimeoutMs(std::stoi(timeout_option->second));
-            oack_packet.options["timeout"] = timeout_option->second;
+        this->admission_queue.erase(i);
+        return true;
+    }
+
+    this->admission_changed = false;
+    return false;
+}
+
+// Transfers
+Transfer Controller::readTransfer(ControllerContext &context,
+                                  bool send_first_block) {
+    bool send_block = send_first_block;
+    bool last_block = false;
+
+    while (true) {
+        if (send_block) {
+            ssize_t bytes_read = co_await this->readBlock(context);
+
+            // A block still on its way is read again on the next timeout
+            // check
+            while (bytes_read == FILE_NOT_READY) {
+                co_await this->waitForFile(context);
+                bytes_read = co_await this->readBlock(context);
+            }
+
+            if (bytes_read < 0) {
+                context.reply_size = this->sendError(
+                    context.dst, ErrorCode::NOT_DEFINED, "Failed to read file!");
+                co_return false;
+            }
+
+            // A block shorter than the window size is the last one
+            last_block = bytes_read < context.getWindowSize();
+            context.reply_size = this->sendBlock(context, bytes_read, context.dst);
+        }
+
+        // Wait for the block to be acknowledged
+        if (!co_await this->nextPacket(context)) co_return false;
+
+        // Resumed without a packet, as the block was not acknowledged in time
+        if (context.src == nullptr) {
+            Metrics::instance().increment(Counter::Retransmits);
+            send_block = true;
+            continue;
+        }
+
+        if (this->getPacketType(context.src) != PacketType::ACK) {
+            context.reply_size = this->sendError(
+                context.dst, ErrorCode::NOT_DEFINED, "Invalid state!");
+            send_block = false;
+            continue;
         }
 
-        // Send OACK packet
-        return oack_packet.serialize(dst);
+        // Deserialize packet
+        AckPacket packet;
+        {
+            TFTP_PHASE_SCOPE(Phase::Decode);
+            packet.deserialize(context.src);
+        }
+        TFTP_PROBE2(decode, context.session_id, packet.block_number);
+
+        // Block 0 acknowledges the OACK and starts the transfer
+        if (packet.block_number == 0 && context.block_sent_time_us == 0) {
+            send_block = true;
+            continue;
+        }
+
+        // Check if the block number is correct
+        if (packet.block_number == context.getBlockNumber()) {
+            Metrics::instance().record(
+                Histogram::BlockRoundTrip,
+                Metrics::nowMicros() - context.block_sent_time_us);
+
+            context.addBytesTransferred(context.block_size);
+            context.incrementBlockNumber();
+
+            // Check if we reached the end of the file
+            if (last_block) co_return true;
+            send_block = true;
+        } else if (packet.block_number > context.getBlockNumber()) {
+            context.reply_size = this->sendError(
+                context.dst, ErrorCode::NOT_DEFINED, "Invalid block number!");
+            send_block = false;
+        } else {
+            // A stale or duplicate ACK is ignored, as sending the block for
+            // every copy would double the blocks in flight each time (RFC
+            // 1123 4.2.3.1). A lost block goes out again on the timeout.
+            send_block = false;
+        }
     }
+}
 
-    // Send ack packet
-    AckPacket ack_packet(0);
-    return ack_packet.serialize(dst);
+Transfer Controller::writeTransfer(ControllerContext &context) {
+    while (true) {
+        if (!co_await this->nextPacket(context)) co_return false;
+
+        // The peer has nothing to acknowledge
+        if (this->getPacketType(context.src) != PacketType::DATA) continue;
+
+        // Only the header is decoded, the data is written from the request
+        uint16_t block_number;
+        {
+            TFTP_PHASE_SCOPE(Phase::Decode);
+            DataPacket::deserializeHeader(context.src, block_number);
+        }
+        TFTP_PROBE2(decode, context.session_id, block_number);
+
+        char *data = context.src + DataPacket::HEADER_SIZE;
+        ssize_t data_size = context.src_size - DataPacket::HEADER_SIZE;
+
+        // The block we have already, whose ACK got lost, is acknowledged
+        // again
+        uint16_t last_block_number = context.getBlockNumber() - 1;
+        if (block_number == last_block_number) {
+            AckPacket ack_packet(block_number);
+            context.reply_size = this->encode(&context, ack_packet, context.dst);
+            continue;
+        }
+
+        // Check if the block number is correct
+        if (block_number != context.getBlockNumber()) {
+            context.reply_size = this->sendError(
+                context.dst, ErrorCode::NOT_DEFINED, "Invalid block number!");
+            continue;
+        }
+
+        // Increment block number
+        context.incrementBlockNumber();
+
+        // A block shorter than the window size is the last one. It is only
+        // acknowledged once the upload is durable and in place.
+        bool last_block = data_size < context.getWindowSize();
+        ssize_t bytes_written =
+            co_await this->appendBlock(context, data, data_size, last_block);
+        if (bytes_written >= 0 && last_block) {
+            bytes_written = co_await this->commitUpload(context);
+        }
+
+        if (bytes_written < 0) {
+            context.reply_size = this->sendError(
+                context.dst, ErrorCode::DISK_FULL, "Failed to write file!");
+            co_return false;
+        }
+
+        context.addBytesTransferred(data_size);
+
+        // Send ack packet
+        AckPacket ack_packet(block_number);
+        context.reply_size = this->encode(&context, ack_packet, context.dst);
+
+        if (last_block) co_return true;
+    }
 }
 
-ssize_t Controller::handleDataPacket(char *src, char *dst, ssize_t src_size) {
-    // Check if we are already reading or writing
-    if (this->state.getState() != ControllerContext::State::WRITING) {
-        return this->sendError(dst, ErrorCode::NOT_DEFINED, "Invalid state!");
+Transfer Controller::multicastTransfer(ControllerContext &context) {
+    MulticastGroup &group = *context.multicast;
+
+    while (true) {
+        if (!co_await this->nextPacket(context)) co_return false;
+
+        // Only the master client acknowledges. The others wait for their
+        // turn, which may take long.
+        if (group.getMaster() != context.session) {
+            context.refreshDeadline(Metrics::nowMicros(),
+                                    MULTICAST_MEMBER_TIMEOUT_MS);
+            continue;
+        }
+
+        if (this->getPacketType(context.src) != PacketType::ACK) continue;
+
+        // Deserialize packet
+        AckPacket packet;
+        {
+            TFTP_PHASE_SCOPE(Phase::Decode);
+            packet.deserialize(context.src);
+        }
+        TFTP_PROBE2(decode, context.session_id, packet.block_number);
+
+        // The master has every block up to the one it acknowledges, and is
+        // done with the last one
+        if (packet.block_number >= group.block_count) {
+            context.setBytesTransferred(context.file_worker->size());
+            co_return true;
+        }
+
+        // Then it gets the block after it, which may have been sent before
+        // it joined
+        uint16_t block_number = packet.block_number + 1;
+        if (block_number <= group.sent_block) {
+            Metrics::instance().increment(Counter::Retransmits);
+        }
+        group.sent_block = std::max(group.sent_block, block_number);
+
+        context.setBlockNumber(block_number);
+        context.setBytesTransferred(static_cast<uint64_t>(block_number - 1) *
+                                    group.block_size);
+
+        ssize_t bytes_read = co_await this->readBlock(context);
+        while (bytes_read == FILE_NOT_READY) {
+            co_await this->waitForFile(context);
+            bytes_read = co_await this->readBlock(context);
+        }
+
+        if (bytes_read < 0) {
+            context.reply_size = this->sendError(
+                context.dst, ErrorCode::NOT_DEFINED, "Failed to read file!");
+            co_return false;
+        }
+
+        context.reply_size = this->sendBlock(context, bytes_read, context.dst);
     }
+}
 
-    // Deserialize packet
-    DataPacket packet;
-    packet.data_size = src_size - 4;
-    packet.deserialize(src);
+ssize_t Controller::resumeTransfer(ControllerContext &context, char *dst) {
+    context.dst = dst;
+    context.reply_size = -1;
+    context.transfer.resume();
 
-    // Check if the block number is correct
-    if (packet.block_number != this->state.block_number) {
-        return this->sendError(dst, ErrorCode::NOT_DEFINED,
-                               "Invalid block number!");
+    ssize_t reply_size = context.reply_size;
+    if (!context.transfer.isDone()) return reply_size;
+
+    // The session ends with its transfer
+    bool completed;
+    try {
+        completed = context.transfer.isCompleted();
+    } catch (...) {
+        this->endSession(&context);
+        throw;
+    }
+
+    if (completed) {
+        this->finishTransfer(&context);
+    } else {
+        this->endSession(&context);
     }
 
-    // Increment block number
-    this->state.incrementBlockNumber();
+    return reply_size;
+}
+
+Controller::PacketAwaiter Controller::nextPacket(ControllerContext &context) {
+    return PacketAwaiter{context};
+}
+
+Controller::DiskAwaiter Controller::readBlock(ControllerContext &context) {
+    // Block numbers wrap around in long transfers, so the offset comes from
+    // the bytes acknowledged so far
+    DiskJob &job = context.disk_job;
+    job.kind = DiskJob::Kind::Read;
+    job.block_number = context.getBlockNumber();
+    job.size = context.getWindowSize();
+    job.offset = context.getBytesTransferred();
 
-    // Write data to filebuffer.
-    this->state.file_worker->append(packet.data, packet.data_size);
+    // Read straight into the reply after its header, unless a pool thread
+    // reads while the reply buffer serves other packets
+    job.buffer = this->io_pool != nullptr
+                     ? this->block_buffers.acquire()
+                     : context.dst + DataPacket::HEADER_SIZE;
+
+    return DiskAwaiter{*this, context};
+}
 
-    // Reset state if we read less than 512 bytes
-    if (packet.data_size < this->state.window_size) {
-        this->state.reset();
+Controller::FileAwaiter Controller::waitForFile(ControllerContext &context) {
+    return FileAwaiter{*this, context};
+}
+
+void Controller::retryWaitingFiles() {
+    // They read their block through nextReply(), like a finished disk job
+    for (uint32_t session : this->waiting_files) {
+        const ControllerContext &context = *this->contexts_by_session[session];
+        this->scheduler.enqueue(
+            session, context.priority,
+            DataPacket::HEADER_SIZE + context.getWindowSize());
     }
+    this->waiting_files.clear();
+}
 
-    // Send ack packet
-    AckPacket ack_packet(packet.block_number);
-    return ack_packet.serialize(dst);
+Controller::DiskAwaiter Controller::appendBlock(ControllerContext &context,
+                                                char *data, ssize_t size,
+                                                bool last_block) {
+    DiskJob &job = context.disk_job;
+    job.kind = DiskJob::Kind::Append;
+    job.block_number = context.getBlockNumber() - 1;
+    job.size = size;
+    job.last_block = last_block;
+
+    // A pool thread cannot use the request, which is reused for the next
+    // packet
+    if (this->io_pool != nullptr) {
+        job.buffer = this->block_buffers.acquire();
+        memcpy(job.buffer, data, size);
+    } else {
+        job.buffer = data;
+    }
+
+    return DiskAwaiter{*this, context};
 }
 
-ssize_t Controller::handleAckPacket(char *src, char *dst, ssize_t src_size) {
-    if (this->state.state != ControllerContext::State::READING) {
-        return -1;
+Controller::DiskAwaiter Controller::commitUpload(ControllerContext &context) {
+    DiskJob &job = context.disk_job;
+    job.kind = DiskJob::Kind::Commit;
+    job.block_number = context.getBlockNumber() - 1;
+    job.buffer = nullptr;
+    job.size = 0;
+
+    return DiskAwaiter{*this, context};
+}
+
+uint32_t Controller::getReplyCost(const DiskJob &job) const {
+    // Reads are answered with their block, appends with an ACK
+    if (job.kind == DiskJob::Kind::Read && job.result > 0) {
+        return DataPacket::HEADER_SIZE + job.result;
     }
+    return DataPacket::HEADER_SIZE;
+}
 
-    // Deserialize packet
-    AckPacket packet;
-    packet.deserialize(src);
+bool Controller::DiskAwaiter::await_ready() {
+    DiskJob &job = this->context.disk_job;
+    job.file_worker = this->context.file_worker;
+    job.session_id = this->context.session_id;
+    job.netascii = this->context.mode == ReadWriteRequestMode::NETASCII
+                       ? &this->context.netascii
+                       : nullptr;
 
-    // Check if the block number is correct
-    if (packet.block_number == this->state.block_number) {
-        this->state.incrementBlockNumber();
+    if (this->controller.io_pool != nullptr) return false;
 
-        // Check if we reached the end of the file
-        if (this->state.isLastBlock()) {
-            this->state.reset();
-            return -1;
+    DiskIoPool::execute(job);
+    return true;
+}
+
+void Controller::DiskAwaiter::await_suspend(std::coroutine_handle<>) {
+    // nextReply() resumes the transfer
+    this->context.io_pending = true;
+    ++this->controller.pending_io;
+
+    DiskJob &job = this->context.disk_job;
+    if (job.kind == DiskJob::Kind::Commit &&
+        this->controller.committer != nullptr) {
+        this->controller.committer->submit(&job);
+    } else {
+        this->controller.io_pool->submit(&job, this->context.session);
+    }
+}
+
+void Controller::FileAwaiter::await_suspend(std::coroutine_handle<>) {
+    // handleTimeouts() resumes the transfer
+    this->context.waiting_file = true;
+    this->controller.waiting_files.push_back(this->context.session);
+}
+
+ssize_t Controller::DiskAwaiter::await_resume() {
+    DiskJob &job = this->context.disk_job;
+    this->context.io_pending = false;
+    TraceContext::set(this->context.session_id, job.block_number);
+
+    // Blocks that went through the pool come back in a pooled buffer
+    if (this->controller.io_pool != nullptr) {
+        --this->controller.pending_io;
+        if (!this->controller.admission_queue.empty()) {
+            this->controller.admission_changed = true;
         }
-    } else if (packet.block_number > this->state.block_number) {
-        return this->sendError(dst, ErrorCode::NOT_DEFINED,
-                               "Invalid block number!");
+
+        if (job.kind == DiskJob::Kind::Read && job.result > 0) {
+            memcpy(this->context.dst + DataPacket::HEADER_SIZE, job.buffer,
+                   job.result);
+        }
+        this->controller.block_buffers.release(job.buffer);
+    }
+
+    job.buffer = nullptr;
+    return job.result;
+}
+
+// Session functions
+ControllerContext *Controller::findSession(const Peer &peer) const {
+    uint32_t session = this->sessions.find(peer);
+    return session != NO_SESSION ? this->contexts_by_session[session] : nullptr;
+}
+
+ControllerContext *Controller::startSession(const Peer &peer) {
+    uint32_t session = this->sessions.insert(peer);
+    if (session >= this->contexts_by_session.size()) {
+        this->contexts_by_session.resize(this->sessions.getIndexLimit());
+
+        // Sweeps never allocate either
+        this->expired_sessions.reserve(this->contexts_by_session.capacity());
+    }
+
+    ControllerContext *context = this->contexts.create(
+        this->worker_factory, session, this->sessions.get(session));
+    context->disk_job.completions = &this->completions;
+    this->contexts_by_session[session] = context;
+    this->client_sessions.increment(peer);
+    return context;
+}
+
+void Controller::expireSession(ControllerContext &context) {
+    if (!context.transfer.isRunning()) {
+        this->endSession(&context);
+        return;
+    }
+
+    // The transfer sees the timeout and gives up, which ends the session
+    context.timed_out = true;
+    this->resumeTransfer(context, nullptr);
+}
+
+void Controller::retransmitBlock(ControllerContext &context) {
+    // The peer is copied first, as the transfer may end the session
+    Peer peer = context.getPeer();
+    char *buffer = this->block_buffers.acquire();
+
+    context.src = nullptr;
+    context.src_size = 0;
+    context.timed_out = false;
+
+    ssize_t size;
+    try {
+        size = this->resumeTransfer(context, buffer);
+    } catch (const std::exception &e) {
+        size = this->sendError(buffer, ErrorCode::NOT_DEFINED, e.what());
+    }
+
+    // A block read by the pool comes out of nextReply() instead
+    if (size > 0) {
+        this->queueReply(peer, buffer, size);
+    } else {
+        this->block_buffers.release(buffer);
+    }
+}
+
+void Controller::endSession(ControllerContext *context) {
+    uint32_t session = context->session;
+
+    if (context->multicast != nullptr) this->leaveMulticast(*context);
+
+    this->client_sessions.decrement(context->getPeer());
+
+    // A queued request may fit now
+    if (!this->admission_queue.empty()) {
+        this->admission_changed = true;
+        this->completions.wake();
+    }
+
+    // The context resets its hot record, so it goes before the slot
+    this->contexts.destroy(context);
+    this->contexts_by_session[session] = nullptr;
+    this->sessions.erase(session);
+}
+
+// Multicast
+bool Controller::joinMulticast(ControllerContext &context,
+                               const char *filename) {
+    // Netascii is translated per session, and block numbers of a group
+    // cannot wrap around, as a late client asks for blocks from the start
+    if (!this->multicast_groups.isEnabled() ||
+        context.mode != ReadWriteRequestMode::OCTET) {
+        return false;
     }
 
-    // Send next block
-    return this->sendNextBlock(dst);
+    ssize_t file_size = context.file_worker->size();
+    if (file_size < 0) return false;
+
+    uint64_t block_count = file_size / context.getWindowSize() + 1;
+    if (block_count > UINT16_MAX) return false;
+
+    MulticastGroup *group = this->multicast_groups.join(
+        filename, context.getWindowSize(), block_count, context.session);
+    if (group == nullptr) return false;
+
+    context.multicast = group;
+
+    // The others wait for their turn, which may take long
+    if (group->getMaster() != context.session) {
+        context.refreshDeadline(Metrics::nowMicros(),
+                                MULTICAST_MEMBER_TIMEOUT_MS);
+    }
+    return true;
+}
+
+void Controller::leaveMulticast(ControllerContext &context) {
+    MulticastGroup *group = context.multicast;
+    context.multicast = nullptr;
+
+    uint32_t master = this->multicast_groups.leave(group, context.session);
+    if (master == NO_SESSION) return;
+
+    // The next client is told it is the master now. It answers with an ACK
+    // of the block before the first one it is missing.
+    ControllerContext &next = *this->contexts_by_session[master];
+    next.refreshDeadline(Metrics::nowMicros());
+
+    OptionAckPacket oack_packet;
+    oack_packet.options["multicast"] = group->describe(true);
+
+    char *buffer = this->block_buffers.acquire();
+    this->queueReply(next.getPeer(), buffer,
+                     this->encode(&next, oack_packet, buffer));
+}
+
+ssize_t Controller::routeGroupReply(const Peer &group, char *dst,
+                                    ssize_t size) {
+    // Errors still go to the peer
+    if (size <= 0 || this->getPacketType(dst) != PacketType::DATA) {
+        return size;
+    }
+
+    char *buffer = this->block_buffers.acquire();
+    memcpy(buffer, dst, size);
+    this->queueReply(group, buffer, size);
+    return -1;
 }
 
 // Utility functions
@@ -241,52 +963,208 @@ PacketType Controller::getPacketType(const char *src) const {
         ntohs(*reinterpret_cast<const uint16_t *>(src)));
 }
 
-bool Controller::openFileWorker(const char *filename,
+PacketType Controller::validatePacket(const char *src, ssize_t size) const {
+    // Every packet we take has an opcode and two more bytes
+    if (size < 4) return PacketType::UNKNOWN;
+
+    const PacketType type = this->getPacketType(src);
+    switch (type) {
+        case PacketType::RRQ:
+        case PacketType::WRQ: {
+            // Filename and mode are terminated inside the packet, and the
+            // filename fits the request
+            const char *end = src + size;
+            const char *filename = src + 2;
+            size_t filename_limit = std::min<size_t>(
+                end - filename, sizeof(ReadWriteRequestPacket::filename));
+            auto filename_end = static_cast<const char *>(
+                memchr(filename, '\0', filename_limit));
+            if (filename_end == nullptr || filename_end == filename) break;
+
+            const char *mode = filename_end + 1;
+            if (mode >= end) break;
+            auto mode_end =
+                static_cast<const char *>(memchr(mode, '\0', end - mode));
+            if (mode_end == nullptr) break;
+
+            ReadWriteRequestMode parsed_mode;
+            if (!ReadWriteRequestPacket::parseMode(mode, parsed_mode)) break;
+
+            return type;
+        }
+        case PacketType::DATA:
+            if (size > DataPacket::HEADER_SIZE + MAX_BLOCK_SIZE) break;
+            return type;
+        case PacketType::ACK:
+            if (size != 4) break;
+            return type;
+        case PacketType::ERROR:
+            return type;
+        default:
+            break;
+    }
+
+    return PacketType::UNKNOWN;
+}
+
+ssize_t Controller::applyOptions(ControllerContext &context,
+                                 const ReadWriteRequestPacket &packet,
+                                 char *dst) {
+    // Create OACK packet
+    OptionAckPacket oack_packet;
+
+    // Values that do not parse are left out of the OACK, without throwing
+    auto parse = [](const std::string &text, auto &value) {
+        const char *end = text.data() + text.size();
+        auto result = std::from_chars(text.data(), end, value);
+        return result.ec == std::errc() && result.ptr == end;
+    };
+
+    // Check if we have a window size option
+    auto window_size_option = packet.options.find("blksize");
+    int value;
+    if (window_size_option != packet.options.end() &&
+        parse(window_size_option->second, value) && value >= MIN_WINDOW_SIZE &&
+        value <= MAX_BLOCK_SIZE) {
+        context.setWindowSize(value);
+        oack_packet.options["blksize"] = window_size_option->second;
+    }
+
+    // Check if we have a timeout option, which is 1-255 seconds
+    auto timeout_option = packet.options.find("timeout");
+    if (timeout_option != packet.options.end() &&
+        parse(timeout_option->second, value) && value >= 1 && value <= 255) {
+        context.setTimeoutMs(value * 1000);
+        oack_packet.options["timeout"] = timeout_option->second;
+    }
+
+    // Check if we have a transfer size option. Uploads announce their size,
+    // which is acknowledged as is, and downloads are told the size of the
+    // file when it is known. Netascii changes the size on the wire, so it is
+    // left out there.
+    auto tsize_option = packet.options.find("tsize");
+    uint64_t transfer_size;
+    if (tsize_option != packet.options.end() &&
+        parse(tsize_option->second, transfer_size)) {
+        if (context.getState() == ControllerContext::State::WRITING) {
+            oack_packet.options["tsize"] = tsize_option->second;
+        } else if (context.mode != ReadWriteRequestMode::NETASCII) {
+            ssize_t file_size = context.file_worker->size();
+            if (file_size >= 0) {
+                oack_packet.options["tsize"] = std::to_string(file_size);
+            }
+        }
+    }
+
+    // Check if we have a multicast option (RFC 2090), which comes with the
+    // group address and whether the client is the master
+    if (packet.options.count("multicast") > 0 &&
+        context.getState() == ControllerContext::State::READING &&
+        this->joinMulticast(context, packet.filename)) {
+        const MulticastGroup &group = *context.multicast;
+        oack_packet.options["multicast"] =
+            group.describe(group.getMaster() == context.session);
+    }
+
+    // Send OACK packet
+    return this->encode(&context, oack_packet, dst);
+}
+
+bool Controller::openFileWorker(ControllerContext &context,
+                                const char *filename,
                                 ReadWriteRequestMode mode) {
+    context.mode = mode;
+
     // Translating ReadWriteRequestMode to FileWorkerMode
     FileWorkerMode file_worker_mode = static_cast<FileWorkerMode>(mode);
-    return this->openFileWorker(filename, file_worker_mode);
+    return this->openFileWorker(context, filename, file_worker_mode);
 }
 
-bool Controller::openFileWorker(const char *filename, FileWorkerMode mode) {
+bool Controller::openFileWorker(ControllerContext &context,
+                                const char *filename, FileWorkerMode mode) {
     // Create file worker
     FileWorker *file_worker = this->worker_factory.create(filename, mode);
-    this->state.setFileWorker(file_worker);
+    context.setFileWorker(file_worker);
 
     return file_worker->exists();
 }
 
+void Controller::startTransfer(ControllerContext &context,
+                               ControllerContext::State state) {
+    static std::atomic<uint32_t> next_session_id{1};
+
+    context.session_id = next_session_id.fetch_add(1);
+    context.setState(state);
+    context.incrementBlockNumber();
+    context.start_time_us = Metrics::nowMicros();
+    context.refreshDeadline(context.start_time_us);
+
+    Metrics::instance().increment(Counter::SessionsStarted);
+}
+
+void Controller::finishTransfer(ControllerContext *context) {
+    uint64_t elapsed_us = Metrics::nowMicros() - context->start_time_us;
+    if (elapsed_us == 0) elapsed_us = 1;
+
+    // Throughput in KiB/s
+    Metrics::instance().record(
+        Histogram::Throughput,
+        context->getBytesTransferred() * 1000000 / 1024 / elapsed_us);
+
+    this->endSession(context);
+}
+
 // Reply functions
 ssize_t Controller::sendError(char *dst, ErrorCode error_code,
                               const char *message) const {
+    Metrics::instance().recordError(error_code);
+
     // Create error packet
     ErrorPacket packet(error_code, message);
-    return packet.serialize(dst);
+    return this->encode(nullptr, packet, dst);
 }
 
-ssize_t Controller::sendNextBlock(char *dst) {
-    // Calculate offset
-    ssize_t offset = (this->state.block_number - 1) * this->state.window_size;
+void Controller::queueReply(const Peer &peer, char *buffer, ssize_t size) {
+    this->queued_replies.push_back(QueuedReply{peer, buffer, size});
+    this->completions.wake();
+}
 
-    // Read from file
-    char *buffer = new char[this->state.window_size + 4];
-    ssize_t bytes_read =
-        this->state.file_worker->read(buffer, this->state.window_size, offset);
+ssize_t Controller::encode(const ControllerContext *context,
+                           const Packet &packet, char *dst) const {
+    TFTP_PHASE_SCOPE(Phase::Encode);
+    ssize_t size = packet.serialize(dst);
+    this->traceEncode(context);
+    return size;
+}
 
-    // Check if we reached the end of the file
-    if (bytes_read < 0) {
-        return this->sendError(dst, ErrorCode::NOT_DEFINED,
-                               "Failed to read file!");
+void Controller::traceEncode(const ControllerContext *context) const {
+    // Replies to the last packet of a transfer keep its context
+    if (context != nullptr && context->session_id != 0) {
+        TraceContext::set(context->session_id, context->getBlockNumber());
     }
 
-    // Create data packet
-    DataPacket data_packet(this->state.block_number, buffer, bytes_read);
+    const TraceContext &current = TraceContext::current();
+    TFTP_PROBE2(encode, current.session_id, current.block_number);
+}
 
-    // Reset state if we read less than the window size
-    if (bytes_read < this->state.window_size) {
-        this->state.is_last_block = true;
+ssize_t Controller::sendBlock(ControllerContext &context, ssize_t bytes_read,
+                              char *dst) {
+    // Time to first byte is measured from the request to the first block
+    uint64_t now = Metrics::nowMicros();
+    if (context.block_sent_time_us == 0) {
+        Metrics::instance().record(Histogram::TimeToFirstByte,
+                                   now - context.start_time_us);
     }
 
-    return data_packet.serialize(dst);
+    context.block_sent_time_us = now;
+    context.unacked_checks = 0;
+    context.block_size = bytes_read;
+
+    // Only the header is left to encode
+    TFTP_PHASE_SCOPE(Phase::Encode);
+    ssize_t size =
+        DataPacket::serializeHeader(dst, context.getBlockNumber()) + bytes_read;
+    this->traceEncode(&context);
+    return size;
 }
-}  // namespace tftp
\ No newline at end of file
+}  // namespace tftp
@@ -1,75 +1,195 @@
 #pragma once
 
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <vector>
+
+#include "admission.hpp"
 #include "common.hpp"
+#include "disk_io.hpp"
 #include "files.hpp"
+#include "metrics.hpp"
+#include "multicast.hpp"
 #include "packets.hpp"
+#include "peer.hpp"
+#include "pool.hpp"
+#include "rate_limiter.hpp"
+#include "scheduler.hpp"
+#include "session_table.hpp"
+#include "trace.hpp"
+#include "transfer.hpp"
 
 constexpr uint16_t DEFAULT_WINDOW_SIZE = 512;
 constexpr uint16_t MAX_WINDOW_SIZE = 65460;
 constexpr uint16_t MIN_WINDOW_SIZE = 8;
+constexpr uint16_t MAX_BLOCK_SIZE = 65464;  // Largest blksize, RFC 2348
 constexpr int DEFAULT_TIMEOUT_MS = 5000;
 
+// A block that is not acknowledged is sent again this many times before the
+// session times out, at even intervals
+constexpr int BLOCK_RETRANSMITS = 4;
+
+// How often handleTimeouts() is called
+constexpr int TIMEOUT_CHECK_INTERVAL_MS = 100;
+
 namespace tftp {
 class PacketHandler {
    public:
-    virtual ssize_t handlePacket(char *src, char *dst, ssize_t src_size) = 0;
+    virtual ~PacketHandler() = default;
+
+    virtual ssize_t handlePacket(const Peer &peer, char *src, char *dst,
+                                 ssize_t src_size) = 0;
+
+    // Called every TIMEOUT_CHECK_INTERVAL_MS, so sessions of peers that went
+    // away can expire and lost blocks are sent again
+    virtual void handleTimeouts() {}
+
+    // Becomes readable when replies are ready that no packet asked for, such
+    // as blocks read on another thread. -1 if there never are any.
+    virtual int getWakeFd() const { return -1; }
+
+    // Takes the next of those replies. Returns false once there are none
+    // left; a size of zero or less means the reply is not sent.
+    virtual bool nextReply(Peer &, char *, ssize_t &) { return false; }
 };
 
+// Cold state of a session. The per-packet state lives in the SessionHot
+// record of the session table and is reached through the getters. What is
+// left of the protocol state lives in the frame of the transfer coroutine.
 class ControllerContext {
    public:
     enum State {
         IDLE,
         READING,
         WRITING,
-    } state;
+    };
 
     // TFTP Operation state
-    uint16_t block_number = 0;
-    time_t last_packet_time = 0;
-    bool is_last_block = false;
+    const uint32_t session;  // Index in the session table
+    SessionHot &hot;
+    uint32_t session_id = 0;
+
+    // Transfer statistics
+    uint64_t start_time_us = 0;
+    uint64_t block_sent_time_us = 0;
+    int unacked_checks = 0;  // Timeout checks since the block was sent
+    ssize_t block_size = 0;
 
     // TFTP Options
     uint16_t window_size = DEFAULT_WINDOW_SIZE;
     int timeout_ms = DEFAULT_TIMEOUT_MS;
 
+    // Scheduling class of the replies
+    uint8_t priority = DEFAULT_PRIORITY_CLASS;
+
+    // Netascii sessions translate every block
+    ReadWriteRequestMode mode = ReadWriteRequestMode::OCTET;
+    NetasciiTranslator netascii;
+
+    // Group of a multicast download, which sends its blocks
+    MulticastGroup *multicast = nullptr;
+
     FileWorker *file_worker = nullptr;
+    FileWorkerFactory &worker_factory;
 
-    ControllerContext() { this->reset(); }
+    // Disk I/O in flight. Packets of the session are dropped until it is
+    // done, so there is only ever one job.
+    DiskJob disk_job;
+    bool io_pending = false;
+
+    // Waiting for bytes of its file that are still on their way. Packets of
+    // the session are dropped, and the timeout check reads the block again.
+    bool waiting_file = false;
+
+    // Coroutine running the transfer, and what it is resumed with
+    Transfer transfer;
+    char *src = nullptr;
+    ssize_t src_size = 0;
+    char *dst = nullptr;
+    ssize_t reply_size = -1;
+    bool timed_out = false;
+
+    ControllerContext(FileWorkerFactory &worker_factory, uint32_t session,
+                      SessionHot &hot)
+        : session(session), hot(hot), worker_factory(worker_factory) {
+        this->disk_job.user_data = this;
+        this->reset();
+    }
+    ~ControllerContext() { this->reset(); }
 
     void reset() {
+        // Count the end of the running transfer, if any
+        if (this->getState() != State::IDLE) {
+            Metrics::instance().increment(Counter::SessionsFinished);
+        }
+
+        // Stop the transfer
+        this->transfer.reset();
+
         // Reset state
-        this->state = State::IDLE;
-        this->block_number = 0;
-        this->last_packet_time = 0;
-        this->is_last_block = false;
+        this->hot.state = State::IDLE;
+        this->hot.block_number = 0;
+        this->hot.deadline_us = 0;
+        this->hot.bytes_transferred = 0;
+        this->session_id = 0;
+
+        // Reset statistics
+        this->start_time_us = 0;
+        this->block_sent_time_us = 0;
+        this->unacked_checks = 0;
+        this->block_size = 0;
 
         // Reset options
         this->window_size = DEFAULT_WINDOW_SIZE;
         this->timeout_ms = DEFAULT_TIMEOUT_MS;
+        this->priority = DEFAULT_PRIORITY_CLASS;
+        this->mode = ReadWriteRequestMode::OCTET;
+        this->netascii.reset();
+        this->multicast = nullptr;
 
-        // Delete file worker
-        if (this->file_worker != nullptr) delete this->file_worker;
+        // Return file worker
+        this->worker_factory.destroy(this->file_worker);
         this->file_worker = nullptr;
     }
 
     // Getters and setters
-    void incrementBlockNumber() { ++this->block_number; }
-    uint16_t getBlockNumber() const { return this->block_number; }
+    const Peer &getPeer() const { return this->hot.peer; }
 
-    void setState(State state) { this->state = state; }
-    State getState() const { return this->state; }
+    void incrementBlockNumber() { ++this->hot.block_number; }
+    uint16_t getBlockNumber() const { return this->hot.block_number; }
+    void setBlockNumber(uint16_t block_number) {
+        this->hot.block_number = block_number;
+    }
+
+    void setState(State state) { this->hot.state = state; }
+    State getState() const { return static_cast<State>(this->hot.state); }
 
-    void setLastPacketTime(time_t last_packet_time) {
-        this->last_packet_time = last_packet_time;
+    // Pushes the deadline back after a packet from the peer
+    void refreshDeadline(uint64_t now_us) {
+        this->refreshDeadline(now_us, this->timeout_ms);
     }
 
-    time_t getLastPacketTime() const { return this->last_packet_time; }
+    void refreshDeadline(uint64_t now_us, int timeout_ms) {
+        this->hot.deadline_us =
+            now_us + static_cast<uint64_t>(timeout_ms) * 1000;
+    }
 
-    void setLastBlock(bool is_last_block) {
-        this->is_last_block = is_last_block;
+    bool isExpired(uint64_t now_us) const {
+        return this->hot.deadline_us != 0 && now_us > this->hot.deadline_us;
     }
 
-    bool isLastBlock() const { return this->is_last_block; }
+    void addBytesTransferred(uint64_t bytes) {
+        this->hot.bytes_transferred += bytes;
+    }
+
+    uint64_t getBytesTransferred() const {
+        return this->hot.bytes_transferred;
+    }
+
+    void setBytesTransferred(uint64_t bytes) {
+        this->hot.bytes_transferred = bytes;
+    }
 
     void setWindowSize(uint16_t window_size) {
         this->window_size = window_size;
@@ -81,40 +201,211 @@ class ControllerContext {
     int getTimeoutMs() const { return this->timeout_ms; }
 
     void setFileWorker(FileWorker *file_worker) {
-        if (this->file_worker != nullptr) {
-            delete this->file_worker;
-        }
-
+        this->worker_factory.destroy(this->file_worker);
         this->file_worker = file_worker;
     }
 };
 
+// Runs one transfer per peer. Sessions are found through a flat table and
+// their contexts come from a pool, so sessions do not allocate once both
+// have grown to the peak number of sessions.
+//
+// Every transfer is a coroutine that awaits the next packet of its peer (or
+// the timeout) and its disk I/O. File reads and writes run inline unless a
+// disk I/O pool is set. With a pool, the reply to a packet that needs the
+// disk comes out of nextReply() once the job is done, in the order the send
+// scheduler picks.
 class Controller : public PacketHandler {
    public:
-    virtual ssize_t handlePacket(char *src, char *dst, ssize_t src_size);
+    virtual ssize_t handlePacket(const Peer &peer, char *src, char *dst,
+                                 ssize_t src_size);
+    virtual void handleTimeouts();
+    virtual int getWakeFd() const;
+    virtual bool nextReply(Peer &peer, char *dst, ssize_t &size);
+
+    Controller(FileWorkerFactory &worker_factory);
+    virtual ~Controller();
 
-    Controller(FileWorkerFactory &worker_factory)
-        : worker_factory(worker_factory) {}
+    // The pool has to be stopped before the controller goes away, so no job
+    // outlives its session
+    void setDiskIoPool(DiskIoPool *io_pool) { this->io_pool = io_pool; }
+
+    // Uploads are committed in groups by this thread rather than one at a
+    // time by the pool. Needs a pool, and stops before the controller too.
+    void setGroupCommitter(GroupCommitter *committer) {
+        this->committer = committer;
+    }
+
+    void setPriorityRules(const PriorityRules &priority_rules) {
+        this->priority_rules = priority_rules;
+    }
+
+    void setSchedulerQuantum(uint32_t quantum) {
+        this->scheduler.setQuantum(quantum);
+    }
+
+    // Requests per second and burst per source address, 0 for no limit
+    void setRateLimit(uint32_t rate, uint32_t burst) {
+        this->rate_limiter.configure(rate, burst);
+    }
+
+    void setAdmissionLimits(const AdmissionLimits &limits) {
+        this->limits = limits;
+        this->admission_queue.setCapacity(limits.queue_length);
+    }
+
+    // Offer multicast downloads (RFC 2090) on groups from the address up.
+    // Throws std::invalid_argument for an address that is not multicast.
+    void setMulticast(const std::string &address, uint16_t port,
+                      unsigned int max_groups = DEFAULT_MULTICAST_GROUPS) {
+        this->multicast_groups.configure(address, port, max_groups);
+    }
+
+    size_t getSessionCount() const { return this->sessions.size(); }
 
    private:
     // State
-    ControllerContext state;
+    SessionTable sessions;
+    std::vector<ControllerContext *> contexts_by_session;
+    std::vector<uint32_t> expired_sessions;
+    ObjectPool<ControllerContext> contexts;
     FileWorkerFactory &worker_factory;
 
+    // Disk I/O
+    DiskIoPool *io_pool = nullptr;
+    GroupCommitter *committer = nullptr;
+    CompletionQueue completions;
+    BufferPool block_buffers{UINT16_MAX};  // Blocks handed to the pool
+
+    // Send scheduling
+    SendScheduler scheduler;
+    PriorityRules priority_rules;
+
+    // Requests per source
+    RateLimiter rate_limiter;
+
+    // Admission control. The queue is only looked at after something that
+    // may have freed a slot.
+    AdmissionLimits limits;
+    ClientCounter client_sessions;
+    AdmissionQueue admission_queue;
+    size_t pending_io = 0;
+    bool admission_changed = false;
+
+    // Multicast groups
+    MulticastGroups multicast_groups;
+
+    // Replies to someone else than the peer of the packet being handled,
+    // such as blocks for a multicast group, which go out through
+    // nextReply(). Their buffers come from the block buffers.
+    struct QueuedReply {
+        Peer peer;
+        char *buffer;
+        ssize_t size;
+    };
+    std::deque<QueuedReply> queued_replies;
+
+    // Sessions waiting for their file, and whether the factory said more of
+    // a file came in since they were last tried
+    std::vector<uint32_t> waiting_files;
+    std::atomic<bool> files_ready{false};
+
+    // Awaits the next packet of the peer. Resumes with false if the peer
+    // timed out instead.
+    struct PacketAwaiter {
+        ControllerContext &context;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        bool await_resume() const noexcept { return !this->context.timed_out; }
+    };
+
+    // Awaits the next timeout check, which resumes the session to read a
+    // block that was not ready again
+    struct FileAwaiter {
+        Controller &controller;
+        ControllerContext &context;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>);
+        void await_resume() const noexcept {
+            this->context.waiting_file = false;
+        }
+    };
+
+    // Awaits the disk job of the session, which runs right away without a
+    // pool. Resumes with the result of the job.
+    struct DiskAwaiter {
+        Controller &controller;
+        ControllerContext &context;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<>);
+        ssize_t await_resume();
+    };
+
     // Packet handlers
-    ssize_t handleReadRequestPacket(char *src, char *dst, ssize_t size);
-    ssize_t handleWriteRequestPacket(char *src, char *dst, ssize_t size);
-    ssize_t handleDataPacket(char *src, char *dst, ssize_t size);
-    ssize_t handleAckPacket(char *src, char *dst, ssize_t size);
+    // Requests that come out of the admission queue are already admitted
+    ssize_t handleReadRequestPacket(const Peer &peer, char *src, char *dst,
+                                    ssize_t size, bool admitted);
+    ssize_t handleWriteRequestPacket(const Peer &peer, char *src, char *dst,
+                                     ssize_t size, bool admitted);
+    ssize_t handleTransferPacket(ControllerContext *context, PacketType type,
+                                 char *src, char *dst, ssize_t size);
+
+    // Admission control
+    bool canAdmit(const Peer &peer) const;
+    ssize_t deferRequest(const Peer &peer, const char *src, char *dst,
+                         ssize_t size);
+    bool nextAdmittedReply(Peer &peer, char *dst, ssize_t &size);
+
+    // Transfers
+    Transfer readTransfer(ControllerContext &context, bool send_first_block);
+    Transfer writeTransfer(ControllerContext &context);
+    Transfer multicastTransfer(ControllerContext &context);
+    ssize_t resumeTransfer(ControllerContext &context, char *dst);
+    PacketAwaiter nextPacket(ControllerContext &context);
+    DiskAwaiter readBlock(ControllerContext &context);
+    FileAwaiter waitForFile(ControllerContext &context);
+    void retryWaitingFiles();
+    DiskAwaiter appendBlock(ControllerContext &context, char *data,
+                            ssize_t size, bool last_block);
+    DiskAwaiter commitUpload(ControllerContext &context);
+    uint32_t getReplyCost(const DiskJob &job) const;
+
+    // Session functions
+    ControllerContext *findSession(const Peer &peer) const;
+    ControllerContext *startSession(const Peer &peer);
+    void expireSession(ControllerContext &context);
+    void retransmitBlock(ControllerContext &context);
+    void endSession(ControllerContext *context);
+
+    // Multicast
+    bool joinMulticast(ControllerContext &context, const char *filename);
+    void leaveMulticast(ControllerContext &context);
+    ssize_t routeGroupReply(const Peer &group, char *dst, ssize_t size);
 
     // Utility functions
     PacketType getPacketType(const char *src) const;
-    bool openFileWorker(const char *filename, ReadWriteRequestMode mode);
-    bool openFileWorker(const char *filename, FileWorkerMode mode);
+    PacketType validatePacket(const char *src, ssize_t size) const;
+    ssize_t applyOptions(ControllerContext &context,
+                         const ReadWriteRequestPacket &packet, char *dst);
+    bool openFileWorker(ControllerContext &context, const char *filename,
+                        ReadWriteRequestMode mode);
+    bool openFileWorker(ControllerContext &context, const char *filename,
+                        FileWorkerMode mode);
+    void startTransfer(ControllerContext &context,
+                       ControllerContext::State state);
+    void finishTransfer(ControllerContext *context);
 
     // Reply functions
-    ssize_t sendNextBlock(char *dst);
+    ssize_t encode(const ControllerContext *context, const Packet &packet,
+                   char *dst) const;
+    void traceEncode(const ControllerContext *context) const;
+    ssize_t sendBlock(ControllerContext &context, ssize_t bytes_read,
+                      char *dst);
     ssize_t sendError(char *dst, ErrorCode error_code,
                       const char *message) const;
+    void queueReply(const Peer &peer, char *buffer, ssize_t size);
 };
 }  // namespace tftp
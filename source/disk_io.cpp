@@ -0,0 +1,268 @@
+#include "disk_io.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <stdexcept>
+
+#include "affinity.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+namespace tftp {
+CompletionQueue::CompletionQueue() {
+#ifndef _WIN32
+    if (pipe(this->wake_fds) != 0) {
+        throw std::runtime_error("Failed to create completion pipe");
+    }
+
+    for (int fd : this->wake_fds) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+}
+
+CompletionQueue::~CompletionQueue() {
+#ifndef _WIN32
+    close(this->wake_fds[0]);
+    close(this->wake_fds[1]);
+#endif
+}
+
+void CompletionQueue::post(DiskJob *job) {
+    this->jobs.push(job);
+
+    // Only the first job after the queue ran empty needs to wake the loop
+    if (this->pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        this->wake();
+    }
+}
+
+void CompletionQueue::wake() {
+#ifndef _WIN32
+    char byte = 0;
+    (void)!write(this->wake_fds[1], &byte, 1);
+#endif
+}
+
+DiskJob *CompletionQueue::pop() {
+    while (this->pending.load(std::memory_order_acquire) > 0) {
+        if (DiskJob *job = this->jobs.pop()) {
+            this->pending.fetch_sub(1, std::memory_order_acq_rel);
+            return job;
+        }
+
+        // A post is halfway done
+        std::this_thread::yield();
+    }
+
+    return nullptr;
+}
+
+DiskIoPool::DiskIoPool(unsigned int thread_count,
+                       std::vector<unsigned int> cpus)
+    : cpus(std::move(cpus)) {
+    if (thread_count == 0) {
+        throw std::invalid_argument("A disk I/O pool needs threads");
+    }
+
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        this->workers.emplace_back(new Worker());
+    }
+    for (auto &worker : this->workers) {
+        worker->thread = std::thread(&DiskIoPool::run, this, std::ref(*worker));
+    }
+}
+
+DiskIoPool::~DiskIoPool() {
+    this->running = false;
+
+    for (auto &worker : this->workers) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->wakeup.notify_one();
+        }
+        worker->thread.join();
+    }
+}
+
+void DiskIoPool::submit(DiskJob *job, uint32_t shard) {
+    Worker &worker = *this->workers[shard % this->workers.size()];
+    worker.jobs.push(job);
+
+    // Wake the thread if it may be asleep
+    if (worker.pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.wakeup.notify_one();
+    }
+}
+
+void DiskIoPool::run(Worker &worker) {
+    pinCurrentThread(this->cpus);
+
+    while (true) {
+        if (DiskJob *job = worker.jobs.pop()) {
+            execute(*job);
+            worker.pending.fetch_sub(1, std::memory_order_acq_rel);
+            job->completions->post(job);
+            continue;
+        }
+
+        // A submit is halfway done
+        if (worker.pending.load(std::memory_order_acquire) > 0) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Jobs submitted before stopping still run
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.wakeup.wait(lock, [this, &worker]() {
+            return worker.pending.load() > 0 || !this->running.load();
+        });
+
+        if (worker.pending.load() == 0 && !this->running.load()) break;
+    }
+}
+
+void DiskIoPool::execute(DiskJob &job) {
+    TraceContext::set(job.session_id, job.block_number);
+
+    try {
+        switch (job.kind) {
+            case DiskJob::Kind::Read: {
+                {
+                    TFTP_PHASE_SCOPE(Phase::FileRead);
+                    job.result =
+                        job.netascii != nullptr
+                            ? job.netascii->read(*job.file_worker, job.buffer,
+                                                 job.size, job.offset)
+                            : job.file_worker->read(job.buffer, job.size,
+                                                    job.offset);
+                }
+                TFTP_PROBE3(file__read, job.session_id, job.block_number,
+                            job.result);
+                break;
+            }
+            case DiskJob::Kind::Append: {
+                {
+                    TFTP_PHASE_SCOPE(Phase::FileWrite);
+                    job.result =
+                        job.netascii != nullptr
+                            ? job.netascii->append(*job.file_worker,
+                                                   job.buffer, job.size,
+                                                   job.last_block)
+                            : job.file_worker->append(job.buffer, job.size);
+                }
+                TFTP_PROBE3(file__write, job.session_id, job.block_number,
+                            job.result);
+                break;
+            }
+            case DiskJob::Kind::Commit: {
+                TFTP_PHASE_SCOPE(Phase::FileWrite);
+                job.result = job.file_worker->commit() ? 0 : -1;
+                if (job.result == 0) {
+                    Metrics::instance().increment(Counter::UploadsCommitted);
+                }
+                Metrics::instance().increment(Counter::CommitGroups);
+                break;
+            }
+        }
+    } catch (const std::exception &) {
+        job.result = -1;
+    }
+}
+
+GroupCommitter::GroupCommitter(const FileSystem &filesystem,
+                               std::vector<unsigned int> cpus)
+    : filesystem(filesystem), cpus(std::move(cpus)) {
+    this->thread = std::thread(&GroupCommitter::run, this);
+}
+
+GroupCommitter::~GroupCommitter() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+    }
+    this->wakeup.notify_one();
+    this->thread.join();
+}
+
+void GroupCommitter::submit(DiskJob *job) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->pending.push_back(job);
+    }
+    this->wakeup.notify_one();
+}
+
+void GroupCommitter::run() {
+    pinCurrentThread(this->cpus);
+
+    std::vector<DiskJob *> group;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->wakeup.wait(lock, [this]() {
+                return !this->pending.empty() || !this->running;
+            });
+
+            // Jobs submitted before stopping still run
+            if (this->pending.empty()) break;
+            group.swap(this->pending);
+        }
+
+        this->commit(group);
+        group.clear();
+    }
+}
+
+void GroupCommitter::commit(std::vector<DiskJob *> &group) {
+    TFTP_PHASE_SCOPE(Phase::FileWrite);
+
+    // Flush what the workers hold, then sync every upload at once
+    std::vector<std::string> uploads;
+    for (DiskJob *job : group) {
+        job->result = job->file_worker->close() ? 0 : -1;
+        std::string upload = job->file_worker->getUploadName();
+        if (job->result == 0 && !upload.empty()) uploads.push_back(upload);
+    }
+
+    bool synced = uploads.empty() || this->filesystem.sync(uploads);
+
+    // Move them into place, and sync the new names the same way
+    std::vector<std::string> files;
+    for (DiskJob *job : group) {
+        FileWorker &file_worker = *job->file_worker;
+        if (job->result < 0 || file_worker.getUploadName().empty()) continue;
+
+        if (!synced || !this->filesystem.rename(file_worker.getUploadName(),
+                                                file_worker.getFilename())) {
+            job->result = -1;
+            continue;
+        }
+
+        file_worker.setCommitted();
+        files.push_back(file_worker.getFilename());
+    }
+
+    // The files are in place by now, whatever happens to their names, so
+    // they are reported committed either way
+    if (!files.empty() && !this->filesystem.sync(files)) {
+        TFTP_LOG_WARNING("Failed to sync the names of {} committed uploads",
+                         files.size());
+    }
+
+    uint64_t committed = 0;
+    for (DiskJob *job : group) {
+        if (job->result == 0) ++committed;
+    }
+    Metrics::instance().increment(Counter::UploadsCommitted, committed);
+    Metrics::instance().increment(Counter::CommitGroups);
+
+    for (DiskJob *job : group) job->completions->post(job);
+}
+}  // namespace tftp
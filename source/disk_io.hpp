@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "files.hpp"
+#include "mpsc_queue.hpp"
+#include "netascii.hpp"
+
+namespace tftp {
+class CompletionQueue;
+
+// A file operation handed to the disk I/O pool. Jobs are embedded in their
+// owner, so handing them over never allocates.
+struct DiskJob : MpscNode {
+    enum class Kind {
+        Read,
+        Append,
+        Commit,  // Make an upload durable and move it into place
+    } kind = Kind::Read;
+
+    FileWorker *file_worker = nullptr;
+    char *buffer = nullptr;
+    ssize_t size = 0;
+    ssize_t offset = 0;
+    bool last_block = false;  // Netascii flushes what it held back
+    ssize_t result = 0;
+
+    // Translates the data of netascii sessions
+    NetasciiTranslator *netascii = nullptr;
+
+    // Tracing context of the session
+    uint32_t session_id = 0;
+    uint16_t block_number = 0;
+
+    CompletionQueue *completions = nullptr;
+    void *user_data = nullptr;
+};
+
+// Finished jobs on their way back to the event loop. Posting makes the wake
+// descriptor readable, so the loop can poll it next to its sockets; the loop
+// reads it empty before popping.
+class CompletionQueue {
+   public:
+    CompletionQueue();
+    ~CompletionQueue();
+    CompletionQueue(const CompletionQueue &) = delete;
+    CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+    // From any thread
+    void post(DiskJob *job);
+
+    // From the event loop only. Returns nullptr once the queue is empty.
+    DiskJob *pop();
+
+    // -1 where there is no way to wake the loop, which then has to poll
+    int getWakeFd() const { return this->wake_fds[0]; }
+
+    // Wakes the loop without posting, when there is other work for it
+    void wake();
+
+   private:
+    MpscQueue<DiskJob> jobs;
+    std::atomic<uint64_t> pending{0};
+    int wake_fds[2] = {-1, -1};
+};
+
+// Threads that run file operations off the network thread, so a slow disk
+// only stalls the sessions that wait for it. Jobs with the same shard go to
+// the same thread and run in the order they were submitted. The threads
+// are restricted to the given CPUs, if any.
+class DiskIoPool {
+   public:
+    DiskIoPool(unsigned int thread_count,
+               std::vector<unsigned int> cpus = {});
+    ~DiskIoPool();
+    DiskIoPool(const DiskIoPool &) = delete;
+    DiskIoPool &operator=(const DiskIoPool &) = delete;
+
+    // The job is posted to its completion queue once it ran
+    void submit(DiskJob *job, uint32_t shard);
+
+    // Runs a job on the calling thread
+    static void execute(DiskJob &job);
+
+    unsigned int getThreadCount() const { return this->workers.size(); }
+
+   private:
+    struct Worker {
+        MpscQueue<DiskJob> jobs;
+        std::atomic<uint64_t> pending{0};
+        std::mutex mutex;  // Only taken to sleep and to wake up
+        std::condition_variable wakeup;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    const std::vector<unsigned int> cpus;
+    std::atomic<bool> running{true};
+
+    void run(Worker &worker);
+};
+
+// Thread that commits finished uploads in groups. Uploads that finish while
+// a group is synced wait for the next group, so under load one sync covers
+// many files rather than each upload paying for its own.
+class GroupCommitter {
+   public:
+    GroupCommitter(const FileSystem &filesystem,
+                   std::vector<unsigned int> cpus = {});
+    ~GroupCommitter();
+    GroupCommitter(const GroupCommitter &) = delete;
+    GroupCommitter &operator=(const GroupCommitter &) = delete;
+
+    // The commit job is posted to its completion queue once the upload is
+    // in place
+    void submit(DiskJob *job);
+
+   private:
+    const FileSystem &filesystem;
+    const std::vector<unsigned int> cpus;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<DiskJob *> pending;
+    bool running = true;
+    std::thread thread;
+
+    void run();
+    void commit(std::vector<DiskJob *> &group);
+};
+}  // namespace tftp
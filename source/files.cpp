@@ -1,29 +1,87 @@
 #include "files.hpp"
 
-#include <algorithm>
+#include <memory.h>
+
+#include <atomic>
+#include <filesystem>
 
 namespace tftp {
 bool BufferedFileWorker::open() {
-    // Check if the file exists
-    if (!this->filesystem.exists(this->filename)) {
-        // Create the file
-        this->filesystem.create(this->filename);
+    // Every upload gets a file of its own, so two uploads of the same file
+    // do not mix
+    static std::atomic<uint32_t> next_upload{0};
+
+    std::filesystem::path path(this->filename);
+    std::string name = "." + path.filename().string() + ".upload-" +
+                       std::to_string(next_upload.fetch_add(1));
+    this->upload_name = (path.parent_path() / name).string();
+    this->committed = false;
+
+    // Create the file, which fails on read-only storage
+    if (!this->filesystem.create(this->upload_name)) {
+        this->upload_name.clear();
+        return false;
     }
 
     return true;
 }
 
 bool BufferedFileWorker::close() {
-    if (this->buffer_position > 0) {
-        // Write the buffer to the file
-        this->filesystem.append(this->filename, this->buffer.data(),
-                                this->buffer_position);
+    bool result = this->flush();
+
+    if (this->read_handle >= 0) this->filesystem.closeFile(this->read_handle);
+    this->read_handle = -1;
+    this->read_opened = false;
+
+    // Give the buffer back for the next session
+    this->buffers.release(this->buffer);
+    this->buffer = nullptr;
+
+    return result;
+}
 
-        // Clear the buffer
-        this->buffer_position = 0;
+bool BufferedFileWorker::commit() {
+    if (!this->close()) return false;
+    if (this->upload_name.empty()) return true;
+
+    // The data has to be on disk before the name is, or a crash could
+    // leave the file cut short
+    if (!this->filesystem.sync({this->upload_name}) ||
+        !this->filesystem.rename(this->upload_name, this->filename)) {
+        return false;
     }
+    this->committed = true;
 
-    return true;
+    return this->filesystem.sync({this->filename});
+}
+
+void BufferedFileWorker::discard() {
+    if (this->upload_name.empty() || this->committed) {
+        this->close();
+        return;
+    }
+
+    // An unfinished upload is thrown away, leaving the file as it was
+    this->buffers.release(this->buffer);
+    this->buffer = nullptr;
+    this->buffer_position = 0;
+    this->filesystem.remove(this->upload_name);
+}
+
+bool BufferedFileWorker::flush() {
+    if (this->buffer_position == 0) return true;
+
+    // Write the buffer to the file
+    ssize_t result = this->filesystem.append(this->getAppendName(),
+                                             this->buffer,
+                                             this->buffer_position);
+
+    ssize_t size = this->buffer_position;
+
+    // Clear the buffer
+    this->buffer_position = 0;
+
+    return result == size;
 }
 
 bool BufferedFileWorker::exists() {
@@ -34,8 +92,21 @@ bool BufferedFileWorker::remove() {
     return this->filesystem.remove(this->filename);
 }
 
+ssize_t BufferedFileWorker::size() {
+    return this->filesystem.size(this->filename);
+}
+
 ssize_t BufferedFileWorker::read(char *dst, ssize_t size, ssize_t offset) {
-    // Read from the file
+    // The file is opened once, so a download that is running when an upload
+    // replaces the file finishes with the old one
+    if (!this->read_opened) {
+        this->read_handle = this->filesystem.openFile(this->filename);
+        this->read_opened = true;
+    }
+
+    if (this->read_handle >= 0) {
+        return this->filesystem.readFile(this->read_handle, dst, size, offset);
+    }
     return this->filesystem.read(this->filename, dst, size, offset);
 }
 
@@ -44,21 +115,27 @@ ssize_t BufferedFileWorker::write(char *src, ssize_t size, ssize_t offset) {
 }
 
 ssize_t BufferedFileWorker::append(char *src, ssize_t size) {
-    // Check if the buffer is full
-    if (this->buffer_position + size > this->buffer.capacity()) {
-        // Write the buffer to the file
-        this->filesystem.append(this->filename, this->buffer.data(),
-                                this->buffer_position);
-
-        // Clear the buffer
-        this->buffer_position = 0;
-        this->buffer.clear();
+    const ssize_t buffer_size = this->buffers.getBufferSize();
+
+    // Check if the buffer is full. A block that could not be written fails
+    // the upload, or the file would be committed without it.
+    if (this->buffer_position + size > buffer_size && !this->flush()) {
+        return -1;
     }
 
+    // Blocks larger than the whole buffer are written directly
+    if (size > buffer_size) {
+        ssize_t result =
+            this->filesystem.append(this->getAppendName(), src, size);
+        return result == size ? size : -1;
+    }
+
+    if (this->buffer == nullptr) this->buffer = this->buffers.acquire();
+
     // Write to the buffer
-    std::copy(src, src + size, this->buffer.begin() + this->buffer_position);
+    memcpy(this->buffer + this->buffer_position, src, size);
     this->buffer_position += size;
 
     return size;
 }
-}  // namespace tftp
\ No newline at end of file
+}  // namespace tftp
\ No newline at end of file
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <functional>
 #include <string>
-#include <vector>
 
 #include "common.hpp"
 #include "filesystem.hpp"
+#include "pool.hpp"
 
 namespace tftp {
+// Returned by reads of bytes that are still on their way, such as those of
+// a file being fetched. The session reads the block again a little later.
+constexpr inline ssize_t FILE_NOT_READY = -2;
+
 enum class FileWorkerMode {
     NetAscii = 0,
     Octet = 1,
@@ -28,6 +33,21 @@ class FileWorker {
     virtual ssize_t write(char *src, ssize_t size, ssize_t offset = 0) = 0;
     virtual ssize_t append(char *src, ssize_t size) = 0;
 
+    // Bytes a read from the start gives, -1 if unknown
+    virtual ssize_t size() { return -1; }
+
+    // An upload may go to a temporary file, which commit() makes durable
+    // and moves over the file. A worker destroyed before that throws the
+    // upload away.
+    virtual bool commit() { return this->close(); }
+
+    // The temporary file, empty if there is none. A group commit syncs and
+    // moves it itself, then marks the upload as committed.
+    virtual std::string getUploadName() const { return std::string(); }
+    virtual void setCommitted() {}
+
+    const std::string &getFilename() const { return this->filename; }
+
    protected:
     const std::string filename;
     const FileWorkerMode mode;
@@ -35,25 +55,51 @@ class FileWorker {
 
 class FileWorkerFactory {
    public:
+    virtual ~FileWorkerFactory() = default;
+
     virtual FileWorker *create(std::string filename, FileWorkerMode mode) = 0;
+
+    // Takes back a worker made by create()
+    virtual void destroy(FileWorker *file_worker) { delete file_worker; }
+
+    // Factories whose reads return FILE_NOT_READY call wake, from any
+    // thread, once more of such a file has come in. An empty function stops
+    // the calls.
+    virtual void setReadyWake(std::function<void()>) {}
 };
 
-// Buffered file worker
+// Buffered file worker. Appends are collected in a buffer from the pool,
+// which is only taken once the first append happens. Uploads are written to
+// a hidden file next to the file, so readers see the old file until the new
+// one is committed whole.
 class BufferedFileWorker : public FileWorker {
    private:
-    std::vector<char> buffer;
+    BufferPool &buffers;
+    char *buffer = nullptr;
     ssize_t buffer_position = 0;
 
     const FileSystem &filesystem;
 
+    // Reads go through the file kept open, where the storage can
+    int read_handle = -1;
+    bool read_opened = false;
+
+    std::string upload_name;
+    bool committed = false;
+
+    bool flush();
+    void discard();
+
+    // Appends go to the upload, if there is one
+    const std::string &getAppendName() const {
+        return this->upload_name.empty() ? this->filename : this->upload_name;
+    }
+
    public:
     BufferedFileWorker(const std::string filename, const FileWorkerMode mode,
-                       const unsigned int buffer_size,
-                       const FileSystem &filesystem)
-        : FileWorker(filename, mode), filesystem(filesystem) {
-        this->buffer.reserve(buffer_size);
-    }
-    virtual ~BufferedFileWorker() { this->close(); }
+                       BufferPool &buffers, const FileSystem &filesystem)
+        : FileWorker(filename, mode), buffers(buffers), filesystem(filesystem) {}
+    virtual ~BufferedFileWorker() { this->discard(); }
 
     virtual bool open();
     virtual bool close();
@@ -63,22 +109,33 @@ class BufferedFileWorker : public FileWorker {
     virtual ssize_t read(char *dst, ssize_t size, ssize_t offset = 0);
     virtual ssize_t write(char *src, ssize_t size, ssize_t offset = 0);
     virtual ssize_t append(char *src, ssize_t size);
+    virtual ssize_t size();
+
+    virtual bool commit();
+    virtual std::string getUploadName() const { return this->upload_name; }
+    virtual void setCommitted() { this->committed = true; }
 };
 
+// Workers and their buffers come from pools and are reused across sessions
 class BufferedFileWorkerFactory : public FileWorkerFactory {
    private:
-    const unsigned int buffer_size;
+    BufferPool buffers;
+    ObjectPool<BufferedFileWorker> workers;
     const FileSystem &filesystem;
 
    public:
     BufferedFileWorkerFactory(const unsigned int buffer_size,
                               const FileSystem &filesystem)
-        : buffer_size(buffer_size), filesystem(filesystem) {}
+        : buffers(buffer_size), filesystem(filesystem) {}
     ~BufferedFileWorkerFactory() {}
 
     virtual FileWorker *create(std::string filename, FileWorkerMode mode) {
-        return new BufferedFileWorker(filename, mode, this->buffer_size,
-                                      this->filesystem);
+        return this->workers.create(filename, mode, this->buffers,
+                                    this->filesystem);
+    }
+
+    virtual void destroy(FileWorker *file_worker) {
+        this->workers.destroy(static_cast<BufferedFileWorker *>(file_worker));
     }
 };
-}  // namespace tftp
\ No newline at end of file
+}  // namespace tftp
\ No newline at end of file
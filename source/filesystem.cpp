@@ -1,28 +1,54 @@
 #include "filesystem.hpp"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <memory.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <filesystem>
 #include <fstream>
-
-#include "utils.hpp"
+#include <set>
 
 namespace tftp {
-bool FileSystem::exists(const std::string filename) const {
+#ifndef _WIN32
+namespace {
+bool syncPath(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    bool result = fsync(fd) == 0;
+    close(fd);
+    return result;
+}
+}  // namespace
+#endif
+
+bool DiskFileSystem::exists(const std::string &filename) const {
     return std::filesystem::exists(filename);
 }
 
-bool FileSystem::create(const std::string filename) const {
+bool DiskFileSystem::create(const std::string &filename) const {
     std::ofstream file(filename);
     file.close();
     return file.good();
 }
 
-bool FileSystem::remove(const std::string filename) const {
+bool DiskFileSystem::remove(const std::string &filename) const {
     return std::filesystem::remove(filename);
 }
 
-ssize_t FileSystem::read(const std::string filename, char *buffer, ssize_t size,
+ssize_t DiskFileSystem::size(const std::string &filename) const {
+    std::error_code error;
+    auto size = std::filesystem::file_size(filename, error);
+    return error ? -1 : static_cast<ssize_t>(size);
+}
+
+ssize_t DiskFileSystem::read(const std::string &filename, char *buffer, ssize_t size,
                          ssize_t offset) const {
     std::ifstream file(filename, std::ios::binary);
     if (!file) return -1;
@@ -33,7 +59,29 @@ ssize_t FileSystem::read(const std::string filename, char *buffer, ssize_t size,
     return file.gcount();
 }
 
-ssize_t FileSystem::write(const std::string filename, char *buffer,
+#ifndef _WIN32
+int DiskFileSystem::openFile(const std::string &filename) const {
+    return open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+ssize_t DiskFileSystem::readFile(int handle, char *buffer, ssize_t size,
+                                 ssize_t offset) const {
+    ssize_t total = 0;
+    while (total < size) {
+        ssize_t result = pread(handle, buffer + total, size - total,
+                               offset + total);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) return -1;
+        if (result == 0) break;
+        total += result;
+    }
+    return total;
+}
+
+void DiskFileSystem::closeFile(int handle) const { close(handle); }
+#endif
+
+ssize_t DiskFileSystem::write(const std::string &filename, char *buffer,
                           ssize_t size, ssize_t offset) const {
     std::ofstream file(filename, std::ios::binary | std::ios::out);
     if (!file) return -1;
@@ -41,17 +89,66 @@ ssize_t FileSystem::write(const std::string filename, char *buffer,
     file.seekp(offset);
     file.write(buffer, size);
     file.close();
-    return file.good();
+    return file.good() ? size : -1;
 }
 
-ssize_t FileSystem::append(const std::string filename, char *buffer,
+ssize_t DiskFileSystem::append(const std::string &filename, char *buffer,
                            ssize_t size) const {
-    printBuffer(buffer, size);
     std::ofstream file(filename, std::ios::binary | std::ios::app);
     if (!file) return -1;
 
     file.write(buffer, size);
     file.close();
-    return file.good();
+    return file.good() ? size : -1;
+}
+
+bool DiskFileSystem::rename(const std::string &from,
+                            const std::string &to) const {
+    std::error_code error;
+    std::filesystem::rename(from, to, error);
+    return !error;
+}
+
+bool DiskFileSystem::sync(const std::vector<std::string> &filenames) const {
+#ifndef _WIN32
+#ifdef __linux__
+    // A syncfs() writes back every file of the filesystem and commits its
+    // journal once, however many files there are
+    if (filenames.size() > 1) {
+        std::vector<dev_t> devices;
+        for (const std::string &filename : filenames) {
+            int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+
+            struct stat status;
+            bool result = fstat(fd, &status) == 0;
+            if (result && std::find(devices.begin(), devices.end(),
+                                    status.st_dev) == devices.end()) {
+                result = syncfs(fd) == 0;
+                devices.push_back(status.st_dev);
+            }
+            close(fd);
+
+            if (!result) return false;
+        }
+        return true;
+    }
+#endif
+
+    // Every file, then every directory once
+    std::set<std::string> directories;
+    for (const std::string &filename : filenames) {
+        if (!syncPath(filename)) return false;
+
+        std::string directory =
+            std::filesystem::path(filename).parent_path().string();
+        directories.insert(directory.empty() ? "." : directory);
+    }
+
+    for (const std::string &directory : directories) {
+        if (!syncPath(directory)) return false;
+    }
+#endif
+    return true;
 }
 }  // namespace tftp
\ No newline at end of file
@@ -1,26 +1,76 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "common.hpp"
 
 namespace tftp {
+// Where files are stored, by the names clients ask for
 class FileSystem {
    public:
-    FileSystem() = default;
-    ~FileSystem() = default;
+    virtual ~FileSystem() = default;
 
-    bool exists(const std::string filename) const;
-    bool create(const std::string filename) const;
-    bool remove(const std::string filename) const;
+    virtual bool exists(const std::string &filename) const = 0;
+    virtual bool create(const std::string &filename) const = 0;
+    virtual bool remove(const std::string &filename) const = 0;
 
-    ssize_t read(const std::string filename, char *buffer, ssize_t size,
-                 ssize_t offset = 0) const;
+    // Size in bytes, -1 if the file does not exist
+    virtual ssize_t size(const std::string &filename) const = 0;
 
-    ssize_t write(const std::string filename, char *buffer, ssize_t size,
-                  ssize_t offset = 0) const;
+    virtual ssize_t read(const std::string &filename, char *buffer,
+                         ssize_t size, ssize_t offset = 0) const = 0;
 
-    ssize_t append(const std::string filename, char *buffer,
-                   ssize_t size) const;
+    // Keeps the file open, so reads through the handle see it as it was
+    // even after it is replaced. -1 where reads only go by name.
+    virtual int openFile(const std::string &) const { return -1; }
+    virtual ssize_t readFile(int, char *, ssize_t, ssize_t) const {
+        return -1;
+    }
+    virtual void closeFile(int) const {}
+
+    // Both return the bytes written, -1 on failure
+    virtual ssize_t write(const std::string &filename, char *buffer,
+                          ssize_t size, ssize_t offset = 0) const = 0;
+    virtual ssize_t append(const std::string &filename, char *buffer,
+                           ssize_t size) const = 0;
+
+    // Replaces the file named to, if any
+    virtual bool rename(const std::string &from,
+                        const std::string &to) const = 0;
+
+    // Makes the files durable, along with the directory entries naming them
+    virtual bool sync(const std::vector<std::string> &filenames) const = 0;
+};
+
+// Files on disk, relative to the working directory
+class DiskFileSystem : public FileSystem {
+   public:
+    bool exists(const std::string &filename) const override;
+    bool create(const std::string &filename) const override;
+    bool remove(const std::string &filename) const override;
+    ssize_t size(const std::string &filename) const override;
+
+    ssize_t read(const std::string &filename, char *buffer, ssize_t size,
+                 ssize_t offset) const override;
+
+#ifndef _WIN32
+    int openFile(const std::string &filename) const override;
+    ssize_t readFile(int handle, char *buffer, ssize_t size,
+                     ssize_t offset) const override;
+    void closeFile(int handle) const override;
+#endif
+
+    ssize_t write(const std::string &filename, char *buffer, ssize_t size,
+                  ssize_t offset) const override;
+
+    ssize_t append(const std::string &filename, char *buffer,
+                   ssize_t size) const override;
+
+    bool rename(const std::string &from, const std::string &to) const override;
+
+    // Several files are synced with one syncfs() per filesystem on Linux,
+    // rather than an fsync() of every file and directory
+    bool sync(const std::vector<std::string> &filenames) const override;
 };
 }  // namespace tftp
\ No newline at end of file
@@ -0,0 +1,285 @@
+#include "image_store.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace tftp {
+namespace {
+// Pack file layout, little endian:
+//   "TFTPPACK", u32 version, u32 image count
+//   per image: u64 offset, u64 size, u16 name length, name
+//   image data, each at a page aligned offset
+constexpr char PACK_MAGIC[8] = {'T', 'F', 'T', 'P', 'P', 'A', 'C', 'K'};
+constexpr uint32_t PACK_VERSION = 1;
+constexpr size_t PACK_HEADER_SIZE = 16;
+constexpr size_t PACK_ALIGNMENT = 4096;
+
+// Images in memory start on their own cache line
+constexpr size_t IMAGE_ALIGNMENT = 64;
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+size_t alignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+template <typename T>
+void putLittleEndian(std::string &out, T value) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+template <typename T>
+T getLittleEndian(const char *src) {
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        value |= static_cast<T>(static_cast<unsigned char>(src[i])) << (8 * i);
+    }
+    return value;
+}
+
+void readWholeFile(const std::string &path, char *dst, size_t size) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read(dst, size)) {
+        throw std::runtime_error("Failed to read image " + path);
+    }
+}
+}  // namespace
+
+std::vector<ManifestEntry> readManifest(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Failed to open manifest " + path);
+
+    std::vector<ManifestEntry> manifest;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string name, image_path;
+        if (!(fields >> name) || name[0] == '#') continue;
+
+        if (!(fields >> image_path)) image_path = name;
+        manifest.push_back({name, image_path});
+    }
+
+    return manifest;
+}
+
+// Images
+bool ImageFileSystem::exists(const std::string &filename) const {
+    return this->images.count(filename) > 0;
+}
+
+ssize_t ImageFileSystem::size(const std::string &filename) const {
+    auto image = this->images.find(filename);
+    return image == this->images.end() ? -1 : image->second.size;
+}
+
+ssize_t ImageFileSystem::read(const std::string &filename, char *buffer,
+                              ssize_t size, ssize_t offset) const {
+    auto image = this->images.find(filename);
+    if (image == this->images.end() || offset < 0) return -1;
+
+    const Image &found = image->second;
+    if (static_cast<size_t>(offset) >= found.size) return 0;
+
+    size = std::min<size_t>(size, found.size - offset);
+    memcpy(buffer, found.data + offset, size);
+    return size;
+}
+
+void ImageFileSystem::addImage(const std::string &name, const char *data,
+                               size_t size) {
+    if (!this->images.emplace(name, Image{data, size}).second) {
+        throw std::runtime_error("Duplicate image " + name);
+    }
+    this->total_size += size;
+}
+
+// Memory
+MemoryFileSystem::MemoryFileSystem(const std::vector<ManifestEntry> &manifest,
+                                   bool huge_pages) {
+    // Lay the images out back to back
+    std::vector<size_t> offsets;
+    for (const ManifestEntry &entry : manifest) {
+        offsets.push_back(this->region_size);
+        this->region_size +=
+            alignUp(std::filesystem::file_size(entry.path), IMAGE_ALIGNMENT);
+    }
+    if (this->region_size == 0) return;
+
+#ifndef _WIN32
+#ifdef MAP_HUGETLB
+    if (huge_pages) {
+        size_t size = alignUp(this->region_size, HUGE_PAGE_SIZE);
+        void *region = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            this->region = static_cast<char *>(region);
+            this->region_size = size;
+            this->huge_pages = true;
+        }
+    }
+#endif
+
+    // Without reserved huge pages, transparent ones may still do
+    if (this->region == nullptr) {
+        void *region = mmap(nullptr, this->region_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            throw std::runtime_error("Failed to allocate the image store");
+        }
+        this->region = static_cast<char *>(region);
+#ifdef MADV_HUGEPAGE
+        if (huge_pages) madvise(region, this->region_size, MADV_HUGEPAGE);
+#endif
+    }
+    this->mapped = true;
+#else
+    (void)huge_pages;
+    this->region = new char[this->region_size];
+#endif
+
+    try {
+        for (size_t i = 0; i < manifest.size(); ++i) {
+            size_t size = std::filesystem::file_size(manifest[i].path);
+            readWholeFile(manifest[i].path, this->region + offsets[i], size);
+            this->addImage(manifest[i].name, this->region + offsets[i], size);
+        }
+    } catch (...) {
+        this->release();
+        throw;
+    }
+}
+
+MemoryFileSystem::~MemoryFileSystem() { this->release(); }
+
+void MemoryFileSystem::release() {
+    if (this->region == nullptr) return;
+
+#ifndef _WIN32
+    if (this->mapped) munmap(this->region, this->region_size);
+#else
+    delete[] this->region;
+#endif
+    this->region = nullptr;
+}
+
+// Pack
+PackFileSystem::PackFileSystem(const std::string &path) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Failed to open pack " + path);
+
+    this->region_size = lseek(fd, 0, SEEK_END);
+    void *region = this->region_size > 0
+                       ? mmap(nullptr, this->region_size, PROT_READ,
+                              MAP_PRIVATE, fd, 0)
+                       : MAP_FAILED;
+    close(fd);
+
+    if (region == MAP_FAILED) {
+        throw std::runtime_error("Failed to map pack " + path);
+    }
+    this->region = static_cast<char *>(region);
+#else
+    this->region_size = std::filesystem::file_size(path);
+    this->region = new char[this->region_size];
+    readWholeFile(path, this->region, this->region_size);
+#endif
+
+    try {
+        const char *end = this->region + this->region_size;
+        if (this->region_size < PACK_HEADER_SIZE ||
+            memcmp(this->region, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 ||
+            getLittleEndian<uint32_t>(this->region + 8) != PACK_VERSION) {
+            throw std::runtime_error("Not a pack file: " + path);
+        }
+
+        uint32_t count = getLittleEndian<uint32_t>(this->region + 12);
+        const char *entry = this->region + PACK_HEADER_SIZE;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (end - entry < 18) throw std::runtime_error("Truncated pack");
+
+            uint64_t offset = getLittleEndian<uint64_t>(entry);
+            uint64_t size = getLittleEndian<uint64_t>(entry + 8);
+            uint16_t name_length = getLittleEndian<uint16_t>(entry + 16);
+            entry += 18;
+
+            if (static_cast<size_t>(end - entry) < name_length ||
+                offset > this->region_size ||
+                size > this->region_size - offset) {
+                throw std::runtime_error("Truncated pack");
+            }
+
+            this->addImage(std::string(entry, name_length),
+                           this->region + offset, size);
+            entry += name_length;
+        }
+    } catch (...) {
+        this->release();
+        throw;
+    }
+}
+
+PackFileSystem::~PackFileSystem() { this->release(); }
+
+void PackFileSystem::release() {
+    if (this->region == nullptr) return;
+
+#ifndef _WIN32
+    munmap(this->region, this->region_size);
+#else
+    delete[] this->region;
+#endif
+    this->region = nullptr;
+}
+
+void PackFileSystem::build(const std::vector<ManifestEntry> &manifest,
+                           const std::string &path) {
+    // The index comes first, so its size decides where the data starts
+    size_t index_size = PACK_HEADER_SIZE;
+    std::vector<uint64_t> sizes;
+    for (const ManifestEntry &entry : manifest) {
+        if (entry.name.size() > UINT16_MAX) {
+            throw std::runtime_error("Image name too long: " + entry.name);
+        }
+        index_size += 18 + entry.name.size();
+        sizes.push_back(std::filesystem::file_size(entry.path));
+    }
+
+    std::string index(PACK_MAGIC, sizeof(PACK_MAGIC));
+    putLittleEndian<uint32_t>(index, PACK_VERSION);
+    putLittleEndian<uint32_t>(index, manifest.size());
+
+    std::vector<uint64_t> offsets;
+    uint64_t offset = alignUp(index_size, PACK_ALIGNMENT);
+    for (size_t i = 0; i < manifest.size(); ++i) {
+        offsets.push_back(offset);
+        putLittleEndian<uint64_t>(index, offset);
+        putLittleEndian<uint64_t>(index, sizes[i]);
+        putLittleEndian<uint16_t>(index, manifest[i].name.size());
+        index += manifest[i].name;
+        offset = alignUp(offset + sizes[i], PACK_ALIGNMENT);
+    }
+
+    std::ofstream pack(path, std::ios::binary | std::ios::trunc);
+    pack.write(index.data(), index.size());
+
+    for (size_t i = 0; i < manifest.size(); ++i) {
+        std::ifstream image(manifest[i].path, std::ios::binary);
+        pack.seekp(offsets[i]);
+        if (sizes[i] > 0) pack << image.rdbuf();
+    }
+
+    if (!pack) throw std::runtime_error("Failed to write pack " + path);
+}
+}  // namespace tftp
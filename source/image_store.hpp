@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "filesystem.hpp"
+
+namespace tftp {
+// An image to serve: the name clients ask for, and the file it comes from
+struct ManifestEntry {
+    std::string name;
+    std::string path;
+};
+
+// Reads a manifest with one image per line, either "NAME PATH" or just
+// "PATH" to serve the file under its own path. Blank lines and lines
+// starting with # are skipped.
+std::vector<ManifestEntry> readManifest(const std::string &path);
+
+// A fixed set of images that are all in memory, so blocks are copied
+// straight out of RAM. Read only: creating, writing, renaming and
+// removing fail.
+class ImageFileSystem : public FileSystem {
+   public:
+    bool exists(const std::string &filename) const override;
+    bool create(const std::string &) const override { return false; }
+    bool remove(const std::string &) const override { return false; }
+    ssize_t size(const std::string &filename) const override;
+
+    ssize_t read(const std::string &filename, char *buffer, ssize_t size,
+                 ssize_t offset) const override;
+
+    ssize_t write(const std::string &, char *, ssize_t,
+                  ssize_t) const override {
+        return -1;
+    }
+
+    ssize_t append(const std::string &, char *, ssize_t) const override {
+        return -1;
+    }
+
+    bool rename(const std::string &, const std::string &) const override {
+        return false;
+    }
+
+    bool sync(const std::vector<std::string> &) const override {
+        return false;
+    }
+
+    size_t getImageCount() const { return this->images.size(); }
+    size_t getTotalSize() const { return this->total_size; }
+
+   protected:
+    struct Image {
+        const char *data;
+        size_t size;
+    };
+
+    std::unordered_map<std::string, Image> images;
+    size_t total_size = 0;
+
+    void addImage(const std::string &name, const char *data, size_t size);
+};
+
+// Images loaded at startup into one region of memory, which can be on
+// huge pages so serving them does not thrash the TLB
+class MemoryFileSystem : public ImageFileSystem {
+   public:
+    MemoryFileSystem(const std::vector<ManifestEntry> &manifest,
+                     bool huge_pages = false);
+    ~MemoryFileSystem();
+    MemoryFileSystem(const MemoryFileSystem &) = delete;
+    MemoryFileSystem &operator=(const MemoryFileSystem &) = delete;
+
+    // False if huge pages were asked for but none were free
+    bool isOnHugePages() const { return this->huge_pages; }
+
+   private:
+    char *region = nullptr;
+    size_t region_size = 0;
+    bool huge_pages = false;
+    bool mapped = false;
+
+    void release();
+};
+
+// Images in a read-only pack file, which is mapped rather than read. A
+// pack is built once from a manifest, with build().
+class PackFileSystem : public ImageFileSystem {
+   public:
+    PackFileSystem(const std::string &path);
+    ~PackFileSystem();
+    PackFileSystem(const PackFileSystem &) = delete;
+    PackFileSystem &operator=(const PackFileSystem &) = delete;
+
+    static void build(const std::vector<ManifestEntry> &manifest,
+                      const std::string &path);
+
+   private:
+    char *region = nullptr;
+    size_t region_size = 0;
+
+    void release();
+};
+}  // namespace tftp
@@ -0,0 +1,212 @@
+#include "logger.hpp"
+
+#include <chrono>
+#include <ctime>
+#include <inttypes.h>
+
+namespace tftp {
+constexpr auto LOGGER_IDLE_SLEEP = std::chrono::milliseconds(1);
+
+// Ring implementation
+LogRecord *LogRing::reserve() {
+    uint64_t head = this->head.load(std::memory_order_relaxed);
+    uint64_t tail = this->tail.load(std::memory_order_acquire);
+
+    // Drop the record if the consumer is too far behind
+    if (head - tail >= LOG_RING_CAPACITY) {
+        this->dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    return &this->records[head % LOG_RING_CAPACITY];
+}
+
+void LogRing::commit() {
+    this->head.store(this->head.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+}
+
+const LogRecord *LogRing::peek() {
+    uint64_t tail = this->tail.load(std::memory_order_relaxed);
+    uint64_t head = this->head.load(std::memory_order_acquire);
+
+    if (tail == head) return nullptr;
+    return &this->records[tail % LOG_RING_CAPACITY];
+}
+
+void LogRing::release() {
+    this->tail.store(this->tail.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+}
+
+// Logger implementation
+Logger &Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() {
+    this->running = true;
+    this->thread = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger() { this->stop(); }
+
+void Logger::setSink(FILE *sink) {
+    std::lock_guard<std::mutex> lock(this->sink_mutex);
+    this->sink = sink;
+}
+
+void Logger::stop() {
+    if (!this->running.exchange(false)) return;
+    if (this->thread.joinable()) this->thread.join();
+}
+
+LogRing &Logger::threadRing() {
+    // Rings are shared with the logger, so records written right before a
+    // thread exits are still formatted.
+    thread_local std::shared_ptr<LogRing> ring;
+
+    if (!ring) {
+        ring = std::make_shared<LogRing>();
+
+        std::lock_guard<std::mutex> lock(this->rings_mutex);
+        this->rings.push_back(ring);
+    }
+
+    return *ring;
+}
+
+void Logger::run() {
+    while (this->running.load()) {
+        if (!this->drain()) {
+            std::this_thread::sleep_for(LOGGER_IDLE_SLEEP);
+        }
+    }
+
+    // Write whatever was queued before stopping
+    while (this->drain()) {
+    }
+}
+
+bool Logger::drain() {
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<std::mutex> lock(this->rings_mutex);
+        rings = this->rings;
+    }
+
+    std::string out;
+    for (auto &ring : rings) {
+        const LogRecord *record;
+        while ((record = ring->peek()) != nullptr) {
+            this->format(*record, out);
+            ring->release();
+        }
+
+        uint64_t dropped = ring->takeDropped();
+        if (dropped > 0) {
+            out += "[logger] dropped " + std::to_string(dropped) +
+                   " records\n";
+        }
+    }
+    rings.clear();
+
+    // Rings only the list holds belong to threads that exited, and go once
+    // they are empty
+    {
+        std::lock_guard<std::mutex> lock(this->rings_mutex);
+        std::erase_if(this->rings, [](const std::shared_ptr<LogRing> &ring) {
+            if (ring.use_count() > 1) return false;
+
+            // See the records the thread wrote before it let go
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return ring->peek() == nullptr;
+        });
+    }
+
+    if (out.empty()) return false;
+
+    std::lock_guard<std::mutex> lock(this->sink_mutex);
+    fwrite(out.data(), 1, out.size(), this->sink);
+    fflush(this->sink);
+    return true;
+}
+
+void Logger::format(const LogRecord &record, std::string &out) const {
+    static const char *level_names[] = {"TRACE", "DEBUG", "INFO",
+                                        "WARN",  "ERROR", "OFF"};
+
+    // Write timestamp and level
+    char prefix[64];
+    time_t seconds = record.timestamp_ns / 1000000000;
+    struct tm time_info;
+#ifdef _WIN32
+    localtime_s(&time_info, &seconds);
+#else
+    localtime_r(&seconds, &time_info);
+#endif
+    size_t prefix_size = strftime(prefix, sizeof(prefix), "%H:%M:%S", &time_info);
+    snprintf(prefix + prefix_size, sizeof(prefix) - prefix_size, ".%06u %-5s ",
+             static_cast<unsigned int>(record.timestamp_ns % 1000000000 / 1000),
+             level_names[static_cast<int>(record.level)]);
+    out += prefix;
+
+    // Replace each placeholder with its argument
+    unsigned int argument = 0;
+    for (const char *c = record.format; *c; ++c) {
+        if (c[0] != '{' || c[1] != '}' || argument >= record.argument_count) {
+            out += *c;
+            continue;
+        }
+
+        const LogArgument &value = record.arguments[argument++];
+        char buffer[32];
+
+        switch (value.kind) {
+            case LogArgument::Signed:
+                snprintf(buffer, sizeof(buffer), "%" PRId64, value.i);
+                out += buffer;
+                break;
+            case LogArgument::Unsigned:
+                snprintf(buffer, sizeof(buffer), "%" PRIu64, value.u);
+                out += buffer;
+                break;
+            case LogArgument::Double:
+                snprintf(buffer, sizeof(buffer), "%g", value.d);
+                out += buffer;
+                break;
+            case LogArgument::String:
+                out.append(record.text + value.s.offset, value.s.length);
+                break;
+        }
+
+        ++c;
+    }
+
+    out += '\n';
+}
+
+uint64_t Logger::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+void Logger::encode(LogRecord &record, const char *value) {
+    LogArgument &argument = record.arguments[record.argument_count++];
+    argument.kind = LogArgument::String;
+
+    if (value == nullptr) value = "(null)";
+
+    // Strings are truncated to whatever space is left in the record
+    size_t length = strlen(value);
+    size_t available = LOG_TEXT_SIZE - record.text_size;
+    if (length > available) length = available;
+
+    memcpy(record.text + record.text_size, value, length);
+    argument.s.offset = record.text_size;
+    argument.s.length = static_cast<uint16_t>(length);
+    record.text_size += length;
+}
+}  // namespace tftp
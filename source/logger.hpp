@@ -0,0 +1,195 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "common.hpp"
+
+// Compile-time log level. Statements below this level are removed entirely,
+// arguments included. 0 = trace, 1 = debug, 2 = info, 3 = warning, 4 = error,
+// 5 = off.
+#ifndef TFTP_LOG_LEVEL
+#define TFTP_LOG_LEVEL 2
+#endif
+
+namespace tftp {
+enum class LogLevel : int {
+    Trace = 0,
+    Debug = 1,
+    Info = 2,
+    Warning = 3,
+    Error = 4,
+    Off = 5,
+};
+
+constexpr inline unsigned int LOG_RING_CAPACITY = 1024;  // Records per thread
+constexpr inline unsigned int LOG_MAX_ARGUMENTS = 8;
+constexpr inline unsigned int LOG_TEXT_SIZE = 192;  // String argument storage
+
+// A single argument of a log record, stored in binary form
+struct LogArgument {
+    enum Kind : uint8_t {
+        Signed,
+        Unsigned,
+        Double,
+        String,
+    } kind;
+
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        struct {
+            uint16_t offset;
+            uint16_t length;
+        } s;
+    };
+};
+
+// A binary log record. Only the format pointer is stored, so formats must be
+// string literals. Formatting happens on the logger thread.
+struct LogRecord {
+    uint64_t timestamp_ns;
+    const char *format;
+    LogLevel level;
+    uint8_t argument_count;
+    uint16_t text_size;
+    LogArgument arguments[LOG_MAX_ARGUMENTS];
+    char text[LOG_TEXT_SIZE];
+};
+
+// Single producer, single consumer ring owned by one logging thread
+class LogRing {
+   public:
+    LogRing() = default;
+
+    // Producer side
+    LogRecord *reserve();
+    void commit();
+
+    // Consumer side
+    const LogRecord *peek();
+    void release();
+
+    uint64_t takeDropped() { return this->dropped.exchange(0); }
+
+   private:
+    std::array<LogRecord, LOG_RING_CAPACITY> records;
+
+    alignas(64) std::atomic<uint64_t> head{0};  // Written by the producer
+    alignas(64) std::atomic<uint64_t> tail{0};  // Written by the consumer
+    alignas(64) std::atomic<uint64_t> dropped{0};
+};
+
+class Logger {
+   public:
+    static Logger &instance();
+
+    void setLevel(LogLevel level) { this->level.store(level); }
+    LogLevel getLevel() const { return this->level.load(); }
+    bool isEnabled(LogLevel level) const {
+        return level >= this->level.load(std::memory_order_relaxed);
+    }
+
+    void setSink(FILE *sink);
+
+    // Formats and writes everything still queued, then stops the thread
+    void stop();
+
+    template <typename... Args>
+    void log(LogLevel level, const char *format, const Args &...args) {
+        static_assert(sizeof...(Args) <= LOG_MAX_ARGUMENTS,
+                      "Too many log arguments!");
+
+        if (!this->isEnabled(level)) return;
+
+        LogRing &ring = this->threadRing();
+        LogRecord *record = ring.reserve();
+        if (record == nullptr) return;
+
+        record->timestamp_ns = now();
+        record->format = format;
+        record->level = level;
+        record->argument_count = 0;
+        record->text_size = 0;
+        (encode(*record, args), ...);
+
+        ring.commit();
+    }
+
+   private:
+    Logger();
+    ~Logger();
+
+    std::atomic<LogLevel> level{static_cast<LogLevel>(TFTP_LOG_LEVEL)};
+
+    std::mutex rings_mutex;
+    std::vector<std::shared_ptr<LogRing>> rings;
+
+    std::mutex sink_mutex;
+    FILE *sink = stdout;
+
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    LogRing &threadRing();
+    void run();
+    bool drain();
+    void format(const LogRecord &record, std::string &out) const;
+
+    static uint64_t now();
+
+    // Argument encoders
+    static void encode(LogRecord &record, const char *value);
+    static void encode(LogRecord &record, const std::string &value) {
+        encode(record, value.c_str());
+    }
+    static void encode(LogRecord &record, double value) {
+        LogArgument &argument = record.arguments[record.argument_count++];
+        argument.kind = LogArgument::Double;
+        argument.d = value;
+    }
+
+    template <typename T,
+              typename = std::enable_if_t<std::is_integral_v<T> ||
+                                          std::is_enum_v<T>>>
+    static void encode(LogRecord &record, T value) {
+        LogArgument &argument = record.arguments[record.argument_count++];
+        if constexpr (std::is_enum_v<T>) {
+            argument.kind = LogArgument::Signed;
+            argument.i = static_cast<int64_t>(value);
+        } else if constexpr (std::is_signed_v<T>) {
+            argument.kind = LogArgument::Signed;
+            argument.i = value;
+        } else {
+            argument.kind = LogArgument::Unsigned;
+            argument.u = value;
+        }
+    }
+};
+}  // namespace tftp
+
+// Logging macros. The first argument is a string literal using "{}" as the
+// placeholder for each following argument.
+#define TFTP_LOG_AT(level, ...)                                          \
+    do {                                                                 \
+        if constexpr (static_cast<int>(level) >= TFTP_LOG_LEVEL) {       \
+            ::tftp::Logger::instance().log(level, __VA_ARGS__);          \
+        }                                                                \
+    } while (0)
+
+#define TFTP_LOG_TRACE(...) TFTP_LOG_AT(::tftp::LogLevel::Trace, __VA_ARGS__)
+#define TFTP_LOG_DEBUG(...) TFTP_LOG_AT(::tftp::LogLevel::Debug, __VA_ARGS__)
+#define TFTP_LOG_INFO(...) TFTP_LOG_AT(::tftp::LogLevel::Info, __VA_ARGS__)
+#define TFTP_LOG_WARNING(...) \
+    TFTP_LOG_AT(::tftp::LogLevel::Warning, __VA_ARGS__)
+#define TFTP_LOG_ERROR(...) TFTP_LOG_AT(::tftp::LogLevel::Error, __VA_ARGS__)
@@ -1,47 +1,708 @@
+#include <chrono>
+#include <csignal>
+#include <filesystem>
 #include <iostream>
+#include <memory>
 
+#include "affinity.hpp"
+#include "client.hpp"
+#include "compressed_files.hpp"
+#include "disk_io.hpp"
+#include "image_store.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "proxy.hpp"
 #include "server.hpp"
+#include "trace.hpp"
+#include "virtual_files.hpp"
+
+tftp::Server *running_server = nullptr;
+
+void handleSignal(int) {
+    if (running_server != nullptr) running_server->stop();
+}
 
 void usage(const char *name) {
-    std::cerr << "Usage: " << name << " [port]" << std::endl;
+    std::cerr << "Usage: " << name << " [options] [port]" << std::endl
+              << "       " << name
+              << " get|put [options] SERVER[:PORT] REMOTE[=LOCAL]..."
+              << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << "  --log-level LEVEL        trace, debug, info, warning, "
+                 "error or off"
+              << std::endl
+              << "  --metrics-file PATH      Write Prometheus metrics to PATH"
+              << std::endl
+              << "  --metrics-socket PATH    Serve Prometheus metrics on a "
+                 "Unix socket"
+              << std::endl
+              << "  --metrics-interval MS    Metrics file refresh interval"
+              << std::endl
+              << "  --phase-trace PATH       Write phase timings to PATH on "
+                 "exit (TFTP_PHASE_TIMING builds)"
+              << std::endl
+              << "  --io-threads N           Disk I/O threads, 0 to do file "
+                 "I/O on the network thread"
+              << std::endl
+              << "  --interface NAME         Run on the NUMA node of this "
+                 "network interface"
+              << std::endl
+              << "  --numa-node N            Run and allocate on this NUMA node"
+              << std::endl
+              << "  --cpus LIST              CPUs to run on, such as 2,4-7. "
+                 "The first is for the network thread."
+              << std::endl
+              << "  --busy-poll US           Spin on the socket, letting the "
+                 "kernel poll the NIC for US"
+              << std::endl
+              << "  --busy-poll-idle MS      Block again after MS without a "
+                 "packet, 0 never"
+              << std::endl
+              << "  --socket-buffer BYTES    Socket receive and send buffer "
+                 "size"
+              << std::endl
+              << "  --xdp NAME               Take DATA and ACK packets off "
+                 "this interface with AF_XDP"
+              << std::endl
+              << "  --xdp-queue N            Receive queue of the interface "
+                 "to take them from"
+              << std::endl
+              << "  --xdp-generic            Use generic XDP, for drivers "
+                 "without XDP support"
+              << std::endl
+              << "  --manifest PATH          Serve the images listed in PATH "
+                 "from memory"
+              << std::endl
+              << "  --huge-pages             Put those images on huge pages"
+              << std::endl
+              << "  --pack PATH              Serve the images of a pack file"
+              << std::endl
+              << "  --build-pack PATH        Pack the images of --manifest "
+                 "into PATH and exit"
+              << std::endl
+              << "  --image-cache MB         Memory for decompressed chunks of "
+                 ".gz and .zst images"
+              << std::endl
+              << "  --virtual PATTERN=FILE   Render files matching PATTERN "
+                 "from the template FILE"
+              << std::endl
+              << "  --clients PATH           Client table that fills the "
+                 "templates"
+              << std::endl
+              << "  --upstream IP:PORT       Fetch and cache files that are "
+                 "not stored locally"
+              << std::endl
+              << "  --multicast ADDR:PORT    Offer multicast downloads on "
+                 "groups from ADDR up"
+              << std::endl
+              << "  --multicast-interface IP Send multicast blocks out of "
+                 "this interface"
+              << std::endl
+              << "  --multicast-ttl N        Hops multicast blocks may take"
+              << std::endl
+              << "  --priority CLASS:RULE    Send class 0-3 (default 1, lower "
+                 "first) for a subnet or filename pattern"
+              << std::endl
+              << "  --quantum BYTES          Bytes a session may send per "
+                 "scheduling round"
+              << std::endl
+              << "  --rate-limit N           Requests per second per client "
+                 "address, 0 for no limit"
+              << std::endl
+              << "  --rate-burst N           Requests a client may send at "
+                 "once"
+              << std::endl
+              << "  --max-sessions N         Concurrent transfers" << std::endl
+              << "  --max-client-sessions N  Concurrent transfers per client "
+                 "address"
+              << std::endl
+              << "  --max-pending-io N       Sessions waiting for the disk"
+              << std::endl
+              << "  --admission-queue N      Requests over a limit that wait "
+                 "for a slot"
+              << std::endl
+              << "  --admission-timeout MS   How long they wait before they "
+                 "are turned away"
+              << std::endl;
+    exit(1);
+}
+
+tftp::LogLevel parseLogLevel(const std::string &name) {
+    static const char *names[] = {"trace", "debug", "info",
+                                  "warning", "error", "off"};
+
+    for (int i = 0; i <= static_cast<int>(tftp::LogLevel::Off); ++i) {
+        if (name == names[i]) return static_cast<tftp::LogLevel>(i);
+    }
+
+    throw std::invalid_argument("Invalid log level!");
+}
+
+void clientUsage(const char *name) {
+    std::cerr << "Usage: " << name
+              << " get|put [options] SERVER[:PORT] REMOTE[=LOCAL]..."
+              << std::endl
+              << std::endl
+              << "Downloads or uploads files, LOCAL being REMOTE unless "
+                 "given."
+              << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << "  --list PATH              Transfer the files listed in PATH "
+                 "as REMOTE [LOCAL]"
+              << std::endl
+              << "  --directory DIR          Where local files are (default .)"
+              << std::endl
+              << "  --parallel N             Transfers at a time (default 8)"
+              << std::endl
+              << "  --blksize N              Block size to ask for (default "
+                 "1428)"
+              << std::endl
+              << "  --windowsize N           Window size to ask for (default "
+                 "8)"
+              << std::endl
+              << "  --tsize                  Ask for the transfer size"
+              << std::endl
+              << "  --timeout MS             Retransmit after MS (default 1000)"
+              << std::endl
+              << "  --retries N              Retransmits before giving up "
+                 "(default 5)"
+              << std::endl
+              << "  --verify                 Check downloads against tsize and "
+                 "read uploads back"
+              << std::endl
+              << "  --log-level LEVEL        trace, debug, info, warning, "
+                 "error or off"
+              << std::endl;
     exit(1);
 }
 
+// Client mode, "get" or "put" followed by the server and the files
+int runClient(int argc, char **argv) {
+    bool put = std::string(argv[1]) == "put";
+
+    // Large blocks and windows for the servers that take them
+    tftp::TransferOptions options;
+    options.block_size = 1428;
+    options.window_size = 8;
+
+    std::string server;
+    std::vector<tftp::ManifestEntry> files;
+    std::string directory = ".";
+    unsigned int parallel = tftp::DEFAULT_CLIENT_PARALLEL;
+    bool verify = false;
+
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string argument = argv[i];
+            if (argument == "-h" || argument == "--help") clientUsage(argv[0]);
+
+            // The server, then REMOTE or REMOTE=LOCAL
+            if (argument.rfind("--", 0) != 0) {
+                if (server.empty()) {
+                    server = argument;
+                    continue;
+                }
+
+                size_t equals = argument.find('=');
+                if (equals == 0) clientUsage(argv[0]);
+                files.push_back({argument.substr(0, equals),
+                                 equals == std::string::npos
+                                     ? argument
+                                     : argument.substr(equals + 1)});
+                continue;
+            }
+
+            if (argument == "--tsize") {
+                options.transfer_size = true;
+                continue;
+            }
+
+            if (argument == "--verify") {
+                verify = true;
+                continue;
+            }
+
+            // Every other option takes a value
+            if (i + 1 >= argc) clientUsage(argv[0]);
+            std::string value = argv[++i];
+
+            if (argument == "--list") {
+                auto listed = tftp::readManifest(value);
+                files.insert(files.end(), listed.begin(), listed.end());
+            } else if (argument == "--directory") {
+                directory = value;
+            } else if (argument == "--parallel") {
+                parallel = std::stoul(value);
+            } else if (argument == "--blksize") {
+                unsigned long block_size = std::stoul(value);
+                if (block_size < 8 || block_size > MAX_BLOCK_SIZE) {
+                    clientUsage(argv[0]);
+                }
+                options.block_size = block_size;
+            } else if (argument == "--windowsize") {
+                unsigned long window_size = std::stoul(value);
+                if (window_size < 1 || window_size > UINT16_MAX) {
+                    clientUsage(argv[0]);
+                }
+                options.window_size = window_size;
+            } else if (argument == "--timeout") {
+                options.timeout_ms = std::stoul(value);
+            } else if (argument == "--retries") {
+                options.retries = std::stoul(value);
+            } else if (argument == "--log-level") {
+                tftp::Logger::instance().setLevel(parseLogLevel(value));
+            } else {
+                clientUsage(argv[0]);
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Invalid argument!" << std::endl;
+        clientUsage(argv[0]);
+    }
+
+    if (server.empty() || files.empty()) clientUsage(argv[0]);
+
+    // SERVER or SERVER:PORT
+    unsigned long port = 69;
+    size_t colon = server.find(':');
+    if (colon != std::string::npos) {
+        try {
+            port = std::stoul(server.substr(colon + 1));
+        } catch (const std::exception &e) {
+            clientUsage(argv[0]);
+        }
+        if (port == 0 || port > UINT16_MAX) clientUsage(argv[0]);
+        server = server.substr(0, colon);
+    }
+
+    // Local paths are under the directory, absolute ones aside
+    std::vector<tftp::ClientTransfer> transfers;
+    for (const tftp::ManifestEntry &file : files) {
+        tftp::ClientTransfer transfer;
+        transfer.mode = put ? tftp::TransferClient::Mode::Write
+                            : tftp::TransferClient::Mode::Read;
+        transfer.remote = file.name;
+
+        std::string local = file.path;
+        if (local == file.name) local.erase(0, local.find_first_not_of('/'));
+        transfer.local = (std::filesystem::path(directory) / local).string();
+        transfers.push_back(transfer);
+    }
+
+    try {
+        tftp::Client client(server, port, options);
+        client.setParallel(parallel);
+        client.setVerify(verify);
+        client.setCallback([](const tftp::ClientTransfer &transfer,
+                              const tftp::ClientResult &result) {
+            if (result.success) {
+                std::cout << transfer.remote << ": " << result.bytes
+                          << " bytes in " << result.elapsed_us / 1000 << " ms"
+                          << std::endl;
+            } else {
+                std::cerr << transfer.remote << ": " << result.error
+                          << std::endl;
+            }
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<tftp::ClientResult> results = client.run(transfers);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+        size_t succeeded = 0;
+        uint64_t bytes = 0;
+        for (const tftp::ClientResult &result : results) {
+            if (!result.success) continue;
+            ++succeeded;
+            bytes += result.bytes;
+        }
+
+        std::cout << succeeded << " of " << results.size() << " files, "
+                  << bytes << " bytes in " << seconds << " s ("
+                  << bytes / seconds / 1e6 << " MB/s)" << std::endl;
+        return succeeded == results.size() ? 0 : 1;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
 int main(int argc, char **argv) {
+    if (argc > 1 && (std::string(argv[1]) == "get" ||
+                     std::string(argv[1]) == "put")) {
+        return runClient(argc, argv);
+    }
+
     // Default port
     unsigned int port = 69;
 
-    // Check if the user wants to see the help message
-    if (argc > 2 || (argc == 2 && (std::string(argv[1]) == "-h" ||
-                                   std::string(argv[1]) == "--help"))) {
-        usage(argv[0]);
-    }
+    // Metrics
+    std::string metrics_file;
+    std::string metrics_socket;
+    unsigned int metrics_interval_ms = 1000;
+
+    // Tracing
+    std::string phase_trace;
+
+    // Send scheduling
+    tftp::PriorityRules priority_rules;
+    uint32_t quantum = tftp::DEFAULT_SCHEDULER_QUANTUM;
+
+    // Admission control
+    tftp::AdmissionLimits limits;
+    unsigned int rate_limit = 0;
+    unsigned int rate_burst = 10;
 
-    // Parse the port number
+    // Disk I/O. Windows has no descriptor to wake the network thread with.
+#ifdef _WIN32
+    unsigned int io_threads = 0;
+#else
+    unsigned int io_threads = 4;
+#endif
+
+    // Storage, the working directory unless images are given
+    std::string manifest;
+    std::string pack;
+    std::string build_pack;
+    bool huge_pages = false;
+    size_t image_cache_size = tftp::DEFAULT_CHUNK_CACHE_SIZE;
+
+    // Generated files, as pattern and template
+    std::vector<std::pair<std::string, std::string>> virtual_files;
+    std::string clients;
+
+    // Caching proxy
+    std::string upstream_address;
+    unsigned int upstream_port = 0;
+
+    // Multicast
+    std::string multicast_address;
+    unsigned int multicast_port = 0;
+    std::string multicast_interface;
+    unsigned int multicast_ttl = 1;
+
+    // CPU and NUMA placement
+    std::string interface;
+    int numa_node = -1;
+    std::vector<unsigned int> cpus;
+
+    // Receive path
+    int busy_poll_us = -1;  // -1 to sleep in poll()
+    unsigned int busy_poll_idle_ms = tftp::DEFAULT_BUSY_POLL_IDLE_MS;
+    int socket_buffer = 0;  // 0 for the system default
+    std::string xdp_interface;
+    unsigned int xdp_queue = 0;
+    bool xdp_generic = false;
+
+    // Parse the arguments
     try {
-        if (argc == 2) port = std::stoi(argv[1]);
+        for (int i = 1; i < argc; ++i) {
+            std::string argument = argv[i];
+
+            // Check if the user wants to see the help message
+            if (argument == "-h" || argument == "--help") usage(argv[0]);
+
+            // Positional port number
+            if (argument.rfind("--", 0) != 0) {
+                port = std::stoi(argument);
+                continue;
+            }
+
+            if (argument == "--huge-pages") {
+                huge_pages = true;
+                continue;
+            }
+
+            if (argument == "--xdp-generic") {
+                xdp_generic = true;
+                continue;
+            }
+
+            // Every other option takes a value
+            if (i + 1 >= argc) usage(argv[0]);
+            std::string value = argv[++i];
+
+            if (argument == "--log-level") {
+                tftp::Logger::instance().setLevel(parseLogLevel(value));
+            } else if (argument == "--metrics-file") {
+                metrics_file = value;
+            } else if (argument == "--metrics-socket") {
+                metrics_socket = value;
+            } else if (argument == "--metrics-interval") {
+                metrics_interval_ms = std::stoul(value);
+            } else if (argument == "--phase-trace") {
+                phase_trace = value;
+            } else if (argument == "--io-threads") {
+                io_threads = std::stoul(value);
+            } else if (argument == "--manifest") {
+                manifest = value;
+            } else if (argument == "--pack") {
+                pack = value;
+            } else if (argument == "--build-pack") {
+                build_pack = value;
+            } else if (argument == "--image-cache") {
+                image_cache_size = std::stoul(value) * 1024 * 1024;
+            } else if (argument == "--interface") {
+                interface = value;
+            } else if (argument == "--numa-node") {
+                numa_node = std::stoi(value);
+                if (numa_node < 0) usage(argv[0]);
+            } else if (argument == "--cpus") {
+                cpus = tftp::parseCpuList(value);
+                if (cpus.empty()) usage(argv[0]);
+            } else if (argument == "--busy-poll") {
+                busy_poll_us = std::stoi(value);
+                if (busy_poll_us < 0) usage(argv[0]);
+            } else if (argument == "--busy-poll-idle") {
+                busy_poll_idle_ms = std::stoul(value);
+            } else if (argument == "--socket-buffer") {
+                socket_buffer = std::stoi(value);
+                if (socket_buffer <= 0) usage(argv[0]);
+            } else if (argument == "--xdp") {
+                xdp_interface = value;
+            } else if (argument == "--xdp-queue") {
+                xdp_queue = std::stoul(value);
+            } else if (argument == "--virtual") {
+                size_t equals = value.find('=');
+                if (equals == std::string::npos || equals == 0) usage(argv[0]);
+                virtual_files.push_back(
+                    {value.substr(0, equals), value.substr(equals + 1)});
+            } else if (argument == "--clients") {
+                clients = value;
+            } else if (argument == "--upstream") {
+                size_t colon = value.find(':');
+                if (colon == std::string::npos) usage(argv[0]);
+                upstream_address = value.substr(0, colon);
+                upstream_port = std::stoul(value.substr(colon + 1));
+                if (upstream_port == 0 || upstream_port > UINT16_MAX) {
+                    usage(argv[0]);
+                }
+            } else if (argument == "--multicast") {
+                size_t colon = value.find(':');
+                if (colon == std::string::npos) usage(argv[0]);
+                multicast_address = value.substr(0, colon);
+                multicast_port = std::stoul(value.substr(colon + 1));
+                if (multicast_port == 0 || multicast_port > UINT16_MAX) {
+                    usage(argv[0]);
+                }
+            } else if (argument == "--multicast-interface") {
+                multicast_interface = value;
+            } else if (argument == "--multicast-ttl") {
+                multicast_ttl = std::stoul(value);
+                if (multicast_ttl > 255) usage(argv[0]);
+            } else if (argument == "--priority") {
+                priority_rules.add(value);
+            } else if (argument == "--rate-limit") {
+                rate_limit = std::stoul(value);
+            } else if (argument == "--rate-burst") {
+                rate_burst = std::stoul(value);
+            } else if (argument == "--max-sessions") {
+                limits.max_sessions = std::stoul(value);
+            } else if (argument == "--max-client-sessions") {
+                limits.max_client_sessions = std::stoul(value);
+            } else if (argument == "--max-pending-io") {
+                limits.max_pending_io = std::stoul(value);
+            } else if (argument == "--admission-queue") {
+                limits.queue_length = std::stoul(value);
+            } else if (argument == "--admission-timeout") {
+                limits.queue_timeout_ms = std::stoul(value);
+            } else if (argument == "--quantum") {
+                quantum = std::stoul(value);
+                if (quantum == 0) usage(argv[0]);
+            } else {
+                usage(argv[0]);
+            }
+        }
     } catch (const std::exception &e) {
-        std::cerr << "Invalid port number!" << std::endl;
+        std::cerr << "Invalid argument!" << std::endl;
+        usage(argv[0]);
+    }
+
+    // Cached files are stored in the working directory
+    if (!upstream_address.empty() && (!manifest.empty() || !pack.empty())) {
         usage(argv[0]);
     }
 
-    // Create a filesystem
-    tftp::FileSystem filesystem;
+    // Move onto the NIC's node before anything is allocated, so the tables
+    // and buffers built below are node-local. The network thread is this
+    // one, and threads started later inherit its placement.
+    tftp::CpuPlacement placement =
+        tftp::CpuPlacement::resolve(interface, numa_node, cpus);
+    if (!interface.empty() && placement.numa_node < 0) {
+        TFTP_LOG_WARNING("NUMA node of {} is unknown", interface);
+    }
+    if (!tftp::pinCurrentThread(placement.network_cpus) ||
+        !tftp::preferNumaNode(placement.numa_node)) {
+        TFTP_LOG_WARNING("Failed to apply the CPU placement");
+    } else if (!placement.isEmpty()) {
+        TFTP_LOG_INFO("Network thread on {} CPUs, memory on NUMA node {}",
+                      placement.network_cpus.size(), placement.numa_node);
+    }
+
+    // Create a filesystem. Images are loaded after the placement above, so
+    // they are on the NIC's node too.
+    std::unique_ptr<tftp::FileSystem> filesystem;
+    try {
+        if (!build_pack.empty()) {
+            if (manifest.empty()) usage(argv[0]);
+            tftp::PackFileSystem::build(tftp::readManifest(manifest),
+                                        build_pack);
+            return 0;
+        }
+
+        if (!pack.empty()) {
+            auto images = new tftp::PackFileSystem(pack);
+            filesystem.reset(images);
+            TFTP_LOG_INFO("Serving {} images ({} bytes) from {}",
+                          images->getImageCount(), images->getTotalSize(),
+                          pack);
+        } else if (!manifest.empty()) {
+            auto images = new tftp::MemoryFileSystem(
+                tftp::readManifest(manifest), huge_pages);
+            filesystem.reset(images);
+            TFTP_LOG_INFO("Serving {} images ({} bytes) from memory{}",
+                          images->getImageCount(), images->getTotalSize(),
+                          images->isOnHugePages() ? " on huge pages" : "");
+        } else {
+            filesystem.reset(new tftp::DiskFileSystem());
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
 
     // Create a file worker factory
     constexpr unsigned int buffer_size = 5 * 1024 * 1024;  // 5 MB
-    tftp::BufferedFileWorkerFactory worker_factory(buffer_size, filesystem);
+    tftp::BufferedFileWorkerFactory file_factory(buffer_size, *filesystem);
+
+    // Files that only exist compressed are served decompressed
+    tftp::CompressedFileWorkerFactory local_factory(file_factory, *filesystem,
+                                                    image_cache_size);
+
+    // Files that are not stored locally are fetched from upstream
+    tftp::FileWorkerFactory *worker_factory = &local_factory;
+    std::unique_ptr<tftp::ProxyFileWorkerFactory> proxy_factory;
+    if (!upstream_address.empty()) {
+        try {
+            proxy_factory.reset(new tftp::ProxyFileWorkerFactory(
+                local_factory, upstream_address, upstream_port));
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        worker_factory = proxy_factory.get();
+    }
+
+    // Generated files are served ahead of everything else
+    std::unique_ptr<tftp::VirtualFileWorkerFactory> virtual_factory;
+    if (!virtual_files.empty()) {
+        virtual_factory.reset(
+            new tftp::VirtualFileWorkerFactory(*worker_factory));
+        try {
+            std::shared_ptr<tftp::ClientTable> client_table;
+            if (!clients.empty()) {
+                client_table = tftp::ClientTable::load(clients);
+                TFTP_LOG_INFO("Loaded {} clients from {}",
+                              client_table->size(), clients);
+            }
+
+            for (const auto &[pattern, path] : virtual_files) {
+                virtual_factory->add(pattern, tftp::TemplateGenerator(
+                                                  pattern, path, client_table));
+            }
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        worker_factory = virtual_factory.get();
+    }
 
     // Create a controller for incomming connections
-    tftp::Controller controller(worker_factory);
+    tftp::Controller controller(*worker_factory);
+    controller.setPriorityRules(priority_rules);
+    controller.setSchedulerQuantum(quantum);
+    controller.setAdmissionLimits(limits);
+    controller.setRateLimit(rate_limit, rate_burst);
+
+    if (!multicast_address.empty()) {
+        try {
+            controller.setMulticast(multicast_address, multicast_port);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // Move file I/O off the network thread, and commit uploads that finish
+    // together with one sync. Both are declared after the controller, so
+    // they stop first.
+    std::unique_ptr<tftp::DiskIoPool> io_pool;
+    std::unique_ptr<tftp::GroupCommitter> committer;
+    if (io_threads > 0) {
+        io_pool.reset(new tftp::DiskIoPool(io_threads, placement.io_cpus));
+        controller.setDiskIoPool(io_pool.get());
+
+        committer.reset(
+            new tftp::GroupCommitter(*filesystem, placement.io_cpus));
+        controller.setGroupCommitter(committer.get());
+    }
 
     // Create a server that listens on all interfaces on port 8080
     tftp::Server server("0.0.0.0", port, controller);
 
     try {
+        if (!multicast_address.empty()) {
+            server.setMulticastOptions(multicast_interface, multicast_ttl);
+        }
+
+        if (socket_buffer > 0) {
+            int size = server.setSocketBuffers(socket_buffer);
+            TFTP_LOG_INFO("Socket receive buffer is {} bytes", size);
+        }
+
+        if (!xdp_interface.empty()) {
+            server.setXdp(xdp_interface, xdp_queue, xdp_generic);
+        }
+
+        // A thread that spins should have a CPU to itself
+        if (busy_poll_us >= 0) {
+            server.setBusyPoll(busy_poll_us, busy_poll_idle_ms);
+            if (placement.network_cpus.empty()) {
+                TFTP_LOG_WARNING(
+                    "Busy polling without --cpus, the network thread is not "
+                    "pinned");
+            }
+        }
+
+        // Publish metrics in the background
+        tftp::MetricsExporter exporter(metrics_file, metrics_socket,
+                                       metrics_interval_ms);
+        exporter.start();
+
+        // Stop gracefully on Ctrl+C
+        running_server = &server;
+        std::signal(SIGINT, handleSignal);
+        std::signal(SIGTERM, handleSignal);
+
         server.listen();
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
         return 1;
     }
-}
\ No newline at end of file
+
+#ifdef TFTP_PHASE_TIMING
+    if (!phase_trace.empty()) {
+        FILE *file = fopen(phase_trace.c_str(), "w");
+        if (file != nullptr) {
+            tftp::PhaseTrace::instance().dump(file);
+            fclose(file);
+        }
+    }
+#endif
+
+    return 0;
+}
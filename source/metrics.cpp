@@ -0,0 +1,322 @@
+#include "metrics.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "logger.hpp"
+
+namespace tftp {
+static const char *COUNTER_NAMES[COUNTER_COUNT] = {
+    "tftp_packets_received_total", "tftp_packets_sent_total",
+    "tftp_bytes_received_total",   "tftp_bytes_sent_total",
+    "tftp_retransmits_total",      "tftp_sessions_started_total",
+    "tftp_sessions_finished_total", "tftp_cache_hits_total",
+    "tftp_cache_misses_total",     "tftp_sessions_queued_total",
+    "tftp_sessions_rejected_total", "tftp_packets_dropped_total",
+    "tftp_upstream_fetches_total", "tftp_upstream_failures_total",
+    "tftp_uploads_committed_total", "tftp_commit_groups_total",
+    "tftp_busy_poll_cpu_microseconds_total", "tftp_busy_poll_empty_total",
+    "tftp_xdp_packets_received_total", "tftp_xdp_packets_sent_total",
+    "tftp_send_failures_total",
+};
+
+static const char *HISTOGRAM_NAMES[HISTOGRAM_COUNT] = {
+    "tftp_time_to_first_byte_microseconds",
+    "tftp_block_round_trip_microseconds",
+    "tftp_transfer_throughput_kibibytes_per_second",
+};
+
+// Histogram buckets
+unsigned int histogramBucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+
+    // Keep the top HISTOGRAM_SUB_BUCKET_BITS bits of the value
+#if defined(_MSC_VER)
+    unsigned long msb;
+    _BitScanReverse64(&msb, value);
+#else
+    unsigned int msb = 63 - __builtin_clzll(value);
+#endif
+    unsigned int shift = msb - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    unsigned int mantissa = value >> shift;
+
+    return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HISTOGRAM_HALF_BUCKETS +
+           (mantissa - HISTOGRAM_HALF_BUCKETS);
+}
+
+uint64_t histogramBucketValue(unsigned int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+
+    // Report the upper bound of the bucket
+    unsigned int shift =
+        (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_HALF_BUCKETS + 1;
+    uint64_t mantissa =
+        (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_HALF_BUCKETS +
+        HISTOGRAM_HALF_BUCKETS;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t MetricsSnapshot::HistogramSnapshot::percentile(
+    double percentile) const {
+    if (this->count == 0) return 0;
+
+    uint64_t target = static_cast<uint64_t>(percentile * this->count);
+    if (target >= this->count) target = this->count - 1;
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += this->buckets[i];
+        if (seen > target) return histogramBucketValue(i);
+    }
+
+    return histogramBucketValue(HISTOGRAM_BUCKETS - 1);
+}
+
+// Slots
+MetricsSlot::MetricsSlot() {
+    for (auto &counter : this->counters) counter.store(0);
+    for (auto &error : this->errors) error.store(0);
+
+    for (auto &histogram : this->histograms) {
+        histogram.count.store(0);
+        histogram.sum.store(0);
+        for (auto &bucket : histogram.buckets) bucket.store(0);
+    }
+}
+
+Metrics &Metrics::instance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+MetricsSlot *Metrics::registerSlot() {
+    // Slots outlive their threads so nothing counted is ever lost
+    std::lock_guard<std::mutex> lock(this->slots_mutex);
+    this->slots.push_back(std::make_unique<MetricsSlot>());
+    return this->slots.back().get();
+}
+
+MetricsSnapshot Metrics::snapshot() {
+    MetricsSnapshot snapshot;
+
+    std::lock_guard<std::mutex> lock(this->slots_mutex);
+    for (auto &slot : this->slots) {
+        for (unsigned int i = 0; i < COUNTER_COUNT; ++i) {
+            snapshot.counters[i] +=
+                slot->counters[i].load(std::memory_order_relaxed);
+        }
+
+        for (unsigned int i = 0; i < ERROR_CODE_COUNT; ++i) {
+            snapshot.errors[i] += slot->errors[i].load(std::memory_order_relaxed);
+        }
+
+        for (unsigned int i = 0; i < HISTOGRAM_COUNT; ++i) {
+            auto &source = slot->histograms[i];
+            auto &target = snapshot.histograms[i];
+
+            target.count += source.count.load(std::memory_order_relaxed);
+            target.sum += source.sum.load(std::memory_order_relaxed);
+            for (unsigned int j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+                target.buckets[j] +=
+                    source.buckets[j].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    return snapshot;
+}
+
+std::string Metrics::renderPrometheus() {
+    MetricsSnapshot snapshot = this->snapshot();
+    std::ostringstream out;
+
+    // Counters
+    for (unsigned int i = 0; i < COUNTER_COUNT; ++i) {
+        out << "# TYPE " << COUNTER_NAMES[i] << " counter\n";
+        out << COUNTER_NAMES[i] << " " << snapshot.counters[i] << "\n";
+    }
+
+    // Errors sent, by TFTP error code
+    out << "# TYPE tftp_errors_total counter\n";
+    for (unsigned int i = 0; i < ERROR_CODE_COUNT; ++i) {
+        out << "tftp_errors_total{code=\"" << i << "\"} " << snapshot.errors[i]
+            << "\n";
+    }
+
+    // Active sessions
+    uint64_t started =
+        snapshot.counters[static_cast<unsigned int>(Counter::SessionsStarted)];
+    uint64_t finished =
+        snapshot.counters[static_cast<unsigned int>(Counter::SessionsFinished)];
+    out << "# TYPE tftp_sessions_active gauge\n";
+    out << "tftp_sessions_active " << (started > finished ? started - finished : 0)
+        << "\n";
+
+    // Histograms, exported as summaries
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (unsigned int i = 0; i < HISTOGRAM_COUNT; ++i) {
+        auto &histogram = snapshot.histograms[i];
+
+        out << "# TYPE " << HISTOGRAM_NAMES[i] << " summary\n";
+        for (double quantile : quantiles) {
+            out << HISTOGRAM_NAMES[i] << "{quantile=\"" << quantile << "\"} "
+                << histogram.percentile(quantile) << "\n";
+        }
+        out << HISTOGRAM_NAMES[i] << "_sum " << histogram.sum << "\n";
+        out << HISTOGRAM_NAMES[i] << "_count " << histogram.count << "\n";
+    }
+
+    return out.str();
+}
+
+uint64_t Metrics::nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+uint64_t Metrics::coarseNowMicros() {
+#ifdef CLOCK_MONOTONIC_COARSE
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+#else
+    return nowMicros();
+#endif
+}
+
+uint64_t Metrics::threadCpuMicros() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec used;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &used) != 0) return 0;
+    return static_cast<uint64_t>(used.tv_sec) * 1000000 + used.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
+
+// Exporter
+MetricsExporter::MetricsExporter(std::string file_path, std::string socket_path,
+                                 unsigned int interval_ms)
+    : file_path(file_path), socket_path(socket_path), interval_ms(interval_ms) {}
+
+MetricsExporter::~MetricsExporter() { this->stop(); }
+
+void MetricsExporter::start() {
+    if (this->file_path.empty() && this->socket_path.empty()) return;
+
+    this->openSocket();
+    this->running = true;
+    this->thread = std::thread(&MetricsExporter::run, this);
+}
+
+void MetricsExporter::stop() {
+    if (this->running.exchange(false) && this->thread.joinable()) {
+        this->thread.join();
+    }
+
+#ifndef _WIN32
+    if (this->socket_fd >= 0) {
+        close(this->socket_fd);
+        unlink(this->socket_path.c_str());
+        this->socket_fd = -1;
+    }
+#endif
+}
+
+void MetricsExporter::run() {
+    while (this->running.load()) {
+        this->writeFile();
+        this->serveSocket(this->interval_ms);
+    }
+
+    // Publish the final values
+    this->writeFile();
+}
+
+void MetricsExporter::writeFile() {
+    if (this->file_path.empty()) return;
+
+    // Write to a temporary file first so readers never see partial output
+    std::string temp_path = this->file_path + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "w");
+    if (file == nullptr) {
+        TFTP_LOG_WARNING("Failed to write metrics to {}", temp_path);
+        return;
+    }
+
+    std::string text = Metrics::instance().renderPrometheus();
+    fwrite(text.data(), 1, text.size(), file);
+    fclose(file);
+
+    std::rename(temp_path.c_str(), this->file_path.c_str());
+}
+
+void MetricsExporter::openSocket() {
+    if (this->socket_path.empty()) return;
+
+#ifndef _WIN32
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (this->socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Metrics socket path is too long");
+    }
+    strcpy(address.sun_path, this->socket_path.c_str());
+
+    this->socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (this->socket_fd < 0) {
+        throw std::runtime_error("Failed to create metrics socket");
+    }
+
+    unlink(this->socket_path.c_str());
+    if (bind(this->socket_fd, (struct sockaddr *)&address, sizeof(address)) <
+            0 ||
+        ::listen(this->socket_fd, 8) < 0) {
+        throw std::runtime_error("Failed to bind metrics socket");
+    }
+
+    TFTP_LOG_INFO("Serving metrics on {}", this->socket_path);
+#else
+    TFTP_LOG_WARNING("Metrics sockets are not supported on this platform");
+#endif
+}
+
+void MetricsExporter::serveSocket(unsigned int timeout_ms) {
+#ifndef _WIN32
+    if (this->socket_fd >= 0) {
+        struct pollfd poll_fd = {this->socket_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, timeout_ms) <= 0) return;
+
+        // Every connection gets one snapshot and is closed
+        int client_fd = accept(this->socket_fd, nullptr, nullptr);
+        if (client_fd < 0) return;
+
+        std::string text = Metrics::instance().renderPrometheus();
+        ssize_t written = 0;
+        while (written < static_cast<ssize_t>(text.size())) {
+            ssize_t result =
+                write(client_fd, text.data() + written, text.size() - written);
+            if (result <= 0) break;
+            written += result;
+        }
+
+        close(client_fd);
+        return;
+    }
+#endif
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+}
+}  // namespace tftp
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "packets.hpp"
+
+namespace tftp {
+enum class Counter : unsigned int {
+    PacketsReceived,
+    PacketsSent,
+    BytesReceived,
+    BytesSent,
+    Retransmits,
+    SessionsStarted,
+    SessionsFinished,
+    CacheHits,
+    CacheMisses,
+    SessionsQueued,
+    SessionsRejected,
+    PacketsDropped,
+    UpstreamFetches,
+    UpstreamFailures,
+    UploadsCommitted,
+    CommitGroups,
+    BusyPollMicros,  // CPU time of the network thread while busy polling
+    BusyPollEmpty,   // Busy polls that found no packet
+    XdpPacketsReceived,
+    XdpPacketsSent,
+    SendFailures,
+    COUNT,
+};
+
+enum class Histogram : unsigned int {
+    TimeToFirstByte,  // Microseconds from request to first DATA
+    BlockRoundTrip,   // Microseconds from DATA to its ACK
+    Throughput,       // KiB/s of a completed transfer
+    COUNT,
+};
+
+constexpr inline unsigned int COUNTER_COUNT =
+    static_cast<unsigned int>(Counter::COUNT);
+constexpr inline unsigned int HISTOGRAM_COUNT =
+    static_cast<unsigned int>(Histogram::COUNT);
+constexpr inline unsigned int ERROR_CODE_COUNT = 8;
+
+// Log-linear histogram buckets with 16 sub-buckets per power of two, giving a
+// worst case relative error of 1/16 over the whole uint64_t range.
+constexpr inline unsigned int HISTOGRAM_SUB_BUCKET_BITS = 5;
+constexpr inline unsigned int HISTOGRAM_SUB_BUCKETS =
+    1 << HISTOGRAM_SUB_BUCKET_BITS;
+constexpr inline unsigned int HISTOGRAM_HALF_BUCKETS =
+    HISTOGRAM_SUB_BUCKETS / 2;
+constexpr inline unsigned int HISTOGRAM_BUCKETS =
+    HISTOGRAM_SUB_BUCKETS +
+    (64 - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_HALF_BUCKETS;
+
+unsigned int histogramBucket(uint64_t value);
+uint64_t histogramBucketValue(unsigned int bucket);
+
+// Metrics written by a single thread. Only the owning thread writes, so
+// updates are plain relaxed stores and never bounce cache lines.
+struct alignas(64) MetricsSlot {
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    std::atomic<uint64_t> errors[ERROR_CODE_COUNT];
+
+    struct {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    } histograms[HISTOGRAM_COUNT];
+
+    MetricsSlot();
+};
+
+// Aggregated view of every slot
+struct MetricsSnapshot {
+    std::array<uint64_t, COUNTER_COUNT> counters{};
+    std::array<uint64_t, ERROR_CODE_COUNT> errors{};
+
+    struct HistogramSnapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        std::vector<uint64_t> buckets =
+            std::vector<uint64_t>(HISTOGRAM_BUCKETS, 0);
+
+        uint64_t percentile(double percentile) const;
+    };
+    std::array<HistogramSnapshot, HISTOGRAM_COUNT> histograms;
+};
+
+class Metrics {
+   public:
+    static Metrics &instance();
+
+    void increment(Counter counter, uint64_t value = 1) {
+        add(this->threadSlot().counters[static_cast<unsigned int>(counter)],
+            value);
+    }
+
+    void recordError(ErrorCode code) {
+        unsigned int index = static_cast<unsigned int>(code);
+        if (index >= ERROR_CODE_COUNT) index = 0;
+        add(this->threadSlot().errors[index], 1);
+    }
+
+    void record(Histogram histogram, uint64_t value) {
+        auto &slot =
+            this->threadSlot().histograms[static_cast<unsigned int>(histogram)];
+        add(slot.count, 1);
+        add(slot.sum, value);
+        add(slot.buckets[histogramBucket(value)], 1);
+    }
+
+    MetricsSnapshot snapshot();
+    std::string renderPrometheus();
+
+    // Monotonic clock used for every latency metric
+    static uint64_t nowMicros();
+
+    // Cheaper, but only as fine as the scheduler tick where that is faster
+    static uint64_t coarseNowMicros();
+
+    // CPU time the calling thread has used, 0 where that is unknown
+    static uint64_t threadCpuMicros();
+
+   private:
+    Metrics() = default;
+
+    std::mutex slots_mutex;
+    std::vector<std::unique_ptr<MetricsSlot>> slots;
+
+    MetricsSlot &threadSlot() {
+        thread_local MetricsSlot *slot = nullptr;
+        if (slot == nullptr) slot = this->registerSlot();
+        return *slot;
+    }
+
+    MetricsSlot *registerSlot();
+
+    static void add(std::atomic<uint64_t> &value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount,
+                    std::memory_order_relaxed);
+    }
+};
+
+// Periodically publishes metrics as Prometheus text, to a file and/or to
+// anyone connecting to a local Unix socket.
+class MetricsExporter {
+   public:
+    MetricsExporter(std::string file_path, std::string socket_path,
+                    unsigned int interval_ms);
+    ~MetricsExporter();
+
+    void start();
+    void stop();
+
+   private:
+    const std::string file_path;
+    const std::string socket_path;
+    const unsigned int interval_ms;
+
+    int socket_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    void run();
+    void writeFile();
+    void openSocket();
+    void serveSocket(unsigned int timeout_ms);
+};
+}  // namespace tftp
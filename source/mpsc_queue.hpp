@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+
+namespace tftp {
+struct MpscNode {
+    std::atomic<MpscNode *> next{nullptr};
+};
+
+// Intrusive multi-producer single-consumer queue (Vyukov). Pushing is wait
+// free from any thread and never allocates, as items embed their node.
+// Only one thread may pop.
+template <typename T>
+class MpscQueue {
+   public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T *item) { this->pushNode(static_cast<MpscNode *>(item)); }
+
+    // Returns nullptr when the queue is empty, and also while a push is
+    // halfway done, in which case the caller has to try again
+    T *pop() {
+        MpscNode *tail = this->tail;
+        MpscNode *next = tail->next.load(std::memory_order_acquire);
+
+        // Step over the stub
+        if (tail == &this->stub) {
+            if (next == nullptr) return nullptr;
+
+            this->tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next != nullptr) {
+            this->tail = next;
+            return static_cast<T *>(tail);
+        }
+
+        if (tail != this->head.load(std::memory_order_acquire)) return nullptr;
+
+        // The last item can only be taken once the stub is behind it
+        this->pushNode(&this->stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            this->tail = next;
+            return static_cast<T *>(tail);
+        }
+
+        return nullptr;
+    }
+
+   private:
+    alignas(64) std::atomic<MpscNode *> head;  // Written by producers
+    alignas(64) MpscNode *tail;                // Owned by the consumer
+    MpscNode stub;
+
+    void pushNode(MpscNode *node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        MpscNode *previous = this->head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+};
+}  // namespace tftp
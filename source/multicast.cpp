@@ -0,0 +1,92 @@
+#include "multicast.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace tftp {
+std::string MulticastGroup::describe(bool master) const {
+    struct sockaddr_in addr = this->address.toSockaddr();
+    return std::string(inet_ntoa(addr.sin_addr)) + "," +
+           std::to_string(ntohs(addr.sin_port)) + (master ? ",1" : ",0");
+}
+
+void MulticastGroups::configure(const std::string &address, uint16_t port,
+                                unsigned int max_groups) {
+    struct in_addr parsed;
+    if (inet_pton(AF_INET, address.c_str(), &parsed) != 1 ||
+        !IN_MULTICAST(ntohl(parsed.s_addr))) {
+        throw std::invalid_argument("Invalid multicast address!");
+    }
+
+    // The addresses must not run past the end of the multicast range
+    this->first_address = ntohl(parsed.s_addr);
+    max_groups = std::min<uint64_t>(max_groups,
+                                    0xEFFFFFFFull - this->first_address + 1);
+
+    this->groups.clear();
+    this->groups.resize(max_groups);
+    this->port = htons(port);
+    this->active = 0;
+}
+
+MulticastGroup *MulticastGroups::join(const std::string &filename,
+                                      uint16_t block_size,
+                                      uint16_t block_count, uint32_t session) {
+    size_t free_slot = this->groups.size();
+
+    for (size_t i = 0; i < this->groups.size(); ++i) {
+        MulticastGroup *group = this->groups[i].get();
+        if (group == nullptr) {
+            if (free_slot == this->groups.size()) free_slot = i;
+            continue;
+        }
+
+        if (group->filename == filename && group->block_size == block_size &&
+            group->block_count == block_count) {
+            group->members.push_back(session);
+            return group;
+        }
+    }
+
+    // Every address is taken
+    if (free_slot == this->groups.size()) return nullptr;
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(this->first_address + free_slot);
+    addr.sin_port = this->port;
+
+    MulticastGroup *group = new MulticastGroup();
+    group->filename = filename;
+    group->block_size = block_size;
+    group->block_count = block_count;
+    group->address = Peer::fromSockaddr(addr);
+    group->members.push_back(session);
+
+    this->groups[free_slot].reset(group);
+    ++this->active;
+    return group;
+}
+
+uint32_t MulticastGroups::leave(MulticastGroup *group, uint32_t session) {
+    bool was_master = group->getMaster() == session;
+
+    auto member =
+        std::find(group->members.begin(), group->members.end(), session);
+    if (member != group->members.end()) group->members.erase(member);
+
+    if (!group->members.empty()) {
+        return was_master ? group->getMaster() : NO_SESSION;
+    }
+
+    // The last one out frees the address
+    for (auto &slot : this->groups) {
+        if (slot.get() == group) {
+            slot.reset();
+            --this->active;
+            break;
+        }
+    }
+    return NO_SESSION;
+}
+}  // namespace tftp
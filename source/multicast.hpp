@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "peer.hpp"
+#include "session_table.hpp"
+
+namespace tftp {
+constexpr inline unsigned int DEFAULT_MULTICAST_GROUPS = 64;
+
+// Clients that are not the master stay silent until their turn, and are
+// only taken for gone after this long
+constexpr inline int MULTICAST_MEMBER_TIMEOUT_MS = 5 * 60 * 1000;
+
+// One multicast download (RFC 2090). Blocks go to the group address, and
+// only the master client acknowledges them. Its ACK of a block asks for the
+// block after it, so a client that joined late fetches what it missed once
+// its turn as master comes.
+struct MulticastGroup {
+    std::string filename;
+    uint16_t block_size;
+    uint16_t block_count;  // The last block is short, possibly empty
+    uint16_t sent_block = 0;  // Highest block sent so far
+    Peer address;
+
+    // Sessions in the order they joined. The first is the master client.
+    std::deque<uint32_t> members;
+
+    uint32_t getMaster() const { return this->members.front(); }
+
+    // Value of the multicast option: address, port and whether the client
+    // is the master
+    std::string describe(bool master) const;
+};
+
+// Groups of a server. Each group has its own address, counted up from the
+// first one, and all share the port. There are few groups at a time, so
+// they are looked up by a linear scan. Not thread safe.
+class MulticastGroups {
+   public:
+    // Throws std::invalid_argument for an address that is not IPv4
+    // multicast
+    void configure(const std::string &address, uint16_t port,
+                   unsigned int max_groups = DEFAULT_MULTICAST_GROUPS);
+    bool isEnabled() const { return !this->groups.empty(); }
+
+    // Adds the session to the group for the file and block size, which is
+    // made if there is none. Null if every address is taken.
+    MulticastGroup *join(const std::string &filename, uint16_t block_size,
+                         uint16_t block_count, uint32_t session);
+
+    // Takes the session out of its group, which goes away with its last
+    // member. Returns the new master client, or NO_SESSION if the master
+    // did not change or nobody is left.
+    uint32_t leave(MulticastGroup *group, uint32_t session);
+
+    size_t size() const { return this->active; }
+
+   private:
+    // Slot i uses the first address plus i, null while free
+    std::vector<std::unique_ptr<MulticastGroup>> groups;
+    uint32_t first_address = 0;  // Host byte order
+    uint16_t port = 0;            // Network byte order
+    size_t active = 0;
+};
+}  // namespace tftp
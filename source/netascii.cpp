@@ -0,0 +1,186 @@
+#include "netascii.hpp"
+
+#include <algorithm>
+
+#include "netascii_kernels.hpp"
+
+namespace tftp {
+namespace {
+using EncodeVectors = void (*)(const char *, size_t, char *, size_t, size_t &,
+                               size_t &);
+using DecodeVectors = void (*)(const char *, size_t, char *, size_t &,
+                               size_t &);
+
+#ifndef __SSE2__
+// Without vectors the scalar loops do everything
+void encodeScalar(const char *, size_t, char *, size_t, size_t &, size_t &) {}
+void decodeScalar(const char *, size_t, char *, size_t &, size_t &) {}
+#endif
+
+// The widest kernels the CPU runs, picked once
+EncodeVectors selectEncodeVectors() {
+#ifdef TFTP_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) return encodeVectorsAvx2;
+#endif
+#ifdef __SSE2__
+    return encodeVectors<Sse2Vector>;
+#else
+    return encodeScalar;
+#endif
+}
+
+DecodeVectors selectDecodeVectors() {
+#ifdef TFTP_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) return decodeVectorsAvx2;
+#endif
+#ifdef __SSE2__
+    return decodeVectors<Sse2Vector>;
+#else
+    return decodeScalar;
+#endif
+}
+
+// Picked on first use, so translating during static initialization works
+void encodeVectorsBest(const char *src, size_t src_size, char *dst,
+                       size_t dst_size, size_t &i, size_t &o) {
+    static const EncodeVectors kernel = selectEncodeVectors();
+    kernel(src, src_size, dst, dst_size, i, o);
+}
+
+void decodeVectorsBest(const char *src, size_t size, char *dst, size_t &i,
+                       size_t &o) {
+    static const DecodeVectors kernel = selectDecodeVectors();
+    kernel(src, size, dst, i, o);
+}
+}  // namespace
+
+size_t NetasciiEncoder::encode(const char *src, size_t src_size, char *dst,
+                               size_t dst_size, size_t &consumed) {
+    size_t i = 0, o = 0;
+
+    // Second half of an expansion cut off last time
+    if (this->has_pending && dst_size > 0) {
+        dst[o++] = this->pending;
+        this->has_pending = false;
+    }
+
+    encodeVectorsBest(src, src_size, dst, dst_size, i, o);
+
+    // The ends, where a vector no longer fits
+    for (; i < src_size && o < dst_size; ++i) {
+        char c = src[i];
+        if (c != '\n' && c != '\r') {
+            dst[o++] = c;
+            continue;
+        }
+
+        char second = c == '\n' ? '\n' : '\0';
+        dst[o++] = '\r';
+        if (o < dst_size) {
+            dst[o++] = second;
+        } else {
+            this->pending = second;
+            this->has_pending = true;
+        }
+    }
+
+    consumed = i;
+    return o;
+}
+
+size_t NetasciiDecoder::decode(const char *src, size_t size, char *dst) {
+    size_t i = 0, o = 0;
+
+    // CR at the end of the previous block
+    if (this->pending_cr && size > 0) {
+        this->pending_cr = false;
+        dst[o++] = src[0] == '\n' ? '\n' : '\r';
+        if (src[0] == '\n' || src[0] == '\0') ++i;
+    }
+
+    decodeVectorsBest(src, size, dst, i, o);
+
+    for (; i < size; ++i) {
+        if (src[i] != '\r') {
+            dst[o++] = src[i];
+            continue;
+        }
+
+        // Resolved by the next block
+        if (i + 1 == size) {
+            this->pending_cr = true;
+            break;
+        }
+
+        char next = src[i + 1];
+        dst[o++] = next == '\n' ? '\n' : '\r';
+        if (next == '\n' || next == '\0') ++i;
+    }
+
+    return o;
+}
+
+ssize_t NetasciiTranslator::read(FileWorker &file_worker, char *dst,
+                                 ssize_t size, uint64_t offset) {
+    if (offset == this->next.offset) {
+        this->block = this->next;
+    } else if (offset != this->block.offset) {
+        return -1;
+    }
+
+    if (this->scratch.size() < static_cast<size_t>(size)) {
+        this->scratch.resize(size);
+    }
+
+    // Fill the block, unless the file ends first. Bytes read but not
+    // translated are read again for the next block.
+    Position position = this->block;
+    size_t consumed;
+    ssize_t produced = position.encoder.encode(nullptr, 0, dst, size, consumed);
+
+    while (produced < size) {
+        ssize_t bytes_read =
+            file_worker.read(this->scratch.data(), size - produced,
+                             position.file_offset);
+        if (bytes_read < 0) return bytes_read;
+        if (bytes_read == 0) break;
+
+        produced += position.encoder.encode(this->scratch.data(), bytes_read,
+                                            dst + produced, size - produced,
+                                            consumed);
+        position.file_offset += consumed;
+    }
+
+    position.offset = offset + produced;
+    this->next = position;
+    return produced;
+}
+
+ssize_t NetasciiTranslator::append(FileWorker &file_worker, const char *data,
+                                   ssize_t size, bool last_block) {
+    if (this->scratch.size() < static_cast<size_t>(size) + 1) {
+        this->scratch.resize(size + 1);
+    }
+
+    size_t decoded = this->decoder.decode(data, size, this->scratch.data());
+
+    // Nothing will follow a CR that is still held back
+    if (last_block && this->decoder.hasPending()) {
+        this->decoder.reset();
+        this->scratch[decoded++] = '\r';
+    }
+
+    if (decoded > 0 &&
+        file_worker.append(this->scratch.data(), decoded) < 0) {
+        return -1;
+    }
+
+    return size;
+}
+
+void NetasciiTranslator::reset() {
+    this->block = Position();
+    this->next = Position();
+    this->decoder.reset();
+}
+}  // namespace tftp
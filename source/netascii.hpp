@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common.hpp"
+#include "files.hpp"
+
+namespace tftp {
+// Local text to netascii: LF becomes CR LF and CR becomes CR NUL. An
+// expansion that does not fit the output is finished by the next call, so
+// a stream can be cut into blocks anywhere.
+class NetasciiEncoder {
+   public:
+    // Returns the bytes written to dst. Consumed is set to the bytes taken
+    // from src.
+    size_t encode(const char *src, size_t src_size, char *dst,
+                  size_t dst_size, size_t &consumed);
+
+    void reset() { this->has_pending = false; }
+
+   private:
+    char pending = 0;
+    bool has_pending = false;
+};
+
+// Netascii to local text: CR LF becomes LF and CR NUL becomes CR. A CR at
+// the end of one block is resolved by the next one. A CR followed by
+// anything else is kept.
+class NetasciiDecoder {
+   public:
+    // Returns the bytes written to dst, which has room for one more byte
+    // than src, for a CR held back from the previous block
+    size_t decode(const char *src, size_t size, char *dst);
+
+    // A CR is held back, which the end of the stream makes final
+    bool hasPending() const { return this->pending_cr; }
+
+    void reset() { this->pending_cr = false; }
+
+   private:
+    bool pending_cr = false;
+};
+
+// Netascii view of one file, for a session in netascii mode. Offsets are
+// in netascii bytes, which drift away from file offsets with every
+// expansion, so blocks have to be read in order. The block before the
+// current one can be read again, for retransmissions.
+class NetasciiTranslator {
+   public:
+    ssize_t read(FileWorker &file_worker, char *dst, ssize_t size,
+                 uint64_t offset);
+
+    // Returns the size taken from data
+    ssize_t append(FileWorker &file_worker, const char *data, ssize_t size,
+                   bool last_block);
+
+    void reset();
+
+   private:
+    struct Position {
+        uint64_t offset = 0;       // In netascii
+        uint64_t file_offset = 0;  // In the file
+        NetasciiEncoder encoder;
+    };
+
+    Position block;  // Start of the last block read
+    Position next;   // Start of the one after it
+    NetasciiDecoder decoder;
+
+    // Bytes on the file side, kept across sessions
+    std::vector<char> scratch;
+};
+}  // namespace tftp
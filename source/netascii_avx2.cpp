@@ -0,0 +1,21 @@
+// The AVX2 kernels, in a file of their own as only it is built for AVX2.
+// Which ones run is decided at runtime.
+
+#include "netascii_kernels.hpp"
+
+#ifdef __AVX2__
+namespace tftp {
+void encodeVectorsAvx2(const char *src, size_t src_size, char *dst,
+                       size_t dst_size, size_t &i, size_t &o) {
+    // Narrower vectors leave less to the scalar loop at the end
+    encodeVectors<Avx2Vector>(src, src_size, dst, dst_size, i, o);
+    encodeVectors<Sse2Vector>(src, src_size, dst, dst_size, i, o);
+}
+
+void decodeVectorsAvx2(const char *src, size_t size, char *dst, size_t &i,
+                       size_t &o) {
+    decodeVectors<Avx2Vector>(src, size, dst, i, o);
+    decodeVectors<Sse2Vector>(src, size, dst, i, o);
+}
+}  // namespace tftp
+#endif
@@ -0,0 +1,133 @@
+#pragma once
+
+// Translation loops over whole vectors, for netascii.cpp. The file is built
+// once per instruction set, and everything in it has internal linkage, so
+// code built for a wider one never ends up in a caller built without it.
+
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace tftp {
+namespace {
+#ifdef __SSE2__
+struct Sse2Vector {
+    static constexpr size_t WIDTH = 16;
+
+    // Bit i is set if byte i is a CR, or an LF when asked for
+    template <bool WITH_LF>
+    static unsigned int scan(const char *src) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        __m128i hits = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'));
+        if (WITH_LF) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+        }
+        return _mm_movemask_epi8(hits);
+    }
+
+    static void copy(const char *src, char *dst) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                         _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+    }
+};
+#endif
+
+#ifdef __AVX2__
+struct Avx2Vector {
+    static constexpr size_t WIDTH = 32;
+
+    template <bool WITH_LF>
+    static unsigned int scan(const char *src) {
+        __m256i chunk =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+        __m256i hits = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r'));
+        if (WITH_LF) {
+            hits = _mm256_or_si256(hits,
+                                   _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')));
+        }
+        return _mm256_movemask_epi8(hits);
+    }
+
+    static void copy(const char *src, char *dst) {
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(dst),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)));
+    }
+};
+#endif
+
+// Encodes a vector at a time while there is room for the widest
+// expansion. The whole vector is stored first; every byte to expand then
+// gets its pair, and the rest of the vector is stored again one further
+// along. Advances i and o past what it did; the caller finishes the ends.
+template <typename Vector>
+void encodeVectors(const char *src, size_t src_size, char *dst,
+                   size_t dst_size, size_t &i, size_t &o) {
+    constexpr size_t WIDTH = Vector::WIDTH;
+
+    while (i + 2 * WIDTH <= src_size && o + 3 * WIDTH <= dst_size) {
+        unsigned int hits = Vector::template scan<true>(src + i);
+        Vector::copy(src + i, dst + o);
+
+        size_t shift = 0;
+        while (hits != 0) {
+            size_t at = __builtin_ctz(hits);
+            hits &= hits - 1;
+
+            char second = src[i + at] == '\n' ? '\n' : '\0';
+            dst[o + at + shift] = '\r';
+            dst[o + at + shift + 1] = second;
+            ++shift;
+            Vector::copy(src + i + at + 1, dst + o + at + shift + 1);
+        }
+
+        i += WIDTH;
+        o += WIDTH + shift;
+    }
+}
+
+// Decodes a vector at a time into a separate dst, the same way. A pair may
+// end in the next vector, which then starts one byte later. The rest of a
+// vector after a pair in its last byte is copied from one byte past the
+// next vector, which has to be in src.
+template <typename Vector>
+void decodeVectors(const char *src, size_t size, char *dst, size_t &i,
+                   size_t &o) {
+    constexpr size_t WIDTH = Vector::WIDTH;
+
+    while (i + 2 * WIDTH < size) {
+        unsigned int hits = Vector::template scan<false>(src + i);
+        Vector::copy(src + i, dst + o);
+
+        size_t consumed = WIDTH;
+        size_t dropped = 0;
+        while (hits != 0) {
+            size_t at = __builtin_ctz(hits);
+            hits &= hits - 1;
+
+            // CR LF and CR NUL take both bytes, a lone CR stays
+            char next = src[i + at + 1];
+            dst[o + at - dropped] = next == '\n' ? '\n' : '\r';
+            if (next != '\n' && next != '\0') continue;
+
+            ++dropped;
+            Vector::copy(src + i + at + 2, dst + o + at - dropped + 2);
+            if (at + 1 == WIDTH) ++consumed;
+        }
+
+        i += consumed;
+        o += consumed - dropped;
+    }
+}
+}  // namespace
+
+#ifdef TFTP_HAVE_AVX2
+// Built with AVX2 enabled, in netascii_avx2.cpp
+void encodeVectorsAvx2(const char *src, size_t src_size, char *dst,
+                       size_t dst_size, size_t &i, size_t &o);
+void decodeVectorsAvx2(const char *src, size_t size, char *dst, size_t &i,
+                       size_t &o);
+#endif
+}  // namespace tftp
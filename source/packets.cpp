@@ -1,10 +1,56 @@
 #include "packets.hpp"
 
+#include <cctype>
 #include <stdexcept>
 
 #include "common.hpp"
+#include "logger.hpp"
 
 namespace tftp {
+bool ReadWriteRequestPacket::parseMode(const char *name,
+                                       ReadWriteRequestMode &mode) {
+    // Longer names cannot match, so they are cut short
+    char mode_str[16];
+    size_t i = 0;
+    for (; name[i] && i < sizeof(mode_str) - 1; ++i) {
+        mode_str[i] = std::tolower(name[i]);
+    }
+    mode_str[i] = '\0';
+
+    if (name[i] != '\0') return false;
+
+    if (strcmp(mode_str, "netascii") == 0) {
+        mode = ReadWriteRequestMode::NETASCII;
+    } else if (strcmp(mode_str, "octet") == 0) {
+        mode = ReadWriteRequestMode::OCTET;
+    } else if (strcmp(mode_str, "mail") == 0) {
+        mode = ReadWriteRequestMode::MAIL;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static ReadWriteRequestMode requireMode(const char *name) {
+    ReadWriteRequestMode mode;
+    if (!ReadWriteRequestPacket::parseMode(name, mode)) {
+        throw std::runtime_error("Invalid file read/write mode!");
+    }
+    return mode;
+}
+
+ReadWriteRequestPacket::ReadWriteRequestPacket(const char *filename,
+                                               const char *mode)
+    : Packet(PacketType::UNKNOWN) {
+    if (strlen(filename) >= sizeof(this->filename)) {
+        throw std::runtime_error("Filename is too long!");
+    }
+
+    strcpy(this->filename, filename);
+    this->mode = requireMode(mode);
+}
+
 ssize_t ReadWriteRequestPacket::serialize(char *dst) const {
     // Create packet with size
     ssize_t size = 0;
@@ -18,6 +64,7 @@ ssize_t ReadWriteRequestPacket::serialize(char *dst) const {
     size += strlen(filename) + 1;
 
     // Write mode
+    const char *mode_str = dst + size;
     switch (mode) {
         case ReadWriteRequestMode::NETASCII:
             strcpy(dst + size, "netascii");
@@ -44,8 +91,8 @@ ssize_t ReadWriteRequestPacket::serialize(char *dst) const {
         size += strlen(option.second.c_str()) + 1;
     }
 
-    printf("<- Read/Write request packet: { filename: %s, mode: %s }\n",
-           filename, dst + size);
+    TFTP_LOG_TRACE("<- Read/Write request packet: { filename: {}, mode: {} }",
+                   filename, mode_str);
 
     return size;
 }
@@ -64,27 +111,14 @@ ssize_t ReadWriteRequestPacket::deserialize(const char *src) {
     size += strlen(filename) + 1;
 
     // Read mode
-    char mode_str[512];
-    strcpy(mode_str, src + size);
+    const char *mode_str = src + size;
     size += strlen(mode_str) + 1;
 
     // Parse mode
-    for (char *c = mode_str; *c; ++c) {
-        *c = std::tolower(*c);
-    }
-
-    if (strcmp(mode_str, "netascii") == 0) {
-        mode = ReadWriteRequestMode::NETASCII;
-    } else if (strcmp(mode_str, "octet") == 0) {
-        mode = ReadWriteRequestMode::OCTET;
-    } else if (strcmp(mode_str, "mail") == 0) {
-        mode = ReadWriteRequestMode::MAIL;
-    } else {
-        throw std::runtime_error("Invalid file read/write mode!");
-    }
+    mode = requireMode(mode_str);
 
-    printf("-> Read/Write request packet: { filename: %s, mode: %s }\n",
-           filename, mode_str);
+    TFTP_LOG_TRACE("-> Read/Write request packet: { filename: {}, mode: {} }",
+                   filename, mode_str);
 
     return size;
 }
@@ -107,12 +141,12 @@ void ReadWriteRequestPacket::deserializeOptions(const char *src,
         options[option_name] = option_value;
     }
 
-    // Print the parsed options
-    printf("-> Read/Write request packet (options): { options: %ld }\n",
-           options.size());
+    // Log the parsed options
+    TFTP_LOG_TRACE("-> Read/Write request packet (options): { options: {} }",
+                   options.size());
 
     for (auto &option : options) {
-        std::cout << "\t" << option.first << ": " << option.second << std::endl;
+        TFTP_LOG_TRACE("\t{}: {}", option.first, option.second);
     }
 }
 
@@ -132,8 +166,8 @@ ssize_t DataPacket::serialize(char *dst) const {
     memcpy(dst + size, data, data_size);
     size += data_size;
 
-    printf("<- Data packet: { block_number: %d, data_size: %ld }\n",
-           block_number, data_size);
+    TFTP_LOG_TRACE("<- Data packet: { block_number: {}, data_size: {} }",
+                   block_number, data_size);
     return size;
 }
 
@@ -154,12 +188,32 @@ ssize_t DataPacket::deserialize(const char *src) {
     memcpy(data, src + size, data_size);
     size += data_size;
 
-    printf("-> Data packet: { block_number: %d, data_size: %ld }\n",
-           block_number, data_size);
+    TFTP_LOG_TRACE("-> Data packet: { block_number: {}, data_size: {} }",
+                   block_number, data_size);
 
     return size;
 }
 
+ssize_t DataPacket::serializeHeader(char *dst, uint16_t block_number) {
+    // Write opcode
+    *reinterpret_cast<uint16_t *>(dst) =
+        htons(static_cast<uint16_t>(PacketType::DATA));
+
+    // Write block number
+    *reinterpret_cast<uint16_t *>(dst + 2) = htons(block_number);
+
+    TFTP_LOG_TRACE("<- Data packet header: { block_number: {} }", block_number);
+    return HEADER_SIZE;
+}
+
+ssize_t DataPacket::deserializeHeader(const char *src, uint16_t &block_number) {
+    // Read block number
+    block_number = ntohs(*reinterpret_cast<const uint16_t *>(src + 2));
+
+    TFTP_LOG_TRACE("-> Data packet header: { block_number: {} }", block_number);
+    return HEADER_SIZE;
+}
+
 ssize_t AckPacket::serialize(char *dst) const {
     // Create packet with size
     ssize_t size = 0;
@@ -172,7 +226,7 @@ ssize_t AckPacket::serialize(char *dst) const {
     *reinterpret_cast<uint16_t *>(dst + size) = htons(block_number);
     size += sizeof(block_number);
 
-    printf("<- Ack packet: { block_number: %d }\n", block_number);
+    TFTP_LOG_TRACE("<- Ack packet: { block_number: {} }", block_number);
     return size;
 }
 
@@ -189,7 +243,7 @@ ssize_t AckPacket::deserialize(const char *src) {
     block_number = ntohs(*reinterpret_cast<const uint16_t *>(src + size));
     size += sizeof(block_number);
 
-    printf("-> Ack packet: { block_number: %d }\n", block_number);
+    TFTP_LOG_TRACE("-> Ack packet: { block_number: {} }", block_number);
 
     return size;
 }
@@ -211,7 +265,7 @@ ssize_t ErrorPacket::serialize(char *dst) const {
     strcpy(dst + size, message);
     size += strlen(message) + 1;
 
-    printf("<- Error packet: { code: %d, message: %s }\n", (int)code, message);
+    TFTP_LOG_TRACE("<- Error packet: { code: {}, message: {} }", code, message);
     return size;
 }
 
@@ -233,7 +287,7 @@ ssize_t ErrorPacket::deserialize(const char *src) {
     strcpy(message, src + size);
     size += strlen(message) + 1;
 
-    printf("-> Error packet: { code: %d, message: %s }\n", (int)code, message);
+    TFTP_LOG_TRACE("-> Error packet: { code: {}, message: {} }", code, message);
 
     return size;
 }
@@ -257,7 +311,7 @@ ssize_t OptionAckPacket::serialize(char *dst) const {
         size += strlen(option.second.c_str()) + 1;
     }
 
-    printf("<- Option ack packet: { options: %ld }\n", options.size());
+    TFTP_LOG_TRACE("<- Option ack packet: { options: {} }", options.size());
     return size;
 }
 
@@ -270,8 +324,8 @@ ssize_t OptionAckPacket::deserialize(const char *src) {
         ntohs(*reinterpret_cast<const uint16_t *>(src)));
     size += sizeof(type);
 
-    // Read options
-    while (size < 512) {
+    // Read options, up to the empty name that terminates the buffer
+    while (src[size] != '\0') {
         // Read option name
         std::string option_name(src + size);
         size += strlen(src + size) + 1;
@@ -284,7 +338,7 @@ ssize_t OptionAckPacket::deserialize(const char *src) {
         options[option_name] = option_value;
     }
 
-    printf("-> Option ack packet: { options: %ld }\n", options.size());
+    TFTP_LOG_TRACE("-> Option ack packet: { options: {} }", options.size());
 
     return size;
 }
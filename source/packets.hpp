@@ -5,7 +5,7 @@
 
 #include <cstdint>
 #include <cstring>
-#include <iostream>
+#include <string>
 #include <map>
 
 namespace tftp {
@@ -51,6 +51,9 @@ class ReadWriteRequestPacket : public Packet {
     ssize_t serialize(char *dst) const override;
     ssize_t deserialize(const char *src) override;
     void deserializeOptions(const char *src, ssize_t size);
+
+    // Modes are case insensitive. False for an unknown mode.
+    static bool parseMode(const char *name, ReadWriteRequestMode &mode);
 };
 
 class ReadRequestPacket : public ReadWriteRequestPacket {
@@ -75,6 +78,8 @@ class WriteRequestPacket : public ReadWriteRequestPacket {
 
 class DataPacket : public Packet {
    public:
+    static constexpr ssize_t HEADER_SIZE = 4;
+
     uint16_t block_number;
     ssize_t data_size;
     char data[UINT16_MAX - 4];
@@ -90,6 +95,10 @@ class DataPacket : public Packet {
 
     ssize_t serialize(char *dst) const override;
     ssize_t deserialize(const char *src) override;
+
+    // The header alone, for data that is read or written in place
+    static ssize_t serializeHeader(char *dst, uint16_t block_number);
+    static ssize_t deserializeHeader(const char *src, uint16_t &block_number);
 };
 
 class AckPacket : public Packet {
@@ -132,6 +141,8 @@ class ErrorPacket : public Packet {
     ssize_t deserialize(const char *src) override;
 };
 
+// Deserializing reads options up to an empty name, so the source buffer must
+// be followed by two NUL bytes.
 class OptionAckPacket : public Packet {
    public:
     std::map<std::string, std::string> options;
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "common.hpp"
+
+namespace tftp {
+// Address and port of a client. IPv4 addresses are stored mapped into IPv6,
+// so every peer packs into the same 18 bytes and compares with memcmp.
+struct Peer {
+    uint8_t address[16] = {};
+    uint16_t port = 0;  // Network byte order
+
+    static Peer fromSockaddr(const struct sockaddr_in &addr) {
+        Peer peer;
+        peer.address[10] = 0xFF;
+        peer.address[11] = 0xFF;
+        memcpy(peer.address + 12, &addr.sin_addr, 4);
+        peer.port = addr.sin_port;
+        return peer;
+    }
+
+    // Only meaningful for peers that came from an IPv4 address
+    struct sockaddr_in toSockaddr() const {
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        memcpy(&addr.sin_addr, this->address + 12, 4);
+        addr.sin_port = this->port;
+        return addr;
+    }
+
+    bool operator==(const Peer &other) const {
+        return memcmp(this, &other, sizeof(Peer)) == 0;
+    }
+    bool operator!=(const Peer &other) const { return !(*this == other); }
+
+    uint64_t hash() const {
+        uint64_t high, low;
+        memcpy(&high, this->address, 8);
+        memcpy(&low, this->address + 8, 8);
+
+        // Mix both halves and the port so every bit reaches the low bits
+        uint64_t hash = high * 0x9E3779B97F4A7C15ull;
+        hash ^= (low + this->port) * 0xC2B2AE3D27D4EB4Full;
+        hash ^= hash >> 29;
+        hash *= 0xBF58476D1CE4E5B9ull;
+        return hash ^ (hash >> 32);
+    }
+};
+
+static_assert(sizeof(Peer) == 18, "Peer must be packed for memcmp");
+}  // namespace tftp
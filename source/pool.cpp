@@ -0,0 +1,26 @@
+#include "pool.hpp"
+
+namespace tftp {
+char *BufferPool::acquire() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (this->free_buffers.empty()) {
+        this->buffers.emplace_back(new char[this->buffer_size]);
+
+        // Every buffer fits in the free list, so releasing never allocates
+        this->free_buffers.reserve(this->buffers.size());
+        return this->buffers.back().get();
+    }
+
+    char *buffer = this->free_buffers.back();
+    this->free_buffers.pop_back();
+    return buffer;
+}
+
+void BufferPool::release(char *buffer) {
+    if (buffer == nullptr) return;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->free_buffers.push_back(buffer);
+}
+}  // namespace tftp
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace tftp {
+constexpr inline size_t POOL_SLAB_SIZE = 64;
+
+// Slab allocator for objects of one type. Storage is allocated a slab at a
+// time and destroyed objects go back to a free list, so once the pool has
+// grown to the peak number of live objects it never allocates again.
+// Not thread safe.
+template <typename T>
+class ObjectPool {
+   public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    template <typename... Args>
+    T *create(Args &&...args) {
+        if (this->free_list == nullptr) this->grow();
+
+        Slot *slot = this->free_list;
+        this->free_list = slot->next;
+
+        try {
+            T *object = new (slot->storage) T(std::forward<Args>(args)...);
+            ++this->live;
+            return object;
+        } catch (...) {
+            slot->next = this->free_list;
+            this->free_list = slot;
+            throw;
+        }
+    }
+
+    void destroy(T *object) {
+        if (object == nullptr) return;
+
+        object->~T();
+
+        Slot *slot = reinterpret_cast<Slot *>(object);
+        slot->next = this->free_list;
+        this->free_list = slot;
+        --this->live;
+    }
+
+    size_t size() const { return this->live; }
+    size_t capacity() const { return this->slabs.size() * POOL_SLAB_SIZE; }
+
+   private:
+    union Slot {
+        Slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    Slot *free_list = nullptr;
+    size_t live = 0;
+
+    void grow() {
+        Slot *slab = new Slot[POOL_SLAB_SIZE];
+        this->slabs.emplace_back(slab);
+
+        for (size_t i = 0; i < POOL_SLAB_SIZE; ++i) {
+            slab[i].next = this->free_list;
+            this->free_list = &slab[i];
+        }
+    }
+};
+
+// Fixed size buffers, kept for reuse once released. Buffers may be taken
+// and given back on disk I/O threads, so the free list is locked.
+class BufferPool {
+   public:
+    BufferPool(size_t buffer_size) : buffer_size(buffer_size) {}
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    char *acquire();
+    void release(char *buffer);
+
+    size_t getBufferSize() const { return this->buffer_size; }
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->buffers.size() - this->free_buffers.size();
+    }
+
+   private:
+    const size_t buffer_size;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<char[]>> buffers;
+    std::vector<char *> free_buffers;
+};
+}  // namespace tftp
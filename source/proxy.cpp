@@ -0,0 +1,476 @@
+#include "proxy.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "packets.hpp"
+
+namespace tftp {
+namespace {
+// Any datagram, so an oversized block is noticed rather than cut short, and
+// two NUL bytes after it for the OACK decoder
+constexpr ssize_t UPSTREAM_BUFFER_SIZE = UINT16_MAX + 2;
+
+// A request is the opcode, a name of up to 511 bytes, the mode and our two
+// options
+constexpr ssize_t UPSTREAM_REQUEST_SIZE = 1024;
+
+// Hidden file in the same directory, so the rename is atomic
+std::string tempPath(const std::string &filename) {
+    std::filesystem::path path(filename);
+    return (path.parent_path() / ("." + path.filename().string() + ".part"))
+        .string();
+}
+
+bool isTimeout() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+void closeSocket(int socket_fd) {
+#ifdef _WIN32
+    closesocket(socket_fd);
+#else
+    close(socket_fd);
+#endif
+}
+}  // namespace
+
+// Upstream fill
+UpstreamFill::UpstreamFill(const Peer &upstream, const std::string &filename,
+                           std::function<void()> wake)
+    : upstream(upstream),
+      filename(filename),
+      temp_path(tempPath(filename)),
+      wake(std::move(wake)) {
+    Metrics::instance().increment(Counter::UpstreamFetches);
+    this->thread = std::thread(&UpstreamFill::run, this);
+}
+
+UpstreamFill::~UpstreamFill() {
+    this->stopping = true;
+    if (this->thread.joinable()) this->thread.join();
+
+#ifndef _WIN32
+    if (this->fd >= 0) close(this->fd);
+#endif
+}
+
+ssize_t UpstreamFill::read(char *dst, ssize_t size, ssize_t offset) {
+    // Read with the lock held, as the file is closed with it
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->state == State::Failed) return -1;
+    if (this->state == State::Done ||
+        this->fetched < static_cast<uint64_t>(offset + size)) {
+        this->waited = true;
+        return FILE_NOT_READY;
+    }
+
+#ifndef _WIN32
+    return size > 0 ? pread(this->fd, dst, size, offset) : 0;
+#else
+    (void)dst;
+    return size > 0 ? -1 : 0;
+#endif
+}
+
+UpstreamFill::State UpstreamFill::getState() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->state;
+}
+
+void UpstreamFill::run() {
+#ifndef _WIN32
+    // Nested names get their directories
+    std::error_code error;
+    std::filesystem::path parent =
+        std::filesystem::path(this->filename).parent_path();
+    if (!parent.empty()) std::filesystem::create_directories(parent, error);
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->fd = open(this->temp_path.c_str(),
+                        O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+#endif
+    if (this->fd < 0) {
+        TFTP_LOG_WARNING("Failed to create {}", this->temp_path);
+        this->finish(State::Failed);
+        return;
+    }
+
+    if (!this->fetch() || !this->complete()) {
+        std::remove(this->temp_path.c_str());
+        this->finish(State::Failed);
+        return;
+    }
+
+    this->finish(State::Done);
+}
+
+bool UpstreamFill::fetch() {
+    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socket_fd < 0) return false;
+
+    // Wake up periodically to resend and to notice stopping
+#ifdef _WIN32
+    DWORD receive_timeout = UPSTREAM_TIMEOUT_MS;
+#else
+    struct timeval receive_timeout = {UPSTREAM_TIMEOUT_MS / 1000,
+                                      UPSTREAM_TIMEOUT_MS % 1000 * 1000};
+#endif
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO,
+               (const char *)&receive_timeout, sizeof(receive_timeout));
+
+    // Octet whatever the client asked for, the controller translates
+    ReadRequestPacket request(this->filename.c_str(), "octet");
+    request.options["blksize"] = std::to_string(UPSTREAM_BLOCK_SIZE);
+    request.options["tsize"] = "0";
+
+    char reply[UPSTREAM_BUFFER_SIZE];
+    char sent[UPSTREAM_REQUEST_SIZE];
+    ssize_t sent_size = request.serialize(sent);
+
+    // The server answers from the port of its session
+    struct sockaddr_in server = this->upstream.toSockaddr();
+    bool connected = false;
+
+    uint16_t block_size = 512;  // Unless the server takes the option
+    uint64_t blocks = 0;
+    int retries = 0;
+    bool result = false;
+
+    sendto(socket_fd, sent, sent_size, 0, (struct sockaddr *)&server,
+           sizeof(server));
+
+    while (!this->stopping) {
+        struct sockaddr_in from = {};
+#ifdef _WIN32
+        int from_len = sizeof(from);
+#else
+        socklen_t from_len = sizeof(from);
+#endif
+        ssize_t size = recvfrom(socket_fd, reply, UPSTREAM_BUFFER_SIZE - 2, 0,
+                                (struct sockaddr *)&from, &from_len);
+
+        if (size < 0) {
+            if (!isTimeout() || ++retries > UPSTREAM_RETRIES) {
+                TFTP_LOG_WARNING("Upstream timed out fetching {}",
+                                 this->filename);
+                break;
+            }
+
+            // Whatever we sent last got lost, or its answer did
+            sendto(socket_fd, sent, sent_size, 0, (struct sockaddr *)&server,
+                   sizeof(server));
+            continue;
+        }
+
+        // Only the upstream server, and only its session once it has one
+        if (size < 4 || from.sin_addr.s_addr != server.sin_addr.s_addr ||
+            (connected && from.sin_port != server.sin_port)) {
+            continue;
+        }
+        server.sin_port = from.sin_port;
+        connected = true;
+        retries = 0;
+
+        PacketType type =
+            static_cast<PacketType>(ntohs(*reinterpret_cast<uint16_t *>(reply)));
+
+        if (type == PacketType::ERROR) {
+            reply[size] = '\0';
+            ErrorPacket error;
+            error.deserialize(reply);
+            TFTP_LOG_INFO("Upstream refused {}: {}", this->filename,
+                          error.message);
+            break;
+        }
+
+        if (type == PacketType::OACK && blocks == 0) {
+            reply[size] = reply[size + 1] = '\0';
+            OptionAckPacket options;
+            options.deserialize(reply);
+
+            auto option = options.options.find("blksize");
+            if (option != options.options.end()) {
+                block_size = strtoul(option->second.c_str(), nullptr, 10);
+            }
+            option = options.options.find("tsize");
+            if (option != options.options.end()) {
+                this->size = strtoll(option->second.c_str(), nullptr, 10);
+            }
+
+            // Never more than we asked for
+            if (block_size < 8 || block_size > UPSTREAM_BLOCK_SIZE) {
+                TFTP_LOG_WARNING("Upstream sent a bad blksize for {}",
+                                 this->filename);
+                break;
+            }
+
+            sent_size = AckPacket(0).serialize(sent);
+            sendto(socket_fd, sent, sent_size, 0, (struct sockaddr *)&server,
+                   sizeof(server));
+            continue;
+        }
+
+        if (type != PacketType::DATA) continue;
+
+        uint16_t block_number;
+        DataPacket::deserializeHeader(reply, block_number);
+        ssize_t data_size = size - DataPacket::HEADER_SIZE;
+
+        // A duplicate is acknowledged again, anything else is ignored
+        if (block_number == static_cast<uint16_t>(blocks + 1)) {
+            char *data = reply + DataPacket::HEADER_SIZE;
+            if (data_size > block_size || !this->store(data, data_size)) break;
+            ++blocks;
+        } else if (block_number != static_cast<uint16_t>(blocks)) {
+            continue;
+        }
+
+        sent_size = AckPacket(block_number).serialize(sent);
+        sendto(socket_fd, sent, sent_size, 0, (struct sockaddr *)&server,
+               sizeof(server));
+
+        // A short block is the last one
+        if (data_size < block_size) {
+            result = true;
+            break;
+        }
+    }
+
+    closeSocket(socket_fd);
+    return result;
+}
+
+bool UpstreamFill::store(const char *data, ssize_t size) {
+    uint64_t offset;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        offset = this->fetched;
+    }
+
+#ifndef _WIN32
+    if (size > 0 && pwrite(this->fd, data, size, offset) != size) {
+        TFTP_LOG_WARNING("Failed to write {}", this->temp_path);
+        return false;
+    }
+#endif
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->fetched += size;
+    }
+    this->wakeReaders();
+    return true;
+}
+
+bool UpstreamFill::complete() {
+    uint64_t fetched;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        fetched = this->fetched;
+    }
+
+    // A file shorter than announced is not cached
+    ssize_t announced = this->size.load();
+    if (announced >= 0 && static_cast<uint64_t>(announced) != fetched) {
+        TFTP_LOG_WARNING("Upstream sent {} bytes of {} instead of {}", fetched,
+                         this->filename, announced);
+        return false;
+    }
+
+    // The data has to be on disk before the name is, or a crash could
+    // leave a cached file that is cut short
+#ifndef _WIN32
+    if (fdatasync(this->fd) != 0) return false;
+#endif
+    if (std::rename(this->temp_path.c_str(), this->filename.c_str()) != 0) {
+        TFTP_LOG_WARNING("Failed to store {}", this->filename);
+        return false;
+    }
+
+    this->size = fetched;
+    TFTP_LOG_INFO("Cached {} ({} bytes) from upstream", this->filename,
+                  fetched);
+    return true;
+}
+
+void UpstreamFill::finish(State state) {
+    if (state == State::Failed) {
+        Metrics::instance().increment(Counter::UpstreamFailures);
+    }
+
+    // Nothing is read from the temporary file from now on, and a complete
+    // file is read where it is stored
+    this->finish_time_us = Metrics::nowMicros();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->state = state;
+#ifndef _WIN32
+        if (this->fd >= 0) close(this->fd);
+#endif
+        this->fd = -1;
+    }
+    this->wakeReaders();
+}
+
+void UpstreamFill::wakeReaders() {
+    // Only when someone asked, not for every block
+    bool waited;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        waited = this->waited;
+        this->waited = false;
+    }
+    if (waited) this->wake();
+}
+
+// Proxy file worker
+bool ProxyFileWorker::close() {
+    this->fill.reset();
+    return this->local->close();
+}
+
+ssize_t ProxyFileWorker::read(char *dst, ssize_t size, ssize_t offset) {
+    // The file may have been stored since the session started
+    if (!this->stored && this->fill == nullptr) {
+        this->stored = this->local->exists();
+        if (!this->stored) this->fill = this->factory.fetch(this->filename);
+    }
+
+    if (!this->stored &&
+        this->fill->getState() == UpstreamFill::State::Done) {
+        this->stored = true;
+    }
+
+    return this->stored ? this->local->read(dst, size, offset)
+                        : this->fill->read(dst, size, offset);
+}
+
+ssize_t ProxyFileWorker::size() {
+    return this->fill != nullptr ? this->fill->getSize() : -1;
+}
+
+// Proxy file worker factory
+ProxyFileWorkerFactory::ProxyFileWorkerFactory(FileWorkerFactory &files,
+                                               const std::string &address,
+                                               uint16_t port)
+    : files(files) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        throw std::invalid_argument("Invalid upstream address!");
+    }
+    this->upstream = Peer::fromSockaddr(addr);
+}
+
+FileWorker *ProxyFileWorkerFactory::create(std::string filename,
+                                           FileWorkerMode mode) {
+    // Anything stored locally is served as it is
+    FileWorker *local = this->files.create(filename, mode);
+    if (local->exists() || !isCacheable(filename)) return local;
+
+    // Sessions that come while the file is fetched see its size
+    std::shared_ptr<UpstreamFill> fill;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        fill = this->findFill(filename);
+    }
+    bool missing =
+        fill != nullptr && fill->getState() == UpstreamFill::State::Failed;
+
+    return this->workers.create(filename, mode, local, *this,
+                                missing ? nullptr : std::move(fill), missing);
+}
+
+void ProxyFileWorkerFactory::destroy(FileWorker *file_worker) {
+    auto proxy = dynamic_cast<ProxyFileWorker *>(file_worker);
+    if (proxy != nullptr) {
+        FileWorker *local = proxy->getLocal();
+        this->workers.destroy(proxy);
+        this->files.destroy(local);
+
+        // It may have held the last session of a fetch that is done
+        this->release();
+    } else {
+        this->files.destroy(file_worker);
+    }
+}
+
+std::shared_ptr<UpstreamFill> ProxyFileWorkerFactory::fetch(
+    const std::string &filename) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    std::shared_ptr<UpstreamFill> fill = this->findFill(filename);
+    if (fill == nullptr) {
+        fill = std::make_shared<UpstreamFill>(this->upstream, filename, [this] {
+            std::lock_guard<std::mutex> lock(this->wake_mutex);
+            if (this->wake) this->wake();
+        });
+        this->fills[filename] = fill;
+    }
+    return fill;
+}
+
+void ProxyFileWorkerFactory::setReadyWake(std::function<void()> wake) {
+    std::lock_guard<std::mutex> lock(this->wake_mutex);
+    this->wake = std::move(wake);
+}
+
+void ProxyFileWorkerFactory::release() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    // The thread of a fetch that is done has ended, so it joins at once
+    for (auto it = this->fills.begin(); it != this->fills.end();) {
+        if (it->second->getState() == UpstreamFill::State::Done) {
+            it = this->fills.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool ProxyFileWorkerFactory::isCacheable(const std::string &filename) {
+    std::filesystem::path path(filename);
+    if (filename.empty() || path.is_absolute()) return false;
+
+    for (const auto &part : path) {
+        if (part == "..") return false;
+    }
+    return true;
+}
+
+std::shared_ptr<UpstreamFill> ProxyFileWorkerFactory::findFill(
+    const std::string &filename) {
+    auto it = this->fills.find(filename);
+    if (it == this->fills.end()) return nullptr;
+
+    // A cached file is found locally from now on
+    UpstreamFill::State state = it->second->getState();
+    if (state == UpstreamFill::State::Done ||
+        (state == UpstreamFill::State::Failed &&
+         Metrics::nowMicros() - it->second->getFinishTime() >
+             UPSTREAM_RETRY_DELAY_US)) {
+        this->fills.erase(it);
+        return nullptr;
+    }
+
+    return it->second;
+}
+}  // namespace tftp
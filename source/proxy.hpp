@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "files.hpp"
+#include "filesystem.hpp"
+#include "peer.hpp"
+#include "pool.hpp"
+
+namespace tftp {
+// Block size asked of the upstream server, which fits an Ethernet frame
+constexpr inline uint16_t UPSTREAM_BLOCK_SIZE = 1428;
+constexpr inline int UPSTREAM_TIMEOUT_MS = 1000;
+constexpr inline int UPSTREAM_RETRIES = 5;
+
+// A file that could not be fetched is reported missing for this long before
+// it is asked for again
+constexpr inline uint64_t UPSTREAM_RETRY_DELAY_US = 10 * 1000 * 1000;
+
+// One file being fetched from the upstream server on a thread of its own.
+// Blocks are written to a hidden file next to where the file goes, which is
+// renamed into place once the whole file is there. Sessions stream the file
+// while it is still coming in, without waiting for it: bytes that are not
+// there yet are not ready to read. Thread safe.
+class UpstreamFill {
+   public:
+    enum class State {
+        Running,
+        Done,
+        Failed,
+    };
+
+    // Calls wake once a read that was not ready may succeed
+    UpstreamFill(const Peer &upstream, const std::string &filename,
+                 std::function<void()> wake);
+    ~UpstreamFill();
+    UpstreamFill(const UpstreamFill &) = delete;
+    UpstreamFill &operator=(const UpstreamFill &) = delete;
+
+    // Returns FILE_NOT_READY until the bytes have been fetched, and once the
+    // file is complete, as it is then read where it is stored. -1 if the
+    // fetch failed.
+    ssize_t read(char *dst, ssize_t size, ssize_t offset);
+
+    // From the tsize option of the upstream server until the file is
+    // complete. -1 if unknown.
+    ssize_t getSize() const { return this->size.load(); }
+
+    State getState();
+    uint64_t getFinishTime() const { return this->finish_time_us.load(); }
+
+   private:
+    const Peer upstream;
+    const std::string filename;
+    const std::string temp_path;
+    const std::function<void()> wake;
+
+    std::mutex mutex;
+    int fd = -1;  // Closed once the fetch is over
+    State state = State::Running;
+    uint64_t fetched = 0;  // Bytes written to the temporary file
+    bool waited = false;   // A read was not ready since the last wake
+
+    std::atomic<ssize_t> size{-1};
+    std::atomic<uint64_t> finish_time_us{0};
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+
+    void run();
+    bool fetch();
+    bool store(const char *data, ssize_t size);
+    bool complete();
+    void finish(State state);
+    void wakeReaders();
+};
+
+class ProxyFileWorkerFactory;
+
+// A file that is not stored locally. Reads are served by the upstream
+// fetch, which the first read starts or joins. Anything else goes to the
+// local worker, so uploads are stored locally.
+class ProxyFileWorker : public FileWorker {
+   public:
+    ProxyFileWorker(const std::string filename, const FileWorkerMode mode,
+                    FileWorker *local, ProxyFileWorkerFactory &factory,
+                    std::shared_ptr<UpstreamFill> fill, bool missing)
+        : FileWorker(filename, mode),
+          local(local),
+          factory(factory),
+          fill(std::move(fill)),
+          missing(missing) {}
+
+    virtual bool open() { return this->local->open(); }
+    virtual bool close();
+    virtual bool exists() { return !this->missing; }
+    virtual bool remove() { return this->local->remove(); }
+
+    virtual ssize_t read(char *dst, ssize_t size, ssize_t offset = 0);
+    virtual ssize_t write(char *src, ssize_t size, ssize_t offset = 0) {
+        return this->local->write(src, size, offset);
+    }
+    virtual ssize_t append(char *src, ssize_t size) {
+        return this->local->append(src, size);
+    }
+    virtual ssize_t size();
+
+    virtual bool commit() { return this->local->commit(); }
+    virtual std::string getUploadName() const {
+        return this->local->getUploadName();
+    }
+    virtual void setCommitted() { this->local->setCommitted(); }
+
+    FileWorker *getLocal() const { return this->local; }
+
+   private:
+    FileWorker *local;
+    ProxyFileWorkerFactory &factory;
+    std::shared_ptr<UpstreamFill> fill;
+    bool missing;         // The last fetch failed not long ago
+    bool stored = false;  // Read where it is stored from now on
+};
+
+// Edge cache in front of an upstream TFTP server. Files that are not stored
+// locally are fetched on the first read and kept for later requests, and
+// every session asking for a file while it is fetched shares the fetch.
+// Local files, compressed images included, are served by the factory it
+// wraps. Cached files are kept until they are removed by hand.
+class ProxyFileWorkerFactory : public FileWorkerFactory {
+   public:
+    // Throws std::invalid_argument for an address that is not IPv4
+    ProxyFileWorkerFactory(FileWorkerFactory &files,
+                           const std::string &address, uint16_t port);
+
+    virtual FileWorker *create(std::string filename, FileWorkerMode mode);
+    virtual void destroy(FileWorker *file_worker);
+    virtual void setReadyWake(std::function<void()> wake);
+
+    // Returns the running fetch of the file, starting one if there is none.
+    // Called from disk I/O threads.
+    std::shared_ptr<UpstreamFill> fetch(const std::string &filename);
+
+    // Forgets the fetches that are done, as their files are found locally
+    // from then on. Called as proxied sessions end.
+    void release();
+
+    // Only relative names without ".." are stored, so nothing is written
+    // outside the working directory
+    static bool isCacheable(const std::string &filename);
+
+   private:
+    FileWorkerFactory &files;
+    Peer upstream;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<UpstreamFill>> fills;
+
+    ObjectPool<ProxyFileWorker> workers;
+
+    // Fetches call it through the factory, so it can be taken away while
+    // they run
+    std::mutex wake_mutex;
+    std::function<void()> wake;
+
+    // Drops the fetch if it is done, or failed long enough ago to be tried
+    // again. Called with the mutex held.
+    std::shared_ptr<UpstreamFill> findFill(const std::string &filename);
+};
+}  // namespace tftp
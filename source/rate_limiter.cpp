@@ -0,0 +1,73 @@
+#include "rate_limiter.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace tftp {
+namespace {
+constexpr uint64_t TOKEN = 1000000;
+}
+
+RateLimiter::RateLimiter(size_t slots) {
+    size_t sets = 16;
+    while (sets * RATE_LIMITER_WAYS < slots) sets *= 2;
+
+    this->buckets.resize(sets * RATE_LIMITER_WAYS);
+    this->set_mask = sets - 1;
+}
+
+void RateLimiter::configure(uint32_t rate, uint32_t burst) {
+    this->rate = rate;
+    this->capacity = std::max<uint64_t>(burst, 1) * TOKEN;
+
+    // Forget buckets filled under other settings
+    for (Bucket &bucket : this->buckets) bucket = Bucket();
+}
+
+bool RateLimiter::allow(const Peer &peer, uint64_t now_us) {
+    if (this->rate == 0) return true;
+
+    Peer source = peer;
+    source.port = 0;
+    Bucket *set =
+        &this->buckets[(source.hash() & this->set_mask) * RATE_LIMITER_WAYS];
+
+    // The bucket of the source, or else the one used longest ago
+    Bucket *bucket = nullptr;
+    Bucket *oldest = set;
+    for (size_t way = 0; way < RATE_LIMITER_WAYS; ++way) {
+        Bucket &candidate = set[way];
+        if (candidate.updated_us != 0 &&
+            memcmp(candidate.address, source.address,
+                   sizeof(source.address)) == 0) {
+            bucket = &candidate;
+            break;
+        }
+        if (candidate.updated_us < oldest->updated_us) oldest = &candidate;
+    }
+
+    if (bucket == nullptr) {
+        bucket = oldest;
+        memcpy(bucket->address, source.address, sizeof(source.address));
+
+        // Only a bucket never used starts full
+        if (bucket->updated_us == 0) {
+            bucket->tokens = this->capacity;
+            bucket->updated_us = now_us;
+        }
+    }
+
+    // Refilling for longer than it takes to fill the bucket changes nothing,
+    // and would overflow after a long idle time
+    uint64_t elapsed_us =
+        now_us > bucket->updated_us ? now_us - bucket->updated_us : 0;
+    elapsed_us = std::min(elapsed_us, this->capacity / this->rate + 1);
+    bucket->tokens =
+        std::min(this->capacity, bucket->tokens + elapsed_us * this->rate);
+    bucket->updated_us = now_us;
+
+    if (bucket->tokens < TOKEN) return false;
+    bucket->tokens -= TOKEN;
+    return true;
+}
+}  // namespace tftp
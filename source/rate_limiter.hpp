@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "peer.hpp"
+
+namespace tftp {
+constexpr inline size_t RATE_LIMITER_SLOTS = 4096;
+constexpr inline size_t RATE_LIMITER_WAYS = 4;  // Buckets a source may use
+
+// Token buckets per source address, whatever the port, in a fixed
+// set-associative table, so memory stays bounded however many addresses a
+// flood comes from. A source that finds no bucket of its own in its set
+// takes over the one used longest ago, with the tokens it has refilled to
+// by then. So sources that share a set cannot hand each other full
+// buckets. Not thread safe.
+class RateLimiter {
+   public:
+    RateLimiter(size_t slots = RATE_LIMITER_SLOTS);
+
+    // Packets per second and burst per source. A rate of zero turns
+    // limiting off.
+    void configure(uint32_t rate, uint32_t burst);
+    bool isEnabled() const { return this->rate > 0; }
+
+    // Takes a token from the bucket of the source. False if it is empty.
+    bool allow(const Peer &peer, uint64_t now_us);
+
+   private:
+    // Tokens are kept in millionths, so refilling needs no division
+    struct Bucket {
+        uint8_t address[16];
+        uint64_t tokens;
+        uint64_t updated_us;
+    };
+
+    std::vector<Bucket> buckets;
+    size_t set_mask;
+    uint32_t rate = 0;
+    uint64_t capacity = 0;
+};
+}  // namespace tftp
@@ -0,0 +1,187 @@
+#include "scheduler.hpp"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "session_table.hpp"
+
+namespace tftp {
+SendScheduler::SendScheduler(uint32_t quantum) : quantum(quantum) {}
+
+void SendScheduler::enqueue(uint32_t session, uint8_t priority,
+                            uint32_t cost) {
+    if (priority >= PRIORITY_CLASS_COUNT) priority = PRIORITY_CLASS_COUNT - 1;
+    this->classes[priority].push({session, cost, 0});
+}
+
+uint32_t SendScheduler::dequeue() {
+    for (Ring &ring : this->classes) {
+        if (ring.empty()) continue;
+
+        while (true) {
+            // Every session gets one quantum per visit, and sends once that
+            // covers its reply
+            size_t visits = ring.size();
+            for (size_t i = 0; i < visits; ++i) {
+                Entry entry = ring.pop();
+                entry.deficit += this->quantum;
+
+                // The deficit is dropped with the reply, as the session has
+                // nothing else waiting
+                if (entry.cost <= entry.deficit) return entry.session;
+                ring.push(entry);
+            }
+
+            // Nobody could send in a whole round, so skip the rounds until
+            // the first one can
+            uint32_t rounds = UINT32_MAX;
+            for (size_t i = 0; i < ring.size(); ++i) {
+                const Entry &entry = ring.at(i);
+                uint32_t missing = entry.cost - entry.deficit;
+                rounds = std::min(rounds,
+                                  (missing + this->quantum - 1) / this->quantum);
+            }
+
+            for (size_t i = 0; i < ring.size(); ++i) {
+                ring.at(i).deficit += (rounds - 1) * this->quantum;
+            }
+        }
+    }
+
+    return NO_SESSION;
+}
+
+size_t SendScheduler::size() const {
+    size_t size = 0;
+    for (const Ring &ring : this->classes) size += ring.size();
+    return size;
+}
+
+void SendScheduler::Ring::push(const Entry &entry) {
+    // Grow to the next power of two, keeping the order
+    if (this->count == this->entries.size()) {
+        std::vector<Entry> entries(std::max<size_t>(16, this->count * 2));
+        for (size_t i = 0; i < this->count; ++i) entries[i] = this->at(i);
+
+        this->entries.swap(entries);
+        this->head = 0;
+    }
+
+    this->at(this->count++) = entry;
+}
+
+SendScheduler::Entry SendScheduler::Ring::pop() {
+    Entry entry = this->front();
+    this->head = (this->head + 1) & (this->entries.size() - 1);
+    --this->count;
+    return entry;
+}
+
+void PriorityRules::add(uint8_t priority, const std::string &rule) {
+    if (priority >= PRIORITY_CLASS_COUNT) {
+        throw std::invalid_argument("Invalid priority class!");
+    }
+
+    Rule parsed = {priority, false, rule, {}, 0};
+
+    // Anything that parses as ADDRESS/LENGTH is a subnet
+    size_t slash = rule.find('/');
+    if (slash != std::string::npos) {
+        std::string address = rule.substr(0, slash);
+        std::string length = rule.substr(slash + 1);
+        struct in_addr ipv4;
+        struct in6_addr ipv6;
+
+        bool numeric = !length.empty() && length.size() <= 3 &&
+                       length.find_first_not_of("0123456789") ==
+                           std::string::npos;
+
+        if (numeric && inet_pton(AF_INET, address.c_str(), &ipv4) == 1) {
+            // Stored mapped into IPv6, like peers
+            parsed.subnet = true;
+            parsed.address[10] = 0xFF;
+            parsed.address[11] = 0xFF;
+            memcpy(parsed.address + 12, &ipv4, 4);
+            parsed.prefix_length = 96 + std::stoul(length);
+        } else if (numeric &&
+                   inet_pton(AF_INET6, address.c_str(), &ipv6) == 1) {
+            parsed.subnet = true;
+            memcpy(parsed.address, &ipv6, 16);
+            parsed.prefix_length = std::stoul(length);
+        }
+
+        if (parsed.subnet && parsed.prefix_length > 128) {
+            throw std::invalid_argument("Invalid subnet prefix length!");
+        }
+    }
+
+    this->rules.push_back(parsed);
+}
+
+void PriorityRules::add(const std::string &rule) {
+    size_t colon = rule.find(':');
+    if (colon == std::string::npos || colon == 0) {
+        throw std::invalid_argument("Priority rules look like CLASS:RULE!");
+    }
+
+    // Checked before it is narrowed, so 257 is no class 1
+    size_t end;
+    unsigned long priority = std::stoul(rule.substr(0, colon), &end);
+    if (end != colon || priority >= PRIORITY_CLASS_COUNT) {
+        throw std::invalid_argument("Invalid priority class!");
+    }
+
+    this->add(static_cast<uint8_t>(priority), rule.substr(colon + 1));
+}
+
+uint8_t PriorityRules::classify(const Peer &peer, const char *filename) const {
+    for (const Rule &rule : this->rules) {
+        bool match = rule.subnet ? matchSubnet(rule, peer)
+                                 : matchPattern(rule.pattern.c_str(), filename);
+        if (match) return rule.priority;
+    }
+
+    return DEFAULT_PRIORITY_CLASS;
+}
+
+bool PriorityRules::matchSubnet(const Rule &rule, const Peer &peer) {
+    unsigned int full_bytes = rule.prefix_length / 8;
+    if (memcmp(rule.address, peer.address, full_bytes) != 0) return false;
+
+    unsigned int bits = rule.prefix_length % 8;
+    if (bits == 0) return true;
+
+    uint8_t mask = 0xFF << (8 - bits);
+    return (rule.address[full_bytes] & mask) ==
+           (peer.address[full_bytes] & mask);
+}
+
+bool PriorityRules::matchPattern(const char *pattern, const char *filename) {
+    // Backtracks to the last * only, which is enough for globs
+    const char *star = nullptr;
+    const char *resume = nullptr;
+
+    while (*filename != '\0') {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = filename;
+        } else if (*pattern == '?' || *pattern == *filename) {
+            ++pattern;
+            ++filename;
+        } else if (star != nullptr) {
+            pattern = star + 1;
+            filename = ++resume;
+        } else {
+            return false;
+        }
+    }
+
+    while (*pattern == '*') ++pattern;
+    return *pattern == '\0';
+}
+}  // namespace tftp
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "peer.hpp"
+
+namespace tftp {
+constexpr inline uint32_t DEFAULT_SCHEDULER_QUANTUM = 8192;
+constexpr inline unsigned int PRIORITY_CLASS_COUNT = 4;
+constexpr inline uint8_t DEFAULT_PRIORITY_CLASS = 1;
+
+// Picks the session whose ready reply is sent next. Within a priority class
+// sessions are served by deficit round-robin, so each gets about a quantum
+// of bytes per round whatever its block size, and large blocks cannot
+// crowd out small ones. Classes are strict: lower ones go first.
+class SendScheduler {
+   public:
+    SendScheduler(uint32_t quantum = DEFAULT_SCHEDULER_QUANTUM);
+
+    void setQuantum(uint32_t quantum) { this->quantum = quantum; }
+    uint32_t getQuantum() const { return this->quantum; }
+
+    // A session has a reply of the given size ready. Sessions have at most
+    // one reply waiting.
+    void enqueue(uint32_t session, uint8_t priority, uint32_t cost);
+
+    // Takes the session that sends next, or NO_SESSION if none is waiting
+    uint32_t dequeue();
+
+    size_t size() const;
+
+   private:
+    struct Entry {
+        uint32_t session;
+        uint32_t cost;
+        uint32_t deficit;
+    };
+
+    // Sessions waiting in a class, in round-robin order
+    class Ring {
+       public:
+        bool empty() const { return this->count == 0; }
+        size_t size() const { return this->count; }
+
+        Entry &front() { return this->entries[this->head]; }
+        Entry &at(size_t i) {
+            return this->entries[(this->head + i) & (this->entries.size() - 1)];
+        }
+
+        void push(const Entry &entry);
+        Entry pop();
+
+       private:
+        std::vector<Entry> entries;  // Size is a power of two
+        size_t head = 0;
+        size_t count = 0;
+    };
+
+    uint32_t quantum;
+    Ring classes[PRIORITY_CLASS_COUNT];
+};
+
+// Assigns sessions to priority classes. A rule is a client subnet such as
+// 10.1.0.0/16, or a filename pattern where * and ? match any characters and
+// any one character. The first matching rule wins.
+class PriorityRules {
+   public:
+    // Throws std::invalid_argument for a class out of range
+    void add(uint8_t priority, const std::string &rule);
+
+    // Parses CLASS:RULE, as given on the command line
+    void add(const std::string &rule);
+
+    uint8_t classify(const Peer &peer, const char *filename) const;
+
+    bool empty() const { return this->rules.empty(); }
+
+    // Whether the filename matches a pattern of * and ?
+    static bool matchPattern(const char *pattern, const char *filename);
+
+   private:
+    struct Rule {
+        uint8_t priority;
+        bool subnet;
+        std::string pattern;
+        uint8_t address[16];
+        unsigned int prefix_length;
+    };
+
+    std::vector<Rule> rules;
+
+    static bool matchSubnet(const Rule &rule, const Peer &peer);
+};
+}  // namespace tftp
@@ -1,9 +1,18 @@
 #include "server.hpp"
 
-#include <iostream>
+#include <cerrno>
+#include <cstring>
 #include <stdexcept>
 
 #include "common.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+// Older headers lack the busy polling options of Linux 5.11
+#if defined(__linux__) && !defined(SO_PREFER_BUSY_POLL)
+#define SO_PREFER_BUSY_POLL 69
+#endif
 
 namespace tftp {
 Server::Server(std::string ip, unsigned int port, PacketHandler &packet_handler)
@@ -21,6 +30,15 @@ Server::Server(std::string ip, unsigned int port, PacketHandler &packet_handler)
         throw std::runtime_error("Failed to create socket");
     }
 
+    // Wake up periodically so stop() is noticed
+#ifdef _WIN32
+    DWORD receive_timeout = SERVER_POLL_INTERVAL_MS;
+#else
+    struct timeval receive_timeout = {0, SERVER_POLL_INTERVAL_MS * 1000};
+#endif
+    setsockopt(this->socket_fd, SOL_SOCKET, SO_RCVTIMEO,
+               (const char *)&receive_timeout, sizeof(receive_timeout));
+
     this->server_addr.sin_family = AF_INET;
     this->server_addr.sin_addr.s_addr = inet_addr(ip.c_str());
     this->server_addr.sin_port = htons(port);
@@ -35,69 +53,352 @@ Server::~Server() {
 #endif
 }
 
+void Server::setMulticastOptions(const std::string &interface_ip,
+                                 unsigned int ttl) {
+    if (!interface_ip.empty()) {
+        struct in_addr interface_addr;
+        interface_addr.s_addr = inet_addr(interface_ip.c_str());
+        if (setsockopt(this->socket_fd, IPPROTO_IP, IP_MULTICAST_IF,
+                       (const char *)&interface_addr,
+                       sizeof(interface_addr)) < 0) {
+            throw std::runtime_error("Failed to set the multicast interface");
+        }
+    }
+
+    unsigned char multicast_ttl = ttl;
+    setsockopt(this->socket_fd, IPPROTO_IP, IP_MULTICAST_TTL,
+               (const char *)&multicast_ttl, sizeof(multicast_ttl));
+}
+
+int Server::setSocketBuffers(int size) {
+    // Past net.core.rmem_max and wmem_max only when privileged
+    bool forced = false;
+#ifdef SO_RCVBUFFORCE
+    forced = setsockopt(this->socket_fd, SOL_SOCKET, SO_RCVBUFFORCE,
+                        (const char *)&size, sizeof(size)) == 0 &&
+             setsockopt(this->socket_fd, SOL_SOCKET, SO_SNDBUFFORCE,
+                        (const char *)&size, sizeof(size)) == 0;
+#endif
+    if (!forced) {
+        setsockopt(this->socket_fd, SOL_SOCKET, SO_RCVBUF, (const char *)&size,
+                   sizeof(size));
+        setsockopt(this->socket_fd, SOL_SOCKET, SO_SNDBUF, (const char *)&size,
+                   sizeof(size));
+    }
+
+    int receive_size = 0;
+#ifdef _WIN32
+    int length = sizeof(receive_size);
+#else
+    socklen_t length = sizeof(receive_size);
+#endif
+    getsockopt(this->socket_fd, SOL_SOCKET, SO_RCVBUF, (char *)&receive_size,
+               &length);
+    return receive_size;
+}
+
+void Server::setBusyPoll(unsigned int busy_poll_us, unsigned int idle_ms) {
+#ifdef _WIN32
+    (void)busy_poll_us;
+    (void)idle_ms;
+    throw std::runtime_error("Busy polling is not supported on Windows");
+#else
+#ifdef SO_BUSY_POLL
+    // Both need CAP_NET_ADMIN above net.core.busy_read. Without them the
+    // server still spins, but only on the socket queue.
+    int value = busy_poll_us;
+    if (busy_poll_us > 0 &&
+        setsockopt(this->socket_fd, SOL_SOCKET, SO_BUSY_POLL, &value,
+                   sizeof(value)) < 0) {
+        TFTP_LOG_WARNING("Failed to set SO_BUSY_POLL, spinning without it");
+    }
+
+    // Keeps the NIC's interrupts off while the server polls its queue
+    int prefer = 1;
+    if (busy_poll_us > 0 &&
+        setsockopt(this->socket_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+                   sizeof(prefer)) < 0) {
+        TFTP_LOG_DEBUG("Failed to set SO_PREFER_BUSY_POLL");
+    }
+#else
+    (void)busy_poll_us;
+#endif
+
+    this->busy_poll = true;
+    this->busy_poll_idle_ms = idle_ms;
+#endif
+}
+
+void Server::setXdp(const std::string &interface, unsigned int queue,
+                    bool generic) {
+    this->xdp.reset(new XdpSocket(interface, queue,
+                                  ntohs(this->server_addr.sin_port), generic));
+    TFTP_LOG_INFO("DATA and ACK packets on {} queue {} bypass the kernel{}",
+                  interface, queue, generic ? " (generic XDP)" : "");
+}
+
 void Server::listen() {
-    std::cout << "Listening on " << inet_ntoa(this->server_addr.sin_addr) << ":"
-              << ntohs(this->server_addr.sin_port) << std::endl;
+    TFTP_LOG_INFO("Listening on {}:{}", inet_ntoa(this->server_addr.sin_addr),
+                  ntohs(this->server_addr.sin_port));
 
     if (bind(this->socket_fd, (struct sockaddr *)&this->server_addr,
              sizeof(this->server_addr)) < 0) {
         throw std::runtime_error("Failed to bind socket");
     }
 
-    for (;;) {
-        // For safety reasons, we clear the buffer on each request
-        memset(this->request, 0, BUFFER_SIZE);
-        memset(this->response, 0, BUFFER_SIZE);
+    uint64_t last_timeout_check_us = Metrics::nowMicros();
+    bool replies_left = false;
+    bool packets_left = false;
+
+    this->last_request_us = last_timeout_check_us;
+    if (this->busy_poll) this->startBusyPolling();
+
+    while (this->running.load()) {
+        // Frames queued last time go out before we wait
+        if (this->xdp != nullptr) this->xdp->flush();
+
+        // Replies finished in the background go out first. Do not wait if
+        // some were left over last time, or while busy polling, where the
+        // receive below does not wait either.
+        bool request_ready =
+            this->busy_polling ||
+            this->waitForRequest(replies_left || packets_left
+                                     ? 0
+                                     : SERVER_POLL_INTERVAL_MS);
+        replies_left = this->sendReadyReplies();
+
+        // Then the transfer packets the XDP program took from the kernel
+        if (this->xdp != nullptr) {
+            unsigned int received = this->receiveXdp();
+            packets_left = received == SERVER_RECEIVE_BATCH;
+            if (received > 0) {
+                this->last_request_us = Metrics::nowMicros();
+                if (this->busy_poll && !this->busy_polling) {
+                    this->startBusyPolling();
+                }
+            }
+        }
+
+        // Let sessions expire, also while packets keep arriving
+        uint64_t now_us = Metrics::nowMicros();
+        if (now_us - last_timeout_check_us >=
+            TIMEOUT_CHECK_INTERVAL_MS * 1000) {
+            last_timeout_check_us = now_us;
+            this->packet_handler.handleTimeouts();
+            if (this->busy_polling) this->sampleBusyPolling();
+        }
+
+        if (!request_ready) continue;
 
 // Attempt to receive data
 #ifdef _WIN32
         int client_len = sizeof(this->client_addr);
-
+        int flags = 0;
 #else
         socklen_t client_len = sizeof(this->client_addr);
+        int flags = this->busy_polling ? MSG_DONTWAIT : 0;
 #endif
         ssize_t request_size =
-            recvfrom(this->socket_fd, this->request, BUFFER_SIZE, 0,
+            recvfrom(this->socket_fd, this->request, BUFFER_SIZE, flags,
                      (struct sockaddr *)&this->client_addr, &client_len);
 
         if (request_size > BUFFER_SIZE) {
-            std::cout << "Ignoring request from "
-                      << inet_ntoa(this->client_addr.sin_addr) << ":"
-                      << ntohs(this->client_addr.sin_port)
-                      << " because it is too large" << std::endl;
+            TFTP_LOG_WARNING("Ignoring request from {}:{} because it is too large",
+                             inet_ntoa(this->client_addr.sin_addr),
+                             ntohs(this->client_addr.sin_port));
 
             continue;
         }
 
         if (request_size < 0) {
-            throw std::runtime_error("Failed to receive data");
+            if (!isReceiveTimeout()) {
+                throw std::runtime_error("Failed to receive data");
+            }
+
+            // Spinning through a quiet spell only burns the CPU
+            if (this->busy_polling) {
+                ++this->busy_poll_empty;
+                if (this->busy_poll_idle_ms > 0 &&
+                    now_us - this->last_request_us >=
+                        this->busy_poll_idle_ms * 1000ull) {
+                    this->sampleBusyPolling();
+                    this->busy_polling = false;
+                    TFTP_LOG_DEBUG("Idle, no longer busy polling");
+                }
+            }
+            continue;
         }
 
-        std::cout << "Received " << request_size << " bytes from "
-                  << inet_ntoa(this->client_addr.sin_addr) << ":"
-                  << ntohs(this->client_addr.sin_port) << std::endl;
+        this->last_request_us = now_us;
+        if (this->busy_poll && !this->busy_polling) this->startBusyPolling();
 
-        // Handle the request
-        ssize_t response_size = this->packet_handler.handlePacket(
-            this->request, this->response, request_size);
+        this->handleRequest(request_size);
+    }
 
-        // Skip packets that don't require a response
-        if (response_size <= 0) {
-            continue;
+    if (this->busy_poll) {
+        if (this->busy_polling) this->sampleBusyPolling();
+
+        MetricsSnapshot snapshot = Metrics::instance().snapshot();
+        TFTP_LOG_INFO(
+            "Busy polling used {} ms of CPU, {} polls found nothing",
+            snapshot.counters[static_cast<unsigned int>(
+                Counter::BusyPollMicros)] / 1000,
+            snapshot.counters[static_cast<unsigned int>(
+                Counter::BusyPollEmpty)]);
+    }
+
+    TFTP_LOG_INFO("Server stopped");
+}
+
+void Server::stop() { this->running = false; }
+
+unsigned int Server::receiveXdp() {
+    unsigned int received = 0;
+    for (; received < SERVER_RECEIVE_BATCH; ++received) {
+        ssize_t request_size = this->xdp->receive(this->request, BUFFER_SIZE,
+                                                  this->client_addr);
+        if (request_size < 0) break;
+
+        Metrics::instance().increment(Counter::XdpPacketsReceived);
+        this->handleRequest(request_size);
+    }
+
+    return received;
+}
+
+void Server::handleRequest(ssize_t request_size) {
+    // For safety reasons, strings in the request are always terminated
+    this->request[request_size] = '\0';
+    this->request[request_size + 1] = '\0';
+
+    TFTP_PROBE2(receive, request_size, ntohs(this->client_addr.sin_port));
+
+    Metrics::instance().increment(Counter::PacketsReceived);
+    Metrics::instance().increment(Counter::BytesReceived, request_size);
+
+    TFTP_LOG_DEBUG("Received {} bytes from {}:{}", request_size,
+                   inet_ntoa(this->client_addr.sin_addr),
+                   ntohs(this->client_addr.sin_port));
+
+    // Handle the request
+    ssize_t response_size = this->packet_handler.handlePacket(
+        Peer::fromSockaddr(this->client_addr), this->request, this->response,
+        request_size);
+
+    // Skip packets that don't require a response
+    if (response_size <= 0) return;
+
+    this->sendResponse(this->client_addr, response_size);
+}
+
+bool Server::waitForRequest(int timeout_ms) {
+#ifdef _WIN32
+    // Without a wake descriptor, recvfrom() waits and replies are late by up
+    // to the poll interval
+    (void)timeout_ms;
+    return true;
+#else
+    struct pollfd fds[3] = {{(int)this->socket_fd, POLLIN, 0}};
+    nfds_t count = 1;
+    int wake_fd = this->packet_handler.getWakeFd();
+    if (wake_fd >= 0) fds[count++] = {wake_fd, POLLIN, 0};
+    if (this->xdp != nullptr) fds[count++] = {this->xdp->getFd(), POLLIN, 0};
+
+    if (poll(fds, count, timeout_ms) < 0) {
+        if (errno == EINTR) return false;
+        throw std::runtime_error("Failed to poll socket");
+    }
+
+    // Empty the wake descriptor before the replies are taken, so a reply
+    // that becomes ready afterwards wakes us again
+    if (wake_fd >= 0 && (fds[1].revents & POLLIN)) {
+        char drain[64];
+        while (read(fds[1].fd, drain, sizeof(drain)) > 0) {
+        }
+    }
+
+    return (fds[0].revents & POLLIN) != 0;
+#endif
+}
+
+void Server::startBusyPolling() {
+    this->busy_polling = true;
+    this->busy_poll_cpu_us = Metrics::threadCpuMicros();
+    this->busy_poll_empty = 0;
+    TFTP_LOG_DEBUG("Busy polling");
+}
+
+void Server::sampleBusyPolling() {
+    uint64_t cpu_us = Metrics::threadCpuMicros();
+    Metrics::instance().increment(Counter::BusyPollMicros,
+                                  cpu_us - this->busy_poll_cpu_us);
+    Metrics::instance().increment(Counter::BusyPollEmpty,
+                                  this->busy_poll_empty);
+    this->busy_poll_cpu_us = cpu_us;
+    this->busy_poll_empty = 0;
+}
+
+bool Server::sendReadyReplies() {
+    Peer peer;
+    ssize_t response_size;
+
+    for (unsigned int i = 0; i < SERVER_SEND_BATCH; ++i) {
+        if (!this->packet_handler.nextReply(peer, this->response,
+                                            response_size)) {
+            return false;
         }
 
-        // Send the response
-        ssize_t bytes_sent = sendto(
-            this->socket_fd, this->response, response_size, 0,
-            (struct sockaddr *)&this->client_addr, sizeof(this->client_addr));
+        if (response_size > 0) {
+            this->sendResponse(peer.toSockaddr(), response_size);
+        }
+    }
 
-        if (bytes_sent < 0) {
-            throw std::runtime_error("Failed to send data");
+    // There may be more
+    return true;
+}
+
+void Server::sendResponse(const struct sockaddr_in &addr,
+                          ssize_t response_size) {
+    ssize_t bytes_sent;
+    {
+        TFTP_PHASE_SCOPE(Phase::Send);
+        if (this->xdp != nullptr &&
+            this->xdp->send(addr, this->response, response_size)) {
+            bytes_sent = response_size;
+            Metrics::instance().increment(Counter::XdpPacketsSent);
+        } else {
+            bytes_sent =
+                sendto(this->socket_fd, this->response, response_size, 0,
+                       (const struct sockaddr *)&addr, sizeof(addr));
         }
+    }
 
-        std::cout << "Sent " << response_size << " bytes to "
-                  << inet_ntoa(this->client_addr.sin_addr) << ":"
-                  << ntohs(this->client_addr.sin_port) << std::endl;
+    const TraceContext &context = TraceContext::current();
+    TFTP_PROBE3(send, context.session_id, context.block_number, bytes_sent);
+
+    // A reply that cannot go out, such as a block for a multicast group
+    // without a route, or one the socket has no room for, is lost like any
+    // other packet
+    if (bytes_sent < 0) {
+        Metrics::instance().increment(Counter::SendFailures);
+        TFTP_LOG_WARNING("Failed to send {} bytes to {}:{}: {}", response_size,
+                         inet_ntoa(addr.sin_addr), ntohs(addr.sin_port),
+                         strerror(errno));
+        return;
     }
+
+    Metrics::instance().increment(Counter::PacketsSent);
+    Metrics::instance().increment(Counter::BytesSent, response_size);
+
+    TFTP_LOG_DEBUG("Sent {} bytes to {}:{}", response_size,
+                   inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+}
+
+bool Server::isReceiveTimeout() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
 }
 }  // namespace tftp
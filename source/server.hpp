@@ -2,18 +2,35 @@
 
 #ifndef _WIN32
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
 #endif
 
+#include <atomic>
+#include <memory>
 #include <string>
 
 #include "controller.hpp"
+#include "xdp.hpp"
 
 namespace tftp {
-constexpr inline unsigned int BUFFER_SIZE = 2048;
+// Large enough for any UDP datagram, so every blksize fits
+constexpr inline unsigned int BUFFER_SIZE = 65536;
+constexpr inline unsigned int SERVER_POLL_INTERVAL_MS = 100;
+
+// Ready replies sent between two reads of the socket, so new requests are
+// not stuck behind a burst of bulk blocks
+constexpr inline unsigned int SERVER_SEND_BATCH = 64;
+
+// Packets taken off the AF_XDP ring between two reads of the socket
+constexpr inline unsigned int SERVER_RECEIVE_BATCH = 64;
+
+// How long busy polling goes on without a packet before the server falls
+// back to blocking waits
+constexpr inline unsigned int DEFAULT_BUSY_POLL_IDLE_MS = 1000;
 
 class Server {
    public:
@@ -22,11 +39,59 @@ class Server {
 
     void listen();
 
+    // Interface and TTL of multicast blocks. Without an interface they go
+    // out the one of the default route.
+    void setMulticastOptions(const std::string &interface_ip,
+                             unsigned int ttl);
+
+    // Sizes of the socket's receive and send buffers. Above the system
+    // limit, that needs CAP_NET_ADMIN. Returns the receive buffer size the
+    // kernel settled on.
+    int setSocketBuffers(int size);
+
+    // Spin on the socket instead of sleeping in poll(), so a packet is
+    // picked up without a wakeup. The kernel polls the NIC queue itself for
+    // up to busy_poll_us per receive where the driver supports it. After
+    // idle_ms without a packet the server blocks again until one arrives.
+    // Throws std::runtime_error where sockets cannot be polled that way.
+    void setBusyPoll(unsigned int busy_poll_us, unsigned int idle_ms);
+
+    // Take DATA and ACK packets off a receive queue of the interface with
+    // AF_XDP, and send the replies to them the same way. Requests and
+    // everything else still use the socket. Throws std::runtime_error if
+    // the XDP program or socket cannot be set up.
+    void setXdp(const std::string &interface, unsigned int queue,
+                bool generic);
+
+    // Makes listen() return. Safe to call from a signal handler.
+    void stop();
+
    private:
     unsigned int socket_fd;
     struct sockaddr_in server_addr, client_addr;
-    char request[BUFFER_SIZE], response[BUFFER_SIZE];
+    char request[BUFFER_SIZE + 2], response[BUFFER_SIZE];
 
     PacketHandler& packet_handler;
+    std::atomic<bool> running{true};
+
+    std::unique_ptr<XdpSocket> xdp;
+
+    // Busy polling. With an idle time of 0 it never stops.
+    bool busy_poll = false;
+    unsigned int busy_poll_idle_ms = 0;
+    bool busy_polling = false;
+    uint64_t last_request_us = 0;
+    uint64_t busy_poll_cpu_us = 0;  // Thread CPU time at the last sample
+    uint64_t busy_poll_empty = 0;   // Empty polls since the last sample
+
+    bool waitForRequest(int timeout_ms);
+    unsigned int receiveXdp();
+    void handleRequest(ssize_t request_size);
+    void startBusyPolling();
+    void sampleBusyPolling();
+    bool sendReadyReplies();
+    void sendResponse(const struct sockaddr_in &addr, ssize_t response_size);
+
+    static bool isReceiveTimeout();
 };
 }  // namespace tftp
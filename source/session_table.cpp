@@ -0,0 +1,106 @@
+#include "session_table.hpp"
+
+namespace tftp {
+SessionTable::SessionTable(size_t capacity) {
+    // Keep the load factor at most 3/4
+    size_t size = 16;
+    while (size * 3 < capacity * 4) size *= 2;
+
+    this->slots.resize(size);
+    this->mask = size - 1;
+}
+
+uint32_t SessionTable::find(const Peer &peer) const {
+    const uint64_t hash = peer.hash();
+    const uint32_t tag = tagOf(hash);
+
+    for (size_t index = hash & this->mask;; index = (index + 1) & this->mask) {
+        const Slot &slot = this->slots[index];
+        if (slot.tag == 0) return NO_SESSION;
+
+        if (slot.tag == tag && this->get(slot.session).peer == peer) {
+            return slot.session;
+        }
+    }
+}
+
+uint32_t SessionTable::insert(const Peer &peer) {
+    if ((this->count + 1) * 4 > this->slots.size() * 3) this->grow();
+
+    uint32_t session = this->allocate();
+    SessionHot &hot = this->get(session);
+    hot = SessionHot();
+    hot.peer = peer;
+    hot.used = true;
+
+    this->place(peer.hash(), session);
+    ++this->count;
+    return session;
+}
+
+void SessionTable::erase(uint32_t session) {
+    SessionHot &hot = this->get(session);
+    if (!hot.used) return;
+
+    // Find the slot of the session
+    size_t hole = hot.peer.hash() & this->mask;
+    while (this->slots[hole].tag == 0 || this->slots[hole].session != session) {
+        hole = (hole + 1) & this->mask;
+    }
+
+    // Shift later entries of the run back, so no tombstones are needed
+    for (size_t index = (hole + 1) & this->mask; this->slots[index].tag != 0;
+         index = (index + 1) & this->mask) {
+        size_t home =
+            this->get(this->slots[index].session).peer.hash() & this->mask;
+
+        // Entries whose home is between the hole and them have to stay
+        if (((index - home) & this->mask) >= ((index - hole) & this->mask)) {
+            this->slots[hole] = this->slots[index];
+            hole = index;
+        }
+    }
+    this->slots[hole] = Slot();
+
+    hot.used = false;
+    hot.deadline_us = 0;
+    this->free_sessions.push_back(session);
+    --this->count;
+}
+
+uint32_t SessionTable::allocate() {
+    if (!this->free_sessions.empty()) {
+        uint32_t session = this->free_sessions.back();
+        this->free_sessions.pop_back();
+        return session;
+    }
+
+    if (this->next_session % SESSION_CHUNK_SIZE == 0) {
+        this->chunks.emplace_back(new SessionHot[SESSION_CHUNK_SIZE]);
+
+        // Every index fits in the free list, so erasing never allocates
+        this->free_sessions.reserve(this->chunks.size() * SESSION_CHUNK_SIZE);
+    }
+
+    return this->next_session++;
+}
+
+void SessionTable::place(uint64_t hash, uint32_t session) {
+    size_t index = hash & this->mask;
+    while (this->slots[index].tag != 0) index = (index + 1) & this->mask;
+
+    this->slots[index].tag = tagOf(hash);
+    this->slots[index].session = session;
+}
+
+void SessionTable::grow() {
+    std::vector<Slot> old_slots(this->slots.size() * 2);
+    old_slots.swap(this->slots);
+    this->mask = this->slots.size() - 1;
+
+    for (const Slot &slot : old_slots) {
+        if (slot.tag == 0) continue;
+        this->place(this->get(slot.session).peer.hash(), slot.session);
+    }
+}
+}  // namespace tftp
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "peer.hpp"
+
+namespace tftp {
+constexpr inline uint32_t NO_SESSION = UINT32_MAX;
+constexpr inline size_t SESSION_CHUNK_SIZE = 4096;
+
+// The state every packet of a session touches, kept apart from its options
+// and file worker so that a lookup and the check that follows share a cache
+// line, and expiry sweeps walk a dense array.
+struct SessionHot {
+    uint64_t deadline_us = 0;        // When the session expires
+    uint64_t bytes_transferred = 0;  // Position of the window in the file
+    Peer peer;
+    uint16_t block_number = 0;
+    uint8_t state = 0;
+    bool used = false;
+};
+
+// Open addressing table from peers to session indexes. Slots are 8 bytes and
+// hold a hash tag, so probing rarely leaves the slot array; the peer itself
+// is compared in the hot record. Indexes stay valid until erased, and hot
+// records never move. Not thread safe.
+class SessionTable {
+   public:
+    SessionTable(size_t capacity = 1024);
+
+    uint32_t find(const Peer &peer) const;
+
+    // The peer must not be in the table yet
+    uint32_t insert(const Peer &peer);
+    void erase(uint32_t session);
+
+    SessionHot &get(uint32_t session) {
+        return this->chunks[session / SESSION_CHUNK_SIZE]
+                           [session % SESSION_CHUNK_SIZE];
+    }
+    const SessionHot &get(uint32_t session) const {
+        return this->chunks[session / SESSION_CHUNK_SIZE]
+                           [session % SESSION_CHUNK_SIZE];
+    }
+
+    size_t size() const { return this->count; }
+
+    // Every index in use is below this
+    uint32_t getIndexLimit() const { return this->next_session; }
+
+   private:
+    struct Slot {
+        uint32_t tag = 0;  // 0 marks an empty slot
+        uint32_t session = 0;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t count = 0;
+
+    std::vector<std::unique_ptr<SessionHot[]>> chunks;
+    std::vector<uint32_t> free_sessions;
+    uint32_t next_session = 0;
+
+    static uint32_t tagOf(uint64_t hash) {
+        return static_cast<uint32_t>(hash >> 32) | 1;
+    }
+
+    uint32_t allocate();
+    void place(uint64_t hash, uint32_t session);
+    void grow();
+};
+}  // namespace tftp
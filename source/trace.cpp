@@ -0,0 +1,49 @@
+#include "trace.hpp"
+
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define TFTP_HAVE_RDTSC
+#endif
+
+namespace tftp {
+static const char *PHASE_NAMES[static_cast<unsigned int>(Phase::COUNT)] = {
+    "decode", "dispatch", "file_read", "file_write", "encode", "send",
+};
+
+uint64_t readTimestampCounter() {
+#ifdef TFTP_HAVE_RDTSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+PhaseTrace &PhaseTrace::instance() {
+    static PhaseTrace trace;
+    return trace;
+}
+
+PhaseTrace::PhaseTrace() : records(new PhaseRecord[PHASE_TRACE_CAPACITY]()) {}
+
+void PhaseTrace::dump(FILE *file) const {
+    uint64_t head = this->head.load();
+    uint64_t first = head > PHASE_TRACE_CAPACITY ? head - PHASE_TRACE_CAPACITY : 0;
+
+    fprintf(file, "start,phase,session,block,cycles\n");
+    for (uint64_t i = first; i < head; ++i) {
+        const PhaseRecord &record = this->records[i % PHASE_TRACE_CAPACITY];
+        fprintf(file, "%llu,%s,%u,%u,%u\n",
+                static_cast<unsigned long long>(record.start),
+                PHASE_NAMES[static_cast<unsigned int>(record.phase)],
+                record.session_id, record.block_number, record.cycles);
+    }
+}
+}  // namespace tftp
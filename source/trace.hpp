@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+
+#include "common.hpp"
+
+// Static tracepoints. Built on <sys/sdt.h> when TFTP_HAVE_SDT is defined, so
+// perf and bpftrace can attach to a running server:
+//
+//   bpftrace -e 'usdt:./self-tftp:tftp:file__read { @[arg0] = count(); }'
+//
+// Without it every probe compiles to nothing.
+#ifdef TFTP_HAVE_SDT
+#include <sys/sdt.h>
+#define TFTP_PROBE2(name, a, b) DTRACE_PROBE2(tftp, name, a, b)
+#define TFTP_PROBE3(name, a, b, c) DTRACE_PROBE3(tftp, name, a, b, c)
+#else
+#define TFTP_PROBE2(name, a, b) \
+    do {                        \
+        (void)(a);              \
+        (void)(b);              \
+    } while (0)
+#define TFTP_PROBE3(name, a, b, c) \
+    do {                           \
+        (void)(a);                 \
+        (void)(b);                 \
+        (void)(c);                 \
+    } while (0)
+#endif
+
+namespace tftp {
+enum class Phase : uint8_t {
+    Decode,
+    Dispatch,
+    FileRead,
+    FileWrite,
+    Encode,
+    Send,
+    COUNT,
+};
+
+// The transfer being handled by the current thread, attached to probes and
+// phase records that have no session of their own.
+struct TraceContext {
+    uint32_t session_id = 0;
+    uint16_t block_number = 0;
+
+    static TraceContext &current() {
+        thread_local TraceContext context;
+        return context;
+    }
+
+    static void set(uint32_t session_id, uint16_t block_number) {
+        TraceContext &context = current();
+        context.session_id = session_id;
+        context.block_number = block_number;
+    }
+};
+
+// Raw timestamp counter on x86, monotonic nanoseconds elsewhere
+uint64_t readTimestampCounter();
+
+constexpr inline unsigned int PHASE_TRACE_CAPACITY = 1 << 16;
+
+struct PhaseRecord {
+    uint64_t start;
+    uint32_t cycles;
+    uint32_t session_id;
+    uint16_t block_number;
+    Phase phase;
+};
+
+// Ring of the most recent phase timings. Older records are overwritten.
+class PhaseTrace {
+   public:
+    static PhaseTrace &instance();
+
+    void record(Phase phase, uint64_t start, uint64_t end) {
+        const TraceContext &context = TraceContext::current();
+
+        uint64_t index = this->head.fetch_add(1, std::memory_order_relaxed);
+        PhaseRecord &record = this->records[index % PHASE_TRACE_CAPACITY];
+        record.start = start;
+        record.cycles = static_cast<uint32_t>(end - start);
+        record.session_id = context.session_id;
+        record.block_number = context.block_number;
+        record.phase = phase;
+    }
+
+    // Writes the buffered records as CSV, oldest first
+    void dump(FILE *file) const;
+
+   private:
+    PhaseTrace();
+
+    std::unique_ptr<PhaseRecord[]> records;
+    std::atomic<uint64_t> head{0};
+};
+
+class PhaseScope {
+   public:
+    PhaseScope(Phase phase) : phase(phase), start(readTimestampCounter()) {}
+    ~PhaseScope() {
+        PhaseTrace::instance().record(this->phase, this->start,
+                                      readTimestampCounter());
+    }
+
+   private:
+    const Phase phase;
+    const uint64_t start;
+};
+}  // namespace tftp
+
+// Times the rest of the enclosing scope when built with TFTP_PHASE_TIMING
+#define TFTP_PHASE_CONCAT_(a, b) a##b
+#define TFTP_PHASE_CONCAT(a, b) TFTP_PHASE_CONCAT_(a, b)
+
+#ifdef TFTP_PHASE_TIMING
+#define TFTP_PHASE_SCOPE(phase) \
+    ::tftp::PhaseScope TFTP_PHASE_CONCAT(phase_scope_, __LINE__)(phase)
+#else
+#define TFTP_PHASE_SCOPE(phase) \
+    do {                        \
+    } while (0)
+#endif
@@ -0,0 +1,48 @@
+#include "transfer.hpp"
+
+#include <new>
+#include <vector>
+
+namespace tftp {
+namespace {
+constexpr size_t FRAME_ALIGNMENT = 64;
+
+// Free frames by their size in cache lines
+struct FrameCache {
+    std::vector<std::vector<void *>> free_frames;
+
+    ~FrameCache() {
+        for (auto &frames : this->free_frames) {
+            for (void *frame : frames) ::operator delete(frame);
+        }
+    }
+};
+
+thread_local FrameCache frame_cache;
+
+size_t sizeClass(size_t size) {
+    return (size + FRAME_ALIGNMENT - 1) / FRAME_ALIGNMENT;
+}
+}  // namespace
+
+void *allocateFrame(size_t size) {
+    size_t size_class = sizeClass(size);
+    auto &free_frames = frame_cache.free_frames;
+
+    if (size_class < free_frames.size() && !free_frames[size_class].empty()) {
+        void *frame = free_frames[size_class].back();
+        free_frames[size_class].pop_back();
+        return frame;
+    }
+
+    return ::operator new(size_class * FRAME_ALIGNMENT);
+}
+
+void releaseFrame(void *frame, size_t size) {
+    size_t size_class = sizeClass(size);
+    auto &free_frames = frame_cache.free_frames;
+
+    if (size_class >= free_frames.size()) free_frames.resize(size_class + 1);
+    free_frames[size_class].push_back(frame);
+}
+}  // namespace tftp
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+namespace tftp {
+// Coroutine frames are recycled by the thread that frees them, so starting a
+// transfer does not allocate once as many ran at once as ever before
+void *allocateFrame(size_t size);
+void releaseFrame(void *frame, size_t size);
+
+// A transfer written as a coroutine. It starts suspended, and its owner
+// resumes it whenever what it awaits is there. It finishes with true once
+// the whole file went through.
+class Transfer {
+   public:
+    struct promise_type {
+        bool completed = false;
+        std::exception_ptr exception;
+
+        Transfer get_return_object() {
+            return Transfer(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // The owner destroys the frame once it saw the result
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_value(bool completed) { this->completed = completed; }
+        void unhandled_exception() {
+            this->exception = std::current_exception();
+        }
+
+        static void *operator new(size_t size) { return allocateFrame(size); }
+        static void operator delete(void *frame, size_t size) {
+            releaseFrame(frame, size);
+        }
+    };
+
+    Transfer() = default;
+    Transfer(Transfer &&other) noexcept
+        : handle(std::exchange(other.handle, nullptr)) {}
+    Transfer &operator=(Transfer &&other) noexcept {
+        if (this != &other) {
+            this->reset();
+            this->handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    ~Transfer() { this->reset(); }
+
+    void resume() { this->handle.resume(); }
+
+    bool isRunning() const { return this->handle && !this->handle.done(); }
+    bool isDone() const { return this->handle && this->handle.done(); }
+
+    // Rethrows what escaped the coroutine
+    bool isCompleted() const {
+        const promise_type &promise = this->handle.promise();
+        if (promise.exception) std::rethrow_exception(promise.exception);
+        return promise.completed;
+    }
+
+    void reset() {
+        if (this->handle) this->handle.destroy();
+        this->handle = nullptr;
+    }
+
+   private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Transfer(std::coroutine_handle<promise_type> handle)
+        : handle(handle) {}
+};
+}  // namespace tftp
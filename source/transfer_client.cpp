@@ -0,0 +1,368 @@
+#include "transfer_client.hpp"
+
+#include <algorithm>
+#include <charconv>
+
+namespace tftp {
+namespace {
+// blksize limits of RFC 2348
+constexpr int MIN_BLOCK_SIZE = 8;
+constexpr int MAX_BLOCK_SIZE = 65464;
+
+// The whole value has to be a number that fits
+template <typename T>
+bool parseValue(const std::string &text, T &value) {
+    const char *end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
+}  // namespace
+
+TransferClient::TransferClient(Mode mode, std::string filename,
+                               TransferOptions options, Sender sender)
+    : mode(mode),
+      filename(filename),
+      options(options),
+      sender(sender),
+      data_packet(new DataPacket()),
+      buffer(UINT16_MAX + 3) {}
+
+void TransferClient::start() {
+    if (this->mode == Mode::Read) {
+        this->data.clear();
+
+        ReadRequestPacket request(this->filename.c_str(), "octet");
+        this->sendRequest(request);
+    } else {
+        WriteRequestPacket request(this->filename.c_str(), "octet");
+        this->sendRequest(request);
+    }
+}
+
+void TransferClient::sendRequest(ReadWriteRequestPacket &request) {
+    // Only ask for what differs from the defaults
+    if (this->options.block_size != 512) {
+        request.options["blksize"] = std::to_string(this->options.block_size);
+    }
+
+    if (this->options.window_size > 1) {
+        request.options["windowsize"] =
+            std::to_string(this->options.window_size);
+    }
+
+    if (this->options.transfer_size) {
+        request.options["tsize"] = std::to_string(this->data.size());
+    }
+
+    if (this->options.multicast && this->mode == Mode::Read) {
+        request.options["multicast"] = "";
+    }
+
+    this->started = true;
+    this->retries_left = this->options.retries;
+    this->send(request);
+}
+
+void TransferClient::handlePacket(const char *src, ssize_t size) {
+    if (!this->started || this->finished || this->failed || size < 2) return;
+
+    PacketType type = static_cast<PacketType>(
+        ntohs(*reinterpret_cast<const uint16_t *>(src)));
+
+    // Only an OACK can be empty, when the server took none of the options
+    if (size < 4 && type != PacketType::OACK) return;
+
+    switch (type) {
+        case PacketType::OACK:
+        case PacketType::ERROR: {
+            // Both are string based, so terminate a copy of the packet
+            memcpy(this->buffer.data(), src, size);
+            this->buffer[size] = '\0';
+            this->buffer[size + 1] = '\0';
+
+            if (type == PacketType::OACK) {
+                this->handleOptionAck(this->buffer.data());
+            } else {
+                ErrorPacket packet;
+                packet.deserialize(this->buffer.data());
+                this->fail(packet.message);
+            }
+            break;
+        }
+        case PacketType::DATA:
+            if (this->mode == Mode::Read) this->handleData(src, size);
+            break;
+        case PacketType::ACK:
+            if (this->mode == Mode::Write) this->handleAck(src);
+            break;
+        default:
+            break;
+    }
+}
+
+void TransferClient::handleTimeout() {
+    if (!this->started || this->finished || this->failed) return;
+
+    if (this->retries_left == 0) {
+        this->fail("Transfer timed out");
+        return;
+    }
+
+    --this->retries_left;
+
+    // Multicast clients that are not the master have nothing to resend
+    if (this->multicast && !this->master) return;
+    ++this->retransmits;
+
+    // Resend the whole window if it was never acknowledged
+    if (this->mode == Mode::Write && this->sent_index > 0) {
+        this->sendWindow();
+    } else {
+        this->sender(this->last_packet.data(), this->last_packet.size());
+    }
+}
+
+void TransferClient::send(const Packet &packet, bool remember) {
+    ssize_t size = packet.serialize(this->buffer.data());
+    this->sender(this->buffer.data(), size);
+
+    if (remember) {
+        this->last_packet.assign(this->buffer.data(),
+                                 this->buffer.data() + size);
+    }
+}
+
+void TransferClient::fail(const std::string &message) {
+    this->failed = true;
+    this->error = message;
+}
+
+void TransferClient::handleOptionAck(const char *src) {
+    OptionAckPacket packet;
+    packet.deserialize(src);
+
+    // Later OACKs make a multicast client the master
+    auto group = packet.options.find("multicast");
+    if (this->multicast) {
+        if (group != packet.options.end()) {
+            this->handleGroupOption(group->second);
+        }
+        return;
+    }
+
+    // Options can only be acknowledged before the first block
+    if (this->next_index != 1 || this->sent_index != 0) return;
+
+    // Values the server made up fail this transfer alone
+    auto block_size = packet.options.find("blksize");
+    if (block_size != packet.options.end()) {
+        int value;
+        if (!parseValue(block_size->second, value) || value < MIN_BLOCK_SIZE ||
+            value > MAX_BLOCK_SIZE) {
+            this->fail("Invalid blksize in the OACK");
+            return;
+        }
+        this->block_size = value;
+    }
+
+    auto window_size = packet.options.find("windowsize");
+    if (window_size != packet.options.end()) {
+        uint16_t value;
+        if (!parseValue(window_size->second, value) || value == 0) {
+            this->fail("Invalid windowsize in the OACK");
+            return;
+        }
+        this->window_size = value;
+    }
+
+    auto transfer_size = packet.options.find("tsize");
+    if (transfer_size != packet.options.end()) {
+        ssize_t value;
+        if (!parseValue(transfer_size->second, value) || value < 0) {
+            this->fail("Invalid tsize in the OACK");
+            return;
+        }
+        this->transfer_size = value;
+    }
+
+    this->retries_left = this->options.retries;
+
+    if (this->mode == Mode::Read && group != packet.options.end()) {
+        this->handleGroupOption(group->second);
+    } else if (this->mode == Mode::Read) {
+        this->send(AckPacket(0));
+    } else {
+        this->sendWindow();
+    }
+}
+
+void TransferClient::handleData(const char *src, ssize_t size) {
+    DataPacket &packet = *this->data_packet;
+    packet.data_size = size - 4;
+    packet.deserialize(src);
+
+    if (this->multicast) {
+        this->handleGroupData(packet);
+        return;
+    }
+
+    // Anything but the next block restarts the window from the last good one
+    if (packet.block_number != (this->next_index & 0xFFFF)) {
+        this->window_blocks = 0;
+        this->send(AckPacket((this->next_index - 1) & 0xFFFF));
+        return;
+    }
+
+    this->data.insert(this->data.end(), packet.data,
+                      packet.data + packet.data_size);
+    ++this->next_index;
+    ++this->window_blocks;
+    this->retries_left = this->options.retries;
+
+    // A short block ends the transfer
+    if (packet.data_size < this->block_size) {
+        this->send(AckPacket(packet.block_number));
+        this->finished = true;
+        return;
+    }
+
+    if (this->window_blocks >= this->window_size) {
+        this->window_blocks = 0;
+        this->send(AckPacket(packet.block_number));
+    }
+}
+
+void TransferClient::handleGroupOption(const std::string &value) {
+    // ADDRESS,PORT,MC
+    size_t first = value.find(',');
+    size_t second =
+        first == std::string::npos ? first : value.find(',', first + 1);
+    if (second == std::string::npos) {
+        this->fail("Invalid multicast option");
+        return;
+    }
+
+    if (!this->multicast) {
+        this->multicast = true;
+
+        std::string address = value.substr(0, first);
+        uint16_t port;
+        if (!parseValue(value.substr(first + 1, second - first - 1), port)) {
+            this->fail("Invalid multicast option");
+            return;
+        }
+        if (this->joiner && !this->joiner(address, port)) {
+            this->fail("Cannot join the multicast group");
+            return;
+        }
+    }
+
+    this->retries_left = this->options.retries;
+    this->master = value.substr(second + 1) == "1";
+    if (this->master) this->acknowledgeGroup();
+}
+
+void TransferClient::handleGroupData(const DataPacket &packet) {
+    uint64_t index = packet.block_number;
+    if (index == 0) return;
+
+    if (index >= this->received.size()) this->received.resize(index + 1);
+    if (!this->received[index]) {
+        size_t offset = (index - 1) * this->block_size;
+        if (this->data.size() < offset + packet.data_size) {
+            this->data.resize(offset + packet.data_size);
+        }
+
+        memcpy(this->data.data() + offset, packet.data, packet.data_size);
+        this->received[index] = true;
+    }
+
+    if (packet.data_size < this->block_size) {
+        this->last_index = index;
+        this->last_size = packet.data_size;
+    }
+
+    while (this->next_index < this->received.size() &&
+           this->received[this->next_index]) {
+        ++this->next_index;
+    }
+    this->retries_left = this->options.retries;
+
+    // Once the block it asked for is there, the master asks for the next
+    if (this->master && index == this->requested_index) {
+        this->acknowledgeGroup();
+    }
+}
+
+void TransferClient::acknowledgeGroup() {
+    // With every block there, the ACK of the last one ends the download
+    if (this->last_index != 0 && this->next_index > this->last_index) {
+        this->send(AckPacket(this->last_index & 0xFFFF));
+        this->data.resize((this->last_index - 1) * this->block_size +
+                          this->last_size);
+        this->finished = true;
+        return;
+    }
+
+    // Otherwise it acknowledges the block before the first one missing
+    this->requested_index = this->next_index;
+    this->send(AckPacket((this->next_index - 1) & 0xFFFF));
+}
+
+void TransferClient::handleAck(const char *src) {
+    AckPacket packet;
+    packet.deserialize(src);
+
+    // ACK 0 accepts a request without options
+    if (this->sent_index == 0) {
+        if (packet.block_number == 0) {
+            this->retries_left = this->options.retries;
+            this->sendWindow();
+        }
+        return;
+    }
+
+    // Find the block being acknowledged among the ones in flight
+    for (uint64_t index = this->next_index; index <= this->sent_index;
+         ++index) {
+        if ((index & 0xFFFF) != packet.block_number) continue;
+
+        this->next_index = index + 1;
+        this->retries_left = this->options.retries;
+
+        if (index == this->lastIndex()) {
+            this->finished = true;
+        } else if (this->next_index > this->sent_index) {
+            this->sendWindow();
+        }
+        return;
+    }
+
+    // Duplicate ACKs are ignored to avoid the Sorcerer's Apprentice bug
+}
+
+void TransferClient::sendWindow() {
+    uint64_t last =
+        std::min(this->next_index + this->window_size - 1, this->lastIndex());
+
+    DataPacket &packet = *this->data_packet;
+    for (uint64_t index = this->next_index; index <= last; ++index) {
+        size_t offset = (index - 1) * this->block_size;
+        size_t size = std::min<size_t>(this->block_size,
+                                       this->data.size() - offset);
+
+        packet.block_number = index & 0xFFFF;
+        packet.data_size = size;
+        memcpy(packet.data, this->data.data() + offset, size);
+
+        this->send(packet, false);
+    }
+
+    this->sent_index = std::max(this->sent_index, last);
+}
+
+uint64_t TransferClient::lastIndex() const {
+    // The last block is always short, possibly empty
+    return this->data.size() / this->block_size + 1;
+}
+}  // namespace tftp
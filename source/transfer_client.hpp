@@ -0,0 +1,116 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "packets.hpp"
+
+namespace tftp {
+struct TransferOptions {
+    uint16_t block_size = 512;  // blksize, RFC 2348
+    uint16_t window_size = 1;   // windowsize, RFC 7440
+    bool transfer_size = false;  // tsize, RFC 2349
+    bool multicast = false;      // multicast, RFC 2090
+    unsigned int timeout_ms = 1000;
+    unsigned int retries = 5;
+};
+
+// Client side of one RRQ/WRQ transfer. It never touches a socket: packets
+// are fed in through handlePacket() and replies go out through the sender,
+// so the same client drives real sockets and simulated links.
+class TransferClient {
+   public:
+    enum class Mode {
+        Read,
+        Write,
+    };
+
+    using Sender = std::function<void(const char *data, ssize_t size)>;
+
+    // Called when the server puts a download in a multicast group, before
+    // anything is acknowledged. False if the group cannot be joined.
+    using Joiner =
+        std::function<bool(const std::string &address, uint16_t port)>;
+
+    TransferClient(Mode mode, std::string filename, TransferOptions options,
+                   Sender sender);
+
+    void setSender(Sender sender) { this->sender = sender; }
+    void setJoiner(Joiner joiner) { this->joiner = joiner; }
+
+    // Data to upload, or the data downloaded so far
+    void setData(std::vector<char> data) { this->data = std::move(data); }
+    const std::vector<char> &getData() const { return this->data; }
+    std::vector<char> takeData() { return std::move(this->data); }
+
+    void start();
+    void handlePacket(const char *src, ssize_t size);
+    void handleTimeout();
+
+    bool isFinished() const { return this->finished; }
+    bool isFailed() const { return this->failed; }
+    const std::string &getError() const { return this->error; }
+
+    const TransferOptions &getOptions() const { return this->options; }
+    uint16_t getBlockSize() const { return this->block_size; }
+    uint16_t getWindowSize() const { return this->window_size; }
+
+    // Size the server gave in its tsize option, -1 if it gave none
+    ssize_t getTransferSize() const { return this->transfer_size; }
+    uint64_t getRetransmits() const { return this->retransmits; }
+    bool isMulticast() const { return this->multicast; }
+
+   private:
+    const Mode mode;
+    const std::string filename;
+    const TransferOptions options;
+    Sender sender;
+    Joiner joiner;
+
+    std::vector<char> data;
+    std::unique_ptr<DataPacket> data_packet;
+    std::vector<char> buffer;
+    std::vector<char> last_packet;
+
+    // Negotiated options
+    uint16_t block_size = 512;
+    uint16_t window_size = 1;
+    ssize_t transfer_size = -1;
+
+    // Transfer state. Indexes count blocks from 1 and never wrap.
+    bool started = false;
+    bool finished = false;
+    bool failed = false;
+    std::string error;
+    uint64_t next_index = 1;    // Next block expected (read) or unacked (write)
+    uint64_t sent_index = 0;     // Last block sent (write)
+    uint64_t window_blocks = 0;  // Blocks received since the last ACK
+    unsigned int retries_left = 0;
+    uint64_t retransmits = 0;
+
+    // Multicast downloads take blocks in any order, and only the master
+    // client acknowledges, asking for the first block it is missing
+    bool multicast = false;
+    bool master = false;
+    std::vector<bool> received;
+    uint64_t requested_index = 0;  // Block the master asked for last
+    uint64_t last_index = 0;       // Short block, once it was seen
+    size_t last_size = 0;
+
+    void sendRequest(ReadWriteRequestPacket &request);
+    void send(const Packet &packet, bool remember = true);
+    void fail(const std::string &message);
+
+    void handleOptionAck(const char *src);
+    void handleData(const char *src, ssize_t size);
+    void handleGroupOption(const std::string &value);
+    void handleGroupData(const DataPacket &packet);
+    void acknowledgeGroup();
+    void handleAck(const char *src);
+    void sendWindow();
+    uint64_t lastIndex() const;
+};
+}  // namespace tftp
@@ -4,6 +4,4 @@
 
 namespace tftp {
 void printBuffer(char *buffer, ssize_t size);
-// void octectToNetASCII(char *buffer, ssize_t size);
-// void netASCIIToOctect(char *buffer, ssize_t size);
 };  // namespace tftp
\ No newline at end of file
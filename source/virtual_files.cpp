@@ -0,0 +1,184 @@
+#include "virtual_files.hpp"
+
+#include <memory.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "scheduler.hpp"
+
+namespace tftp {
+// Client table
+std::shared_ptr<ClientTable> ClientTable::load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Failed to open client table " + path);
+
+    auto table = std::make_shared<ClientTable>();
+    std::vector<std::string> columns;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::vector<std::string> values;
+        std::string value;
+        while (fields >> value) values.push_back(value);
+        if (values.empty() || values[0][0] == '#') continue;
+
+        if (columns.empty()) {
+            columns = std::move(values);
+            continue;
+        }
+
+        // The first row of a key wins
+        Row row;
+        for (size_t i = 0; i < std::min(columns.size(), values.size()); ++i) {
+            row[columns[i]] = values[i];
+        }
+        table->rows.emplace(values[0], std::move(row));
+    }
+
+    return table;
+}
+
+const ClientTable::Row *ClientTable::find(const std::string &key) const {
+    auto row = this->rows.find(key);
+    return row != this->rows.end() ? &row->second : nullptr;
+}
+
+// Template generator
+TemplateGenerator::TemplateGenerator(const std::string &pattern,
+                                     const std::string &template_path,
+                                     std::shared_ptr<const ClientTable> clients)
+    : clients(std::move(clients)) {
+    size_t star = pattern.find('*');
+    if (star != std::string::npos &&
+        pattern.find('*', star + 1) != std::string::npos) {
+        throw std::invalid_argument("Template patterns take one * at most!");
+    }
+
+    // The key is what is left of the name without the text around the *
+    this->keyed = star != std::string::npos;
+    if (this->keyed) {
+        this->prefix_size = star;
+        this->suffix_size = pattern.size() - star - 1;
+    }
+
+    std::ifstream file(template_path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open template " + template_path);
+    }
+    std::string text((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+
+    // Split it up front, so rendering only copies
+    size_t position = 0;
+    while (position < text.size()) {
+        size_t start = text.find("${", position);
+        size_t end = start != std::string::npos ? text.find('}', start) : start;
+        if (end == std::string::npos) {
+            this->segments.push_back({text.substr(position), false});
+            break;
+        }
+
+        if (start > position) {
+            this->segments.push_back({text.substr(position, start - position),
+                                      false});
+        }
+        this->segments.push_back({text.substr(start + 2, end - start - 2),
+                                  true});
+        position = end + 1;
+    }
+}
+
+bool TemplateGenerator::operator()(const std::string &filename,
+                                   std::string &content) const {
+    std::string key;
+    const ClientTable::Row *row = nullptr;
+    if (this->keyed) {
+        if (filename.size() < this->prefix_size + this->suffix_size) {
+            return false;
+        }
+        size_t key_size =
+            filename.size() - this->prefix_size - this->suffix_size;
+        key = filename.substr(this->prefix_size, key_size);
+
+        row = this->clients != nullptr ? this->clients->find(key) : nullptr;
+        if (row == nullptr) return false;
+    }
+
+    content.clear();
+    for (const Segment &segment : this->segments) {
+        if (!segment.field) {
+            content += segment.text;
+        } else if (segment.text == "filename") {
+            content += filename;
+        } else if (segment.text == "key") {
+            content += key;
+        } else if (row != nullptr) {
+            auto value = row->find(segment.text);
+            if (value != row->end()) content += value->second;
+        }
+    }
+
+    return true;
+}
+
+// Virtual file worker
+ssize_t VirtualFileWorker::read(char *dst, ssize_t size, ssize_t offset) {
+    if (offset < 0) return -1;
+    if (static_cast<size_t>(offset) >= this->content->size()) return 0;
+
+    size = std::min<size_t>(size, this->content->size() - offset);
+    memcpy(dst, this->content->data() + offset, size);
+    return size;
+}
+
+// Virtual file worker factory
+void VirtualFileWorkerFactory::add(const std::string &pattern,
+                                   FileGenerator generator) {
+    this->rules.push_back({pattern, std::move(generator)});
+}
+
+FileWorker *VirtualFileWorkerFactory::create(std::string filename,
+                                             FileWorkerMode mode) {
+    std::shared_ptr<const std::string> content = this->render(filename);
+    if (content != nullptr) {
+        return this->workers.create(filename, mode, std::move(content));
+    }
+
+    return this->files.create(filename, mode);
+}
+
+void VirtualFileWorkerFactory::destroy(FileWorker *file_worker) {
+    auto generated = dynamic_cast<VirtualFileWorker *>(file_worker);
+    if (generated != nullptr) {
+        this->workers.destroy(generated);
+    } else {
+        this->files.destroy(file_worker);
+    }
+}
+
+std::shared_ptr<const std::string> VirtualFileWorkerFactory::render(
+    const std::string &filename) {
+    auto cached = this->cache.find(filename);
+    if (cached != this->cache.end()) return cached->second;
+
+    for (const Rule &rule : this->rules) {
+        if (!PriorityRules::matchPattern(rule.pattern.c_str(),
+                                         filename.c_str())) {
+            continue;
+        }
+
+        auto content = std::make_shared<std::string>();
+        if (!rule.generator(filename, *content)) continue;
+
+        // Sessions still holding a dropped file keep their copy
+        if (this->cache.size() >= VIRTUAL_CACHE_LIMIT) this->cache.clear();
+        this->cache.emplace(filename, content);
+        return content;
+    }
+
+    return nullptr;
+}
+}  // namespace tftp
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "files.hpp"
+#include "pool.hpp"
+
+namespace tftp {
+// Rendered files kept at most, so names that are made up cannot grow the
+// cache without end
+constexpr inline size_t VIRTUAL_CACHE_LIMIT = 65536;
+
+// Renders a file that is generated rather than stored. Returns false if
+// there is no such file.
+using FileGenerator =
+    std::function<bool(const std::string &filename, std::string &content)>;
+
+// Rows of named columns, looked up by their first column. The first line
+// that is not blank or a # comment names the columns, and every line after
+// it is a row. Columns are separated by whitespace.
+class ClientTable {
+   public:
+    using Row = std::unordered_map<std::string, std::string>;
+
+    // Throws std::runtime_error if the file cannot be read
+    static std::shared_ptr<ClientTable> load(const std::string &path);
+
+    const Row *find(const std::string &key) const;
+    size_t size() const { return this->rows.size(); }
+
+   private:
+    std::unordered_map<std::string, Row> rows;
+};
+
+// Fills the ${NAME} fields of a template. A pattern with one * takes what
+// it matched as the key of a client table row, whose columns fill the
+// fields, and there is no file for a key without a row. A pattern without
+// a * renders the template as it is. ${filename} and ${key} are always
+// there, and fields the row does not have are left empty.
+class TemplateGenerator {
+   public:
+    // Throws std::runtime_error if the template cannot be read, and
+    // std::invalid_argument for a pattern with more than one *
+    TemplateGenerator(const std::string &pattern,
+                      const std::string &template_path,
+                      std::shared_ptr<const ClientTable> clients);
+
+    bool operator()(const std::string &filename, std::string &content) const;
+
+   private:
+    // Literal text, or the name of a field
+    struct Segment {
+        std::string text;
+        bool field;
+    };
+
+    std::vector<Segment> segments;
+    std::shared_ptr<const ClientTable> clients;
+
+    bool keyed;
+    size_t prefix_size = 0;
+    size_t suffix_size = 0;
+};
+
+// A generated file, served from memory. Read only.
+class VirtualFileWorker : public FileWorker {
+   public:
+    VirtualFileWorker(const std::string filename, const FileWorkerMode mode,
+                      std::shared_ptr<const std::string> content)
+        : FileWorker(filename, mode), content(std::move(content)) {}
+
+    virtual bool open() { return false; }
+    virtual bool close() { return true; }
+    virtual bool exists() { return true; }
+    virtual bool remove() { return false; }
+
+    virtual ssize_t read(char *dst, ssize_t size, ssize_t offset = 0);
+    virtual ssize_t write(char *, ssize_t, ssize_t = 0) { return -1; }
+    virtual ssize_t append(char *, ssize_t) { return -1; }
+    virtual ssize_t size() { return this->content->size(); }
+
+   private:
+    std::shared_ptr<const std::string> content;
+};
+
+// Serves files whose names match a pattern from generators, ahead of the
+// factory it wraps, so they never touch the filesystem. The first pattern
+// whose generator renders the file wins; names no generator renders go to
+// the wrapped factory. Rendered files are cached by name until the cache
+// is cleared. Like the controller it belongs to, not thread safe.
+class VirtualFileWorkerFactory : public FileWorkerFactory {
+   public:
+    VirtualFileWorkerFactory(FileWorkerFactory &files) : files(files) {}
+
+    // Patterns use * and ? like priority rules
+    void add(const std::string &pattern, FileGenerator generator);
+
+    virtual FileWorker *create(std::string filename, FileWorkerMode mode);
+    virtual void destroy(FileWorker *file_worker);
+    virtual void setReadyWake(std::function<void()> wake) {
+        this->files.setReadyWake(std::move(wake));
+    }
+
+    // For generators whose input changed
+    void clearCache() { this->cache.clear(); }
+    size_t getCacheSize() const { return this->cache.size(); }
+
+   private:
+    struct Rule {
+        std::string pattern;
+        FileGenerator generator;
+    };
+
+    FileWorkerFactory &files;
+    std::vector<Rule> rules;
+
+    std::unordered_map<std::string, std::shared_ptr<const std::string>> cache;
+    ObjectPool<VirtualFileWorker> workers;
+
+    std::shared_ptr<const std::string> render(const std::string &filename);
+};
+}  // namespace tftp
@@ -0,0 +1,495 @@
+#include "xdp.hpp"
+
+#ifdef __linux__
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "logger.hpp"
+#include "packets.hpp"
+
+namespace tftp {
+#ifdef __linux__
+namespace {
+// Ethernet, IPv4 and UDP header fields, at their offsets in a frame
+constexpr size_t ETHERNET_DESTINATION = 0;
+constexpr size_t ETHERNET_SOURCE = 6;
+constexpr size_t ETHERNET_TYPE = 12;
+constexpr size_t IP_HEADER = 14;
+constexpr size_t IP_PROTOCOL = IP_HEADER + 9;
+constexpr size_t IP_SOURCE = IP_HEADER + 12;
+constexpr size_t IP_DESTINATION = IP_HEADER + 16;
+constexpr size_t UDP_HEADER = IP_HEADER + 20;
+
+int bpf(int command, union bpf_attr &attr) {
+    return syscall(__NR_bpf, command, &attr, sizeof(attr));
+}
+
+struct bpf_insn instruction(uint8_t code, uint8_t dst, uint8_t src,
+                            int16_t offset, int32_t imm) {
+    struct bpf_insn insn = {};
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = offset;
+    insn.imm = imm;
+    return insn;
+}
+
+uint32_t load(uint32_t *index) {
+    return std::atomic_ref<uint32_t>(*index).load(std::memory_order_acquire);
+}
+
+void store(uint32_t *index, uint32_t value) {
+    std::atomic_ref<uint32_t>(*index).store(value, std::memory_order_release);
+}
+
+// Ones' complement sum of 16 bit words. Summed as they lie in memory, so
+// the folded result goes back into the packet as it is.
+uint64_t addChecksum(const char *data, size_t size, uint64_t sum) {
+    for (; size >= 2; data += 2, size -= 2) {
+        uint16_t word;
+        memcpy(&word, data, 2);
+        sum += word;
+    }
+    if (size > 0) {
+        uint16_t word = 0;
+        memcpy(&word, data, 1);
+        sum += word;
+    }
+    return sum;
+}
+
+uint16_t foldChecksum(uint64_t sum) {
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+}  // namespace
+
+XdpSocket::XdpSocket(const std::string &interface, unsigned int queue,
+                     uint16_t port, bool generic)
+    : port(htons(port)) {
+    try {
+        this->setUp(interface, queue, generic);
+    } catch (...) {
+        this->release();
+        throw;
+    }
+}
+
+XdpSocket::~XdpSocket() { this->release(); }
+
+void XdpSocket::setUp(const std::string &interface, unsigned int queue,
+                      bool generic) {
+    unsigned int ifindex = if_nametoindex(interface.c_str());
+    if (ifindex == 0) {
+        throw std::runtime_error("Unknown interface " + interface);
+    }
+
+    // Replies that would need fragmenting go through the kernel
+    size_t mtu = 1500;
+    std::ifstream mtu_file("/sys/class/net/" + interface + "/mtu");
+    mtu_file >> mtu;
+    this->max_payload =
+        std::min<size_t>(XDP_FRAME_SIZE - XDP_FRAME_HEADROOM - XDP_HEADER_SIZE,
+                         mtu - (XDP_HEADER_SIZE - 14));
+
+    this->socket_fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (this->socket_fd < 0) {
+        throw std::runtime_error("Failed to create AF_XDP socket");
+    }
+
+    // Frames are shared with the kernel
+    void *umem = mmap(nullptr, XDP_FRAME_COUNT * XDP_FRAME_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem == MAP_FAILED) {
+        throw std::runtime_error("Failed to allocate XDP frames");
+    }
+    this->umem = static_cast<char *>(umem);
+
+    struct xdp_umem_reg umem_reg = {};
+    umem_reg.addr = reinterpret_cast<uint64_t>(this->umem);
+    umem_reg.len = XDP_FRAME_COUNT * XDP_FRAME_SIZE;
+    umem_reg.chunk_size = XDP_FRAME_SIZE;
+    if (setsockopt(this->socket_fd, SOL_XDP, XDP_UMEM_REG, &umem_reg,
+                   sizeof(umem_reg)) < 0) {
+        throw std::runtime_error("Failed to register XDP frames");
+    }
+
+    this->mapRings();
+
+    // The first half of the frames is for the kernel to fill
+    uint64_t *fill = static_cast<uint64_t *>(this->fill.descriptors);
+    for (uint32_t i = 0; i < XDP_RING_SIZE; ++i) {
+        fill[i] = static_cast<uint64_t>(i) * XDP_FRAME_SIZE;
+    }
+    store(this->fill.producer, XDP_RING_SIZE);
+
+    for (uint32_t i = XDP_RING_SIZE; i < XDP_FRAME_COUNT; ++i) {
+        this->free_frames.push_back(static_cast<uint64_t>(i) * XDP_FRAME_SIZE);
+    }
+
+    // Drivers without zero-copy support copy the packets
+    struct sockaddr_xdp address = {};
+    address.sxdp_family = AF_XDP;
+    address.sxdp_ifindex = ifindex;
+    address.sxdp_queue_id = queue;
+    address.sxdp_flags = generic ? XDP_COPY : 0;
+    if (bind(this->socket_fd, (struct sockaddr *)&address, sizeof(address)) <
+        0) {
+        throw std::runtime_error("Failed to bind AF_XDP socket to " +
+                                 interface + " queue " +
+                                 std::to_string(queue) + ": " +
+                                 strerror(errno));
+    }
+
+    // Packets go to the socket of the queue they came in on
+    union bpf_attr attr = {};
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queue + 1;
+    this->map_fd = bpf(BPF_MAP_CREATE, attr);
+    if (this->map_fd < 0) {
+        throw std::runtime_error("Failed to create XDP socket map");
+    }
+
+    uint32_t key = queue;
+    uint32_t value = this->socket_fd;
+    attr = {};
+    attr.map_fd = this->map_fd;
+    attr.key = reinterpret_cast<uint64_t>(&key);
+    attr.value = reinterpret_cast<uint64_t>(&value);
+    if (bpf(BPF_MAP_UPDATE_ELEM, attr) < 0) {
+        throw std::runtime_error("Failed to add the AF_XDP socket to its map");
+    }
+
+    this->loadProgram(ifindex, generic);
+}
+
+void XdpSocket::mapRings() {
+    uint32_t size = XDP_RING_SIZE;
+    if (setsockopt(this->socket_fd, SOL_XDP, XDP_UMEM_FILL_RING, &size,
+                   sizeof(size)) < 0 ||
+        setsockopt(this->socket_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+                   sizeof(size)) < 0 ||
+        setsockopt(this->socket_fd, SOL_XDP, XDP_RX_RING, &size,
+                   sizeof(size)) < 0 ||
+        setsockopt(this->socket_fd, SOL_XDP, XDP_TX_RING, &size,
+                   sizeof(size)) < 0) {
+        throw std::runtime_error("Failed to size the XDP rings");
+    }
+
+    struct xdp_mmap_offsets offsets;
+    socklen_t length = sizeof(offsets);
+    if (getsockopt(this->socket_fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets,
+                   &length) < 0) {
+        throw std::runtime_error("Failed to locate the XDP rings");
+    }
+
+    auto map = [this](Ring &ring, const struct xdp_ring_offset &offset,
+                      size_t descriptor_size, off_t page_offset) {
+        ring.map_size = offset.desc + XDP_RING_SIZE * descriptor_size;
+        ring.map = mmap(nullptr, ring.map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->socket_fd,
+                        page_offset);
+        if (ring.map == MAP_FAILED) {
+            ring.map = nullptr;
+            throw std::runtime_error("Failed to map an XDP ring");
+        }
+
+        char *base = static_cast<char *>(ring.map);
+        ring.producer = reinterpret_cast<uint32_t *>(base + offset.producer);
+        ring.consumer = reinterpret_cast<uint32_t *>(base + offset.consumer);
+        ring.descriptors = base + offset.desc;
+    };
+
+    map(this->fill, offsets.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+    map(this->completion, offsets.cr, sizeof(uint64_t),
+        XDP_UMEM_PGOFF_COMPLETION_RING);
+    map(this->rx, offsets.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+    map(this->tx, offsets.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+}
+
+void XdpSocket::loadProgram(unsigned int ifindex, bool generic) {
+    // Assembled here, so there is no BPF toolchain to build with. In C:
+    //
+    //   if (data + 46 > data_end || data_end > data + MAX) return XDP_PASS;
+    //   if (eth->type != IP || ip->version_ihl != 0x45 ||
+    //       ip->protocol != UDP || ip->frag_off & (MF | OFFSET) ||
+    //       udp->dest != port) return XDP_PASS;
+    //   if (opcode != DATA && opcode != ACK) return XDP_PASS;
+    //   return bpf_redirect_map(&sockets, ctx->rx_queue_index, XDP_PASS);
+    std::vector<struct bpf_insn> program;
+    std::vector<size_t> passes;  // Jumps to the end, which passes the packet
+
+    auto emit = [&](struct bpf_insn insn) { program.push_back(insn); };
+    auto loadPacket = [&](uint8_t size, int16_t offset) {
+        emit(instruction(BPF_LDX | BPF_MEM | size, BPF_REG_5, BPF_REG_2,
+                         offset, 0));
+    };
+    auto passUnless = [&](int32_t value) {
+        passes.push_back(program.size());
+        emit(instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, value));
+    };
+    auto passIfAbove = [&](uint8_t reg, uint8_t limit) {
+        passes.push_back(program.size());
+        emit(instruction(BPF_JMP | BPF_JGT | BPF_X, reg, limit, 0, 0));
+    };
+
+    emit(instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+    emit(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+                     offsetof(struct xdp_md, data), 0));
+    emit(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+                     offsetof(struct xdp_md, data_end), 0));
+
+    // Headers and a TFTP opcode and block number, in one frame
+    emit(instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+    emit(instruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0,
+                     XDP_HEADER_SIZE + 4));
+    passIfAbove(BPF_REG_4, BPF_REG_3);
+    emit(instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+    emit(instruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0,
+                     XDP_FRAME_SIZE - XDP_FRAME_HEADROOM));
+    passIfAbove(BPF_REG_3, BPF_REG_4);
+
+    // Unfragmented UDP over IPv4 without options, to the server's port
+    loadPacket(BPF_H, ETHERNET_TYPE);
+    passUnless(htons(0x0800));
+    loadPacket(BPF_B, IP_HEADER);
+    passUnless(0x45);
+    loadPacket(BPF_B, IP_PROTOCOL);
+    passUnless(17);
+    loadPacket(BPF_H, IP_HEADER + 6);
+    emit(instruction(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0,
+                     htons(0x3FFF)));
+    passUnless(0);
+    loadPacket(BPF_H, UDP_HEADER + 2);
+    passUnless(this->port);
+
+    // DATA or ACK
+    loadPacket(BPF_H, XDP_HEADER_SIZE);
+    emit(instruction(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 1,
+                     htons(static_cast<uint16_t>(PacketType::DATA))));
+    passUnless(htons(static_cast<uint16_t>(PacketType::ACK)));
+
+    // Packets of a queue without a socket still reach the kernel
+    emit(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+                     offsetof(struct xdp_md, rx_queue_index), 0));
+    emit(instruction(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+                     0, this->map_fd));
+    emit(instruction(0, 0, 0, 0, 0));
+    emit(instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+    emit(instruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    emit(instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    for (size_t pass : passes) program[pass].off = program.size() - pass - 1;
+    emit(instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+    emit(instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    char log[4096] = {};
+    union bpf_attr attr = {};
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(program.data());
+    attr.insn_cnt = program.size();
+    attr.license = reinterpret_cast<uint64_t>("GPL");
+    attr.log_buf = reinterpret_cast<uint64_t>(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    strncpy(attr.prog_name, "tftp_steer", sizeof(attr.prog_name) - 1);
+    this->program_fd = bpf(BPF_PROG_LOAD, attr);
+    if (this->program_fd < 0) {
+        TFTP_LOG_ERROR("XDP program rejected: {}", log);
+        throw std::runtime_error("Failed to load the XDP program");
+    }
+
+    // A link is detached when its descriptor is closed, also if the server
+    // dies
+    attr = {};
+    attr.link_create.prog_fd = this->program_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = generic ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+    this->link_fd = bpf(BPF_LINK_CREATE, attr);
+    if (this->link_fd < 0) {
+        throw std::runtime_error(
+            std::string("Failed to attach the XDP program: ") +
+            strerror(errno));
+    }
+}
+
+ssize_t XdpSocket::receive(char *dst, size_t size, struct sockaddr_in &addr) {
+    uint32_t consumer = *this->rx.consumer;
+    auto descriptors = static_cast<struct xdp_desc *>(this->rx.descriptors);
+    auto fill = static_cast<uint64_t *>(this->fill.descriptors);
+
+    while (consumer != load(this->rx.producer)) {
+        struct xdp_desc descriptor = descriptors[consumer % XDP_RING_SIZE];
+        store(this->rx.consumer, ++consumer);
+
+        // Checksums are not checked, with generic XDP on veth they are not
+        // even filled in
+        const char *frame = this->umem + descriptor.addr;
+        uint16_t udp_size;
+        memcpy(&udp_size, frame + UDP_HEADER + 4, 2);
+        udp_size = ntohs(udp_size);
+
+        ssize_t payload_size = -1;
+        if (udp_size >= 8 &&
+            udp_size - 8u <= descriptor.len - XDP_HEADER_SIZE &&
+            udp_size - 8u <= size) {
+            payload_size = udp_size - 8;
+            memcpy(dst, frame + XDP_HEADER_SIZE, payload_size);
+
+            addr = {};
+            addr.sin_family = AF_INET;
+            memcpy(&addr.sin_addr, frame + IP_SOURCE, 4);
+            memcpy(&addr.sin_port, frame + UDP_HEADER, 2);
+
+            // Replies go back the way the packet came
+            if (this->routes.size() >= XDP_ROUTE_LIMIT) this->routes.clear();
+            Route &route = this->routes[addr.sin_addr.s_addr];
+            memcpy(route.peer_mac, frame + ETHERNET_SOURCE, 6);
+            memcpy(route.local_mac, frame + ETHERNET_DESTINATION, 6);
+            memcpy(&route.local_address, frame + IP_DESTINATION, 4);
+        }
+
+        // The frame goes back to the kernel right away
+        uint32_t producer = *this->fill.producer;
+        fill[producer % XDP_RING_SIZE] =
+            descriptor.addr - descriptor.addr % XDP_FRAME_SIZE;
+        store(this->fill.producer, producer + 1);
+
+        if (payload_size >= 0) return payload_size;
+    }
+
+    return -1;
+}
+
+bool XdpSocket::send(const struct sockaddr_in &addr, const char *payload,
+                     size_t size) {
+    if (size > this->max_payload) return false;
+
+    auto route = this->routes.find(addr.sin_addr.s_addr);
+    if (route == this->routes.end()) return false;
+
+    if (this->free_frames.empty()) this->reclaimFrames();
+    if (this->free_frames.empty()) return false;
+
+    uint64_t frame_addr = this->free_frames.back();
+    this->free_frames.pop_back();
+    char *frame = this->umem + frame_addr;
+
+    memcpy(frame + ETHERNET_DESTINATION, route->second.peer_mac, 6);
+    memcpy(frame + ETHERNET_SOURCE, route->second.local_mac, 6);
+    uint16_t type = htons(0x0800);
+    memcpy(frame + ETHERNET_TYPE, &type, 2);
+
+    // IPv4, don't fragment
+    uint16_t ip_size = htons(size + XDP_HEADER_SIZE - IP_HEADER);
+    uint8_t ip[20] = {0x45, 0, 0, 0, 0, 0, 0x40, 0, 64, 17};
+    memcpy(ip + 2, &ip_size, 2);
+    memcpy(ip + 12, &route->second.local_address, 4);
+    memcpy(ip + 16, &addr.sin_addr, 4);
+    uint16_t ip_checksum = foldChecksum(
+        addChecksum(reinterpret_cast<const char *>(ip), sizeof(ip), 0));
+    memcpy(ip + 10, &ip_checksum, 2);
+    memcpy(frame + IP_HEADER, ip, sizeof(ip));
+
+    uint16_t udp_size = htons(size + 8);
+    char *udp = frame + UDP_HEADER;
+    memcpy(udp, &this->port, 2);
+    memcpy(udp + 2, &addr.sin_port, 2);
+    memcpy(udp + 4, &udp_size, 2);
+    memset(udp + 6, 0, 2);
+    memcpy(frame + XDP_HEADER_SIZE, payload, size);
+
+    // Over the pseudo header, UDP header and payload. 0 means none.
+    uint64_t sum = addChecksum(frame + IP_SOURCE, 8, htons(17) + udp_size);
+    uint16_t udp_checksum = foldChecksum(addChecksum(udp, size + 8, sum));
+    if (udp_checksum == 0) udp_checksum = 0xFFFF;
+    memcpy(udp + 6, &udp_checksum, 2);
+
+    // Every frame for sending fits the ring
+    auto descriptors = static_cast<struct xdp_desc *>(this->tx.descriptors);
+    uint32_t producer = *this->tx.producer;
+    descriptors[producer % XDP_RING_SIZE] = {
+        frame_addr, static_cast<uint32_t>(size + XDP_HEADER_SIZE), 0};
+    store(this->tx.producer, producer + 1);
+    ++this->tx_queued;
+
+    return true;
+}
+
+void XdpSocket::flush() {
+    if (this->tx_queued == 0) return;
+
+    // Tried again next time if the kernel is busy
+    if (sendto(this->socket_fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0) >= 0 ||
+        (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)) {
+        this->tx_queued = 0;
+    }
+    this->reclaimFrames();
+}
+
+void XdpSocket::reclaimFrames() {
+    auto descriptors = static_cast<uint64_t *>(this->completion.descriptors);
+    uint32_t consumer = *this->completion.consumer;
+    uint32_t producer = load(this->completion.producer);
+
+    for (; consumer != producer; ++consumer) {
+        this->free_frames.push_back(descriptors[consumer % XDP_RING_SIZE]);
+    }
+    store(this->completion.consumer, consumer);
+}
+
+void XdpSocket::release() {
+    // The program goes first, so no packet is sent to a closed socket
+    for (int *fd : {&this->link_fd, &this->program_fd, &this->map_fd,
+                    &this->socket_fd}) {
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+    }
+
+    for (Ring *ring : {&this->fill, &this->completion, &this->rx, &this->tx}) {
+        if (ring->map != nullptr) munmap(ring->map, ring->map_size);
+        ring->map = nullptr;
+    }
+
+    if (this->umem != nullptr) {
+        munmap(this->umem, XDP_FRAME_COUNT * XDP_FRAME_SIZE);
+        this->umem = nullptr;
+    }
+}
+#else
+XdpSocket::XdpSocket(const std::string &, unsigned int, uint16_t, bool) {
+    throw std::runtime_error("AF_XDP needs Linux");
+}
+
+XdpSocket::~XdpSocket() {}
+
+ssize_t XdpSocket::receive(char *, size_t, struct sockaddr_in &) {
+    return -1;
+}
+
+bool XdpSocket::send(const struct sockaddr_in &, const char *, size_t) {
+    return false;
+}
+
+void XdpSocket::flush() {}
+#endif
+}  // namespace tftp
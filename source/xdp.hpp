@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+
+namespace tftp {
+// Each packet takes one frame of the shared memory area, so packets larger
+// than a frame go through the kernel
+constexpr inline uint32_t XDP_FRAME_SIZE = 4096;
+constexpr inline uint32_t XDP_FRAME_COUNT = 4096;
+
+// The kernel keeps the start of each frame it fills free for XDP
+constexpr inline uint32_t XDP_FRAME_HEADROOM = 256;
+
+// Half of the frames take packets in, the other half send them
+constexpr inline uint32_t XDP_RING_SIZE = XDP_FRAME_COUNT / 2;
+
+// Ethernet, IPv4 without options and UDP
+constexpr inline uint32_t XDP_HEADER_SIZE = 14 + 20 + 8;
+
+// Peers whose link addresses are kept at most
+constexpr inline size_t XDP_ROUTE_LIMIT = 65536;
+
+// AF_XDP socket on one receive queue of an interface, next to the server's
+// UDP socket. An XDP program sends it the DATA and ACK packets to the
+// server's port that fit a frame, and passes everything else, requests
+// included, on to the kernel. Replies to peers it has heard from are framed
+// here and skip the kernel too. The program is detached when the socket is
+// destroyed. Linux only, and not thread safe.
+class XdpSocket {
+   public:
+    // In generic mode the program runs after the kernel has built its
+    // socket buffer, which works with any driver, veth included. Throws
+    // std::runtime_error if the program cannot be loaded and attached or
+    // the socket cannot be bound.
+    XdpSocket(const std::string &interface, unsigned int queue, uint16_t port,
+              bool generic);
+    ~XdpSocket();
+    XdpSocket(const XdpSocket &) = delete;
+    XdpSocket &operator=(const XdpSocket &) = delete;
+
+    // Becomes readable when packets came in
+    int getFd() const { return this->socket_fd; }
+
+    // Copies the UDP payload of the next packet to dst and its source to
+    // addr. Returns -1 once there are none.
+    ssize_t receive(char *dst, size_t size, struct sockaddr_in &addr);
+
+    // Frames a UDP payload to a peer a packet came from. Returns false if
+    // the peer is unknown, the payload does not fit a frame or every frame
+    // is in flight, in which case the socket should send it.
+    bool send(const struct sockaddr_in &addr, const char *payload,
+              size_t size);
+
+    // Makes the kernel send what send() queued
+    void flush();
+
+   private:
+    // Shared with the kernel, which moves the other end
+    struct Ring {
+        uint32_t *producer = nullptr;
+        uint32_t *consumer = nullptr;
+        void *descriptors = nullptr;
+        void *map = nullptr;
+        size_t map_size = 0;
+    };
+
+    // Where replies to a peer go, learned from its packets
+    struct Route {
+        uint8_t peer_mac[6];
+        uint8_t local_mac[6];
+        uint32_t local_address;
+    };
+
+    int socket_fd = -1;
+    int map_fd = -1;
+    int program_fd = -1;
+    int link_fd = -1;
+
+    uint16_t port;  // Network byte order
+    size_t max_payload;
+
+    char *umem = nullptr;
+    Ring fill, completion, rx, tx;
+    std::vector<uint64_t> free_frames;  // For sending
+    uint32_t tx_queued = 0;             // Since the last flush
+
+    std::unordered_map<uint32_t, Route> routes;
+
+    void setUp(const std::string &interface, unsigned int queue,
+               bool generic);
+    void mapRings();
+    void loadProgram(unsigned int ifindex, bool generic);
+    void reclaimFrames();
+    void release();
+};
+}  // namespace tftp
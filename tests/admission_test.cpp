@@ -0,0 +1,203 @@
+// Admission control driven through the controller: requests over a limit
+// wait in order, new ones queue behind them rather than take a freed slot,
+// a request that fits passes one that does not, retransmitted requests keep
+// their place, and requests are turned away when the queue is full or they
+// waited too long.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "controller.hpp"
+#include "memory_files.hpp"
+
+namespace {
+int failures = 0;
+
+void check(bool ok, const char *what) {
+    if (ok) return;
+
+    ++failures;
+    std::fprintf(stderr, "FAIL %s\n", what);
+}
+
+// Files of two blocks, so sessions stay until their second block is acked
+constexpr size_t FILE_SIZE = 1000;
+
+tftp::Peer makePeer(uint8_t host, uint16_t port) {
+    tftp::Peer peer;
+    peer.address[10] = 0xFF;
+    peer.address[11] = 0xFF;
+    peer.address[12] = 10;
+    peer.address[15] = host;
+    peer.port = htons(port);
+    return peer;
+}
+
+class Harness {
+   public:
+    tftp::MemoryFileWorkerFactory factory;
+    tftp::Controller controller;
+    std::vector<char> response = std::vector<char>(UINT16_MAX + 1);
+
+    explicit Harness(const tftp::AdmissionLimits &limits)
+        : controller(factory) {
+        this->factory.files["file"] = std::vector<char>(FILE_SIZE, 'x');
+        this->controller.setAdmissionLimits(limits);
+    }
+
+    // Sends a packet, and returns the size of the reply
+    ssize_t send(const tftp::Peer &peer, std::vector<char> packet) {
+        ssize_t size = packet.size();
+
+        // Strings in packets must be terminated, as the server does
+        packet.resize(packet.size() + 2, '\0');
+        return this->controller.handlePacket(peer, packet.data(),
+                                             this->response.data(), size);
+    }
+
+    ssize_t request(const tftp::Peer &peer, tftp::PacketType type) {
+        std::vector<char> packet = {0, static_cast<char>(type)};
+        for (const char *field : {"file", "octet"}) {
+            packet.insert(packet.end(), field, field + strlen(field) + 1);
+        }
+        return this->send(peer, packet);
+    }
+
+    ssize_t ack(const tftp::Peer &peer, uint16_t block) {
+        return this->send(peer, {0, static_cast<char>(tftp::PacketType::ACK),
+                                 static_cast<char>(block >> 8),
+                                 static_cast<char>(block)});
+    }
+
+    // Acks both blocks, which ends the session
+    void finish(const tftp::Peer &peer) {
+        this->ack(peer, 1);
+        this->ack(peer, 2);
+    }
+
+    // The peer of the next reply not sent with a packet, if any
+    bool nextReply(tftp::Peer &peer) {
+        ssize_t size;
+        return this->controller.nextReply(peer, this->response.data(), size) &&
+               size > 0;
+    }
+
+    tftp::PacketType replyType() const {
+        return static_cast<tftp::PacketType>(
+            ntohs(*reinterpret_cast<const uint16_t *>(this->response.data())));
+    }
+};
+
+// Sessions over the limit wait their turn, oldest first
+void checkOrder() {
+    tftp::AdmissionLimits limits;
+    limits.max_sessions = 2;
+    limits.queue_length = 3;
+    limits.queue_timeout_ms = 60 * 1000;
+    Harness harness(limits);
+
+    tftp::Peer a = makePeer(1, 1000), b = makePeer(2, 1000),
+               c = makePeer(3, 1000), d = makePeer(4, 1000),
+               e = makePeer(5, 1000), f = makePeer(6, 1000),
+               g = makePeer(7, 1000);
+    tftp::Peer peer;
+
+    check(harness.request(a, tftp::PacketType::RRQ) > 0 &&
+              harness.replyType() == tftp::PacketType::DATA,
+          "first session admitted");
+    check(harness.request(b, tftp::PacketType::RRQ) > 0, "second admitted");
+
+    check(harness.request(c, tftp::PacketType::RRQ) < 0, "third queued");
+    check(harness.request(d, tftp::PacketType::WRQ) < 0, "fourth queued");
+    check(harness.request(c, tftp::PacketType::RRQ) < 0,
+          "retransmitted request dropped");
+    check(harness.request(e, tftp::PacketType::RRQ) < 0, "fifth queued");
+    check(harness.request(f, tftp::PacketType::RRQ) > 0 &&
+              harness.replyType() == tftp::PacketType::ERROR,
+          "rejected with the queue full");
+    check(!harness.nextReply(peer), "nothing admitted without a slot");
+
+    // A slot frees up, and goes to the oldest request
+    harness.finish(a);
+    check(harness.nextReply(peer) && peer == c &&
+              harness.replyType() == tftp::PacketType::DATA,
+          "oldest request admitted");
+    check(!harness.nextReply(peer), "one request per slot");
+
+    // A new request does not take the next slot from the queued ones
+    harness.finish(b);
+    check(harness.request(g, tftp::PacketType::RRQ) < 0,
+          "new request queued behind");
+    check(harness.nextReply(peer) && peer == d &&
+              harness.replyType() == tftp::PacketType::ACK,
+          "queued upload admitted");
+
+    harness.finish(c);
+    check(harness.nextReply(peer) && peer == e, "queued in order");
+    harness.finish(e);
+    check(harness.nextReply(peer) && peer == g, "new request last");
+}
+
+// A request that fits passes one that waits for its client
+void checkClients() {
+    tftp::AdmissionLimits limits;
+    limits.max_client_sessions = 1;
+    limits.queue_length = 4;
+    limits.queue_timeout_ms = 60 * 1000;
+    Harness harness(limits);
+
+    tftp::Peer a1 = makePeer(1, 1000), a2 = makePeer(1, 1001),
+               b = makePeer(2, 1000);
+    tftp::Peer peer;
+
+    check(harness.request(a1, tftp::PacketType::RRQ) > 0, "client admitted");
+    check(harness.request(a2, tftp::PacketType::RRQ) < 0,
+          "second port of a client queued");
+    check(harness.request(b, tftp::PacketType::RRQ) < 0,
+          "other client queued behind");
+    check(harness.nextReply(peer) && peer == b,
+          "other client passes the one over its limit");
+    check(!harness.nextReply(peer), "client over its limit waits");
+
+    harness.finish(a1);
+    check(harness.nextReply(peer) && peer == a2, "client admitted again");
+}
+
+// Requests that wait too long are turned away
+void checkTimeout() {
+    tftp::AdmissionLimits limits;
+    limits.max_sessions = 1;
+    limits.queue_length = 2;
+    limits.queue_timeout_ms = 20;
+    Harness harness(limits);
+
+    tftp::Peer a = makePeer(1, 1000), b = makePeer(2, 1000);
+    tftp::Peer peer;
+
+    check(harness.request(a, tftp::PacketType::RRQ) > 0, "session admitted");
+    check(harness.request(b, tftp::PacketType::RRQ) < 0, "request queued");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    harness.controller.handleTimeouts();
+    check(harness.nextReply(peer) && peer == b &&
+              harness.replyType() == tftp::PacketType::ERROR,
+          "expired request rejected");
+    check(!harness.nextReply(peer), "queue empty after expiry");
+}
+}  // namespace
+
+int main() {
+    checkOrder();
+    checkClients();
+    checkTimeout();
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,273 @@
+// Compressed images checked against the data they were made from, in every
+// format this build can read: read in order, read in any order through a
+// cache too small to keep them, so gzip resumes at its access points and
+// zstd starts over, and cut short. Images are made of several gzip members
+// or zstd frames, and the chunk cache is checked on its own.
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef TFTP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef TFTP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compressed_files.hpp"
+
+namespace {
+int failures = 0;
+
+void check(bool ok, const char *what, const char *format) {
+    if (ok) return;
+
+    ++failures;
+    std::fprintf(stderr, "FAIL %s, %s\n", what, format);
+}
+
+// Files in memory, read only
+class MemoryFileSystem : public tftp::FileSystem {
+   public:
+    std::map<std::string, std::string> files;
+
+    bool exists(const std::string &filename) const override {
+        return this->files.count(filename) > 0;
+    }
+    bool create(const std::string &) const override { return false; }
+    bool remove(const std::string &) const override { return false; }
+
+    ssize_t size(const std::string &filename) const override {
+        auto file = this->files.find(filename);
+        return file == this->files.end() ? -1 : file->second.size();
+    }
+
+    ssize_t read(const std::string &filename, char *buffer, ssize_t size,
+                 ssize_t offset) const override {
+        auto file = this->files.find(filename);
+        if (file == this->files.end()) return -1;
+        if (offset >= static_cast<ssize_t>(file->second.size())) return 0;
+
+        size = std::min<ssize_t>(size, file->second.size() - offset);
+        std::copy_n(file->second.data() + offset, size, buffer);
+        return size;
+    }
+
+    ssize_t write(const std::string &, char *, ssize_t,
+                  ssize_t) const override {
+        return -1;
+    }
+    ssize_t append(const std::string &, char *, ssize_t) const override {
+        return -1;
+    }
+    bool rename(const std::string &, const std::string &) const override {
+        return false;
+    }
+    bool sync(const std::vector<std::string> &) const override {
+        return false;
+    }
+};
+
+// Words from a small vocabulary, which compress to many deflate blocks
+std::string makeText(size_t size, unsigned int seed) {
+    const char *words[] = {"boot ", "kernel ", "initrd ", "image ", "tftp\n",
+                           "block ", "0x1f ", "window "};
+    std::mt19937 random(seed);
+
+    std::string text;
+    while (text.size() < size) text += words[random() % 8];
+    text.resize(size);
+    return text;
+}
+
+#ifdef TFTP_HAVE_ZLIB
+std::string compressGzip(const std::string &data) {
+    z_stream stream = z_stream();
+    deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+
+    std::string out(deflateBound(&stream, data.size()), '\0');
+    stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = out.size();
+
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+#endif
+
+#ifdef TFTP_HAVE_ZSTD
+std::string compressZstd(const std::string &data) {
+    std::string out(ZSTD_compressBound(data.size()), '\0');
+    out.resize(ZSTD_compress(&out[0], out.size(), data.data(), data.size(),
+                             3));
+    return out;
+}
+#endif
+
+std::string compress(tftp::CompressionFormat format, const std::string &data) {
+#ifdef TFTP_HAVE_ZLIB
+    if (format == tftp::CompressionFormat::Gzip) return compressGzip(data);
+#endif
+#ifdef TFTP_HAVE_ZSTD
+    if (format == tftp::CompressionFormat::Zstd) return compressZstd(data);
+#endif
+    return "";
+}
+
+const char *getName(tftp::CompressionFormat format) {
+    return format == tftp::CompressionFormat::Gzip ? "gzip" : "zstd";
+}
+
+// Whether the chunk holds its part of the data
+bool matches(const tftp::ChunkCache::Chunk &chunk, const std::string &data,
+             uint32_t index) {
+    if (chunk == nullptr) return false;
+
+    const size_t start =
+        static_cast<size_t>(index) * tftp::COMPRESSED_CHUNK_SIZE;
+    const size_t size = start < data.size()
+                            ? std::min(data.size() - start,
+                                       tftp::COMPRESSED_CHUNK_SIZE)
+                            : 0;
+    return chunk->size() == size &&
+           std::equal(chunk->begin(), chunk->end(), data.begin() + start);
+}
+
+void checkFormat(tftp::CompressionFormat format) {
+    const char *name = getName(format);
+
+    // Two members or frames, the first ending mid chunk
+    std::string data = makeText(5 * tftp::COMPRESSED_CHUNK_SIZE + 12345, 1);
+    const size_t split = 2 * tftp::COMPRESSED_CHUNK_SIZE + 777;
+
+    MemoryFileSystem filesystem;
+    filesystem.files["image"] = compress(format, data.substr(0, split)) +
+                                compress(format, data.substr(split));
+    const uint32_t chunks = data.size() / tftp::COMPRESSED_CHUNK_SIZE + 1;
+
+    // In order, with room for everything
+    {
+        tftp::ChunkCache cache(16 * tftp::COMPRESSED_CHUNK_SIZE);
+        tftp::CompressedImage image(filesystem, "image", format, cache);
+        check(image.getSize() == -1, "size known up front", name);
+
+        for (uint32_t index = 0; index <= chunks; ++index) {
+            check(matches(image.getChunk(index), data, index),
+                  "chunk read in order", name);
+        }
+        check(image.getSize() == static_cast<ssize_t>(data.size()),
+              "size after reading to the end", name);
+    }
+
+    // Backwards and at random with one chunk cached, once the whole image
+    // was read and the gzip stream indexed, so every chunk is decompressed
+    // again
+    {
+        tftp::ChunkCache cache(tftp::COMPRESSED_CHUNK_SIZE);
+        tftp::CompressedImage image(filesystem, "image", format, cache);
+        for (uint32_t index = 0; index < chunks; ++index) image.getChunk(index);
+
+        for (uint32_t index = chunks; index-- > 0;) {
+            check(matches(image.getChunk(index), data, index),
+                  "chunk read backwards", name);
+        }
+
+        std::mt19937 random(2);
+        for (int i = 0; i < 20; ++i) {
+            uint32_t index = random() % (chunks + 1);
+            check(matches(image.getChunk(index), data, index),
+                  "chunk read at random", name);
+        }
+    }
+
+    // Through a worker, across chunk boundaries
+    {
+        tftp::ChunkCache cache(tftp::COMPRESSED_CHUNK_SIZE);
+        auto image = std::make_shared<tftp::CompressedImage>(
+            filesystem, "image", format, cache);
+        tftp::CompressedFileWorker worker("image", tftp::FileWorkerMode::Octet,
+                                          image);
+
+        std::vector<char> buffer(1428);
+        std::mt19937 random(3);
+        for (int i = 0; i < 50; ++i) {
+            size_t offset = random() % (data.size() + 100);
+            ssize_t count = worker.read(buffer.data(), buffer.size(), offset);
+            size_t expected =
+                offset < data.size()
+                    ? std::min(buffer.size(), data.size() - offset)
+                    : 0;
+            check(count == static_cast<ssize_t>(expected) &&
+                      std::equal(buffer.begin(), buffer.begin() + expected,
+                                 data.begin() + offset),
+                  "read through a worker", name);
+        }
+    }
+
+    // Cut short in the second member or frame, which must fail rather
+    // than end early
+    {
+        std::string &file = filesystem.files["image"];
+        file.resize(file.size() - 100);
+
+        tftp::ChunkCache cache(16 * tftp::COMPRESSED_CHUNK_SIZE);
+        tftp::CompressedImage image(filesystem, "image", format, cache);
+
+        bool failed = false;
+        for (uint32_t index = 0; index <= chunks && !failed; ++index) {
+            failed = image.getChunk(index) == nullptr;
+        }
+        check(failed, "image cut short", name);
+        check(image.getSize() == -1, "size of an image cut short", name);
+    }
+}
+
+void checkCache() {
+    auto chunk = [](size_t size) {
+        return std::make_shared<const std::vector<char>>(size);
+    };
+
+    tftp::ChunkCache cache(25);
+    cache.insert(1, 0, chunk(10));
+    cache.insert(1, 1, chunk(10));
+
+    // Found chunks move to the front, so the second one is dropped
+    check(cache.find(1, 0) != nullptr, "cached chunk", "cache");
+    cache.insert(2, 0, chunk(10));
+    check(cache.find(1, 1) == nullptr, "least recently used dropped",
+          "cache");
+    check(cache.find(1, 0) != nullptr && cache.find(2, 0) != nullptr,
+          "recently used kept", "cache");
+    check(cache.getSize() == 20, "size after dropping", "cache");
+
+    // A chunk larger than the cache is still kept until the next one
+    cache.insert(3, 0, chunk(40));
+    check(cache.find(3, 0) != nullptr && cache.getSize() == 40,
+          "oversized chunk kept", "cache");
+}
+}  // namespace
+
+int main() {
+    checkCache();
+
+    for (tftp::CompressionFormat format :
+         tftp::CompressedFileWorkerFactory::getFormats()) {
+        checkFormat(format);
+    }
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
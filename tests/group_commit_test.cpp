@@ -0,0 +1,301 @@
+// Group commit over a file system that records what it is asked to do:
+// uploads are synced before they are moved into place and their names
+// after, uploads that finish during a sync share the next one, a failure
+// fails only the uploads it touches, and a failed sync of the names leaves
+// uploads that are already in place committed.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "disk_io.hpp"
+#include "metrics.hpp"
+
+namespace {
+int failures = 0;
+
+void check(bool ok, const char *what) {
+    if (ok) return;
+
+    ++failures;
+    std::fprintf(stderr, "FAIL %s\n", what);
+}
+
+// Records syncs and renames, and fails those it is told to. Syncs can be
+// held until released, to make uploads pile up behind one.
+class RecordingFileSystem : public tftp::FileSystem {
+   public:
+    mutable std::mutex mutex;
+    mutable std::condition_variable changed;
+    mutable std::vector<std::vector<std::string>> syncs;
+    mutable std::vector<std::string> renames;
+
+    std::string failing_sync;    // Fails any sync of this name
+    std::string failing_rename;  // Fails renaming this upload
+    mutable bool holding = false;
+    mutable bool held = false;  // A sync waits to be released
+
+    bool exists(const std::string &) const override { return true; }
+    bool create(const std::string &) const override { return true; }
+    bool remove(const std::string &) const override { return true; }
+    ssize_t size(const std::string &) const override { return 0; }
+    ssize_t read(const std::string &, char *, ssize_t,
+                 ssize_t) const override {
+        return -1;
+    }
+    ssize_t write(const std::string &, char *, ssize_t,
+                  ssize_t) const override {
+        return -1;
+    }
+    ssize_t append(const std::string &, char *, ssize_t) const override {
+        return -1;
+    }
+
+    bool rename(const std::string &from,
+                const std::string &to) const override {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->renames.push_back(from + ">" + to);
+        return from != this->failing_rename;
+    }
+
+    bool sync(const std::vector<std::string> &filenames) const override {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->syncs.push_back(filenames);
+
+        if (this->holding) {
+            this->held = true;
+            this->changed.notify_all();
+            this->changed.wait(lock, [this]() { return !this->holding; });
+            this->held = false;
+        }
+
+        for (const std::string &filename : filenames) {
+            if (filename == this->failing_sync) return false;
+        }
+        return true;
+    }
+
+    void hold() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->holding = true;
+    }
+
+    void waitHeld() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->changed.wait(lock, [this]() { return this->held; });
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->holding = false;
+        this->changed.notify_all();
+    }
+};
+
+// An upload to NAME.part, or straight to NAME without an upload name
+class UploadWorker : public tftp::FileWorker {
+   public:
+    bool closes = true;
+    bool committed = false;
+
+    UploadWorker(const std::string &filename, bool temporary)
+        : FileWorker(filename, tftp::FileWorkerMode::Octet),
+          temporary(temporary) {}
+
+    bool open() override { return true; }
+    bool close() override { return this->closes; }
+    bool exists() override { return true; }
+    bool remove() override { return true; }
+    ssize_t read(char *, ssize_t, ssize_t) override { return -1; }
+    ssize_t write(char *, ssize_t, ssize_t) override { return -1; }
+    ssize_t append(char *, ssize_t) override { return -1; }
+
+    std::string getUploadName() const override {
+        return this->temporary ? this->filename + ".part" : std::string();
+    }
+    void setCommitted() override { this->committed = true; }
+
+   private:
+    bool temporary;
+};
+
+struct Upload {
+    UploadWorker worker;
+    tftp::DiskJob job;
+
+    Upload(const std::string &filename, tftp::CompletionQueue &completions,
+           bool temporary = true)
+        : worker(filename, temporary) {
+        this->job.kind = tftp::DiskJob::Kind::Commit;
+        this->job.file_worker = &this->worker;
+        this->job.completions = &completions;
+        this->job.result = 1;  // Neither committed nor failed yet
+    }
+};
+
+uint64_t committedCount() {
+    return tftp::Metrics::instance()
+        .snapshot()
+        .counters[static_cast<unsigned int>(tftp::Counter::UploadsCommitted)];
+}
+
+// Waits for count jobs to come back, false after a few seconds
+bool waitFor(tftp::CompletionQueue &completions, size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (count > 0 && std::chrono::steady_clock::now() < deadline) {
+        if (completions.pop() != nullptr) {
+            --count;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    return count == 0;
+}
+
+bool contains(const std::vector<std::string> &names, const std::string &name) {
+    for (const std::string &other : names) {
+        if (other == name) return true;
+    }
+    return false;
+}
+
+void checkCommit() {
+    RecordingFileSystem filesystem;
+    tftp::CompletionQueue completions;
+    tftp::GroupCommitter committer(filesystem);
+    uint64_t committed = committedCount();
+
+    Upload upload("a", completions);
+    committer.submit(&upload.job);
+    check(waitFor(completions, 1), "commit posted");
+
+    check(upload.job.result == 0 && upload.worker.committed,
+          "upload committed");
+    check(filesystem.syncs.size() == 2 &&
+              filesystem.syncs[0] == std::vector<std::string>{"a.part"} &&
+              filesystem.syncs[1] == std::vector<std::string>{"a"},
+          "upload synced before its name");
+    check(filesystem.renames == std::vector<std::string>{"a.part>a"},
+          "upload moved into place");
+    check(committedCount() == committed + 1, "commit counted");
+}
+
+// Uploads that finish during a sync share the next one
+void checkGroups() {
+    RecordingFileSystem filesystem;
+    tftp::CompletionQueue completions;
+    tftp::GroupCommitter committer(filesystem);
+
+    std::vector<std::unique_ptr<Upload>> uploads;
+    for (int i = 0; i < 9; ++i) {
+        uploads.emplace_back(new Upload(std::to_string(i), completions));
+    }
+
+    filesystem.hold();
+    committer.submit(&uploads[0]->job);
+    filesystem.waitHeld();
+    for (size_t i = 1; i < uploads.size(); ++i) {
+        committer.submit(&uploads[i]->job);
+    }
+    filesystem.release();
+    check(waitFor(completions, uploads.size()), "group posted");
+
+    bool all = true;
+    for (const auto &upload : uploads) {
+        all = all && upload->job.result == 0 && upload->worker.committed;
+    }
+    check(all, "every upload of the groups committed");
+    check(filesystem.syncs.size() == 4 && filesystem.syncs[2].size() == 8,
+          "uploads during a sync share the next one");
+}
+
+// A failure fails the uploads it touches, and only those
+void checkFailures() {
+    RecordingFileSystem filesystem;
+    tftp::CompletionQueue completions;
+    uint64_t committed = committedCount();
+
+    Upload closed("closed", completions), renamed("renamed", completions),
+        plain("plain", completions, false), fine("fine", completions);
+    closed.worker.closes = false;
+    filesystem.failing_rename = "renamed.part";
+
+    // Submitted while the committer waits, so they make one group
+    {
+        tftp::GroupCommitter committer(filesystem);
+        filesystem.hold();
+        Upload first("first", completions);
+        committer.submit(&first.job);
+        filesystem.waitHeld();
+
+        for (Upload *upload : {&closed, &renamed, &plain, &fine}) {
+            committer.submit(&upload->job);
+        }
+        filesystem.release();
+        check(waitFor(completions, 5), "failures posted");
+    }
+
+    check(closed.job.result == -1 && !closed.worker.committed,
+          "upload that did not close failed");
+    check(!contains(filesystem.syncs[2], "closed.part"),
+          "upload that did not close not synced");
+    check(renamed.job.result == -1 && !renamed.worker.committed,
+          "upload that was not moved failed");
+    check(plain.job.result == 0 && !contains(filesystem.syncs[2], "plain"),
+          "upload without a temporary file left alone");
+    check(fine.job.result == 0 && fine.worker.committed,
+          "other uploads of the group committed");
+    check(committedCount() == committed + 3, "only commits counted");
+
+    // A failed sync of the uploads fails the group, before anything moves
+    {
+        RecordingFileSystem failing;
+        failing.failing_sync = "b.part";
+        tftp::GroupCommitter committer(failing);
+
+        Upload a("a", completions), b("b", completions);
+        failing.hold();
+        committer.submit(&a.job);
+        failing.waitHeld();
+        committer.submit(&b.job);
+        failing.release();
+        check(waitFor(completions, 2), "failed sync posted");
+
+        check(a.job.result == 0 && b.job.result == -1 && !b.worker.committed,
+              "failed sync of the uploads");
+        check(failing.renames == std::vector<std::string>{"a.part>a"},
+              "nothing moved after a failed sync");
+    }
+
+    // Once the upload is in place, a failed sync of its name keeps it
+    // committed
+    {
+        RecordingFileSystem failing;
+        failing.failing_sync = "a";
+        tftp::GroupCommitter committer(failing);
+
+        Upload a("a", completions);
+        committer.submit(&a.job);
+        check(waitFor(completions, 1), "failed name sync posted");
+        check(a.job.result == 0 && a.worker.committed,
+              "failed sync of the names keeps the upload");
+    }
+}
+}  // namespace
+
+int main() {
+    checkCommit();
+    checkGroups();
+    checkFailures();
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
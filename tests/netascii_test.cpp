@@ -0,0 +1,217 @@
+// Netascii translation checked against a byte at a time reference: the
+// vector kernels on their own, and the encoder and decoder cut into blocks
+// of every size around the vector widths. Inputs end right before a page
+// that cannot be read, so a kernel that reads past its input crashes.
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "netascii.hpp"
+#include "netascii_kernels.hpp"
+
+namespace {
+using EncodeKernel = void (*)(const char *, size_t, char *, size_t, size_t &,
+                              size_t &);
+using DecodeKernel = void (*)(const char *, size_t, char *, size_t &,
+                              size_t &);
+
+struct Kernel {
+    const char *name;
+    EncodeKernel encode;
+    DecodeKernel decode;
+};
+
+int failures = 0;
+
+void check(bool ok, const char *what, const std::string &input) {
+    if (ok) return;
+
+    ++failures;
+    std::fprintf(stderr, "FAIL %s, input of %zu bytes:", what, input.size());
+    for (unsigned char c : input) std::fprintf(stderr, " %02x", c);
+    std::fprintf(stderr, "\n");
+}
+
+// Copies text to the end of an area that an unreadable page follows. Only
+// the last text copied is there.
+const char *guard(const std::string &text) {
+    constexpr size_t AREA_SIZE = 64 * 1024;
+#ifndef _WIN32
+    static char *area = [] {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        char *map = static_cast<char *>(
+            mmap(nullptr, AREA_SIZE + page, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        mprotect(map + AREA_SIZE, page, PROT_NONE);
+        return map;
+    }();
+#else
+    static char *area = new char[AREA_SIZE + 1];
+#endif
+
+    char *data = area + AREA_SIZE - text.size();
+    std::memcpy(data, text.data(), text.size());
+    return data;
+}
+
+std::string encodeReference(const std::string &text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '\n') {
+            out += "\r\n";
+        } else if (c == '\r') {
+            out += std::string("\r\0", 2);
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// A lone CR stays, as does a CR at the end of the stream
+std::string decodeReference(const std::string &text) {
+    std::string out;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char next = i + 1 < text.size() ? text[i + 1] : 'x';
+        if (text[i] == '\r' && (next == '\n' || next == '\0')) {
+            out += next == '\n' ? '\n' : '\r';
+            ++i;
+        } else {
+            out += text[i];
+        }
+    }
+    return out;
+}
+
+// The kernels leave the ends to the scalar loop, which the reference stands
+// in for
+std::string encodeWith(const Kernel &kernel, const std::string &text) {
+    const char *src = guard(text);
+    std::vector<char> dst(text.size() * 2);
+    size_t i = 0, o = 0;
+    kernel.encode(src, text.size(), dst.data(), dst.size(), i, o);
+    return std::string(dst.data(), o) + encodeReference(text.substr(i));
+}
+
+std::string decodeWith(const Kernel &kernel, const std::string &text) {
+    const char *src = guard(text);
+    std::vector<char> dst(text.size() + 1);
+    size_t i = 0, o = 0;
+    kernel.decode(src, text.size(), dst.data(), i, o);
+    return std::string(dst.data(), o) + decodeReference(text.substr(i));
+}
+
+// Blocks of netascii as a download sends them
+std::string encodeBlocks(const std::string &text, size_t block_size) {
+    tftp::NetasciiEncoder encoder;
+    const char *src = guard(text);
+    std::vector<char> dst(block_size);
+    std::string out;
+
+    size_t position = 0;
+    while (true) {
+        size_t consumed;
+        size_t produced =
+            encoder.encode(src + position, text.size() - position,
+                           dst.data(), dst.size(), consumed);
+        position += consumed;
+        out.append(dst.data(), produced);
+        if (produced == 0) break;
+    }
+    return out;
+}
+
+// Blocks as an upload receives them
+std::string decodeBlocks(const std::string &text, size_t block_size) {
+    tftp::NetasciiDecoder decoder;
+    std::vector<char> dst(block_size + 1);
+    std::string out;
+
+    for (size_t position = 0; position < text.size();
+         position += block_size) {
+        std::string block = text.substr(position, block_size);
+        out.append(dst.data(),
+                   decoder.decode(guard(block), block.size(), dst.data()));
+    }
+    if (decoder.hasPending()) out += '\r';
+    return out;
+}
+
+void checkText(const std::vector<Kernel> &kernels, const std::string &text) {
+    const std::string encoded = encodeReference(text);
+    const std::string decoded = decodeReference(text);
+
+    for (const Kernel &kernel : kernels) {
+        check(encodeWith(kernel, text) == encoded, kernel.name, text);
+        check(decodeWith(kernel, text) == decoded, kernel.name, text);
+        check(decodeWith(kernel, encoded) == text, kernel.name, encoded);
+    }
+}
+
+void checkBlocks(const std::string &text) {
+    const std::string encoded = encodeReference(text);
+    const std::string decoded = decodeReference(text);
+
+    for (size_t block_size : {1, 2, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65,
+                              512}) {
+        check(encodeBlocks(text, block_size) == encoded, "encoder", text);
+        check(decodeBlocks(text, block_size) == decoded, "decoder", text);
+        check(decodeBlocks(encoded, block_size) == text, "decoder", encoded);
+    }
+}
+}  // namespace
+
+int main() {
+    std::vector<Kernel> kernels;
+#ifdef __SSE2__
+    kernels.push_back({"sse2", tftp::encodeVectors<tftp::Sse2Vector>,
+                       tftp::decodeVectors<tftp::Sse2Vector>});
+#endif
+#ifdef TFTP_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(
+            {"avx2", tftp::encodeVectorsAvx2, tftp::decodeVectorsAvx2});
+    } else {
+        std::printf("No AVX2 on this CPU, its kernels are not checked\n");
+    }
+#endif
+
+    // A pair, a lone CR or LF, or a CR at the end, at every offset around
+    // the ends of one and two vectors of either width
+    const std::string pairs[] = {std::string("\r\n"), std::string("\r\0", 2),
+                                 "\r", "\n", "\rx", "\r\r\n", "\n\r"};
+    for (size_t size : {31, 32, 33, 34, 63, 64, 65, 66, 95, 96, 97, 128, 129}) {
+        for (const std::string &pair : pairs) {
+            for (size_t at = 0; at + pair.size() <= size; ++at) {
+                std::string text(size, 'a');
+                text.replace(at, pair.size(), pair);
+                checkText(kernels, text);
+                checkBlocks(text);
+            }
+        }
+    }
+
+    // Dense mixes of everything that is translated
+    std::mt19937 random(1);
+    const char alphabet[] = {'\r', '\n', '\0', 'a'};
+    for (int round = 0; round < 2000; ++round) {
+        std::string text(random() % 300, 'a');
+        for (char &c : text) c = alphabet[random() % sizeof(alphabet)];
+        checkText(kernels, text);
+        if (round % 10 == 0) checkBlocks(text);
+    }
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,144 @@
+// The request rate limiter: bursts and refills of one source, ports sharing
+// the bucket of their address, refilling after an idle time long enough to
+// overflow, and sources that collide in one set of buckets, which must not
+// get more between them than the buckets of the set refill to.
+
+#include <cstdio>
+#include <vector>
+
+#include "rate_limiter.hpp"
+
+namespace {
+int failures = 0;
+
+void check(bool ok, const char *what) {
+    if (ok) return;
+
+    ++failures;
+    std::fprintf(stderr, "FAIL %s\n", what);
+}
+
+// Anything but zero, which marks a bucket never used
+constexpr uint64_t START_US = 1000000;
+
+tftp::Peer makePeer(uint32_t host, uint16_t port) {
+    tftp::Peer peer;
+    peer.address[10] = 0xFF;
+    peer.address[11] = 0xFF;
+    peer.address[12] = 10;
+    peer.address[13] = host >> 16;
+    peer.address[14] = host >> 8;
+    peer.address[15] = host;
+    peer.port = port;
+    return peer;
+}
+
+// How many of count packets, one every interval, get through
+unsigned int send(tftp::RateLimiter &limiter, const tftp::Peer &peer,
+                  uint64_t &now_us, unsigned int count,
+                  uint64_t interval_us) {
+    unsigned int allowed = 0;
+    for (unsigned int i = 0; i < count; ++i) {
+        allowed += limiter.allow(peer, now_us);
+        now_us += interval_us;
+    }
+    return allowed;
+}
+
+void checkSource() {
+    tftp::RateLimiter limiter;
+    tftp::Peer peer = makePeer(1, 1000);
+    uint64_t now_us = START_US;
+
+    check(limiter.allow(peer, now_us) && !limiter.isEnabled(),
+          "everything allowed while disabled");
+
+    // 10 per second with a burst of 5
+    limiter.configure(10, 5);
+    check(send(limiter, peer, now_us, 10, 0) == 5, "burst");
+    now_us += 100000;
+    check(send(limiter, peer, now_us, 10, 0) == 1, "refill of 100 ms");
+
+    // Other ports of the address share its bucket
+    now_us += 100000;
+    check(limiter.allow(makePeer(1, 2000), now_us) &&
+              !limiter.allow(makePeer(1, 3000), now_us),
+          "ports share a bucket");
+
+    // A second at 1000 packets per second gets the rate through
+    check(send(limiter, peer, now_us, 1001, 1000) == 10, "rate over a second");
+
+    // Refilling after an idle time that would overflow gives a full bucket.
+    // Ten tokens a second for this long wraps to next to nothing.
+    now_us += UINT64_MAX / 10 + 1;
+    check(send(limiter, peer, now_us, 10, 0) == 5, "burst after a long idle");
+
+    // Configuring again forgets the buckets
+    limiter.configure(10, 2);
+    check(send(limiter, peer, now_us, 10, 0) == 2, "burst after configuring");
+}
+
+// Sources that all map to the set of the first one
+std::vector<tftp::Peer> collidingPeers(size_t count) {
+    // The smallest table, 16 sets
+    const uint64_t set = makePeer(0, 0).hash() & 15;
+
+    std::vector<tftp::Peer> peers;
+    for (uint32_t host = 0; peers.size() < count; ++host) {
+        tftp::Peer peer = makePeer(host, 0);
+        if ((peer.hash() & 15) == set) peers.push_back(peer);
+    }
+    return peers;
+}
+
+void checkCollisions() {
+    const unsigned int burst = 5;
+    const unsigned int rate = 10;
+    std::vector<tftp::Peer> peers =
+        collidingPeers(tftp::RATE_LIMITER_WAYS * 2);
+
+    // Sources that empty every bucket of the set leave nothing for the
+    // sources that take the buckets over
+    {
+        tftp::RateLimiter limiter(1);
+        limiter.configure(rate, burst);
+        uint64_t now_us = START_US;
+
+        for (size_t i = 0; i < tftp::RATE_LIMITER_WAYS; ++i) {
+            check(send(limiter, peers[i], now_us, burst, 0) == burst,
+                  "burst of a source in the set");
+        }
+        for (size_t i = tftp::RATE_LIMITER_WAYS; i < peers.size(); ++i) {
+            check(send(limiter, peers[i], now_us, burst, 0) == 0,
+                  "taken over bucket starts full");
+        }
+    }
+
+    // More sources than ways, taking turns for a second, get no more than
+    // the buckets of the set refill to
+    {
+        tftp::RateLimiter limiter(1);
+        limiter.configure(rate, burst);
+        uint64_t now_us = START_US;
+
+        unsigned int allowed = 0;
+        for (int round = 0; round < 1000; ++round) {
+            allowed += limiter.allow(peers[round % peers.size()], now_us);
+            now_us += 1000;
+        }
+        check(allowed <= tftp::RATE_LIMITER_WAYS * (burst + rate),
+              "sources sharing a set");
+    }
+}
+}  // namespace
+
+int main() {
+    checkSource();
+    checkCollisions();
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
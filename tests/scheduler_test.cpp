@@ -0,0 +1,198 @@
+// The send scheduler checked against a plain deficit round-robin that visits
+// one session at a time and never skips rounds, through random enqueue and
+// dequeue churn over every class, along with the shares of bytes sessions
+// with different block sizes get, and the priority rules.
+
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "scheduler.hpp"
+#include "session_table.hpp"
+
+namespace {
+int failures = 0;
+
+void check(bool ok, const char *what) {
+    if (ok) return;
+
+    ++failures;
+    std::fprintf(stderr, "FAIL %s\n", what);
+}
+
+class ReferenceScheduler {
+   public:
+    explicit ReferenceScheduler(uint32_t quantum) : quantum(quantum) {}
+
+    void enqueue(uint32_t session, uint8_t priority, uint32_t cost) {
+        if (priority >= tftp::PRIORITY_CLASS_COUNT) {
+            priority = tftp::PRIORITY_CLASS_COUNT - 1;
+        }
+        this->classes[priority].push_back({session, cost, 0});
+    }
+
+    uint32_t dequeue() {
+        for (std::deque<Entry> &ring : this->classes) {
+            if (ring.empty()) continue;
+
+            while (true) {
+                Entry entry = ring.front();
+                ring.pop_front();
+                entry.deficit += this->quantum;
+                if (entry.cost <= entry.deficit) return entry.session;
+                ring.push_back(entry);
+            }
+        }
+        return tftp::NO_SESSION;
+    }
+
+   private:
+    struct Entry {
+        uint32_t session;
+        uint32_t cost;
+        uint32_t deficit;
+    };
+
+    uint32_t quantum;
+    std::deque<Entry> classes[tftp::PRIORITY_CLASS_COUNT];
+};
+
+void checkChurn(uint32_t quantum, unsigned int seed) {
+    tftp::SendScheduler scheduler(quantum);
+    ReferenceScheduler reference(quantum);
+    std::mt19937 random(seed);
+
+    // Costs around the quantum, so sessions wait from none to many rounds
+    std::vector<uint32_t> waiting;
+    uint32_t next_session = 0;
+    bool same = true;
+
+    for (int step = 0; step < 100000 && same; ++step) {
+        // Grow past the first ring size and drain again now and then
+        bool enqueue = waiting.empty() ||
+                       (step / 5000 % 2 == 0 ? random() % 3 != 0
+                                             : random() % 3 == 0);
+        if (enqueue) {
+            uint32_t session = next_session++;
+            uint8_t priority = random() % (tftp::PRIORITY_CLASS_COUNT + 1);
+            uint32_t cost = 1 + random() % (quantum * 4);
+            scheduler.enqueue(session, priority, cost);
+            reference.enqueue(session, priority, cost);
+            waiting.push_back(session);
+        } else {
+            uint32_t session = scheduler.dequeue();
+            same = session == reference.dequeue() &&
+                   session != tftp::NO_SESSION;
+            std::erase(waiting, session);
+        }
+
+        same = same && scheduler.size() == waiting.size();
+    }
+    check(same, "order against the reference");
+
+    while (!waiting.empty()) {
+        uint32_t session = scheduler.dequeue();
+        check(session == reference.dequeue(), "draining order");
+        std::erase(waiting, session);
+    }
+    check(scheduler.dequeue() == tftp::NO_SESSION && scheduler.size() == 0,
+          "empty after draining");
+}
+
+// Lower classes go first, whatever the order they came in
+void checkClasses() {
+    tftp::SendScheduler scheduler(512);
+    scheduler.enqueue(1, 3, 100);
+    scheduler.enqueue(2, 200, 100);  // Past the last class, so in it
+    scheduler.enqueue(3, 1, 100000);
+    scheduler.enqueue(4, 0, 1428);
+
+    check(scheduler.dequeue() == 4, "class 0 first");
+    check(scheduler.dequeue() == 3, "class 1 before 3, however large");
+    check(scheduler.dequeue() == 1, "class 3 in order");
+    check(scheduler.dequeue() == 2, "class out of range in the last");
+    check(scheduler.dequeue() == tftp::NO_SESSION, "empty");
+}
+
+// Sessions that always have a reply ready get about the same bytes, whatever
+// their block size
+void checkShares() {
+    const uint32_t costs[] = {512, 1428, 8192, 65464};
+    uint64_t bytes[4] = {};
+
+    tftp::SendScheduler scheduler(512);
+    for (uint32_t session = 0; session < 4; ++session) {
+        scheduler.enqueue(session, 1, costs[session]);
+    }
+
+    for (int i = 0; i < 20000; ++i) {
+        uint32_t session = scheduler.dequeue();
+        bytes[session] += costs[session];
+        scheduler.enqueue(session, 1, costs[session]);
+    }
+
+    // A session loses what is left of its last quantum when it sends
+    for (uint32_t session = 0; session < 4; ++session) {
+        uint64_t quanta = (costs[session] + 511) / 512;
+        double share = static_cast<double>(costs[session]) / (quanta * 512);
+        check(bytes[session] >= bytes[0] * share * 0.95 &&
+                  bytes[session] <= bytes[0] * 1.05,
+              "share of bytes");
+    }
+}
+
+void checkRules() {
+    tftp::PriorityRules rules;
+    rules.add("0:10.1.0.0/16");
+    rules.add("2:*.iso");
+    rules.add(3, "pxelinux.?");
+
+    tftp::Peer inside, outside;
+    inside.address[10] = outside.address[10] = 0xFF;
+    inside.address[11] = outside.address[11] = 0xFF;
+    inside.address[12] = outside.address[12] = 10;
+    inside.address[13] = 1;
+    outside.address[13] = 2;
+
+    check(rules.classify(inside, "boot.iso") == 0, "subnet rule first");
+    check(rules.classify(outside, "boot.iso") == 2, "pattern rule");
+    check(rules.classify(outside, "pxelinux.0") == 3, "? pattern");
+    check(rules.classify(outside, "pxelinux.cfg") ==
+              tftp::DEFAULT_PRIORITY_CLASS,
+          "no rule matches");
+
+    check(tftp::PriorityRules::matchPattern("a*b*c", "aXXbYbZc"),
+          "backtracking pattern");
+    check(!tftp::PriorityRules::matchPattern("a*b", "aXXbY"),
+          "pattern with a tail");
+
+    const char *invalid[] = {"4:*.iso", "260:*.iso", ":*.iso", "*.iso",
+                             "1:10.0.0.0/129"};
+    for (const char *rule : invalid) {
+        bool thrown = false;
+        try {
+            rules.add(rule);
+        } catch (const std::invalid_argument &) {
+            thrown = true;
+        }
+        check(thrown, rule);
+    }
+}
+}  // namespace
+
+int main() {
+    checkChurn(512, 1);
+    checkChurn(8192, 2);
+    checkChurn(1, 3);
+    checkClasses();
+    checkShares();
+    checkRules();
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+// The session table checked against a std::unordered_map through random
+// insert and erase churn, from a table small enough to grow several times
+// and to wrap its probe runs around the end of the slots.
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "session_table.hpp"
+
+namespace {
+int failures = 0;
+
+void check(bool ok, const char *what, size_t step) {
+    if (ok) return;
+
+    ++failures;
+    std::fprintf(stderr, "FAIL %s, at step %zu\n", what, step);
+}
+
+std::string keyOf(const tftp::Peer &peer) {
+    return std::string(reinterpret_cast<const char *>(&peer), sizeof(peer));
+}
+
+// IPv4 peers from a few addresses and many ports, like NATed clients
+std::vector<tftp::Peer> makePeers(size_t count, unsigned int seed) {
+    std::mt19937 random(seed);
+    std::unordered_map<std::string, bool> seen;
+
+    std::vector<tftp::Peer> peers;
+    while (peers.size() < count) {
+        tftp::Peer peer;
+        peer.address[10] = 0xFF;
+        peer.address[11] = 0xFF;
+        peer.address[12] = 10;
+        peer.address[15] = random() % 4;
+        peer.port = random();
+        if (seen.emplace(keyOf(peer), true).second) peers.push_back(peer);
+    }
+    return peers;
+}
+
+struct Entry {
+    uint32_t session;
+    const tftp::SessionHot *hot;
+};
+
+// Every peer of the pool is found exactly when the reference has it
+void checkAll(const tftp::SessionTable &table,
+              const std::vector<tftp::Peer> &peers,
+              const std::unordered_map<std::string, Entry> &reference,
+              size_t step) {
+    check(table.size() == reference.size(), "size", step);
+
+    for (const tftp::Peer &peer : peers) {
+        uint32_t session = table.find(peer);
+        auto expected = reference.find(keyOf(peer));
+        if (expected == reference.end()) {
+            check(session == tftp::NO_SESSION, "erased peer found", step);
+            continue;
+        }
+
+        check(session == expected->second.session, "session of a peer", step);
+        if (session == tftp::NO_SESSION) continue;
+
+        const tftp::SessionHot &hot = table.get(session);
+        check(&hot == expected->second.hot, "hot record moved", step);
+        check(hot.used && hot.peer == peer, "hot record of a peer", step);
+        check(session < table.getIndexLimit(), "index over the limit", step);
+    }
+}
+
+void churn(size_t pool_size, size_t steps, unsigned int seed) {
+    std::vector<tftp::Peer> peers = makePeers(pool_size, seed);
+    std::mt19937 random(seed);
+
+    tftp::SessionTable table(1);
+    std::unordered_map<std::string, Entry> reference;
+    std::vector<bool> index_used;
+
+    for (size_t step = 0; step < steps; ++step) {
+        // Fill up, drain and fill up again, so the table sees every load
+        bool filling = (step / (steps / 4)) % 2 == 0;
+        const tftp::Peer &peer = peers[random() % peers.size()];
+        auto found = reference.find(keyOf(peer));
+
+        if (found == reference.end() && (filling || random() % 4 == 0)) {
+            uint32_t session = table.insert(peer);
+            if (session >= index_used.size()) index_used.resize(session + 1);
+
+            check(!index_used[session], "index handed out twice", step);
+            index_used[session] = true;
+            reference[keyOf(peer)] = {session, &table.get(session)};
+        } else if (found != reference.end() &&
+                   (!filling || random() % 4 == 0)) {
+            uint32_t session = found->second.session;
+            table.erase(session);
+            index_used[session] = false;
+            reference.erase(found);
+
+            // A second erase of the same index changes nothing
+            if (random() % 8 == 0) table.erase(session);
+        }
+
+        if (step % (steps / 64) == 0) checkAll(table, peers, reference, step);
+    }
+    checkAll(table, peers, reference, steps);
+
+    // Erased indexes are reused before new ones are made
+    check(table.getIndexLimit() <= pool_size, "indexes not reused", steps);
+}
+}  // namespace
+
+int main() {
+    churn(64, 20000, 1);
+    churn(3000, 200000, 2);
+    churn(20000, 400000, 3);
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}